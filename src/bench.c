@@ -0,0 +1,436 @@
+#include "include/executor.h"
+#include "include/expand.h"
+#include "include/history.h"
+#include "include/scripting.h"
+#include "include/utils.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Micro-benchmarks for the shell's hot paths. Every operation is timed on
+// its own, so besides the mean the report has percentiles; allocations are
+// counted by wrapping the C library's allocator below.
+//
+//   cshell_bench [--json] [-n iterations] [name-filter]
+//
+// --json prints one object per benchmark and line, for tracking results
+// across commits.
+
+extern char **environ;
+
+// --- Allocation counting ---
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static size_t allocation_count = 0;
+
+void *malloc(size_t size) {
+  allocation_count++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+  allocation_count++;
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  allocation_count++;
+  return __libc_realloc(ptr, size);
+}
+
+// --- Measurement ---
+
+#define WARMUP_OPS 16
+
+typedef struct {
+  const char *name;
+  int iterations;
+  long long *samples; // ns, one per measured operation
+  size_t allocations;
+  struct timespec op_started;
+  size_t op_allocations;
+} Bench;
+
+static int json_output = 0;
+static int iterations_override = 0;
+static const char *filter = NULL;
+
+// Returns 0 when the filter leaves this benchmark out.
+static int bench_begin(Bench *bench, const char *name, int iterations) {
+  if (filter && !strstr(name, filter))
+    return 0;
+  bench->name = name;
+  bench->iterations = iterations_override ? iterations_override : iterations;
+  bench->samples = malloc(bench->iterations * sizeof(long long));
+  if (!bench->samples) {
+    perror("malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  bench->allocations = 0;
+  return 1;
+}
+
+static void op_start(Bench *bench) {
+  bench->op_allocations = allocation_count;
+  clock_gettime(CLOCK_MONOTONIC, &bench->op_started);
+}
+
+// Operations with a negative index are warm-up and are not recorded.
+static void op_stop(Bench *bench, int index) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (index < 0)
+    return;
+  bench->samples[index] =
+      (now.tv_sec - bench->op_started.tv_sec) * 1000000000LL +
+      (now.tv_nsec - bench->op_started.tv_nsec);
+  bench->allocations += allocation_count - bench->op_allocations;
+}
+
+static int compare_samples(const void *a, const void *b) {
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+static long long percentile(const Bench *bench, int pct) {
+  int index = (int)((long long)(bench->iterations - 1) * pct / 100);
+  return bench->samples[index];
+}
+
+static void bench_end(Bench *bench) {
+  long long total = 0;
+  for (int i = 0; i < bench->iterations; i++)
+    total += bench->samples[i];
+  qsort(bench->samples, bench->iterations, sizeof(long long), compare_samples);
+  double mean = (double)total / bench->iterations;
+  double allocs = (double)bench->allocations / bench->iterations;
+
+  if (json_output) {
+    printf("{\"name\":\"%s\",\"iterations\":%d,\"ns_per_op\":%.1f,"
+           "\"p50_ns\":%lld,\"p90_ns\":%lld,\"p99_ns\":%lld,"
+           "\"allocs_per_op\":%.2f}\n",
+           bench->name, bench->iterations, mean, percentile(bench, 50),
+           percentile(bench, 90), percentile(bench, 99), allocs);
+  } else {
+    printf("%-28s %8d %12.1f %10lld %10lld %10lld %10.2f\n", bench->name,
+           bench->iterations, mean, percentile(bench, 50),
+           percentile(bench, 90), percentile(bench, 99), allocs);
+  }
+  fflush(stdout);
+  free(bench->samples);
+}
+
+// --- Parsing ---
+
+static const struct {
+  const char *name;
+  const char *line;
+} command_lines[] = {
+    {"parse_command/simple", "ls -l"},
+    {"parse_command/pipeline",
+     "cat notes.txt | grep -v '^#' | sort -u | head -n 20 > out.txt"},
+    {"parse_command/redirects", "make all 2>&1 >>build.log < /dev/null"},
+    {"parse_command/quoted",
+     "echo \"hello $USER\" 'single quoted' ${HOME}/bin $(date +%s) *.c"},
+};
+
+static void bench_parse(void) {
+  Bench bench;
+  for (size_t c = 0; c < sizeof(command_lines) / sizeof(command_lines[0]);
+       c++) {
+    if (!bench_begin(&bench, command_lines[c].name, 100000))
+      continue;
+    for (int i = -WARMUP_OPS; i < bench.iterations; i++) {
+      op_start(&bench);
+      free_command(parse_command(command_lines[c].line));
+      op_stop(&bench, i);
+    }
+    bench_end(&bench);
+  }
+
+  if (bench_begin(&bench, "parse_list/and_or", 100000)) {
+    for (int i = -WARMUP_OPS; i < bench.iterations; i++) {
+      op_start(&bench);
+      free_node(parse_list("make && make test || echo failed; date & wait"));
+      op_stop(&bench, i);
+    }
+    bench_end(&bench);
+  }
+}
+
+// --- Globbing ---
+
+#define GLOB_FILES 1000
+
+static void bench_glob(void) {
+  static const struct {
+    const char *name;
+    const char *pattern;
+  } patterns[] = {
+      {"expand_wildcards/all", "*.txt"},
+      {"expand_wildcards/prefix", "file00*"},
+      {"expand_wildcards/nomatch", "*.none"},
+  };
+  int wanted = 0;
+  for (size_t p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++)
+    wanted |= !filter || strstr(patterns[p].name, filter);
+  if (!wanted)
+    return;
+
+  char dir[] = "/tmp/cshell_bench_XXXXXX";
+  char cwd[PATH_MAX];
+  if (!mkdtemp(dir) || !getcwd(cwd, sizeof(cwd)) || chdir(dir) == -1) {
+    perror("cshell_bench: glob directory");
+    return;
+  }
+  for (int i = 0; i < GLOB_FILES; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), i % 10 ? "file%04d.txt" : "file%04d.log", i);
+    int fd = open(name, O_WRONLY | O_CREAT, 0644);
+    if (fd != -1)
+      close(fd);
+  }
+
+  Bench bench;
+  for (size_t p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++) {
+    if (!bench_begin(&bench, patterns[p].name, 2000))
+      continue;
+    for (int i = -WARMUP_OPS; i < bench.iterations; i++) {
+      op_start(&bench);
+      free_args(expand_wildcards(patterns[p].pattern));
+      op_stop(&bench, i);
+    }
+    bench_end(&bench);
+  }
+
+  for (int i = 0; i < GLOB_FILES; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), i % 10 ? "file%04d.txt" : "file%04d.log", i);
+    unlink(name);
+  }
+  if (chdir(cwd) == -1)
+    perror(cwd);
+  rmdir(dir);
+}
+
+// --- Parameter expansion ---
+
+// String operators that scripts would otherwise pipe through sed or cut.
+static void bench_expand(void) {
+  static const struct {
+    const char *name;
+    const char *word;
+  } words[] = {
+      {"expand/strip_suffix", "${bench_path%.*}"},
+      {"expand/strip_dir", "${bench_path##*/}"},
+      {"expand/replace_literal", "${bench_line//,/ }"},
+      {"expand/replace_glob", "${bench_line//[0-9]/#}"},
+      {"expand/substring", "${bench_line:10:20}"},
+  };
+  set_shell_variable("bench_path", "/usr/local/lib/x86_64/libexample.so.1.2");
+  char line[256];
+  for (int i = 0; i < 32; i++)
+    snprintf(line + i * 8, sizeof(line) - i * 8, "%06d, ", i * 7919);
+  set_shell_variable("bench_line", line);
+
+  Bench bench;
+  for (size_t w = 0; w < sizeof(words) / sizeof(words[0]); w++) {
+    if (!bench_begin(&bench, words[w].name, 100000))
+      continue;
+    for (int i = -WARMUP_OPS; i < bench.iterations; i++) {
+      op_start(&bench);
+      free(expand_word_single(words[w].word));
+      op_stop(&bench, i);
+    }
+    bench_end(&bench);
+  }
+}
+
+// --- History ---
+
+static void bench_history(void) {
+  int current = 0;
+  Bench bench;
+  if (bench_begin(&bench, "history/add", 200000)) {
+    char line[64];
+    for (int i = -WARMUP_OPS; i < bench.iterations; i++) {
+      snprintf(line, sizeof(line), "grep -n pattern file%d.c\n", i);
+      op_start(&bench);
+      add_to_history(line, history, &history_count, &current);
+      op_stop(&bench, i);
+    }
+    bench_end(&bench);
+  }
+
+  if (history_count == 0)
+    add_to_history("ls", history, &history_count, &current);
+  if (bench_begin(&bench, "history/get", 200000)) {
+    int held =
+        history_count < MAX_HISTORY_SIZE ? history_count : MAX_HISTORY_SIZE;
+    volatile char *sink;
+    for (int i = -WARMUP_OPS; i < bench.iterations; i++) {
+      int index = history_count - 1 - (i < 0 ? 0 : i) % held;
+      op_start(&bench);
+      sink = get_history_entry(history, history_count, index);
+      op_stop(&bench, i);
+    }
+    (void)sink;
+    bench_end(&bench);
+  }
+}
+
+// --- Scripts ---
+
+// Builtins and assignments only, so the figures are the interpreter's.
+static const char *bench_script = "greeting=hello\n"
+                                  "name=world\n"
+                                  "message=$greeting-$name\n"
+                                  "cd .\n"
+                                  "set -o pipefail\n"
+                                  "set +o pipefail\n";
+
+static void bench_scripts(void) {
+  Bench bench;
+  if (bench_begin(&bench, "script/function_call", 50000)) {
+    ScriptElement *define = parse_script("bench_fn() { local x=$1; }\n");
+    ScriptElement *call = parse_script("bench_fn value\n");
+    execute_script(define);
+    for (int i = -WARMUP_OPS; i < bench.iterations; i++) {
+      op_start(&bench);
+      execute_script(call);
+      op_stop(&bench, i);
+    }
+    free_script_element(call);
+    free_script_element(define);
+    bench_end(&bench);
+  }
+
+  if (bench_begin(&bench, "script/parse", 50000)) {
+    for (int i = -WARMUP_OPS; i < bench.iterations; i++) {
+      op_start(&bench);
+      free_script_element(parse_script(bench_script));
+      op_stop(&bench, i);
+    }
+    bench_end(&bench);
+  }
+
+  if (bench_begin(&bench, "script/execute", 50000)) {
+    ScriptElement *script = parse_script(bench_script);
+    for (int i = -WARMUP_OPS; i < bench.iterations; i++) {
+      op_start(&bench);
+      execute_script(script);
+      op_stop(&bench, i);
+    }
+    free_script_element(script);
+    bench_end(&bench);
+  }
+}
+
+// --- Spawning ---
+
+static char *true_argv[] = {"true", NULL};
+
+static void reap(pid_t pid) {
+  int status;
+  if (pid > 0)
+    waitpid(pid, &status, 0);
+}
+
+static pid_t spawn_fork(void) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    execve("/bin/true", true_argv, environ);
+    _exit(127);
+  }
+  return pid;
+}
+
+static pid_t spawn_vfork(void) {
+  pid_t pid = vfork();
+  if (pid == 0) {
+    execve("/bin/true", true_argv, environ);
+    _exit(127);
+  }
+  return pid;
+}
+
+static pid_t spawn_posix(void) {
+  pid_t pid;
+  if (posix_spawn(&pid, "/bin/true", NULL, NULL, true_argv, environ) != 0)
+    return -1;
+  return pid;
+}
+
+static void bench_spawn(void) {
+  static const struct {
+    const char *name;
+    pid_t (*spawn)(void);
+  } paths[] = {
+      {"spawn/fork_exec", spawn_fork},
+      {"spawn/vfork_exec", spawn_vfork},
+      {"spawn/posix_spawn", spawn_posix},
+  };
+  Bench bench;
+  for (size_t p = 0; p < sizeof(paths) / sizeof(paths[0]); p++) {
+    if (!bench_begin(&bench, paths[p].name, 1000))
+      continue;
+    for (int i = -WARMUP_OPS; i < bench.iterations; i++) {
+      op_start(&bench);
+      reap(paths[p].spawn());
+      op_stop(&bench, i);
+    }
+    bench_end(&bench);
+  }
+
+  // The shell's own path: parse, expand, fork, exec, wait.
+  if (bench_begin(&bench, "spawn/execute_node", 1000)) {
+    Node *node = parse_list("/bin/true");
+    for (int i = -WARMUP_OPS; i < bench.iterations; i++) {
+      op_start(&bench);
+      execute_node(node);
+      op_stop(&bench, i);
+    }
+    free_node(node);
+    bench_end(&bench);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--json") == 0) {
+      json_output = 1;
+    } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      iterations_override = atoi(argv[++i]);
+      if (iterations_override <= 0) {
+        fprintf(stderr, "cshell_bench: bad iteration count: %s\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    } else if (argv[i][0] == '-') {
+      fprintf(stderr, "usage: cshell_bench [--json] [-n iterations] [filter]\n");
+      return EXIT_FAILURE;
+    } else {
+      filter = argv[i];
+    }
+  }
+
+  if (!json_output)
+    printf("%-28s %8s %12s %10s %10s %10s %10s\n", "benchmark", "iters",
+           "ns/op", "p50", "p90", "p99", "allocs/op");
+  bench_parse();
+  bench_glob();
+  bench_expand();
+  bench_history();
+  bench_scripts();
+  bench_spawn();
+  return EXIT_SUCCESS;
+}
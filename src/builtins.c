@@ -1,13 +1,28 @@
+#define _GNU_SOURCE // pipe2, tee
 #include "include/builtins.h"
+#include "include/environment.h"
+#include "include/executor.h"
+#include "include/fileio.h"
 #include "include/history.h"
+#include "include/jobs.h"
+#include "include/scripting.h"
+#include "include/scriptcache.h"
+#include "include/stats.h"
 #include "include/utils.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 int builtin_history(char **args) {
   (void)args;
+  history_ensure_loaded();
   print_history(history, history_count);
   return 0;
 }
@@ -33,30 +48,1089 @@ int builtin_cd(char **args) {
 }
 
 int builtin_exit(char **args) {
-  (void)args;
-  exit(0);
+  exit(args[1] ? atoi(args[1]) : 0);
 }
 
 int builtin_help(char **args) {
   printf("cshell - A simple shell written in C\n");
   printf("Built-in commands:\n");
   printf("  cd <directory>   - Change the current working directory.\n");
-  printf("  exit             - Exit the shell.\n");
+  printf("  declare [-aAp] name[=value] - Declare (array) variables.\n");
+  printf("  exit [n]         - Exit the shell with status n.\n");
+  printf("  export [-n] name[=value] - Export variables to commands.\n");
   printf("  help             - Display this help message.\n");
   printf("  history          - Display command history.\n");
+  printf("  jobs             - List background jobs.\n");
+  printf("  local name[=value] - Make a variable local to a function.\n");
+  printf("  mapfile [-t] [array] - Read lines into an array (readarray).\n");
+  printf("  read [-r] [name ...] - Read a line into variables.\n");
+  printf("  return [n]       - Return from a function with status n.\n");
+  printf("  set [-+]o option - Set or unset a shell option.\n");
+  printf("  source file      - Run a script in this shell (also '.').\n");
+  printf("  stats [-r]       - Show the shell's memory use and counters.\n");
+  printf("  ulimit [-SHa] [-n ...] [n] - Show or set resource limits.\n");
+  printf("  unset name|name[key] - Remove a variable or array element.\n");
+  printf("  wait [%%n|pid]    - Wait for background jobs to finish.\n");
+  printf("With set -o fileio, 'cat', 'cp' and 'wc -l' run as builtins.\n");
   printf("Other commands are executed as external programs.\n");
   return 1;
 }
 
+// Shell options, set with -o and cleared with +o.
+int builtin_set(char **args) {
+  struct {
+    const char *name;
+    int *value;
+  } options[] = {
+      {"argbatch", &option_argbatch},
+      {"fileio", &option_fileio},
+      {"globstar", &option_globstar},
+      {"pipefail", &option_pipefail},
+  };
+  int option_count = sizeof(options) / sizeof(options[0]);
+  if (args[1] == NULL || (strcmp(args[1], "-o") == 0 && args[2] == NULL)) {
+    for (int i = 0; i < option_count; i++)
+      printf("%s\t%s\n", options[i].name, *options[i].value ? "on" : "off");
+    return 0;
+  }
+  for (int i = 1; args[i] != NULL; i++) {
+    if ((strcmp(args[i], "-o") != 0 && strcmp(args[i], "+o") != 0) ||
+        args[i + 1] == NULL) {
+      fprintf(stderr, "set: unsupported option: %s\n", args[i]);
+      return 2;
+    }
+    int enable = args[i][0] == '-', found = 0;
+    for (int j = 0; j < option_count && !found; j++) {
+      if (strcmp(args[i + 1], options[j].name) == 0) {
+        *options[j].value = enable;
+        found = 1;
+      }
+    }
+    if (!found) {
+      fprintf(stderr, "set: unknown option name: %s\n", args[i + 1]);
+      return 2;
+    }
+    i++;
+  }
+  return 0;
+}
+
+static int compare_strings(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int valid_name(const char *name, size_t len) {
+  if (len == 0 || isdigit((unsigned char)name[0]))
+    return 0;
+  for (size_t i = 0; i < len; i++) {
+    if (!isalnum((unsigned char)name[i]) && name[i] != '_')
+      return 0;
+  }
+  return 1;
+}
+
+// export [-n] NAME[=value] ...: put variables in the environment of the
+// commands the shell runs; -n takes them out again but keeps their values.
+// With no names, the environment is listed.
+int builtin_export(char **args) {
+  int i = 1, unexport = 0;
+  if (args[1] && strcmp(args[1], "-n") == 0) {
+    unexport = 1;
+    i++;
+  }
+  if (args[i] == NULL) {
+    char **env = env_vector();
+    size_t n = 0;
+    while (env[n])
+      n++;
+    char **sorted = malloc((n + 1) * sizeof(char *));
+    if (!sorted) {
+      perror("malloc failed");
+      exit(EXIT_FAILURE);
+    }
+    memcpy(sorted, env, n * sizeof(char *));
+    qsort(sorted, n, sizeof(char *), compare_strings);
+    for (size_t j = 0; j < n; j++)
+      printf("export %s\n", sorted[j]);
+    free(sorted);
+    return 0;
+  }
+
+  int status = 0;
+  for (; args[i] != NULL; i++) {
+    const char *eq = strchr(args[i], '=');
+    size_t len = eq ? (size_t)(eq - args[i]) : strlen(args[i]);
+    if (!valid_name(args[i], len)) {
+      fprintf(stderr, "export: %s: not a valid identifier\n", args[i]);
+      status = 1;
+      continue;
+    }
+    char *name = strndup(args[i], len);
+    if (!name) {
+      perror("strndup failed");
+      exit(EXIT_FAILURE);
+    }
+    if (unexport) {
+      // The value stays behind as a shell variable.
+      const char *value = eq ? eq + 1 : get_shell_variable(name);
+      char *kept = value ? strdup(value) : NULL;
+      if (value && !kept) {
+        perror("strdup failed");
+        exit(EXIT_FAILURE);
+      }
+      env_unset(name);
+      if (kept)
+        set_shell_variable(name, kept);
+      free(kept);
+    } else if (eq) {
+      set_shell_variable(name, eq + 1);
+      env_set(name, eq + 1);
+    } else {
+      // A variable without a value has nothing to export yet.
+      const char *value = get_shell_variable(name);
+      if (value && !env_get(name))
+        env_set(name, value);
+    }
+    free(name);
+  }
+  return status;
+}
+
+// local NAME[=value] ...: inside a function, variables that get their old
+// values back when it returns.
+int builtin_local(char **args) {
+  int status = 0;
+  for (int i = 1; args[i] != NULL; i++) {
+    const char *eq = strchr(args[i], '=');
+    if (!valid_name(args[i], eq ? (size_t)(eq - args[i]) : strlen(args[i]))) {
+      fprintf(stderr, "local: %s: not a valid identifier\n", args[i]);
+      status = 1;
+    } else if (declare_local(args[i]) != 0) {
+      return 1;
+    }
+  }
+  return status;
+}
+
+static void print_declaration(const char *name) {
+  ShellArray *array = find_array(name);
+  if (!array) {
+    const char *value = get_shell_variable(name);
+    if (value)
+      printf("declare -- %s=\"%s\"\n", name, value);
+    return;
+  }
+  printf("declare -%c %s=(", array->kind == ARRAY_INDEXED ? 'a' : 'A', name);
+  const char *separator = "";
+  for (int i = 0; i < array->count; i++) {
+    if (!array->values[i])
+      continue;
+    if (array->kind == ARRAY_INDEXED)
+      printf("%s[%d]=\"%s\"", separator, i, array->values[i]);
+    else
+      printf("%s[%s]=\"%s\"", separator, array->keys[i], array->values[i]);
+    separator = " ";
+  }
+  printf(")\n");
+}
+
+// declare [-a | -A] [-p] NAME[=value] ...: -a makes indexed arrays, -A
+// associative ones; -p prints the variables, or every array if none is
+// named.
+int builtin_declare(char **args) {
+  int i = 1, print = 0, kind = -1;
+  for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+    for (const char *flag = args[i] + 1; *flag; flag++) {
+      if (*flag == 'a') {
+        kind = ARRAY_INDEXED;
+      } else if (*flag == 'A') {
+        kind = ARRAY_ASSOCIATIVE;
+      } else if (*flag == 'p') {
+        print = 1;
+      } else {
+        fprintf(stderr, "declare: -%c: invalid option\n", *flag);
+        return 2;
+      }
+    }
+  }
+  if (args[i] == NULL) {
+    int count;
+    ShellArray **arrays = shell_arrays(&count);
+    char **names = malloc((count + 1) * sizeof(char *));
+    if (!names) {
+      perror("malloc failed");
+      exit(EXIT_FAILURE);
+    }
+    for (int j = 0; j < count; j++)
+      names[j] = arrays[j]->name;
+    qsort(names, count, sizeof(char *), compare_strings);
+    for (int j = 0; j < count; j++)
+      print_declaration(names[j]);
+    free(names);
+    return 0;
+  }
+
+  int status = 0;
+  for (; args[i] != NULL; i++) {
+    const char *eq = strchr(args[i], '=');
+    size_t len = eq ? (size_t)(eq - args[i]) : strlen(args[i]);
+    if (!valid_name(args[i], len)) {
+      fprintf(stderr, "declare: %s: not a valid identifier\n", args[i]);
+      status = 1;
+      continue;
+    }
+    char *name = strndup(args[i], len);
+    if (!name) {
+      perror("strndup failed");
+      exit(EXIT_FAILURE);
+    }
+    if (print && !eq) {
+      print_declaration(name);
+    } else {
+      if (kind != -1)
+        declare_array(name, (ArrayKind)kind);
+      if (eq)
+        set_shell_variable(name, eq + 1);
+    }
+    free(name);
+  }
+  return status;
+}
+
+// unset NAME ... | unset 'NAME[subscript]' ...: remove variables, from the
+// environment too, or single array elements.
+int builtin_unset(char **args) {
+  for (int i = 1; args[i] != NULL; i++) {
+    char *name = strdup(args[i]);
+    if (!name) {
+      perror("strdup failed");
+      exit(EXIT_FAILURE);
+    }
+    char *subscript = strchr(name, '[');
+    if (subscript) {
+      *subscript++ = '\0';
+      char *close = strrchr(subscript, ']');
+      if (close)
+        *close = '\0';
+      ShellArray *array = find_array(name);
+      if (array)
+        array_unset(array, subscript);
+      else if (atoi(subscript) == 0)
+        unset_shell_variable(name);
+    } else {
+      unset_shell_variable(name);
+      env_unset(name);
+    }
+    free(name);
+  }
+  return 0;
+}
+
+// return [n]: leave the function with status n, or that of the last
+// command.
+int builtin_return(char **args) {
+  return function_return(args[1] ? atoi(args[1]) : last_exit_status);
+}
+
+// source file: run file in this shell, so its variables and functions
+// stay defined. A name without a slash is looked up in PATH, then in the
+// current directory.
+int builtin_source(char **args) {
+  if (args[1] == NULL) {
+    fprintf(stderr, "%s: filename argument required\n", args[0]);
+    return 2;
+  }
+  char *path = NULL;
+  if (strchr(args[1], '/') == NULL) {
+    const char *search = getenv("PATH");
+    char *dirs = strdup(search ? search : "");
+    if (!dirs) {
+      perror("strdup failed");
+      exit(EXIT_FAILURE);
+    }
+    char *saveptr = NULL;
+    for (char *dir = strtok_r(dirs, ":", &saveptr); dir && !path;
+         dir = strtok_r(NULL, ":", &saveptr)) {
+      char candidate[4096];
+      snprintf(candidate, sizeof(candidate), "%s/%s", dir, args[1]);
+      if (access(candidate, R_OK) == 0)
+        path = strdup(candidate);
+    }
+    free(dirs);
+  }
+  int status = source_file(path ? path : args[1], NULL);
+  if (status == -1) {
+    fprintf(stderr, "%s: %s: %s\n", args[0], args[1], strerror(errno));
+    status = 1;
+  }
+  free(path);
+  return status;
+}
+
+// --- read and mapfile ---
+
+#define READ_CHUNK 4096
+#define MAPFILE_CHUNK 65536
+
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} LineBuffer;
+
+static void line_append(LineBuffer *line, const char *text, size_t n) {
+  if (line->len + n + 1 > line->cap) {
+    line->cap = line->cap ? line->cap : 128;
+    while (line->len + n + 1 > line->cap)
+      line->cap *= 2;
+    line->data = realloc(line->data, line->cap);
+    if (!line->data) {
+      perror("realloc failed");
+      exit(EXIT_FAILURE);
+    }
+  }
+  memcpy(line->data + line->len, text, n);
+  line->len += n;
+  line->data[line->len] = '\0';
+}
+
+// What read_record() read from a regular file past the last record it
+// returned. The next call takes its record from here, rather than reading
+// the same chunk again, while fd is still that file, unmodified, with its
+// offset where read_record() left it.
+static struct {
+  int fd;
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  off_t size;
+  off_t offset; // Of data[start] in the file, where its offset was left
+  size_t start, end;
+  char data[READ_CHUNK];
+} ahead = {.fd = -1};
+
+// The bytes of fd from its offset on: what is left in ahead, or a chunk
+// read into it. Returns how many, as read() does.
+static ssize_t file_ahead(int fd, const struct stat *st) {
+  if (ahead.fd == fd && ahead.start < ahead.end && ahead.dev == st->st_dev &&
+      ahead.ino == st->st_ino &&
+      ahead.mtime.tv_sec == st->st_mtim.tv_sec &&
+      ahead.mtime.tv_nsec == st->st_mtim.tv_nsec &&
+      ahead.size == st->st_size && lseek(fd, 0, SEEK_CUR) == ahead.offset)
+    return (ssize_t)(ahead.end - ahead.start);
+
+  ahead.fd = -1;
+  off_t offset = lseek(fd, 0, SEEK_CUR);
+  ssize_t got = read(fd, ahead.data, sizeof(ahead.data));
+  if (got > 0 && offset != -1) {
+    ahead.fd = fd;
+    ahead.dev = st->st_dev;
+    ahead.ino = st->st_ino;
+    ahead.mtime = st->st_mtim;
+    ahead.size = st->st_size;
+  }
+  ahead.offset = offset;
+  ahead.start = 0;
+  ahead.end = got > 0 ? (size_t)got : 0;
+  return got;
+}
+
+// Hand out the first used bytes of ahead and leave the offset of fd just
+// past them.
+static void file_consume(int fd, size_t used) {
+  ahead.start += used;
+  ahead.offset += (off_t)used;
+  if (lseek(fd, ahead.offset, SEEK_SET) == -1)
+    ahead.fd = -1;
+}
+
+// Read from fd up to the next delim without consuming anything after it,
+// so commands run next see the rest of the input. A regular file is read
+// a chunk at a time into ahead and its offset moved back to just after
+// the delimiter. A pipe is first looked into with tee(), which copies without
+// consuming, and then only the bytes up to the delimiter are read.
+// Anything else is read a byte at a time. Returns 1 when delim was found,
+// 0 at end of input and -1 on error.
+static int read_record(int fd, char delim, LineBuffer *line) {
+  static int peek[2] = {-1, -1}; // Private pipe for tee(), always empty
+  char chunk[READ_CHUNK];
+  struct stat st;
+  int mode = 0;
+  if (fstat(fd, &st) == 0)
+    mode = S_ISREG(st.st_mode) ? 'f' : S_ISFIFO(st.st_mode) ? 'p' : 0;
+  if (mode == 'p' && peek[0] == -1 && pipe2(peek, O_CLOEXEC) == -1)
+    mode = 0;
+
+  while (1) {
+    ssize_t got;
+    const char *data = chunk;
+    if (mode == 'f') {
+      got = file_ahead(fd, &st);
+      data = ahead.data + ahead.start;
+    } else if (mode == 'p') {
+      got = tee(fd, peek[1], sizeof(chunk), 0);
+      if (got == -1 && errno == EINVAL) {
+        mode = 0; // The kernel cannot tee this pipe
+        continue;
+      }
+      if (got > 0 && read_exactly(peek[0], chunk, got) == -1)
+        return -1;
+    } else {
+      got = read(fd, chunk, 1);
+    }
+    if (got == -1 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      return got == 0 ? 0 : -1;
+
+    const char *end = memchr(data, delim, got);
+    size_t used = end ? (size_t)(end - data) + 1 : (size_t)got;
+    line_append(line, data, end ? used - 1 : used);
+    if (mode == 'f')
+      file_consume(fd, used);
+    else if (mode == 'p' && read_exactly(fd, chunk, used) == -1)
+      return -1;
+    if (end)
+      return 1;
+  }
+}
+
+static int is_ifs_space(char c, const char *ifs) {
+  return (c == ' ' || c == '\t' || c == '\n') && strchr(ifs, c);
+}
+
+// The next IFS-delimited field of text[*pos, len), or NULL at the end. The
+// last field takes the rest of the line when 'rest' is set. Characters
+// whose 'escaped' flag is set never delimit.
+static char *next_field(const char *text, const char *escaped, size_t len,
+                        size_t *pos, const char *ifs, int rest) {
+  size_t i = *pos;
+  while (i < len && !escaped[i] && is_ifs_space(text[i], ifs))
+    i++;
+  if (i >= len) {
+    *pos = len;
+    return NULL;
+  }
+  size_t start = i, end;
+  if (rest) {
+    end = len;
+    while (end > start && !escaped[end - 1] && is_ifs_space(text[end - 1], ifs))
+      end--;
+    i = len;
+  } else {
+    while (i < len && (escaped[i] || !strchr(ifs, text[i])))
+      i++;
+    end = i;
+    while (i < len && !escaped[i] && is_ifs_space(text[i], ifs))
+      i++;
+    if (i < len && !escaped[i] && strchr(ifs, text[i]))
+      i++; // One non-blank separator, with the blanks around it
+  }
+  *pos = i;
+  char *field = strndup(text + start, end - start);
+  if (!field) {
+    perror("strndup failed");
+    exit(EXIT_FAILURE);
+  }
+  return field;
+}
+
+// read [-r] [-d delim] [-p prompt] [-u fd] [-a array] [name ...]: read a
+// line and split it on IFS into the names, the last taking what is left,
+// or into the array; with no names the line goes to REPLY. Without -r a
+// backslash quotes the next character and joins continued lines. Status 1
+// at end of input.
+int builtin_read(char **args) {
+  int raw = 0, fd = STDIN_FILENO;
+  char delim = '\n';
+  const char *prompt = NULL, *array_name = NULL;
+  int i = 1;
+  for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+    if (strcmp(args[i], "--") == 0) {
+      i++;
+      break;
+    }
+    char option = args[i][1];
+    if (option == 'r' && args[i][2] == '\0') {
+      raw = 1;
+      continue;
+    }
+    const char *value = args[i][2] ? args[i] + 2 : args[++i];
+    if (!value || !strchr("dpua", option)) {
+      fprintf(stderr, "read: %s: invalid option\n", args[i - (value == NULL)]);
+      return 2;
+    }
+    if (option == 'd')
+      delim = *value;
+    else if (option == 'p')
+      prompt = value;
+    else if (option == 'u')
+      fd = atoi(value);
+    else
+      array_name = value;
+  }
+  if (prompt && isatty(fd)) {
+    fputs(prompt, stderr);
+    fflush(stderr);
+  }
+
+  LineBuffer line = {NULL, 0, 0}, escaped = {NULL, 0, 0};
+  int found;
+  while (1) {
+    size_t start = line.len;
+    found = read_record(fd, delim, &line);
+    if (found == -1) {
+      fprintf(stderr, "read: %d: %s\n", fd, strerror(errno));
+      break;
+    }
+    if (raw)
+      break;
+    // Drop the backslashes, flagging what they quoted. One ending the
+    // record joins the next record on.
+    size_t out = start;
+    int continued = 0;
+    for (size_t j = start; j < line.len; j++) {
+      char flag = 0;
+      if (line.data[j] == '\\') {
+        if (j + 1 == line.len) {
+          continued = found == 1;
+          break;
+        }
+        j++;
+        flag = 1;
+      }
+      line.data[out++] = line.data[j];
+      line_append(&escaped, &flag, 1);
+    }
+    line.len = out;
+    if (!continued)
+      break;
+  }
+  if (line.data == NULL)
+    line_append(&line, "", 0);
+  line.data[line.len] = '\0';
+  while (escaped.len < line.len) {
+    char flag = 0;
+    line_append(&escaped, &flag, 1);
+  }
+
+  const char *ifs = get_shell_variable("IFS");
+  if (!ifs)
+    ifs = " \t\n";
+  size_t pos = 0;
+  if (array_name) {
+    ShellArray *array = declare_array(array_name, ARRAY_INDEXED);
+    array_clear(array);
+    char *field;
+    while ((field = next_field(line.data, escaped.data, line.len, &pos, ifs,
+                               0)) != NULL) {
+      array_append(array, field);
+      free(field);
+    }
+  } else if (args[i] == NULL) {
+    set_shell_variable("REPLY", line.data);
+  } else {
+    for (; args[i] != NULL; i++) {
+      char *field = next_field(line.data, escaped.data, line.len, &pos, ifs,
+                               args[i + 1] == NULL);
+      set_shell_variable(args[i], field ? field : "");
+      free(field);
+    }
+  }
+  free(line.data);
+  free(escaped.data);
+  return found == 1 ? 0 : 1;
+}
+
+// mapfile [-t] [-d delim] [-n count] [-s skip] [-u fd] [array]: read lines
+// into an array, MAPFILE by default; -t drops the delimiters. Without -n
+// the input is read to its end in large chunks and split in one pass;
+// with -n, no further than the last line taken.
+int builtin_mapfile(char **args) {
+  int strip = 0, fd = STDIN_FILENO;
+  long count = 0, skip = 0;
+  char delim = '\n';
+  int i = 1;
+  for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+    char option = args[i][1];
+    if (option == 't' && args[i][2] == '\0') {
+      strip = 1;
+      continue;
+    }
+    const char *value = args[i][2] ? args[i] + 2 : args[++i];
+    if (!value || !strchr("dnsu", option)) {
+      fprintf(stderr, "%s: %s: invalid option\n", args[0],
+              args[i - (value == NULL)]);
+      return 2;
+    }
+    if (option == 'd')
+      delim = *value;
+    else if (option == 'n')
+      count = atol(value);
+    else if (option == 's')
+      skip = atol(value);
+    else
+      fd = atoi(value);
+  }
+  ShellArray *array =
+      declare_array(args[i] ? args[i] : "MAPFILE", ARRAY_INDEXED);
+  array_clear(array);
+
+  LineBuffer line = {NULL, 0, 0};
+  long seen = 0;
+  int status = 0;
+  if (count > 0) {
+    int found;
+    while (seen < skip + count &&
+           (found = read_record(fd, delim, &line)) != 0) {
+      if (found == -1) {
+        status = 1;
+        break;
+      }
+      if (seen++ >= skip) {
+        if (!strip)
+          line_append(&line, &delim, 1);
+        array_append(array, line.data);
+      }
+      line.len = 0;
+    }
+  } else {
+    char *chunk = malloc(MAPFILE_CHUNK);
+    if (!chunk) {
+      perror("malloc failed");
+      exit(EXIT_FAILURE);
+    }
+    ssize_t got;
+    while ((got = read(fd, chunk, MAPFILE_CHUNK)) != 0) {
+      if (got == -1) {
+        if (errno == EINTR)
+          continue;
+        status = 1;
+        break;
+      }
+      const char *p = chunk, *end = chunk + got, *next;
+      while ((next = memchr(p, delim, end - p)) != NULL) {
+        size_t len = next - p + !strip;
+        if (seen++ >= skip) {
+          // Joined to what the last chunk left, by length: the delimiter
+          // may be the chunk's last byte.
+          line_append(&line, p, len);
+          array_append(array, line.data);
+        }
+        line.len = 0;
+        p = next + 1;
+      }
+      line_append(&line, p, end - p); // Carried into the next chunk
+    }
+    free(chunk);
+  }
+  if (line.len && seen++ >= skip && (count == 0 || seen <= skip + count))
+    array_append(array, line.data); // A last line without a delimiter
+  free(line.data);
+  if (status)
+    fprintf(stderr, "%s: %d: %s\n", args[0], fd, strerror(errno));
+  return status;
+}
+
+int builtin_jobs(char **args) {
+  (void)args;
+  jobs_print();
+  return 0;
+}
+
+// stats [-r]: what the shell holds in memory, by subsystem, and its
+// allocation, fork, glob and cache counters; -r zeroes the counters.
+int builtin_stats(char **args) {
+  if (args[1] && strcmp(args[1], "-r") == 0) {
+    stats_reset();
+    return 0;
+  }
+  if (args[1]) {
+    fprintf(stderr, "stats: %s: invalid option\n", args[1]);
+    return 2;
+  }
+  stats_report(stdout);
+  return 0;
+}
+
+static const struct {
+  char option;
+  int resource;
+  int unit; // Bytes per unit of the value shown and given
+  const char *name;
+} ulimit_resources[] = {
+    {'c', RLIMIT_CORE, 1024, "core file size (kbytes)"},
+    {'d', RLIMIT_DATA, 1024, "data seg size (kbytes)"},
+    {'e', RLIMIT_NICE, 1, "scheduling priority"},
+    {'f', RLIMIT_FSIZE, 1024, "file size (kbytes)"},
+    {'i', RLIMIT_SIGPENDING, 1, "pending signals"},
+    {'l', RLIMIT_MEMLOCK, 1024, "max locked memory (kbytes)"},
+    {'m', RLIMIT_RSS, 1024, "max memory size (kbytes)"},
+    {'n', RLIMIT_NOFILE, 1, "open files"},
+    {'q', RLIMIT_MSGQUEUE, 1, "POSIX message queues (bytes)"},
+    {'r', RLIMIT_RTPRIO, 1, "real-time priority"},
+    {'s', RLIMIT_STACK, 1024, "stack size (kbytes)"},
+    {'t', RLIMIT_CPU, 1, "cpu time (seconds)"},
+    {'u', RLIMIT_NPROC, 1, "max user processes"},
+    {'v', RLIMIT_AS, 1024, "virtual memory (kbytes)"},
+    {'x', RLIMIT_LOCKS, 1, "file locks"},
+};
+#define ULIMIT_COUNT                                                           \
+  (int)(sizeof(ulimit_resources) / sizeof(ulimit_resources[0]))
+
+static void print_limit(int index, int hard, int labelled) {
+  struct rlimit limit;
+  if (labelled)
+    printf("%-32s(-%c) ", ulimit_resources[index].name,
+           ulimit_resources[index].option);
+  if (getrlimit(ulimit_resources[index].resource, &limit) == -1) {
+    printf("error\n");
+    return;
+  }
+  rlim_t value = hard ? limit.rlim_max : limit.rlim_cur;
+  if (value == RLIM_INFINITY)
+    printf("unlimited\n");
+  else
+    printf("%llu\n",
+           (unsigned long long)(value / ulimit_resources[index].unit));
+}
+
+// ulimit [-SH] [-a | -cdefilmnqrstuvx ...] [value]: show the shell's
+// resource limits, soft ones unless -H is given, or set one to a number,
+// "unlimited", "soft" or "hard"; without -S or -H both are set. The
+// default resource is -f. Commands the shell starts inherit the limits.
+int builtin_ulimit(char **args) {
+  int soft = 0, hard = 0, all = 0, selected[ULIMIT_COUNT], count = 0;
+  int i = 1;
+  for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+    for (const char *p = args[i] + 1; *p; p++) {
+      if (*p == 'S' || *p == 'H' || *p == 'a') {
+        soft |= *p == 'S';
+        hard |= *p == 'H';
+        all |= *p == 'a';
+        continue;
+      }
+      int found = -1;
+      for (int r = 0; r < ULIMIT_COUNT && found == -1; r++) {
+        if (ulimit_resources[r].option == *p)
+          found = r;
+      }
+      if (found == -1) {
+        fprintf(stderr, "ulimit: -%c: invalid option\n", *p);
+        return 2;
+      }
+      if (count < ULIMIT_COUNT)
+        selected[count++] = found;
+    }
+  }
+  if (count == 0 && !all) {
+    for (int r = 0; r < ULIMIT_COUNT; r++) {
+      if (ulimit_resources[r].option == 'f')
+        selected[count++] = r;
+    }
+  }
+
+  const char *value = args[i];
+  if (value == NULL || all) {
+    for (int r = 0; r < (all ? ULIMIT_COUNT : count); r++)
+      print_limit(all ? r : selected[r], hard && !soft, all || count > 1);
+    return 0;
+  }
+  if (args[i + 1] != NULL) {
+    fprintf(stderr, "ulimit: too many arguments\n");
+    return 2;
+  }
+
+  int index = selected[count - 1];
+  struct rlimit limit;
+  if (getrlimit(ulimit_resources[index].resource, &limit) == -1) {
+    fprintf(stderr, "ulimit: %s: %s\n", ulimit_resources[index].name,
+            strerror(errno));
+    return 1;
+  }
+  rlim_t wanted;
+  if (strcmp(value, "unlimited") == 0) {
+    wanted = RLIM_INFINITY;
+  } else if (strcmp(value, "hard") == 0) {
+    wanted = limit.rlim_max;
+  } else if (strcmp(value, "soft") == 0) {
+    wanted = limit.rlim_cur;
+  } else {
+    char *end;
+    errno = 0;
+    unsigned long long number = strtoull(value, &end, 10);
+    if (errno || end == value || *end || value[0] == '-' ||
+        number > (unsigned long long)RLIM_INFINITY /
+                      ulimit_resources[index].unit) {
+      fprintf(stderr, "ulimit: %s: invalid number\n", value);
+      return 1;
+    }
+    wanted = (rlim_t)(number * ulimit_resources[index].unit);
+  }
+  if (soft || !hard)
+    limit.rlim_cur = wanted;
+  if (hard || !soft)
+    limit.rlim_max = wanted;
+  if (setrlimit(ulimit_resources[index].resource, &limit) == -1) {
+    fprintf(stderr, "ulimit: %s: cannot modify limit: %s\n",
+            ulimit_resources[index].name, strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+// wait [%n | pid ...]: the status is that of the last job named; with no
+// arguments every background job is waited for and the status is 0.
+int builtin_wait(char **args) {
+  if (args[1] == NULL) {
+    jobs_wait(0);
+    return 0;
+  }
+  int status = 0;
+  for (int i = 1; args[i] != NULL; i++) {
+    pid_t pid = job_lookup(args[i]);
+    if (pid == 0) {
+      fprintf(stderr, "wait: %s: no such job\n", args[i]);
+      status = 127;
+      continue;
+    }
+    status = jobs_wait(pid);
+  }
+  return status;
+}
+
+// cat [file ...]: a missing file or '-' is the standard input.
+int builtin_cat(char **args) {
+  char *standard_input[] = {"-", NULL};
+  char **files = args[1] ? args + 1 : standard_input;
+  struct stat out;
+  int out_regular = fstat(STDOUT_FILENO, &out) == 0 && S_ISREG(out.st_mode);
+  int status = 0;
+  fileio_interrupted = 0;
+  for (int i = 0; files[i] != NULL; i++) {
+    int fd = strcmp(files[i], "-") == 0 ? STDIN_FILENO
+                                         : open(files[i], O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      fprintf(stderr, "cat: %s: %s\n", files[i], strerror(errno));
+      status = 1;
+      continue;
+    }
+    struct stat in;
+    int result;
+    if (out_regular && fstat(fd, &in) == 0 && in.st_dev == out.st_dev &&
+        in.st_ino == out.st_ino && lseek(fd, 0, SEEK_CUR) < in.st_size) {
+      // It would never reach the end of what it is writing.
+      fprintf(stderr, "cat: %s: input file is output file\n", files[i]);
+      result = 1;
+    } else if (fileio_copy(fd, STDOUT_FILENO) == -1) {
+      result = errno == EINTR ? 130 : 1;
+      if (result == 1)
+        fprintf(stderr, "cat: %s: %s\n", files[i], strerror(errno));
+    } else {
+      result = 0;
+    }
+    if (fd != STDIN_FILENO)
+      close(fd);
+    if (result == 130)
+      return 130;
+    status |= result;
+  }
+  return status;
+}
+
+static int copy_file(const char *source, const char *target, int into) {
+  char path[PATH_MAX];
+  if (into) {
+    const char *base = strrchr(source, '/');
+    snprintf(path, sizeof(path), "%s/%s", target, base ? base + 1 : source);
+    target = path;
+  }
+  int in = open(source, O_RDONLY | O_CLOEXEC);
+  struct stat st, existing;
+  if (in == -1 || fstat(in, &st) == -1) {
+    fprintf(stderr, "cp: %s: %s\n", source, strerror(errno));
+    if (in != -1)
+      close(in);
+    return 1;
+  }
+  if (S_ISDIR(st.st_mode) ||
+      (stat(target, &existing) == 0 && existing.st_dev == st.st_dev &&
+       existing.st_ino == st.st_ino)) {
+    if (S_ISDIR(st.st_mode))
+      fprintf(stderr, "cp: -r not specified; omitting directory '%s'\n",
+              source);
+    else
+      fprintf(stderr, "cp: '%s' and '%s' are the same file\n", source,
+              target);
+    close(in);
+    return 1;
+  }
+  int out = open(target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                 st.st_mode & 0777);
+  if (out == -1) {
+    fprintf(stderr, "cp: %s: %s\n", target, strerror(errno));
+    close(in);
+    return 1;
+  }
+  int result = fileio_copy(in, out), error = errno;
+  close(in);
+  if (close(out) == -1 && result == 0) {
+    result = -1;
+    error = errno;
+  }
+  if (result == -1) {
+    if (error == EINTR)
+      return 130;
+    fprintf(stderr, "cp: %s: %s\n", target, strerror(error));
+    return 1;
+  }
+  return 0;
+}
+
+// cp source target, or cp source ... directory.
+int builtin_cp(char **args) {
+  int count = 1;
+  while (args[count + 1] != NULL)
+    count++;
+  const char *target = args[count];
+  struct stat st;
+  int into = stat(target, &st) == 0 && S_ISDIR(st.st_mode);
+  if (count > 2 && !into) {
+    fprintf(stderr, "cp: target '%s' is not a directory\n", target);
+    return 1;
+  }
+  int status = 0;
+  fileio_interrupted = 0;
+  for (int i = 1; i < count; i++) {
+    int result = copy_file(args[i], target, into);
+    if (result == 130)
+      return 130;
+    status |= result;
+  }
+  return status;
+}
+
+// wc -l [file ...]. As in GNU wc, several counts share a width, from the
+// total size of the regular files, and at least 7 when one is not.
+int builtin_wc(char **args) {
+  char *standard_input[] = {"-", NULL};
+  char **files = args[2] ? args + 2 : standard_input;
+  int count = 0, width = 1, minimum = 1;
+  long long size = 0;
+  while (files[count] != NULL)
+    count++;
+  if (count > 1) {
+    for (int i = 0; i < count; i++) {
+      struct stat st;
+      int found = strcmp(files[i], "-") == 0 ? fstat(STDIN_FILENO, &st)
+                                              : stat(files[i], &st);
+      if (found == 0 && S_ISREG(st.st_mode))
+        size += st.st_size;
+      else if (found == 0)
+        minimum = 7;
+    }
+    for (; size >= 10; size /= 10)
+      width++;
+    if (width < minimum)
+      width = minimum;
+  }
+
+  long long total = 0;
+  int status = 0;
+  fileio_interrupted = 0;
+  for (int i = 0; i < count; i++) {
+    int fd = strcmp(files[i], "-") == 0 ? STDIN_FILENO
+                                         : open(files[i], O_RDONLY | O_CLOEXEC);
+    long long lines = fd == -1 ? -1 : fileio_count_lines(fd);
+    int error = errno;
+    if (fd > STDIN_FILENO)
+      close(fd);
+    if (lines == -1) {
+      if (error == EINTR)
+        return 130;
+      fprintf(stderr, "wc: %s: %s\n", files[i], strerror(error));
+      status = 1;
+      continue;
+    }
+    total += lines;
+    if (args[2])
+      printf("%*lld %s\n", width, lines, files[i]);
+    else
+      printf("%lld\n", lines);
+  }
+  if (count > 1)
+    printf("%*lld total\n", width, total);
+  return status;
+}
+
+const Builtin builtins[] = {
+    {".", builtin_source},
+    {"cd", builtin_cd},
+    {"declare", builtin_declare},
+    {"exit", builtin_exit},
+    {"export", builtin_export},
+    {"help", builtin_help},
+    {"history", builtin_history},
+    {"jobs", builtin_jobs},
+    {"local", builtin_local},
+    {"mapfile", builtin_mapfile},
+    {"read", builtin_read},
+    {"readarray", builtin_mapfile},
+    {"return", builtin_return},
+    {"set", builtin_set},
+    {"source", builtin_source},
+    {"stats", builtin_stats},
+    {"ulimit", builtin_ulimit},
+    {"unset", builtin_unset},
+    {"wait", builtin_wait},
+};
+const int builtin_count = sizeof(builtins) / sizeof(builtins[0]);
+
+const Builtin *find_builtin(const char *name) {
+  for (int i = 0; i < builtin_count; i++) {
+    if (strcmp(name, builtins[i].name) == 0)
+      return &builtins[i];
+  }
+  return NULL;
+}
+
+// The file builtins stand in for the programs of the same name under
+// set -o fileio, and only in the forms they implement; any option beyond
+// 'wc -l' leaves the command to the real program.
+static const Builtin file_builtins[] = {
+    {"cat", builtin_cat},
+    {"cp", builtin_cp},
+    {"wc", builtin_wc},
+};
+
+const Builtin *find_file_builtin(char **argv) {
+  if (!option_fileio)
+    return NULL;
+  const Builtin *builtin = NULL;
+  int count = sizeof(file_builtins) / sizeof(file_builtins[0]);
+  for (int i = 0; i < count && !builtin; i++) {
+    if (strcmp(argv[0], file_builtins[i].name) == 0)
+      builtin = &file_builtins[i];
+  }
+  if (!builtin)
+    return NULL;
+  int first = 1, operands = 0;
+  if (builtin->func == builtin_wc) {
+    if (argv[1] == NULL || strcmp(argv[1], "-l") != 0)
+      return NULL;
+    first = 2;
+  }
+  for (int i = first; argv[i] != NULL; i++, operands++) {
+    if (argv[i][0] == '-' && argv[i][1] != '\0')
+      return NULL;
+  }
+  if (builtin->func == builtin_cp && operands < 2)
+    return NULL;
+  return builtin;
+}
+
 int executable_builtin(char **args, int argc) {
   (void)argc;
-  if (strcmp(args[0], "cd") == 0)
-    return builtin_cd(args);
-  else if (strcmp(args[0], "exit") == 0)
-    return builtin_exit(args);
-  else if (strcmp(args[0], "help") == 0)
-    return builtin_help(args);
-  else if (strcmp(args[0], "history") == 0)
-    return builtin_history(args);
-  return -1;
+  const Builtin *builtin = find_builtin(args[0]);
+  return builtin ? builtin->func(args) : -1;
 }
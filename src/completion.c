@@ -0,0 +1,491 @@
+#include "include/completion.h"
+#include "include/builtins.h"
+#include "include/environment.h"
+#include "include/scripting.h"
+#include "include/stats.h"
+#include "include/utils.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHELL_SPECIAL_CHARS " \t\\'\"|&;<>()$`*?[]!#"
+#define WORD_BREAK_CHARS " \t|&;<>()"
+
+// Executables found in one PATH directory.
+typedef struct {
+  char *path;
+  struct timespec mtime;
+  char **names;
+  size_t count;
+} PathDir;
+
+// Index of every executable on PATH. It is built on the first completion
+// and only directories whose mtime changed are rescanned afterwards; mtimes
+// are checked at most every PATH_RECHECK_SECONDS so repeated Tab presses
+// don't stat the whole PATH.
+static struct {
+  char *path_env;
+  PathDir *dirs;
+  size_t dir_count;
+  char **names; // Merged and deduplicated; points into dirs[].names
+  size_t count;
+  time_t checked;
+} path_index;
+
+// Recently listed directories for file completion.
+typedef struct {
+  char *path;
+  struct timespec mtime;
+  char **names;
+  unsigned char *is_dir;
+  size_t count;
+  unsigned long last_used;
+} DirCacheEntry;
+
+static DirCacheEntry dir_cache[DIR_CACHE_SIZE];
+static unsigned long dir_cache_clock = 0;
+
+static int compare_names(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int same_mtime(const struct timespec *a, const struct timespec *b) {
+  return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+static void *xrealloc(void *ptr, size_t size) {
+  STATS_ALLOC(STATS_COMPLETION);
+  void *grown = realloc(ptr, size);
+  if (!grown) {
+    perror("realloc failed");
+    exit(EXIT_FAILURE);
+  }
+  return grown;
+}
+
+static char *xstrdup(const char *s) {
+  STATS_ALLOC(STATS_COMPLETION);
+  char *copy = strdup(s);
+  if (!copy) {
+    perror("strdup failed");
+    exit(EXIT_FAILURE);
+  }
+  return copy;
+}
+
+static char *xstrndup(const char *s, size_t n) {
+  STATS_ALLOC(STATS_COMPLETION);
+  char *copy = strndup(s, n);
+  if (!copy) {
+    perror("strndup failed");
+    exit(EXIT_FAILURE);
+  }
+  return copy;
+}
+
+static void free_names(char **names, size_t count) {
+  for (size_t i = 0; i < count; i++)
+    free(names[i]);
+  free(names);
+}
+
+// --- PATH executable index ---
+
+static void scan_path_dir(PathDir *dir) {
+  free_names(dir->names, dir->count);
+  dir->names = NULL;
+  dir->count = 0;
+
+  struct stat st;
+  if (stat(dir->path, &st) != 0)
+    return;
+  dir->mtime = st.st_mtim;
+
+  DIR *d = opendir(dir->path);
+  if (!d)
+    return;
+
+  size_t capacity = 0;
+  struct dirent *entry;
+  while ((entry = readdir(d)) != NULL) {
+    if (entry->d_name[0] == '.' || entry->d_type == DT_DIR)
+      continue;
+    if (fstatat(dirfd(d), entry->d_name, &st, 0) != 0 ||
+        !S_ISREG(st.st_mode) || !(st.st_mode & 0111))
+      continue;
+    if (dir->count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      dir->names = xrealloc(dir->names, capacity * sizeof(char *));
+    }
+    dir->names[dir->count++] = xstrdup(entry->d_name);
+  }
+  closedir(d);
+}
+
+static void merge_path_index(void) {
+  size_t total = 0;
+  for (size_t i = 0; i < path_index.dir_count; i++)
+    total += path_index.dirs[i].count;
+
+  free(path_index.names);
+  path_index.names = xrealloc(NULL, (total + 1) * sizeof(char *));
+  path_index.count = 0;
+  for (size_t i = 0; i < path_index.dir_count; i++) {
+    memcpy(path_index.names + path_index.count, path_index.dirs[i].names,
+           path_index.dirs[i].count * sizeof(char *));
+    path_index.count += path_index.dirs[i].count;
+  }
+  qsort(path_index.names, path_index.count, sizeof(char *), compare_names);
+
+  size_t unique = 0;
+  for (size_t i = 0; i < path_index.count; i++) {
+    if (unique == 0 ||
+        strcmp(path_index.names[unique - 1], path_index.names[i]) != 0)
+      path_index.names[unique++] = path_index.names[i];
+  }
+  path_index.count = unique;
+}
+
+static void clear_path_index(void) {
+  for (size_t i = 0; i < path_index.dir_count; i++) {
+    free(path_index.dirs[i].path);
+    free_names(path_index.dirs[i].names, path_index.dirs[i].count);
+  }
+  free(path_index.dirs);
+  free(path_index.names);
+  free(path_index.path_env);
+  memset(&path_index, 0, sizeof(path_index));
+}
+
+// Bring the index up to date with PATH. A changed PATH rebuilds it; an
+// unchanged one only rescans directories whose mtime moved.
+void path_index_refresh(void) {
+  const char *path = getenv("PATH");
+  time_t now = time(NULL);
+
+  if (!path)
+    path = "";
+
+  if (path_index.path_env && strcmp(path_index.path_env, path) == 0) {
+    if (now - path_index.checked < PATH_RECHECK_SECONDS)
+      return;
+    path_index.checked = now;
+
+    int changed = 0;
+    for (size_t i = 0; i < path_index.dir_count; i++) {
+      struct stat st;
+      PathDir *dir = &path_index.dirs[i];
+      if (stat(dir->path, &st) != 0) {
+        if (dir->count > 0) {
+          free_names(dir->names, dir->count);
+          dir->names = NULL;
+          dir->count = 0;
+          changed = 1;
+        }
+      } else if (!same_mtime(&st.st_mtim, &dir->mtime)) {
+        scan_path_dir(dir);
+        changed = 1;
+      }
+    }
+    if (changed)
+      merge_path_index();
+    return;
+  }
+
+  clear_path_index();
+  path_index.path_env = xstrdup(path);
+  path_index.checked = now;
+
+  char *copy = xstrdup(path);
+  char *saveptr;
+  size_t capacity = 0;
+  for (char *dir = strtok_r(copy, ":", &saveptr); dir != NULL;
+       dir = strtok_r(NULL, ":", &saveptr)) {
+    int duplicate = 0;
+    for (size_t i = 0; i < path_index.dir_count && !duplicate; i++)
+      duplicate = (strcmp(path_index.dirs[i].path, dir) == 0);
+    if (duplicate)
+      continue;
+
+    if (path_index.dir_count == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      path_index.dirs = xrealloc(path_index.dirs, capacity * sizeof(PathDir));
+    }
+    PathDir *entry = &path_index.dirs[path_index.dir_count++];
+    memset(entry, 0, sizeof(*entry));
+    entry->path = xstrdup(dir);
+    scan_path_dir(entry);
+  }
+  free(copy);
+  merge_path_index();
+}
+
+// --- Directory cache ---
+
+static DirCacheEntry *dir_cache_get(const char *path) {
+  struct stat st;
+  if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+    return NULL;
+
+  DirCacheEntry *slot = &dir_cache[0];
+  for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+    DirCacheEntry *entry = &dir_cache[i];
+    if (entry->path && strcmp(entry->path, path) == 0) {
+      slot = entry;
+      if (same_mtime(&entry->mtime, &st.st_mtim)) {
+        entry->last_used = ++dir_cache_clock;
+        STATS_COUNT(STATS_DIR_CACHE_HITS, 1);
+        return entry;
+      }
+      break;
+    }
+    if (entry->last_used < slot->last_used)
+      slot = entry;
+  }
+
+  STATS_COUNT(STATS_DIR_CACHE_MISSES, 1);
+  DIR *d = opendir(path);
+  if (!d)
+    return NULL;
+
+  free(slot->path);
+  free_names(slot->names, slot->count);
+  free(slot->is_dir);
+  memset(slot, 0, sizeof(*slot));
+  slot->path = xstrdup(path);
+  slot->mtime = st.st_mtim;
+  slot->last_used = ++dir_cache_clock;
+
+  size_t capacity = 0;
+  struct dirent *entry;
+  while ((entry = readdir(d)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+    if (slot->count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      slot->names = xrealloc(slot->names, capacity * sizeof(char *));
+      slot->is_dir = xrealloc(slot->is_dir, capacity);
+    }
+    int is_dir = (entry->d_type == DT_DIR);
+    if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+      struct stat entry_st;
+      is_dir = fstatat(dirfd(d), entry->d_name, &entry_st, 0) == 0 &&
+               S_ISDIR(entry_st.st_mode);
+    }
+    slot->is_dir[slot->count] = (unsigned char)is_dir;
+    slot->names[slot->count++] = xstrdup(entry->d_name);
+  }
+  closedir(d);
+  return slot;
+}
+
+void free_completion_caches(void) {
+  clear_path_index();
+  for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+    free(dir_cache[i].path);
+    free_names(dir_cache[i].names, dir_cache[i].count);
+    free(dir_cache[i].is_dir);
+    memset(&dir_cache[i], 0, sizeof(dir_cache[i]));
+  }
+}
+
+// The PATH index's names point into its directories' lists.
+size_t completion_bytes(void) {
+  size_t total = stats_block(path_index.path_env) +
+                 stats_block(path_index.dirs) + stats_block(path_index.names);
+  for (size_t i = 0; i < path_index.dir_count; i++) {
+    PathDir *dir = &path_index.dirs[i];
+    total += stats_block(dir->path) + stats_block(dir->names);
+    for (size_t j = 0; j < dir->count; j++)
+      total += stats_block(dir->names[j]);
+  }
+  for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+    DirCacheEntry *entry = &dir_cache[i];
+    total += stats_block(entry->path) + stats_block(entry->names) +
+             stats_block(entry->is_dir);
+    for (size_t j = 0; j < entry->count; j++)
+      total += stats_block(entry->names[j]);
+  }
+  return total;
+}
+
+// --- Candidate generation ---
+
+static void add_candidate(Completions *out, const char *prefix,
+                          const char *name, const char *suffix) {
+  size_t len = strlen(prefix) + 2 * strlen(name) + strlen(suffix) + 1;
+  char *item = xrealloc(NULL, len);
+  char *p = item + strlen(prefix);
+
+  memcpy(item, prefix, strlen(prefix));
+  for (const char *c = name; *c; c++) {
+    if (strchr(SHELL_SPECIAL_CHARS, *c))
+      *p++ = '\\';
+    *p++ = *c;
+  }
+  strcpy(p, suffix);
+
+  if (out->count == out->capacity) {
+    out->capacity = out->capacity ? out->capacity * 2 : 16;
+    out->items = xrealloc(out->items, out->capacity * sizeof(char *));
+  }
+  out->items[out->count++] = item;
+}
+
+static void complete_commands(const char *word, Completions *out) {
+  size_t len = strlen(word);
+
+  for (int i = 0; i < builtin_count; i++) {
+    if (strncmp(builtins[i].name, word, len) == 0)
+      add_candidate(out, "", builtins[i].name, "");
+  }
+
+  path_index_refresh();
+
+  // Binary search for the first name >= word; matches are contiguous.
+  size_t lo = 0, hi = path_index.count;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (strcmp(path_index.names[mid], word) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  for (size_t i = lo; i < path_index.count; i++) {
+    if (strncmp(path_index.names[i], word, len) != 0)
+      break;
+    add_candidate(out, "", path_index.names[i], "");
+  }
+}
+
+// Shell variables and arrays come first; the environment adds those the
+// shell has not read in. Duplicates go when the candidates are sorted.
+static void complete_variables(const char *word, Completions *out) {
+  size_t len = strlen(word);
+  int count;
+  char **names = shell_variable_names(&count);
+  for (int i = 0; i < count; i++) {
+    if (strncmp(names[i], word, len) == 0)
+      add_candidate(out, "$", names[i], "");
+  }
+  ShellArray **arrays = shell_arrays(&count);
+  for (int i = 0; i < count; i++) {
+    if (strncmp(arrays[i]->name, word, len) == 0)
+      add_candidate(out, "$", arrays[i]->name, "");
+  }
+  for (char **env = env_vector(); *env; env++) {
+    const char *eq = strchr(*env, '=');
+    if (!eq || (size_t)(eq - *env) < len || strncmp(*env, word, len) != 0)
+      continue;
+    char *name = xstrndup(*env, eq - *env);
+    add_candidate(out, "$", name, "");
+    free(name);
+  }
+}
+
+static void complete_files(const char *word, const char *typed,
+                           Completions *out) {
+  const char *slash = strrchr(word, '/');
+  const char *base = slash ? slash + 1 : word;
+  size_t base_len = strlen(base);
+  char *dir;
+
+  if (!slash) {
+    dir = xstrdup(".");
+  } else if (slash == word) {
+    dir = xstrdup("/");
+  } else if (word[0] == '~' && (word[1] == '/' || word + 1 == slash)) {
+    const char *home = getenv("HOME");
+    size_t home_len = strlen(home ? home : "");
+    dir = xrealloc(NULL, home_len + (slash - word));
+    memcpy(dir, home ? home : "", home_len);
+    memcpy(dir + home_len, word + 1, slash - word - 1);
+    dir[home_len + (slash - word) - 1] = '\0';
+    if (dir[0] == '\0')
+      strcpy(dir, "/");
+  } else {
+    dir = xstrndup(word, slash - word);
+  }
+
+  // The typed directory part is kept verbatim in the replacement.
+  const char *typed_slash = strrchr(typed, '/');
+  char *prefix = typed_slash ? xstrndup(typed, typed_slash - typed + 1)
+                             : xstrdup("");
+
+  DirCacheEntry *entry = dir_cache_get(dir);
+  for (size_t i = 0; entry && i < entry->count; i++) {
+    const char *name = entry->names[i];
+    if (name[0] == '.' && base[0] != '.')
+      continue;
+    if (strncmp(name, base, base_len) == 0)
+      add_candidate(out, prefix, name, entry->is_dir[i] ? "/" : "");
+  }
+  free(prefix);
+  free(dir);
+}
+
+// Find the word ending at the cursor and collect its completions. Command
+// position completes builtins and PATH executables, "$" completes
+// environment variables, anything else completes file names.
+size_t complete_word(const char *line, size_t cursor, Completions *out) {
+  size_t start = cursor;
+  while (start > 0 && !strchr(WORD_BREAK_CHARS, line[start - 1]))
+    start--;
+  // A backslash-escaped break character belongs to the word.
+  while (start > 1 && line[start - 2] == '\\' &&
+         strchr(WORD_BREAK_CHARS, line[start - 1])) {
+    start--;
+    while (start > 0 && !strchr(WORD_BREAK_CHARS, line[start - 1]))
+      start--;
+  }
+
+  memset(out, 0, sizeof(*out));
+  out->word_start = start;
+
+  char *typed = xstrndup(line + start, cursor - start);
+  char *word = xstrdup(typed);
+  char *w = word;
+  for (const char *c = typed; *c; c++) {
+    if (*c == '\\' && c[1])
+      c++;
+    *w++ = *c;
+  }
+  *w = '\0';
+
+  size_t p = start;
+  while (p > 0 && (line[p - 1] == ' ' || line[p - 1] == '\t'))
+    p--;
+  int command_position = (p == 0 || strchr("|&;(", line[p - 1]));
+
+  if (word[0] == '$')
+    complete_variables(word + 1, out);
+  else if (command_position && !strchr(word, '/'))
+    complete_commands(word, out);
+  else
+    complete_files(word, typed, out);
+
+  qsort(out->items, out->count, sizeof(char *), compare_names);
+  size_t unique = 0;
+  for (size_t i = 0; i < out->count; i++) {
+    if (unique > 0 && strcmp(out->items[unique - 1], out->items[i]) == 0)
+      free(out->items[i]);
+    else
+      out->items[unique++] = out->items[i];
+  }
+  out->count = unique;
+
+  free(word);
+  free(typed);
+  return out->count;
+}
+
+void free_completions(Completions *completions) {
+  free_names(completions->items, completions->count);
+  completions->items = NULL;
+  completions->count = completions->capacity = 0;
+}
@@ -0,0 +1,560 @@
+#define _GNU_SOURCE // forkpty
+#include "include/utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// End-to-end harness: runs a built cshell on whole workloads the way users
+// do -- a script passed with -c, the same script on stdin, and the
+// commands typed one by one at the prompt of a pty -- and reports commands
+// per second, the shell's peak RSS and, at the prompt, how long each
+// command took to give the prompt back.
+//
+//   cshell_e2e [--shell path]... [--mode c|stdin|pty]...
+//              [--workload loop|pipeline|glob]... [--script file]...
+//              [--session file]... [--json]
+//
+// Several --shell options run every workload on each build in turn, so a
+// candidate can be compared with the one in use.
+
+#define MODE_C 1
+#define MODE_STDIN 2
+#define MODE_PTY 4
+#define ALL_MODES (MODE_C | MODE_STDIN | MODE_PTY)
+
+#define MAX_SHELLS 8
+#define MAX_WORKLOADS 16
+#define PROMPT_TIMEOUT_MS 10000
+#define ARG_LIMIT 100000 // -c takes one argument; longer scripts go by file
+
+#define LOOP_ITERATIONS 10000
+#define PIPELINE_DEPTH 32
+#define PIPELINE_RUNS 100
+#define GLOB_FILES 10000
+#define GLOB_RUNS 100
+
+typedef struct {
+  const char *name;
+  char *script; // One command per line
+  int commands;
+  int modes; // Modes this workload makes sense in
+  const char *dir; // Working directory, or NULL
+} Workload;
+
+typedef struct {
+  double seconds;
+  long max_rss; // KiB
+  int status;
+  long long *latencies; // MODE_PTY: ns from Enter to the next prompt
+  int latency_count;
+} RunResult;
+
+static int json_output = 0;
+static char glob_dir[] = "/tmp/cshell_e2e_XXXXXX";
+static int glob_dir_made = 0;
+
+static void *xmalloc(size_t size) {
+  void *ptr = malloc(size);
+  if (!ptr) {
+    perror("malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  return ptr;
+}
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// --- Workloads ---
+
+// A growable script buffer.
+typedef struct {
+  char *text;
+  size_t len;
+  size_t cap;
+  int lines;
+} Script;
+
+static void script_line(Script *script, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void script_line(Script *script, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  char line[4096];
+  int len = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  if (len < 0 || len >= (int)sizeof(line) - 1)
+    return;
+  if (script->len + len + 2 > script->cap) {
+    script->cap = script->cap ? script->cap * 2 : 4096;
+    while (script->len + len + 2 > script->cap)
+      script->cap *= 2;
+    script->text = realloc(script->text, script->cap);
+    if (!script->text) {
+      perror("realloc failed");
+      exit(EXIT_FAILURE);
+    }
+  }
+  memcpy(script->text + script->len, line, len);
+  script->len += len;
+  script->text[script->len++] = '\n';
+  script->text[script->len] = '\0';
+  script->lines++;
+}
+
+// The script language has no arithmetic yet, so the loop is unrolled: each
+// iteration is an assignment, an expansion and a builtin, with an external
+// command every hundredth time round.
+static void make_loop(Workload *workload) {
+  Script script = {0};
+  for (int i = 0; i < LOOP_ITERATIONS; i++) {
+    if (i % 100 == 99)
+      script_line(&script, "/bin/true $i");
+    else
+      script_line(&script, "i=%d; last=$i; cd .", i);
+  }
+  workload->script = script.text;
+  workload->commands = script.lines;
+}
+
+static void make_pipeline(Workload *workload) {
+  Script script = {0};
+  char line[PIPELINE_DEPTH * 8 + 64];
+  size_t len = (size_t)snprintf(line, sizeof(line), "echo deep");
+  for (int i = 0; i < PIPELINE_DEPTH - 1; i++)
+    len += snprintf(line + len, sizeof(line) - len, " | cat");
+  for (int i = 0; i < PIPELINE_RUNS; i++)
+    script_line(&script, "%s > /dev/null", line);
+  workload->script = script.text;
+  workload->commands = script.lines;
+}
+
+static void make_glob(Workload *workload) {
+  if (!glob_dir_made) {
+    if (!mkdtemp(glob_dir)) {
+      perror(glob_dir);
+      exit(EXIT_FAILURE);
+    }
+    glob_dir_made = 1;
+    for (int i = 0; i < GLOB_FILES; i++) {
+      char path[sizeof(glob_dir) + 32];
+      snprintf(path, sizeof(path), "%s/entry%05d.%s", glob_dir, i,
+               i % 2 ? "c" : "h");
+      int fd = open(path, O_WRONLY | O_CREAT, 0644);
+      if (fd != -1)
+        close(fd);
+    }
+  }
+  Script script = {0};
+  for (int i = 0; i < GLOB_RUNS; i++)
+    script_line(&script, i % 2 ? "echo *.c > /dev/null"
+                               : "echo entry0* > /dev/null");
+  workload->script = script.text;
+  workload->commands = script.lines;
+  workload->dir = glob_dir;
+}
+
+static void remove_glob_dir(void) {
+  if (!glob_dir_made)
+    return;
+  for (int i = 0; i < GLOB_FILES; i++) {
+    char path[sizeof(glob_dir) + 32];
+    snprintf(path, sizeof(path), "%s/entry%05d.%s", glob_dir, i,
+             i % 2 ? "c" : "h");
+    unlink(path);
+  }
+  rmdir(glob_dir);
+}
+
+static int load_workload(Workload *workload, const char *path) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    perror(path);
+    return -1;
+  }
+  Script script = {0};
+  char line[4096];
+  while (fgets(line, sizeof(line), file)) {
+    line[strcspn(line, "\n")] = '\0';
+    script_line(&script, "%s", line);
+  }
+  fclose(file);
+  workload->script = script.text ? script.text : strdup("");
+  workload->name = path;
+  workload->commands = 0;
+  for (const char *p = workload->script; *p; p++) {
+    const char *end = strchr(p, '\n');
+    if (!end)
+      end = p + strlen(p);
+    workload->commands += strspn(p, " \t") < (size_t)(end - p);
+    if (!*end)
+      break;
+    p = end;
+  }
+  return 0;
+}
+
+// --- Running ---
+
+static void child_setup(const Workload *workload, int quiet) {
+  if (workload->dir && chdir(workload->dir) == -1) {
+    perror(workload->dir);
+    _exit(127);
+  }
+  if (quiet) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    close(null);
+  }
+}
+
+static pid_t wait_shell(pid_t pid, RunResult *result) {
+  struct rusage usage;
+  int status = 0;
+  pid_t waited;
+  while ((waited = wait4(pid, &status, 0, &usage)) == -1 && errno == EINTR) {
+  }
+  if (waited == pid) {
+    result->max_rss = usage.ru_maxrss;
+    result->status = WIFEXITED(status) ? WEXITSTATUS(status)
+                                       : 128 + WTERMSIG(status);
+  }
+  return waited;
+}
+
+// The script as cshell -c text (or, when too long for one argument, as a
+// script file), or piped to its stdin.
+static int run_batch(const char *shell, const Workload *workload, int mode,
+                     RunResult *result) {
+  char file[] = "/tmp/cshell_e2e_script_XXXXXX";
+  int use_file = mode == MODE_C && strlen(workload->script) > ARG_LIMIT;
+  if (use_file) {
+    int fd = mkstemp(file);
+    if (fd == -1 || write(fd, workload->script, strlen(workload->script)) !=
+                        (ssize_t)strlen(workload->script)) {
+      perror(file);
+      return -1;
+    }
+    close(fd);
+  }
+
+  int input[2] = {-1, -1};
+  if (mode == MODE_STDIN && pipe(input) == -1) {
+    perror("pipe");
+    return -1;
+  }
+
+  double start = now_seconds();
+  pid_t pid = fork();
+  if (pid == 0) {
+    child_setup(workload, 1);
+    if (mode == MODE_STDIN) {
+      dup2(input[0], STDIN_FILENO);
+      close(input[0]);
+      close(input[1]);
+      execl(shell, shell, (char *)NULL);
+    } else if (use_file) {
+      execl(shell, shell, file, (char *)NULL);
+    } else {
+      execl(shell, shell, "-c", workload->script, (char *)NULL);
+    }
+    perror(shell);
+    _exit(127);
+  }
+  if (pid == -1) {
+    perror("fork");
+    return -1;
+  }
+  if (mode == MODE_STDIN) {
+    close(input[0]);
+    const char *p = workload->script;
+    size_t left = strlen(p);
+    while (left > 0) {
+      ssize_t n = write(input[1], p, left);
+      if (n == -1 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      p += n;
+      left -= n;
+    }
+    close(input[1]);
+  }
+  wait_shell(pid, result);
+  result->seconds = now_seconds() - start;
+  if (use_file)
+    unlink(file);
+  return 0;
+}
+
+// Read from the pty until the prompt shows up; with after_newline, only a
+// prompt printed after the echoed Enter counts. Returns -1 on timeout or
+// when the shell went away.
+static int await_prompt(int fd, int after_newline) {
+  static const char prompt[] = PROMPT;
+  size_t matched = 0;
+  int armed = !after_newline;
+  double deadline = now_seconds() + PROMPT_TIMEOUT_MS / 1000.0;
+  char buf[4096];
+
+  while (1) {
+    int wait_ms = (int)((deadline - now_seconds()) * 1000);
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if (wait_ms <= 0 || poll(&pfd, 1, wait_ms) <= 0)
+      return -1;
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n <= 0)
+      return -1;
+    for (ssize_t i = 0; i < n; i++) {
+      if (!armed) {
+        armed = buf[i] == '\n';
+        continue;
+      }
+      if (buf[i] == prompt[matched])
+        matched++;
+      else
+        matched = buf[i] == prompt[0];
+      if (matched == sizeof(prompt) - 1)
+        return 0;
+    }
+  }
+}
+
+// Type the commands at the prompt, one at a time.
+static int run_pty(const char *shell, const Workload *workload,
+                   RunResult *result) {
+  struct winsize size = {.ws_row = 50, .ws_col = 200};
+  int fd;
+  result->latencies = xmalloc(workload->commands * sizeof(long long));
+  result->latency_count = 0;
+
+  double start = now_seconds();
+  pid_t pid = forkpty(&fd, NULL, NULL, &size);
+  if (pid == 0) {
+    child_setup(workload, 0);
+    execl(shell, shell, (char *)NULL);
+    perror(shell);
+    _exit(127);
+  }
+  if (pid == -1) {
+    perror("forkpty");
+    return -1;
+  }
+
+  int ok = await_prompt(fd, 0) == 0;
+  const char *line = workload->script;
+  while (ok && *line) {
+    size_t len = strcspn(line, "\n");
+    if (strspn(line, " \t") < len) {
+      struct timespec sent, back;
+      clock_gettime(CLOCK_MONOTONIC, &sent);
+      if (write(fd, line, len) != (ssize_t)len || write(fd, "\r", 1) != 1 ||
+          await_prompt(fd, 1) == -1) {
+        ok = 0;
+        break;
+      }
+      clock_gettime(CLOCK_MONOTONIC, &back);
+      result->latencies[result->latency_count++] =
+          (back.tv_sec - sent.tv_sec) * 1000000000LL +
+          (back.tv_nsec - sent.tv_nsec);
+    }
+    line += len + (line[len] == '\n');
+  }
+
+  if (ok && write(fd, "exit\r", 5) == 5) {
+    // Keep the pty drained so the shell's last output cannot block it.
+    char buf[4096];
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+  } else {
+    fprintf(stderr, "cshell_e2e: %s: no prompt after command %d\n",
+            workload->name, result->latency_count + 1);
+    kill(pid, SIGKILL);
+  }
+  close(fd);
+  wait_shell(pid, result);
+  result->seconds = now_seconds() - start;
+  return ok ? 0 : -1;
+}
+
+// --- Reporting ---
+
+static int compare_latencies(const void *a, const void *b) {
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+static double latency_us(const RunResult *result, int pct) {
+  if (result->latency_count == 0)
+    return 0;
+  return result->latencies[(long long)(result->latency_count - 1) * pct / 100] /
+         1e3;
+}
+
+static void report(const char *shell, const Workload *workload,
+                   const char *mode, RunResult *result) {
+  int commands = result->latencies ? result->latency_count : workload->commands;
+  double rate = result->seconds > 0 ? commands / result->seconds : 0;
+  if (result->latencies)
+    qsort(result->latencies, result->latency_count, sizeof(long long),
+          compare_latencies);
+
+  if (json_output) {
+    printf("{\"shell\":\"%s\",\"workload\":\"%s\",\"mode\":\"%s\","
+           "\"commands\":%d,\"seconds\":%.3f,\"commands_per_s\":%.1f,"
+           "\"max_rss_kib\":%ld,\"status\":%d",
+           shell, workload->name, mode, commands, result->seconds, rate,
+           result->max_rss, result->status);
+    if (result->latencies)
+      printf(",\"prompt_p50_us\":%.1f,\"prompt_p99_us\":%.1f",
+             latency_us(result, 50), latency_us(result, 99));
+    printf("}\n");
+  } else {
+    printf("%-10s %-6s %8d %9.3f %12.1f %9ld %6d", workload->name, mode,
+           commands, result->seconds, rate, result->max_rss, result->status);
+    if (result->latencies)
+      printf(" %10.1f %10.1f", latency_us(result, 50), latency_us(result, 99));
+    printf("\n");
+  }
+  fflush(stdout);
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: cshell_e2e [--shell path]... [--mode c|stdin|pty]...\n"
+          "                  [--workload loop|pipeline|glob]... "
+          "[--script file]...\n"
+          "                  [--session file]... [--json]\n");
+}
+
+int main(int argc, char *argv[]) {
+  const char *shells[MAX_SHELLS];
+  int shell_count = 0;
+  Workload workloads[MAX_WORKLOADS];
+  int workload_count = 0;
+  int modes = 0;
+
+  memset(workloads, 0, sizeof(workloads));
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+    if (strcmp(arg, "--json") == 0) {
+      json_output = 1;
+      continue;
+    }
+    if (!value || (shell_count == MAX_SHELLS && strcmp(arg, "--shell") == 0) ||
+        workload_count == MAX_WORKLOADS) {
+      usage();
+      return EXIT_FAILURE;
+    }
+    i++;
+    Workload *workload = &workloads[workload_count];
+    if (strcmp(arg, "--shell") == 0) {
+      shells[shell_count++] = value;
+    } else if (strcmp(arg, "--mode") == 0) {
+      modes |= strcmp(value, "c") == 0       ? MODE_C
+               : strcmp(value, "stdin") == 0 ? MODE_STDIN
+               : strcmp(value, "pty") == 0   ? MODE_PTY
+                                             : 0;
+    } else if (strcmp(arg, "--workload") == 0) {
+      workload->name = value;
+      workload->modes = ALL_MODES;
+      if (strcmp(value, "loop") == 0) {
+        make_loop(workload);
+      } else if (strcmp(value, "pipeline") == 0) {
+        make_pipeline(workload);
+      } else if (strcmp(value, "glob") == 0) {
+        make_glob(workload);
+      } else {
+        usage();
+        return EXIT_FAILURE;
+      }
+      workload_count++;
+    } else if (strcmp(arg, "--script") == 0 ||
+               strcmp(arg, "--session") == 0) {
+      if (load_workload(workload, value) == -1)
+        return EXIT_FAILURE;
+      // A recorded session is replayed at the prompt; a script runs all
+      // three ways.
+      workload->modes = strcmp(arg, "--session") == 0 ? MODE_PTY : ALL_MODES;
+      workload_count++;
+    } else {
+      usage();
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (shell_count == 0)
+    shells[shell_count++] = CSHELL_PATH;
+  if (modes == 0)
+    modes = ALL_MODES;
+  if (workload_count == 0) {
+    workloads[0].name = "loop";
+    make_loop(&workloads[0]);
+    workloads[1].name = "pipeline";
+    make_pipeline(&workloads[1]);
+    workloads[2].name = "glob";
+    make_glob(&workloads[2]);
+    for (workload_count = 0; workload_count < 3; workload_count++)
+      workloads[workload_count].modes = ALL_MODES;
+  }
+
+  // History must neither be read nor grow while the harness types.
+  setenv("CSHELL_HISTFILE", "/dev/null", 1);
+  signal(SIGPIPE, SIG_IGN);
+
+  static const struct {
+    int mode;
+    const char *name;
+  } mode_names[] = {{MODE_C, "c"}, {MODE_STDIN, "stdin"}, {MODE_PTY, "pty"}};
+  int failed = 0;
+  for (int s = 0; s < shell_count; s++) {
+    if (!json_output)
+      printf("%s%s\n%-10s %-6s %8s %9s %12s %9s %6s %10s %10s\n",
+             s ? "\n" : "", shells[s], "workload", "mode", "commands",
+             "seconds", "commands/s", "RSS KiB", "status", "p50 us",
+             "p99 us");
+    for (int w = 0; w < workload_count; w++) {
+      for (size_t m = 0; m < sizeof(mode_names) / sizeof(mode_names[0]);
+           m++) {
+        int mode = mode_names[m].mode;
+        if (!(modes & mode & workloads[w].modes))
+          continue;
+        RunResult result = {0};
+        int rc = mode == MODE_PTY ? run_pty(shells[s], &workloads[w], &result)
+                                  : run_batch(shells[s], &workloads[w], mode,
+                                              &result);
+        // Scripts too long for -c went to the shell as a file.
+        const char *name = mode == MODE_C && strlen(workloads[w].script) >
+                                                 ARG_LIMIT
+                               ? "file"
+                               : mode_names[m].name;
+        if (rc == 0)
+          report(shells[s], &workloads[w], name, &result);
+        failed |= rc != 0;
+        free(result.latencies);
+      }
+    }
+  }
+
+  for (int w = 0; w < workload_count; w++)
+    free(workloads[w].script);
+  remove_glob_dir();
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,189 @@
+#include "include/environment.h"
+#include "include/stats.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The exported environment as the NULL-terminated "NAME=value" vector that
+// execve() takes. It is edited in place when a variable is exported,
+// changed or unexported, so launching a command never rebuilds it. Entries
+// point into the inherited environment until they are first changed; only
+// replaced entries are allocated here. environ points at the vector too,
+// so getenv() and execvp()'s PATH search see the same variables.
+//
+// A hash of names to positions keeps lookups constant-time however many
+// variables the shell inherited.
+
+extern char **environ;
+
+static char **entries = NULL;
+static unsigned char *owned = NULL; // 1 where entries[i] was allocated here
+static size_t count = 0;
+static size_t capacity = 0;
+
+// Open addressing; a slot holds an index into entries plus one, 0 if free.
+static size_t *slots = NULL;
+static size_t slot_count = 0;
+
+static void *xrealloc(void *ptr, size_t size) {
+  STATS_ALLOC(STATS_ENVIRONMENT);
+  ptr = realloc(ptr, size);
+  if (!ptr) {
+    perror("realloc failed");
+    exit(EXIT_FAILURE);
+  }
+  return ptr;
+}
+
+static size_t name_length(const char *entry) {
+  const char *eq = strchr(entry, '=');
+  return eq ? (size_t)(eq - entry) : strlen(entry);
+}
+
+static size_t hash_name(const char *name, size_t len) {
+  uint64_t hash = 14695981039346656037ULL; // FNV-1a
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)name[i];
+    hash *= 1099511628211ULL;
+  }
+  return (size_t)hash;
+}
+
+// The slot holding name, or the free slot where it would go.
+static size_t *find_slot(const char *name, size_t len) {
+  size_t mask = slot_count - 1;
+  for (size_t i = hash_name(name, len) & mask;; i = (i + 1) & mask) {
+    if (slots[i] == 0)
+      return &slots[i];
+    const char *entry = entries[slots[i] - 1];
+    if (name_length(entry) == len && strncmp(entry, name, len) == 0)
+      return &slots[i];
+  }
+}
+
+static void rehash(void) {
+  size_t wanted = 64;
+  while (wanted < count * 2 + 2)
+    wanted *= 2;
+  if (wanted != slot_count) {
+    slot_count = wanted;
+    slots = xrealloc(slots, slot_count * sizeof(size_t));
+  }
+  memset(slots, 0, slot_count * sizeof(size_t));
+  for (size_t i = 0; i < count; i++)
+    *find_slot(entries[i], name_length(entries[i])) = i + 1;
+}
+
+static void reserve(size_t wanted) {
+  if (wanted + 1 <= capacity)
+    return;
+  capacity = capacity ? capacity * 2 : 64;
+  while (wanted + 1 > capacity)
+    capacity *= 2;
+  entries = xrealloc(entries, capacity * sizeof(char *));
+  owned = xrealloc(owned, capacity);
+  environ = entries;
+}
+
+// Take over environ when it is not the vector kept here: at first use, or
+// after something called setenv() behind the shell's back, or unsetenv(),
+// which closes the gap in place and leaves the last counted entry NULL.
+// Strings this module allocated may still be referenced by the new environ,
+// so they are given up rather than freed.
+static void sync_environ(void) {
+  if (entries && environ == entries && (count == 0 || entries[count - 1]))
+    return;
+  char **source = environ;
+  size_t n = 0;
+  while (source && source[n])
+    n++;
+  STATS_ALLOC(STATS_ENVIRONMENT);
+  char **adopted = malloc((n + 1) * sizeof(char *));
+  if (!adopted) {
+    perror("malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(adopted, source, n * sizeof(char *));
+  adopted[n] = NULL;
+
+  free(entries);
+  entries = adopted;
+  count = n;
+  capacity = n + 1;
+  owned = xrealloc(owned, capacity);
+  memset(owned, 0, capacity);
+  environ = entries;
+  rehash();
+}
+
+char **env_vector(void) {
+  sync_environ();
+  return entries;
+}
+
+const char *env_get(const char *name) {
+  sync_environ();
+  size_t len = strlen(name);
+  size_t slot = *find_slot(name, len);
+  return slot ? entries[slot - 1] + len + 1 : NULL;
+}
+
+void env_set(const char *name, const char *value) {
+  sync_environ();
+  size_t len = strlen(name);
+  STATS_ALLOC(STATS_ENVIRONMENT);
+  char *entry = malloc(len + strlen(value) + 2);
+  if (!entry) {
+    perror("malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(entry, name, len);
+  entry[len] = '=';
+  strcpy(entry + len + 1, value);
+
+  size_t *slot = find_slot(name, len);
+  if (*slot) {
+    size_t i = *slot - 1;
+    if (owned[i])
+      free(entries[i]);
+    entries[i] = entry;
+    owned[i] = 1;
+    return;
+  }
+  reserve(count + 1);
+  entries[count] = entry;
+  owned[count] = 1;
+  entries[++count] = NULL;
+  if (count * 2 + 2 > slot_count)
+    rehash();
+  else
+    *find_slot(name, len) = count;
+}
+
+// The last entry fills the hole, so the vector stays dense.
+void env_unset(const char *name) {
+  sync_environ();
+  size_t *slot = find_slot(name, strlen(name));
+  if (*slot == 0)
+    return;
+  size_t i = *slot - 1;
+  if (owned[i])
+    free(entries[i]);
+  count--;
+  entries[i] = entries[count];
+  owned[i] = owned[count];
+  entries[count] = NULL;
+  rehash();
+}
+
+// Inherited strings belong to the process image and are not counted.
+size_t env_bytes(void) {
+  sync_environ();
+  size_t total = stats_block(entries) + stats_block(owned) + stats_block(slots);
+  for (size_t i = 0; i < count; i++) {
+    if (owned[i])
+      total += stats_block(entries[i]);
+  }
+  return total;
+}
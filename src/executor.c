@@ -0,0 +1,1136 @@
+#define _GNU_SOURCE // memfd_create, execvpe
+#include "include/executor.h"
+#include "include/builtins.h"
+#include "include/environment.h"
+#include "include/expand.h"
+#include "include/ioloop.h"
+#include "include/joblimits.h"
+#include "include/jobs.h"
+#include "include/lexer.h"
+#include "include/scripting.h"
+#include "include/stats.h"
+#include "include/timing.h"
+#include "include/trace.h"
+#include "include/utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Saved copies of the shell's own descriptors live above anything a
+// redirection can name.
+#define SAVED_FD_BASE (REDIRECT_FD_MAX + 1)
+// Descriptors handed out for {name}> redirections and coprocesses stay
+// clear of the 0-9 that scripts use by number.
+#define FD_VARIABLE_BASE 10
+#define COPROC_FD_BASE 60
+
+pid_t foreground_pid = 0;
+int job_control = 0;
+int option_pipefail = 0;
+int option_argbatch = 0;
+int last_exit_status = 0;
+
+int decode_status(int status) {
+  if (WIFEXITED(status))
+    return WEXITSTATUS(status);
+  if (WIFSIGNALED(status))
+    return 128 + WTERMSIG(status);
+  if (WIFSTOPPED(status))
+    return 128 + WSTOPSIG(status);
+  return 0;
+}
+
+// Publish per-stage statuses as the PIPESTATUS array and the pipeline's
+// status as $?.
+static void record_status(const int *statuses, int stages, int status) {
+  ShellArray *pipestatus = declare_array("PIPESTATUS", ARRAY_INDEXED);
+  array_clear(pipestatus);
+  for (int i = 0; i < stages; i++) {
+    char number[12];
+    snprintf(number, sizeof(number), "%d", statuses[i]);
+    array_append(pipestatus, number);
+  }
+  last_exit_status = status;
+}
+
+static int count_assignments(Command *cmd) {
+  int n = 0;
+  while (n < cmd->argc && is_assignment(cmd->args[n]))
+    n++;
+  return n;
+}
+
+// Apply NAME=value words: to the shell's variables for a bare assignment,
+// or to the environment of the command about to be exec'd, which has no
+// arrays. Returns 1 if any of them failed.
+static int apply_assignments(Command *cmd, int count, int to_environment) {
+  int status = 0;
+  for (int i = 0; i < count; i++) {
+    if (!to_environment) {
+      status |= assign_word(cmd->args[i]);
+      continue;
+    }
+    char *name = strdup(cmd->args[i]);
+    if (!name) {
+      perror("strdup failed");
+      exit(EXIT_FAILURE);
+    }
+    char *eq = strchr(name, '=');
+    *eq = '\0';
+    if (strpbrk(name, "[+") || eq[1] == '(') {
+      fprintf(stderr, "cshell: %s: cannot export an array\n", name);
+      free(name);
+      continue;
+    }
+    char *value = expand_word_single(eq + 1);
+    env_set(name, value);
+    free(value);
+    free(name);
+  }
+  return status;
+}
+
+// A variable as it was before a prefix assignment hid it.
+typedef struct {
+  char *name;
+  char *value;    // NULL if it was unset
+  char *exported; // NULL if it was not in the environment
+} SavedVariable;
+
+static char *copy_or_null(const char *text) {
+  char *copy = text ? strdup(text) : NULL;
+  if (text && !copy) {
+    perror("strdup failed");
+    exit(EXIT_FAILURE);
+  }
+  return copy;
+}
+
+// NAME=value words before a builtin or function hold while it runs, and
+// are exported to what it starts, as a command's environment would be.
+// Returns what they replaced, for restore_assignments().
+static SavedVariable *push_assignments(Command *cmd, int count) {
+  SavedVariable *saved = calloc(count, sizeof(SavedVariable));
+  if (!saved) {
+    perror("calloc failed");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < count; i++) {
+    const char *word = cmd->args[i];
+    size_t len = strcspn(word, "[+=");
+    if (word[len] == '[' || word[assignment_length(word)] == '(') {
+      fprintf(stderr, "cshell: %.*s: cannot export an array\n", (int)len,
+              word);
+      continue;
+    }
+    saved[i].name = strndup(word, len);
+    if (!saved[i].name) {
+      perror("strndup failed");
+      exit(EXIT_FAILURE);
+    }
+    saved[i].value = copy_or_null(get_shell_variable(saved[i].name));
+    saved[i].exported = copy_or_null(env_get(saved[i].name));
+    if (assign_word(word) == 0)
+      env_set(saved[i].name, get_shell_variable(saved[i].name));
+  }
+  return saved;
+}
+
+// Put the variables back, last first so a name assigned twice ends up
+// with its value from before both.
+static void restore_assignments(SavedVariable *saved, int count) {
+  for (int i = count - 1; i >= 0; i--) {
+    if (!saved[i].name)
+      continue;
+    if (saved[i].value)
+      set_shell_variable(saved[i].name, saved[i].value);
+    else
+      unset_shell_variable(saved[i].name);
+    if (saved[i].exported)
+      env_set(saved[i].name, saved[i].exported);
+    else
+      env_unset(saved[i].name);
+    free(saved[i].name);
+    free(saved[i].value);
+    free(saved[i].exported);
+  }
+  free(saved);
+}
+
+// Words are expanded at run time, so loops see fresh values. Leading
+// NAME=value words are assignments and are skipped. spread[0..1] is set to
+// the range of arguments that came from words expanding to several fields,
+// a glob say, which is what batching splits up; the words around them are
+// kept in every batch.
+static char **expand_arguments(Command *cmd, int first, int *argc,
+                               int spread[2]) {
+  ArgList argv;
+  arglist_init(&argv);
+  spread[0] = spread[1] = -1;
+  for (int i = first; i < cmd->argc; i++) {
+    int before = argv.count;
+    expand_word(cmd->args[i], &argv);
+    if (argv.count - before > 1) {
+      if (spread[0] == -1)
+        spread[0] = before;
+      spread[1] = argv.count;
+    }
+  }
+  if (spread[0] == -1) {
+    spread[0] = argv.count > 0 ? 1 : 0;
+    spread[1] = argv.count;
+  }
+  *argc = argv.count;
+  return argv.items;
+}
+
+// --- Argument batching ---
+
+static size_t argument_cost(const char *arg) {
+  return strlen(arg) + 1 + sizeof(char *);
+}
+
+// What execve() leaves for the arguments once the environment is in.
+static size_t argument_budget(void) {
+  long max = sysconf(_SC_ARG_MAX);
+  size_t budget = max > 0 ? (size_t)max : 131072;
+  // An environment bigger than ARG_MAX leaves nothing, not a wrapped
+  // size_t that every argv would fit in.
+  for (char **entry = env_vector(); *entry; entry++) {
+    size_t cost = argument_cost(*entry);
+    budget = budget > cost ? budget - cost : 0;
+  }
+  return budget > 4096 ? budget - 4096 : 0; // Headroom, as xargs keeps
+}
+
+static int argument_size_fits(char **argv, size_t budget) {
+  size_t total = sizeof(char *);
+  for (int i = 0; argv[i] != NULL; i++) {
+    total += argument_cost(argv[i]);
+    if (total > budget)
+      return 0;
+  }
+  return 1;
+}
+
+// Run argv as several commands that each fit in ARG_MAX, as xargs would:
+// the spread arguments are dealt out in order and the ones around them are
+// repeated in every command. ARGBATCH_JOBS of them run at once (1 by
+// default, 0 for one per CPU). The status is the highest any of them had.
+static int run_batches(char **argv, int argc, const int spread[2]) {
+  const char *jobs_text = get_shell_variable("ARGBATCH_JOBS");
+  long jobs = jobs_text ? atol(jobs_text) : 1;
+  if (jobs <= 0)
+    jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  if (jobs <= 0)
+    jobs = 1;
+
+  size_t budget = argument_budget(), fixed = sizeof(char *);
+  int tail = argc - spread[1];
+  for (int i = 0; i < argc; i++) {
+    if (i < spread[0] || i >= spread[1])
+      fixed += argument_cost(argv[i]);
+  }
+  char **batch = malloc((argc + 1) * sizeof(char *));
+  if (!batch) {
+    perror("malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(batch, argv, spread[0] * sizeof(char *));
+
+  signal(SIGCHLD, SIG_DFL); // Our own waitpid() collects them
+  int status = 0, running = 0;
+  for (int next = spread[0]; next < spread[1] || running > 0;) {
+    if (next < spread[1] && running < jobs) {
+      int count = spread[0];
+      size_t size = fixed;
+      do {
+        size += argument_cost(argv[next]);
+        batch[count++] = argv[next++];
+      } while (next < spread[1] && size + argument_cost(argv[next]) <= budget);
+      memcpy(batch + count, argv + spread[1], tail * sizeof(char *));
+      batch[count + tail] = NULL;
+
+      pid_t pid;
+      int error = posix_spawnp(&pid, batch[0], NULL, NULL, batch, env_vector());
+      if (error != 0) {
+        fprintf(stderr, "posix_spawnp failed: %s\n", strerror(error));
+        status = 127;
+        next = spread[1]; // Start no more, but collect those running
+        continue;
+      }
+      running++;
+      continue;
+    }
+    int child_status;
+    if (waitpid(-1, &child_status, 0) == -1) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    running--;
+    int decoded = decode_status(child_status);
+    if (decoded > status)
+      status = decoded;
+  }
+  free(batch);
+  return status;
+}
+
+static int write_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    data += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+// Here-document bodies go into an anonymous memory file, so nothing is
+// written to disk. Without memfd_create a pipe is used; bodies larger than
+// PIPE_BUF are fed by a writer process so the reader never deadlocks.
+static int open_here_doc(const Redirection *redir) {
+  char *body;
+  if (redir->here_flags & HERE_STRING) {
+    char *word = expand_word_single(redir->target);
+    body = malloc(strlen(word) + 2);
+    if (!body) {
+      perror("malloc failed");
+      exit(EXIT_FAILURE);
+    }
+    sprintf(body, "%s\n", word);
+    free(word);
+  } else if (redir->here_flags & HERE_EXPAND) {
+    body = expand_variables(redir->target);
+  } else {
+    body = redir->target;
+  }
+  if (expansion_failed) {
+    if (body != redir->target)
+      free(body);
+    return -1;
+  }
+  size_t len = strlen(body);
+  int fd = memfd_create("cshell-heredoc", MFD_CLOEXEC);
+
+  if (fd != -1) {
+    if (write_all(fd, body, len) == -1 || lseek(fd, 0, SEEK_SET) == -1) {
+      perror("here-document");
+      close(fd);
+      fd = -1;
+    }
+  } else {
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) == -1) {
+      perror("pipe failed");
+    } else if (len <= PIPE_BUF) {
+      write_all(pipefd[1], body, len);
+      close(pipefd[1]);
+      fd = pipefd[0];
+    } else {
+      pid_t writer = stats_fork();
+      if (writer == 0) {
+        close(pipefd[0]);
+        _exit(write_all(pipefd[1], body, len) == -1);
+      }
+      close(pipefd[1]);
+      fd = writer == -1 ? (close(pipefd[0]), -1) : pipefd[0];
+    }
+  }
+
+  if (body != redir->target)
+    free(body);
+  return fd;
+}
+
+// Put an O_CLOEXEC descriptor at 'to'. When open() already returned the
+// wanted number only the close-on-exec flag needs clearing.
+static void move_fd(int from, int to) {
+  if (from == to) {
+    fcntl(to, F_SETFD, 0);
+    return;
+  }
+  dup2(from, to);
+  close(from);
+}
+
+static int open_target(const Redirection *redir) {
+  int flags;
+  switch (redir->type) {
+  case REDIR_INPUT:
+    flags = O_RDONLY;
+    break;
+  case REDIR_OUTPUT:
+    flags = O_WRONLY | O_CREAT | O_TRUNC;
+    break;
+  case REDIR_APPEND:
+    flags = O_WRONLY | O_CREAT | O_APPEND;
+    break;
+  default:
+    flags = O_RDWR | O_CREAT;
+    break;
+  }
+  char *path = expand_word_single(redir->target);
+  int fd = expansion_failed ? -1 : open(path, flags | O_CLOEXEC, 0644);
+  if (fd == -1 && !expansion_failed)
+    perror(path);
+  free(path);
+  return fd;
+}
+
+// The descriptor a dup copies: the number written in the command, or the
+// one its word expands to (>&$fd). Those above REDIRECT_FD_MAX belong to
+// the shell.
+static int dup_source(const Redirection *redir) {
+  if (redir->target == NULL)
+    return redir->target_fd;
+  char *value = expand_word_single(redir->target);
+  int fd = -1;
+  if (!*value || strspn(value, "0123456789") != strlen(value))
+    fprintf(stderr, "cshell: %s: bad file descriptor\n", value);
+  else if (strlen(value) > 3 || (fd = atoi(value)) > REDIRECT_FD_MAX) {
+    fprintf(stderr, "cshell: %s: %s\n", value, strerror(EBADF));
+    fd = -1;
+  }
+  free(value);
+  return fd;
+}
+
+// {name}>file and the like put the file on the lowest free descriptor from
+// FD_VARIABLE_BASE up and store its number in name; {name}>&- closes the
+// descriptor that name holds.
+static int redirect_fd_variable(const Redirection *redir) {
+  int fd;
+  if (redir->type == REDIR_CLOSE) {
+    char *ref = malloc(strlen(redir->fd_name) + 4);
+    if (!ref) {
+      perror("malloc failed");
+      exit(EXIT_FAILURE);
+    }
+    sprintf(ref, "${%s}", redir->fd_name);
+    char *value = expand_word_single(ref);
+    fd = *value ? atoi(value) : -1;
+    free(value);
+    free(ref);
+    if (fd < 0 || close(fd) == -1) {
+      fprintf(stderr, "cshell: %s: bad file descriptor\n", redir->fd_name);
+      return -1;
+    }
+    return 0;
+  }
+
+  if (redir->type == REDIR_DUP) {
+    if ((fd = dup_source(redir)) == -1)
+      return -1;
+    fd = fcntl(fd, F_DUPFD, FD_VARIABLE_BASE);
+  } else {
+    int source = redir->type == REDIR_HEREDOC ? open_here_doc(redir)
+                                              : open_target(redir);
+    if (source == -1)
+      return -1;
+    fd = fcntl(source, F_DUPFD, FD_VARIABLE_BASE);
+    close(source);
+  }
+  if (fd == -1) {
+    fprintf(stderr, "cshell: %s: %s\n", redir->fd_name, strerror(errno));
+    return -1;
+  }
+  // name may be an array element, as in {fds[1]}>file
+  size_t size = strlen(redir->fd_name) + 16;
+  char *assignment = malloc(size);
+  if (!assignment) {
+    perror("malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  snprintf(assignment, size, "%s=%d", redir->fd_name, fd);
+  assign_word(assignment);
+  free(assignment);
+  return 0;
+}
+
+// Wire a stage's descriptors: the pipe ends first, then its redirections
+// in the order they were written, so "2>&1 >file" and ">file 2>&1" differ
+// as they should. Everything the shell opens is O_CLOEXEC; only the
+// descriptors dup'ed into place survive into the command.
+static int setup_stdio(Command *cmd, int input_fd, int output_fd) {
+  if (input_fd != -1)
+    dup2(input_fd, STDIN_FILENO);
+  if (output_fd != -1)
+    dup2(output_fd, STDOUT_FILENO);
+
+  for (Redirection *redir = cmd->redirs; redir != NULL; redir = redir->next) {
+    int fd;
+    if (redir->fd_name) {
+      if (redirect_fd_variable(redir) == -1)
+        return -1;
+      continue;
+    }
+    switch (redir->type) {
+    case REDIR_DUP:
+      if ((fd = dup_source(redir)) == -1)
+        return -1;
+      if (redir->fd != fd && dup2(fd, redir->fd) == -1) {
+        fprintf(stderr, "cshell: %d: %s\n", fd, strerror(errno));
+        return -1;
+      }
+      break;
+    case REDIR_CLOSE:
+      close(redir->fd);
+      break;
+    case REDIR_HEREDOC:
+      if ((fd = open_here_doc(redir)) == -1)
+        return -1;
+      move_fd(fd, redir->fd);
+      break;
+    default:
+      if ((fd = open_target(redir)) == -1)
+        return -1;
+      move_fd(fd, redir->fd);
+      break;
+    }
+  }
+  return 0;
+}
+
+
+typedef struct {
+  int fd;
+  int saved; // Copy of the original, or -1 if fd was closed
+} SavedFd;
+
+static int save_fd(SavedFd *saved, int count, int fd) {
+  for (int i = 0; i < count; i++) {
+    if (saved[i].fd == fd)
+      return count;
+  }
+  saved[count].fd = fd;
+  saved[count].saved = fcntl(fd, F_DUPFD_CLOEXEC, SAVED_FD_BASE);
+  return count + 1;
+}
+
+// Run a builtin, a function or a { } group in the shell process with the
+// stage's descriptors and its first 'assignments' words assigned, then put
+// the shell's own back. With none of them, only the redirections happen
+// (">file" creates the file).
+static int run_here(Command *cmd, int input_fd, const Builtin *builtin,
+                    ShellFunction *function, char **argv, int assignments) {
+  int count = 0, capacity = 1;
+  int status = 1;
+
+  for (Redirection *redir = cmd->redirs; redir; redir = redir->next)
+    capacity++;
+  SavedFd *saved = malloc(sizeof(SavedFd) * capacity);
+  if (!saved) {
+    perror("malloc failed");
+    exit(EXIT_FAILURE);
+  }
+
+  fflush(stdout);
+  if (input_fd != -1)
+    count = save_fd(saved, count, STDIN_FILENO);
+  // {name}> redirections are not undone: the descriptor outlives the
+  // command, which is their point.
+  for (Redirection *redir = cmd->redirs; redir; redir = redir->next) {
+    if (!redir->fd_name)
+      count = save_fd(saved, count, redir->fd);
+  }
+
+  SavedVariable *variables =
+      assignments ? push_assignments(cmd, assignments) : NULL;
+  if (!expansion_failed && setup_stdio(cmd, input_fd, -1) == 0) {
+    if (cmd->group)
+      status = execute_node(cmd->group);
+    else if (function)
+      status = call_function(function, argv);
+    else
+      status = builtin ? builtin->func(argv) : 0;
+  }
+  if (variables)
+    restore_assignments(variables, assignments);
+  if (expansion_aborted(1))
+    status = 1;
+
+  fflush(stdout);
+  fflush(stderr);
+  for (int i = count - 1; i >= 0; i--) {
+    if (saved[i].saved == -1) {
+      close(saved[i].fd);
+    } else {
+      dup2(saved[i].saved, saved[i].fd);
+      close(saved[i].saved);
+    }
+  }
+  free(saved);
+  return status;
+}
+
+static const char *stage_label(const Command *cmd, char **argv) {
+  if (cmd->group)
+    return cmd->subshell ? "( ... )" : "{ ... }";
+  if (argv && argv[0])
+    return argv[0];
+  return cmd->argc > 0 ? cmd->args[0] : "";
+}
+
+// Reap the stages in whatever order they finish, so that under 'time'
+// each one's end time and rusage are its own. SIGCHLD is blocked, so it
+// is taken here with sigwaitinfo() instead of by the handler. Returns
+// non-zero if a stage stopped.
+static int wait_stages(pid_t *pids, int stages, int *statuses,
+                       StageTiming *timing, TraceStage *trace,
+                       JobLimits *limits) {
+  sigset_t chld;
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  int remaining = 0, stopped = 0, took_signal = 0;
+  for (int stage = 0; stage < stages; stage++)
+    remaining += pids[stage] > 0;
+
+  while (remaining > 0) {
+    int reaped = 0;
+    for (int stage = 0; stage < stages; stage++) {
+      if (pids[stage] <= 0)
+        continue;
+      int status;
+      struct rusage usage;
+      pid_t waited = wait4(pids[stage], &status, WNOHANG | WUNTRACED, &usage);
+      if (waited == 0 || (waited == -1 && errno == EINTR))
+        continue;
+      if (waited > 0) {
+        statuses[stage] = decode_status(status);
+        if (WIFSTOPPED(status))
+          stopped = 1;
+        if (timing)
+          timing_end(&timing[stage], &usage);
+        if (limits)
+          job_limits_reaped(limits, &usage);
+        if (trace)
+          trace_finish(&trace[stage], statuses[stage]);
+      }
+      pids[stage] = 0;
+      remaining--;
+      reaped = 1;
+    }
+    if (remaining > 0 && !reaped) {
+      while (sigwaitinfo(&chld, NULL) == -1 && errno == EINTR) {
+      }
+      took_signal = 1;
+    }
+  }
+  // A background job's SIGCHLD may have been swallowed above; let the
+  // handler look once the signal is unblocked.
+  if (took_signal)
+    raise(SIGCHLD);
+  return stopped;
+}
+
+// Run a parsed pipeline and return its exit status: the last stage's, or
+// with pipefail the rightmost non-zero one. Every stage is waited for, and
+// all stages share one process group.
+int execute_command(Command *cmd) {
+  int stages = 0;
+  for (Command *c = cmd; c != NULL; c = c->next)
+    stages++;
+
+  pid_t *pids = calloc(stages, sizeof(pid_t));
+  int *statuses = calloc(stages, sizeof(int));
+  StageTiming *timing = cmd->timed ? calloc(stages, sizeof(StageTiming)) : NULL;
+  if (!pids || !statuses || (cmd->timed && !timing)) {
+    perror("malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  int counters = cmd->timed & TIME_VERBOSE;
+  JobLimits limits;
+  if (cmd->limited)
+    job_limits_start(&limits, cmd->mem_limit, cmd->cpu_limit);
+  TraceStage *trace = NULL;
+  long pipeline_id = 0;
+  struct timespec launch;
+  if (trace_enabled()) {
+    trace = calloc(stages, sizeof(TraceStage));
+    if (!trace) {
+      perror("malloc failed");
+      exit(EXIT_FAILURE);
+    }
+    pipeline_id = trace_next_pipeline();
+  }
+
+  Command *current = cmd;
+  int input_fd = -1;
+  pid_t pgid = 0;
+  sigset_t block, saved_mask;
+
+  // Keep the SIGCHLD handler from reaping our children before we wait.
+  sigemptyset(&block);
+  sigaddset(&block, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &block, &saved_mask);
+
+  for (int stage = 0; current != NULL; current = current->next, stage++) {
+    int pipefd[2] = {-1, -1};
+    if (current->next != NULL) {
+      if (pipe2(pipefd, O_CLOEXEC) == -1) {
+        perror("pipe failed");
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    int argc = 0, assignments = 0, spread[2];
+    char **argv = NULL;
+    const Builtin *builtin = NULL;
+    ShellFunction *function = NULL;
+    // A function definition has no words and lands with the assignments.
+    if (current->group == NULL || current->function_name) {
+      assignments = count_assignments(current);
+      argv = expand_arguments(current, assignments, &argc, spread);
+      if (argc == 0 || expansion_failed) {
+        // Assignments alone change the shell, unless they are one stage of
+        // a longer pipeline.
+        if (timing)
+          timing_begin(&timing[stage], stage_label(current, argv));
+        if (trace) {
+          clock_gettime(CLOCK_MONOTONIC, &launch);
+          trace_launch(&trace[stage], pipeline_id, stage, current,
+                       current->args, "assignment", getpid(), &launch);
+        }
+        // A stage of a longer pipeline is a subshell in other shells, and
+        // its failure does not stop the script.
+        int failed = expansion_aborted(stages == 1);
+        int assigned = stages == 1 && !failed
+                           ? apply_assignments(current, assignments, 0)
+                           : 0;
+        failed |= expansion_aborted(1);
+        if (failed)
+          statuses[stage] = 1;
+        else if (current->function_name)
+          statuses[stage] = define_function_command(current);
+        else if (current->redirs)
+          statuses[stage] = run_here(current, input_fd, NULL, NULL, NULL, 0);
+        else
+          statuses[stage] = assigned;
+        if (timing)
+          timing_end(&timing[stage], NULL);
+        if (trace)
+          trace_finish(&trace[stage], statuses[stage]);
+        free_args(argv);
+        if (input_fd != -1)
+          close(input_fd);
+        if (pipefd[1] != -1)
+          close(pipefd[1]);
+        input_fd = pipefd[0];
+        continue;
+      }
+      // Functions shadow builtins of the same name.
+      function = find_function(argv[0]);
+      if (!function)
+        builtin = find_builtin(argv[0]);
+      if (!function && !builtin)
+        builtin = find_file_builtin(argv);
+    }
+
+    // A builtin, function or { } group in the last stage runs in the shell
+    // itself (lastpipe), so 'cd' and variable assignments stick and no fork
+    // is paid. Earlier stages must run concurrently with their readers and
+    // get a child, as does every ( ) subshell, and every stage under
+    // 'limit', so that they can be put in its cgroup.
+    if (current->next == NULL && !cmd->limited &&
+        (builtin || function || (current->group && !current->subshell))) {
+      // Pipelines inside a group must not take the terminal from the
+      // stages still running.
+      int saved_job_control = job_control;
+      if (stages > 1)
+        job_control = 0;
+      if (timing) {
+        timing_begin(&timing[stage], stage_label(current, argv));
+        if (counters)
+          timing_attach_counters(&timing[stage], 0, 0);
+      }
+      if (trace) {
+        clock_gettime(CLOCK_MONOTONIC, &launch);
+        trace_launch(&trace[stage], pipeline_id, stage, current, argv,
+                     builtin    ? "builtin"
+                     : function ? "function"
+                                : "group",
+                     getpid(), &launch);
+      }
+      statuses[stage] = run_here(current, input_fd, builtin, function, argv,
+                               assignments);
+      if (timing)
+        timing_end(&timing[stage], NULL);
+      if (trace)
+        trace_finish(&trace[stage], statuses[stage]);
+      job_control = saved_job_control;
+      free_args(argv);
+      if (input_fd != -1)
+        close(input_fd);
+      input_fd = -1;
+      continue;
+    }
+
+    // With counters the child holds off until they are attached, so that
+    // they see its exec.
+    int go[2] = {-1, -1};
+    if (timing) {
+      timing_begin(&timing[stage], stage_label(current, argv));
+      if (counters && pipe2(go, O_CLOEXEC) == -1)
+        go[0] = go[1] = -1;
+    }
+
+    fflush(stdout);
+    if (trace)
+      clock_gettime(CLOCK_MONOTONIC, &launch);
+    pid_t pid = stats_fork();
+
+    if (pid == -1) {
+      perror("fork failed");
+      exit(EXIT_FAILURE);
+    } else if (pid == 0) {
+      if (cmd->limited)
+        job_limits_enter(&limits);
+      if (go[0] != -1) {
+        char byte;
+        close(go[1]);
+        while (read(go[0], &byte, 1) == -1 && errno == EINTR) {
+        }
+        close(go[0]);
+      }
+      if (job_control) {
+        setpgid(0, pgid);
+        if (pgid == 0)
+          tcsetpgrp(STDIN_FILENO, getpid());
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+      }
+      sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+
+      if (setup_stdio(current, input_fd, pipefd[1]) == -1)
+        exit(EXIT_FAILURE);
+
+      // Close all pipe ends in the child
+      if (current->next != NULL) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+      }
+      if (input_fd != -1) {
+        close(input_fd);
+      }
+
+      if (current->group) {
+        job_control = 0;
+        exit(execute_node(current->group));
+      }
+      apply_assignments(current, assignments, 1);
+      if (expansion_failed)
+        exit(EXIT_FAILURE);
+      if (function) {
+        job_control = 0;
+        exit(call_function(function, argv));
+      }
+      if (builtin)
+        exit(builtin->func(argv));
+      if (option_argbatch &&
+          !argument_size_fits(argv, argument_budget()))
+        exit(run_batches(argv, argc, spread));
+      if (execvpe(argv[0], argv, env_vector()) == -1) {
+        int error = errno;
+        perror("execvp failed");
+        if (error == E2BIG && !option_argbatch)
+          fprintf(stderr, "cshell: set -o argbatch runs it in batches\n");
+        exit(127);
+      }
+
+    } else {
+      pids[stage] = pid;
+      if (trace) {
+        const char *kind = current->group ? (current->subshell ? "subshell"
+                                                               : "group")
+                           : builtin      ? "builtin"
+                           : function     ? "function"
+                                          : "exec";
+        trace_launch(&trace[stage], pipeline_id, stage, current, argv, kind,
+                     pid, &launch);
+      }
+      if (go[0] != -1) {
+        timing_attach_counters(&timing[stage], pid,
+                               !builtin && !current->group);
+        close(go[0]);
+        close(go[1]);
+      }
+      if (job_control) {
+        // Also done in the child; whichever runs first wins the race.
+        if (pgid == 0) {
+          pgid = pid;
+          foreground_pid = pgid;
+          setpgid(pid, pgid);
+          tcsetpgrp(STDIN_FILENO, pgid);
+        } else {
+          setpgid(pid, pgid);
+        }
+      }
+      free_args(argv);
+      if (input_fd != -1) {
+        close(input_fd);
+      }
+      if (current->next != NULL) {
+        close(pipefd[1]);
+      }
+      input_fd = pipefd[0];
+    }
+  }
+  if (input_fd != -1)
+    close(input_fd);
+
+  int stopped = wait_stages(pids, stages, statuses, timing, trace,
+                            cmd->limited ? &limits : NULL);
+  if (cmd->limited)
+    job_limits_finish(&limits);
+
+  if (job_control && pgid > 0) {
+    tcsetpgrp(STDIN_FILENO, getpgrp());
+    if (stopped) {
+      printf("\nStopped: %d\n", (int)pgid);
+      fflush(stdout);
+    }
+  }
+  foreground_pid = 0;
+  sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+
+  int status = statuses[stages - 1];
+  if (option_pipefail) {
+    for (int stage = stages - 1; stage >= 0; stage--) {
+      if (statuses[stage] != 0) {
+        status = statuses[stage];
+        break;
+      }
+    }
+  }
+  record_status(statuses, stages, status);
+  if (timing) {
+    timing_report(timing, stages, cmd->timed);
+    free(timing);
+  }
+  free(trace);
+
+  free(pids);
+  free(statuses);
+  return status;
+}
+
+// $(commands): run them in a child with stdout on a pipe and return what
+// they printed, without trailing newlines. The read waits in the I/O loop,
+// so background jobs that finish meanwhile are still picked up.
+char *command_output(const char *commands) {
+  int pipefd[2];
+  if (pipe2(pipefd, O_CLOEXEC) == -1) {
+    perror("pipe failed");
+    return NULL;
+  }
+
+  sigset_t block, saved_mask;
+  sigemptyset(&block);
+  sigaddset(&block, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &block, &saved_mask);
+
+  fflush(stdout);
+  pid_t pid = stats_fork();
+  if (pid == -1) {
+    perror("fork failed");
+    exit(EXIT_FAILURE);
+  } else if (pid == 0) {
+    sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+    signal(SIGINT, SIG_DFL);
+    job_control = 0;
+    foreground_pid = 0;
+    dup2(pipefd[1], STDOUT_FILENO);
+    close(pipefd[0]);
+    close(pipefd[1]);
+    // Parsed as a script, so the commands may span lines.
+    ScriptElement *script = parse_script(commands);
+    int status = script ? execute_script(script) : 0;
+    free_script_element(script);
+    exit(status);
+  }
+  close(pipefd[1]);
+
+  size_t len = 0, capacity = 256;
+  char *output = malloc(capacity);
+  if (!output) {
+    perror("malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  while (1) {
+    if (ioloop_wait_fd(pipefd[0], -1) == 0)
+      continue;
+    if (capacity - len < READ_CHUNK_SIZE / 4) {
+      capacity *= 2;
+      output = realloc(output, capacity);
+      if (!output) {
+        perror("realloc failed");
+        exit(EXIT_FAILURE);
+      }
+    }
+    ssize_t n = read(pipefd[0], output + len, capacity - len - 1);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    len += (size_t)n;
+  }
+  close(pipefd[0]);
+
+  int status = 0;
+  while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+  }
+  sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+  last_exit_status = decode_status(status);
+
+  while (len > 0 && output[len - 1] == '\n')
+    len--;
+  output[len] = '\0';
+  return output;
+}
+
+// Start 'list &' or a coprocess without waiting for it. A coprocess reads
+// from and writes to pipes whose other ends the shell keeps, published as
+// NAME ("read-fd write-fd", so ${NAME[0]} and ${NAME[1]}) and NAME_PID.
+static int run_async(Node *node) {
+  int coproc = node->type == NODE_COPROC;
+  int to_child[2] = {-1, -1}, from_child[2] = {-1, -1};
+  if (coproc && (pipe2(to_child, O_CLOEXEC) == -1 ||
+                 pipe2(from_child, O_CLOEXEC) == -1)) {
+    perror("pipe failed");
+    exit(EXIT_FAILURE);
+  }
+
+  // The job must be in the table before its SIGCHLD can arrive.
+  sigset_t block, saved_mask;
+  sigemptyset(&block);
+  sigaddset(&block, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &block, &saved_mask);
+
+  fflush(stdout);
+  pid_t pid = stats_fork();
+  if (pid == -1) {
+    perror("fork failed");
+    exit(EXIT_FAILURE);
+  } else if (pid == 0) {
+    sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+    if (job_control) {
+      // Its own group keeps ^C and ^Z at the prompt away from it; the
+      // terminal stays with the shell.
+      setpgid(0, 0);
+      signal(SIGINT, SIG_DFL);
+      signal(SIGTSTP, SIG_DFL);
+    } else {
+      // Without job control, POSIX has background commands ignore
+      // interrupts and read from /dev/null.
+      signal(SIGINT, SIG_IGN);
+      signal(SIGQUIT, SIG_IGN);
+      if (!coproc) {
+        int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (null_fd != -1)
+          move_fd(null_fd, STDIN_FILENO);
+      }
+    }
+    job_control = 0;
+    foreground_pid = 0;
+    if (coproc) {
+      dup2(to_child[0], STDIN_FILENO);
+      dup2(from_child[1], STDOUT_FILENO);
+      close(to_child[0]);
+      close(to_child[1]);
+      close(from_child[0]);
+      close(from_child[1]);
+    }
+    exit(execute_node(node->left));
+  }
+
+  if (job_control)
+    setpgid(pid, pid);
+  int id = job_add(pid, node->text);
+  sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+  last_background_pid = pid;
+
+  if (coproc) {
+    close(to_child[0]);
+    close(from_child[1]);
+    int read_fd = fcntl(from_child[0], F_DUPFD_CLOEXEC, COPROC_FD_BASE);
+    int write_fd = fcntl(to_child[1], F_DUPFD_CLOEXEC, COPROC_FD_BASE);
+    close(from_child[0]);
+    close(to_child[1]);
+
+    char value[32];
+    ShellArray *fds = declare_array(node->name, ARRAY_INDEXED);
+    array_clear(fds);
+    snprintf(value, sizeof(value), "%d", read_fd);
+    array_append(fds, value);
+    snprintf(value, sizeof(value), "%d", write_fd);
+    array_append(fds, value);
+    char *pid_name = malloc(strlen(node->name) + sizeof("_PID"));
+    if (!pid_name) {
+      perror("malloc failed");
+      exit(EXIT_FAILURE);
+    }
+    sprintf(pid_name, "%s_PID", node->name);
+    snprintf(value, sizeof(value), "%d", (int)pid);
+    set_shell_variable(pid_name, value);
+    free(pid_name);
+  }
+
+  if (job_control && id > 0) {
+    printf("[%d] %d\n", id, (int)pid);
+    fflush(stdout);
+  }
+  last_exit_status = 0;
+  return 0;
+}
+
+// Run a command list: && and || look at the status of their left side
+// before running the right one; ; runs both.
+int execute_node(Node *node) {
+  int status = 0;
+  if (node == NULL)
+    return 0;
+
+  switch (node->type) {
+  case NODE_PIPELINE:
+    status = execute_command(node->pipeline);
+    break;
+  case NODE_AND:
+    status = execute_node(node->left);
+    if (status == 0 && !function_returning && !script_aborted)
+      status = execute_node(node->right);
+    break;
+  case NODE_OR:
+    status = execute_node(node->left);
+    if (status != 0 && !function_returning && !script_aborted)
+      status = execute_node(node->right);
+    break;
+  case NODE_SEQUENCE:
+    status = execute_node(node->left);
+    if (!function_returning && !script_aborted)
+      status = execute_node(node->right);
+    break;
+  case NODE_BACKGROUND:
+  case NODE_COPROC:
+    status = run_async(node);
+    break;
+  }
+  return status;
+}
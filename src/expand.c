@@ -0,0 +1,990 @@
+#define _GNU_SOURCE // memmem
+#include "include/expand.h"
+#include "include/executor.h"
+#include "include/jobs.h"
+#include "include/lexer.h"
+#include "include/scripting.h"
+#include "include/stats.h"
+#include "include/utils.h"
+#include <ctype.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DEFAULT_IFS " \t\n"
+
+// Set when ${name:?message} finds name unset, until expansion_aborted().
+int expansion_failed = 0;
+
+// ${name:?message} failed while a command was being expanded: it does not
+// run. Unless the command stands for a subshell (stop is 0), the script
+// stops as it does on a syntax error; the interactive shell only drops the
+// rest of the line.
+int expansion_aborted(int stop) {
+  if (!expansion_failed)
+    return 0;
+  expansion_failed = 0;
+  if (stop)
+    script_aborted = 1;
+  return 1;
+}
+
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} StrBuf;
+
+static void buf_init(StrBuf *buf, size_t cap) {
+  STATS_ALLOC(STATS_EXPAND);
+  buf->data = malloc(cap);
+  if (!buf->data) {
+    perror("malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  buf->data[0] = '\0';
+  buf->len = 0;
+  buf->cap = cap;
+}
+
+static void buf_append(StrBuf *buf, const char *text, size_t n) {
+  if (buf->len + n + 1 > buf->cap) {
+    while (buf->len + n + 1 > buf->cap)
+      buf->cap *= 2;
+    STATS_ALLOC(STATS_EXPAND);
+    buf->data = realloc(buf->data, buf->cap);
+    if (!buf->data) {
+      perror("realloc failed");
+      exit(EXIT_FAILURE);
+    }
+  }
+  memcpy(buf->data + buf->len, text, n);
+  buf->len += n;
+  buf->data[buf->len] = '\0';
+}
+
+void arglist_init(ArgList *list) {
+  STATS_ALLOC(STATS_EXPAND);
+  list->capacity = 8;
+  list->count = 0;
+  list->items = malloc(sizeof(char *) * list->capacity);
+  if (!list->items) {
+    perror("malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  list->items[0] = NULL;
+}
+
+void arglist_push(ArgList *list, char *item) {
+  if (list->count + 1 >= list->capacity) {
+    list->capacity *= 2;
+    STATS_ALLOC(STATS_EXPAND);
+    list->items = realloc(list->items, sizeof(char *) * list->capacity);
+    if (!list->items) {
+      perror("realloc failed");
+      exit(EXIT_FAILURE);
+    }
+  }
+  list->items[list->count++] = item;
+  list->items[list->count] = NULL;
+}
+
+void arglist_free(ArgList *list) {
+  free_args(list->items);
+  list->items = NULL;
+  list->count = list->capacity = 0;
+}
+
+// NAME=value and the array forms, where NAME is a valid identifier.
+int is_assignment(const char *word) { return assignment_length(word) != 0; }
+
+// The elements of the positional parameters, of an array, or of a scalar
+// taken as a one-element array, one at a time.
+typedef struct {
+  int positional;
+  const ShellArray *array;
+  const char *single;
+  int keys; // The subscripts instead of the values
+  int next;
+  char numbers[2][16]; // An index stays valid until the call after next
+  int flip;
+} ListCursor;
+
+static void list_open(ListCursor *cursor, const char *name, int keys) {
+  memset(cursor, 0, sizeof(*cursor));
+  cursor->keys = keys;
+  if (!name) {
+    cursor->positional = 1;
+  } else if (!(cursor->array = find_array(name))) {
+    cursor->single = get_shell_variable(name);
+    if (cursor->single && keys)
+      cursor->single = "0";
+  }
+}
+
+static const char *list_next(ListCursor *cursor) {
+  if (cursor->positional) {
+    if (cursor->next >= positional_count())
+      return NULL;
+    return positional_parameter(++cursor->next);
+  }
+  if (!cursor->array) {
+    const char *single = cursor->next++ ? NULL : cursor->single;
+    return single;
+  }
+  const ShellArray *array = cursor->array;
+  while (cursor->next < array->count) {
+    int i = cursor->next++;
+    if (!array->values[i])
+      continue;
+    if (!cursor->keys)
+      return array->values[i];
+    if (array->kind == ARRAY_ASSOCIATIVE)
+      return array->keys[i];
+    char *number = cursor->numbers[cursor->flip ^= 1];
+    snprintf(number, sizeof(cursor->numbers[0]), "%d", i);
+    return number;
+  }
+  return NULL;
+}
+
+// "$@", "${@}", "${NAME[@]}" or "${!NAME[@]}" at p, the '$': opens cursor
+// on its elements and returns the reference's length, or 0 if p is
+// something else. Unquoted, the * forms are the same.
+static size_t list_reference(const char *p, ListCursor *cursor, int quoted) {
+  char all = p[1] == '{' ? p[2] : p[1];
+  if (all == '@' || (!quoted && all == '*')) {
+    if (p[1] != '{') {
+      list_open(cursor, NULL, 0);
+      return 2;
+    }
+    if (p[3] == '}') {
+      list_open(cursor, NULL, 0);
+      return 4;
+    }
+  }
+  if (p[1] != '{')
+    return 0;
+  const char *close = strchr(p, '}');
+  if (!close)
+    return 0;
+  const char *name = p + 2;
+  int keys = *name == '!';
+  name += keys;
+  size_t len = close - name;
+  if (!isalpha((unsigned char)*name) && *name != '_')
+    return 0;
+  if (len < 4 || strncmp(close - 3, "[@]", 3) != 0) {
+    if (quoted || len < 4 || strncmp(close - 3, "[*]", 3) != 0)
+      return 0;
+  }
+  char *base = strndup(name, len - 3);
+  if (!base) {
+    perror("strndup failed");
+    exit(EXIT_FAILURE);
+  }
+  list_open(cursor, base, keys);
+  free(base);
+  return close + 1 - p;
+}
+
+// $1 ... $# $@ $*, joined with spaces. NULL when there are none.
+static char *joined_positionals(void) {
+  int count = positional_count();
+  if (count == 0)
+    return NULL;
+  StrBuf out;
+  buf_init(&out, 64);
+  for (int i = 1; i <= count; i++) {
+    const char *arg = positional_parameter(i);
+    if (i > 1)
+      buf_append(&out, " ", 1);
+    buf_append(&out, arg, strlen(arg));
+  }
+  return out.data;
+}
+
+// The positional and special parameters named by key: digits, #, @ or *.
+// Returns 0 if key is not one of them.
+static int positional_value(const char *key, size_t len, char **value) {
+  char number[16];
+  if (len == 1 && *key == '#') {
+    snprintf(number, sizeof(number), "%d", positional_count());
+    *value = strdup(number);
+  } else if (len == 1 && (*key == '@' || *key == '*')) {
+    *value = joined_positionals();
+  } else if (len > 0 && strspn(key, "0123456789") >= len) {
+    const char *arg = positional_parameter(atoi(key));
+    *value = arg ? strdup(arg) : NULL;
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+// ${NAME}, ${NAME[subscript]}, ${NAME[@]} and ${NAME[*]} (the elements
+// joined by a space or the first character of IFS), ${#NAME[@]} (how many
+// there are) and ${!NAME[@]} (their subscripts). NULL when unset.
+static char *variable_value(const char *name, size_t len) {
+  char *key = strndup(name, len);
+  if (!key) {
+    perror("strndup failed");
+    exit(EXIT_FAILURE);
+  }
+  int count = *key == '#' && len > 1, keys = *key == '!';
+  char *base = key + count + keys;
+  char *subscript = strchr(base, '[');
+  if (subscript) {
+    *subscript++ = '\0';
+    char *close = strrchr(subscript, ']');
+    if (close)
+      *close = '\0';
+  }
+  int all = subscript && (strcmp(subscript, "@") == 0 ||
+                          strcmp(subscript, "*") == 0);
+
+  char *result = NULL;
+  if (all && count) {
+    ShellArray *array = find_array(base);
+    char number[16];
+    snprintf(number, sizeof(number), "%d",
+             array ? array->used : get_shell_variable(base) != NULL);
+    result = strdup(number);
+  } else if (all) {
+    const char *ifs = get_shell_variable("IFS");
+    char separator = *subscript == '*' ? (ifs ? *ifs : ' ') : ' ';
+    ListCursor cursor;
+    list_open(&cursor, base, keys);
+    const char *item = list_next(&cursor);
+    if (item) {
+      StrBuf out;
+      buf_init(&out, 64);
+      for (; item; item = list_next(&cursor)) {
+        if (out.len && separator)
+          buf_append(&out, &separator, 1);
+        buf_append(&out, item, strlen(item));
+      }
+      result = out.data;
+    }
+  } else if (subscript && !count && !keys) {
+    char *index = expand_word_single(subscript);
+    ShellArray *array = find_array(base);
+    const char *found = array ? array_get(array, index)
+                        : atoi(index) == 0 ? get_shell_variable(base)
+                                           : NULL;
+    if (found)
+      result = strdup(found);
+    free(index);
+  } else if (!subscript && !count && !keys) {
+    const char *found = get_shell_variable(base);
+    if (found)
+      result = strdup(found);
+  }
+  free(key);
+  return result;
+}
+
+// --- Parameter operators ---
+
+static const char *parameter_value(const char *p, char **value);
+static void expand_into(const char *word, ArgList *out, int split_glob,
+                        int as_pattern);
+
+// A pattern from ${x#pat} and its kin, in the form fnmatch() takes, with
+// quoted characters escaped. One without glob characters is also kept as
+// literal text and matched with memcmp() and memmem(); otherwise a literal
+// first character lets memchr() skip to where a match can start, and a
+// pattern without '*' only ever matches 'width' bytes.
+typedef struct {
+  char *glob;
+  char *literal;
+  size_t literal_len;
+  int first;  // Literal first character, or -1
+  long width; // Bytes every match spans, or -1
+} Pattern;
+
+static void pattern_init(Pattern *pattern, const char *word) {
+  ArgList list;
+  arglist_init(&list);
+  expand_into(word, &list, 0, 1);
+  pattern->glob = list.items[0];
+  free(list.items);
+
+  const char *g = pattern->glob;
+  pattern->first = g[0] == '\\' && g[1]                   ? (unsigned char)g[1]
+                   : g[0] && !strchr("*?[", g[0]) ? (unsigned char)g[0]
+                                                         : -1;
+  StrBuf literal;
+  buf_init(&literal, strlen(g) + 1);
+  int is_literal = 1;
+  pattern->width = 0;
+  for (const char *c = g; *c; c++) {
+    if (*c == '\\' && c[1]) {
+      buf_append(&literal, ++c, 1);
+    } else if (*c == '*') {
+      is_literal = 0;
+      pattern->width = -1;
+      continue;
+    } else if (*c == '?') {
+      is_literal = 0;
+    } else if (*c == '[') {
+      const char *close = c + 1;
+      if (*close == '!' || *close == '^')
+        close++;
+      if (*close == ']')
+        close++;
+      close = strchr(close, ']');
+      if (close) {
+        is_literal = 0;
+        c = close;
+      } else {
+        buf_append(&literal, c, 1);
+      }
+    } else {
+      buf_append(&literal, c, 1);
+    }
+    if (pattern->width >= 0)
+      pattern->width++;
+  }
+  if (is_literal) {
+    pattern->literal = literal.data;
+    pattern->literal_len = literal.len;
+  } else {
+    free(literal.data);
+    pattern->literal = NULL;
+  }
+}
+
+static void pattern_free(Pattern *pattern) {
+  free(pattern->glob);
+  free(pattern->literal);
+}
+
+// Whether text[start, end) matches. text is modifiable; a NUL is put at
+// end for the duration.
+static int pattern_matches(const Pattern *pattern, char *text, size_t start,
+                           size_t end) {
+  if (pattern->literal)
+    return end - start == pattern->literal_len &&
+           memcmp(text + start, pattern->literal, end - start) == 0;
+  if (pattern->width >= 0 && end - start != (size_t)pattern->width)
+    return 0;
+  char saved = text[end];
+  text[end] = '\0';
+  int match = fnmatch(pattern->glob, text + start, 0) == 0;
+  text[end] = saved;
+  return match;
+}
+
+#define NO_MATCH ((size_t)-1)
+
+// The end of the longest non-empty match starting at start.
+static size_t longest_match(const Pattern *pattern, char *text, size_t start,
+                            size_t len) {
+  size_t end = len;
+  if (pattern->literal)
+    end = start + pattern->literal_len;
+  else if (pattern->width >= 0)
+    end = start + pattern->width;
+  if (end > len)
+    return NO_MATCH;
+  for (; end > start; end--) {
+    if (pattern_matches(pattern, text, start, end))
+      return end;
+    if (pattern->literal || pattern->width >= 0)
+      break;
+  }
+  return NO_MATCH;
+}
+
+// ${x#pat}, ${x##pat}: text without its shortest or longest matching
+// prefix.
+static char *remove_prefix(const Pattern *pattern, char *text, int longest) {
+  size_t len = strlen(text);
+  for (size_t k = 0; k <= len; k++) {
+    size_t end = longest ? len - k : k;
+    if (pattern_matches(pattern, text, 0, end))
+      return strdup(text + end);
+  }
+  return strdup(text);
+}
+
+// ${x%pat}, ${x%%pat}: the same at the end.
+static char *remove_suffix(const Pattern *pattern, char *text, int longest) {
+  size_t len = strlen(text);
+  for (size_t k = 0; k <= len; k++) {
+    size_t start = longest ? k : len - k;
+    if (pattern_matches(pattern, text, start, len))
+      return strndup(text, start);
+  }
+  return strdup(text);
+}
+
+// ${x/pat/with} replaces the first longest match, ${x//pat/with} every
+// one, and ${x/#pat/with} and ${x/%pat/with} one at the start or the end.
+static char *replace_matches(const Pattern *pattern, char *text,
+                             const char *with, char mode) {
+  size_t len = strlen(text);
+  StrBuf out;
+  buf_init(&out, len + strlen(with) + 1);
+  size_t copied = 0;
+
+  if (mode == '%') {
+    for (size_t start = 0; start < len; start++) {
+      if (pattern_matches(pattern, text, start, len)) {
+        buf_append(&out, text, start);
+        buf_append(&out, with, strlen(with));
+        return out.data;
+      }
+    }
+    buf_append(&out, text, len);
+    return out.data;
+  }
+
+  for (size_t i = 0; i < len;) {
+    size_t end;
+    if (pattern->literal && mode != '#') {
+      if (pattern->literal_len == 0)
+        break;
+      const char *hit = memmem(text + i, len - i, pattern->literal,
+                               pattern->literal_len);
+      if (!hit)
+        break;
+      i = hit - text;
+      end = i + pattern->literal_len;
+    } else {
+      if (pattern->first >= 0 && mode != '#') {
+        const char *hit = memchr(text + i, pattern->first, len - i);
+        if (!hit)
+          break;
+        i = hit - text;
+      }
+      end = longest_match(pattern, text, i, len);
+    }
+    if (end == NO_MATCH) {
+      if (mode == '#')
+        break;
+      i++;
+      continue;
+    }
+    buf_append(&out, text + copied, i - copied);
+    buf_append(&out, with, strlen(with));
+    copied = i = end;
+    if (mode != '/')
+      break;
+  }
+  buf_append(&out, text + copied, len - copied);
+  return out.data;
+}
+
+// An offset or length in ${x:offset:length}: a number, possibly in
+// parentheses as in ${x:(-1)}, or the name of a variable holding one.
+static long number_value(char *text) {
+  text += strspn(text, " \t(");
+  size_t len = strlen(text);
+  while (len > 0 && strchr(" \t)", text[len - 1]))
+    text[--len] = '\0';
+  char *end;
+  long number = strtol(text, &end, 10);
+  if (*end == '\0' && end != text)
+    return number;
+  const char *value = get_shell_variable(text);
+  return value ? strtol(value, NULL, 10) : 0;
+}
+
+static char *substring(const char *text, char *range) {
+  long len = (long)strlen(text);
+  char *colon = strchr(range, ':');
+  if (colon)
+    *colon = '\0';
+  long offset = number_value(range);
+  if (offset < 0)
+    offset += len;
+  if (offset < 0 || offset > len)
+    return strdup("");
+  long count = len - offset;
+  if (colon) {
+    count = number_value(colon + 1);
+    if (count < 0)
+      count += len - offset;
+    if (count < 0) {
+      fprintf(stderr, "cshell: %s: substring expression < 0\n", colon + 1);
+      return strdup("");
+    }
+    if (count > len - offset)
+      count = len - offset;
+  }
+  return strndup(text + offset, count);
+}
+
+// The '/' that ends the pattern of ${x/pat/with}, outside quotes and
+// escapes, or NULL.
+static const char *pattern_end(const char *word) {
+  for (const char *p = word; *p; p++) {
+    if (*p == '\\' && p[1])
+      p++;
+    else if (*p == '\'' || *p == '"')
+      p = strchr(p + 1, *p) ? strchr(p + 1, *p) : p + strlen(p) - 1;
+    else if (*p == '/')
+      return p;
+  }
+  return NULL;
+}
+
+// Apply the operator after a ${ reference } to its value, which is taken
+// over; NULL stands for unset.
+static char *apply_operator(const char *name, size_t name_len, char *value,
+                            const char *op) {
+  char kind = op[0];
+  int colon = kind == ':' && op[1] && strchr("-=+?", op[1]);
+  if (colon)
+    kind = *++op;
+  const char *word = op + 1;
+  int unset = value == NULL || (colon && *value == '\0');
+  char *result = NULL;
+
+  switch (kind) {
+  case '-':
+    if (!unset)
+      return value;
+    result = expand_word_single(word);
+    break;
+  case '=': {
+    if (!unset)
+      return value;
+    result = expand_word_single(word);
+    char *target = strndup(name, name_len);
+    if (!target) {
+      perror("strndup failed");
+      exit(EXIT_FAILURE);
+    }
+    if ((isalpha((unsigned char)*target) || *target == '_') &&
+        !strchr(target, '['))
+      set_shell_variable(target, result);
+    else
+      fprintf(stderr, "cshell: $%s: cannot assign in this way\n", target);
+    free(target);
+    break;
+  }
+  case '+':
+    if (!unset)
+      result = expand_word_single(word);
+    break;
+  case '?':
+    if (!unset)
+      return value;
+    result = expand_word_single(word);
+    fprintf(stderr, "cshell: %.*s: %s\n", (int)name_len, name,
+            *result ? result : "parameter null or not set");
+    free(result);
+    result = NULL;
+    expansion_failed = 1;
+    break;
+  case ':': {
+    if (!value)
+      break;
+    char *range = expand_word_single(word);
+    result = substring(value, range);
+    free(range);
+    break;
+  }
+  case '#':
+  case '%': {
+    if (!value)
+      break;
+    int longest = *word == kind;
+    Pattern pattern;
+    pattern_init(&pattern, word + longest);
+    result = kind == '#' ? remove_prefix(&pattern, value, longest)
+                         : remove_suffix(&pattern, value, longest);
+    pattern_free(&pattern);
+    break;
+  }
+  case '/': {
+    if (!value)
+      break;
+    char mode = '1'; // The first match only
+    if (*word == '/' || *word == '#' || *word == '%')
+      mode = *word++;
+    const char *slash = pattern_end(word);
+    char *pattern_word = slash ? strndup(word, slash - word) : strdup(word);
+    char *with = expand_word_single(slash ? slash + 1 : "");
+    Pattern pattern;
+    pattern_init(&pattern, pattern_word);
+    result = replace_matches(&pattern, value, with, mode);
+    pattern_free(&pattern);
+    free(with);
+    free(pattern_word);
+    break;
+  }
+  default:
+    fprintf(stderr, "cshell: ${%.*s%s}: bad substitution\n", (int)name_len,
+            name, op);
+  }
+  free(value);
+  return result;
+}
+
+// Length of the parameter a ${ ... } starts with: a name with an optional
+// [subscript], digits, or one of @ * # ? $ !, after a '!' for the
+// subscripts of an array. 0 if there is none.
+static size_t reference_length(const char *text, size_t len) {
+  size_t i = len > 1 && text[0] == '!' ? 1 : 0;
+  if (i < len && (isalpha((unsigned char)text[i]) || text[i] == '_')) {
+    while (i < len && (isalnum((unsigned char)text[i]) || text[i] == '_'))
+      i++;
+    if (i < len && text[i] == '[') {
+      const char *close = memchr(text + i, ']', len - i);
+      if (!close)
+        return 0;
+      i = close - text + 1;
+    }
+    return i;
+  }
+  if (i < len && isdigit((unsigned char)text[i])) {
+    while (i < len && isdigit((unsigned char)text[i]))
+      i++;
+    return i;
+  }
+  return i < len && strchr("@*#?$!", text[i]) ? i + 1 : 0;
+}
+
+static char *reference_value(const char *text, size_t len) {
+  char *value = NULL;
+  if (len == 1 && strchr("?$!", *text))
+    parameter_value(text, &value);
+  else if (!positional_value(text, len, &value))
+    value = variable_value(text, len);
+  return value;
+}
+
+// The inside of ${ ... }: a parameter, its length with a leading '#', or
+// the parameter followed by an operator.
+static char *braced_value(const char *text, size_t len) {
+  if (len > 1 && text[0] == '#' &&
+      reference_length(text + 1, len - 1) == len - 1) {
+    char number[24];
+    if (text[len - 1] == ']' && len > 4 && strchr("@*", text[len - 2]) &&
+        text[len - 3] == '[')
+      return variable_value(text, len); // How many elements
+    if (len == 2 && strchr("@*", text[1])) {
+      snprintf(number, sizeof(number), "%d", positional_count());
+    } else {
+      char *value = reference_value(text + 1, len - 1);
+      snprintf(number, sizeof(number), "%zu", value ? strlen(value) : 0);
+      free(value);
+    }
+    return strdup(number);
+  }
+
+  size_t ref = reference_length(text, len);
+  if (ref == 0) {
+    fprintf(stderr, "cshell: ${%.*s}: bad substitution\n", (int)len, text);
+    return NULL;
+  }
+  char *value = reference_value(text, ref);
+  if (ref == len)
+    return value;
+  char *op = strndup(text + ref, len - ref);
+  if (!op) {
+    perror("strndup failed");
+    exit(EXIT_FAILURE);
+  }
+  char *result = apply_operator(text, ref, value, op);
+  free(op);
+  return result;
+}
+
+// Parse a parameter reference just after '$' and return a pointer past it,
+// or NULL when the '$' is literal. *value is malloc'd, or NULL if unset.
+static const char *parameter_value(const char *p, char **value) {
+  char number[16];
+  *value = NULL;
+
+  if (*p == '?' || *p == '$') {
+    snprintf(number, sizeof(number), "%d",
+             *p == '?' ? last_exit_status : (int)getpid());
+    *value = strdup(number);
+    return p + 1;
+  }
+  if (*p == '!') {
+    if (last_background_pid > 0) {
+      snprintf(number, sizeof(number), "%d", (int)last_background_pid);
+      *value = strdup(number);
+    }
+    return p + 1;
+  }
+  if (*p == '(') {
+    size_t len = substitution_end(p - 1);
+    if (len == 0)
+      return NULL;
+    char *commands = strndup(p + 1, len - 3);
+    *value = command_output(commands);
+    free(commands);
+    return p - 1 + len;
+  }
+
+  if (isdigit((unsigned char)*p) || *p == '#' || *p == '@' || *p == '*') {
+    positional_value(p, 1, value);
+    return p + 1;
+  }
+
+  if (*p == '{') {
+    size_t len = parameter_end(p - 1);
+    if (len == 0)
+      return NULL;
+    *value = braced_value(p + 1, len - 3);
+    return p - 1 + len;
+  }
+
+  const char *name = p;
+  while (isalnum((unsigned char)*p) || *p == '_')
+    p++;
+  if (p == name)
+    return NULL;
+  *value = variable_value(name, p - name);
+  return p;
+}
+
+// Expand $?, $$, $!, $1, $#, $NAME, ${NAME} and $(commands) in text, leaving
+// quotes alone; used for here-document bodies. Unset names expand to "".
+// A backslash quotes only $, `, \ and a newline, which it removes.
+char *expand_variables(const char *text) {
+  StrBuf out;
+  buf_init(&out, strlen(text) + 32);
+
+  const char *p = text;
+  while (*p) {
+    const char *stop = p + strcspn(p, "$\\");
+    buf_append(&out, p, stop - p);
+    if (*stop == '\0')
+      break;
+    if (*stop == '\\') {
+      char next = stop[1];
+      if (next == '$' || next == '`' || next == '\\')
+        buf_append(&out, &next, 1);
+      else if (next != '\n')
+        buf_append(&out, stop, next ? 2 : 1);
+      p = stop + (next ? 2 : 1);
+      continue;
+    }
+
+    char *value;
+    const char *end = parameter_value(stop + 1, &value);
+    if (!end) {
+      buf_append(&out, "$", 1);
+      p = stop + 1;
+      continue;
+    }
+    if (value)
+      buf_append(&out, value, strlen(value));
+    free(value);
+    p = end;
+  }
+  return out.data;
+}
+
+// --- Word expansion ---
+
+typedef struct {
+  StrBuf text;    // Quote-removed text
+  StrBuf pattern; // The same text with quoted glob characters escaped
+  int globbing;   // An unquoted *, ? or [ is present
+  int exists;     // Quoting makes even an empty field an argument
+  int split_glob; // Field splitting and globbing are enabled
+  int as_pattern; // The result is the pattern, not the text
+} Field;
+
+static void field_add(Field *field, const char *text, size_t n, int quoted) {
+  buf_append(&field->text, text, n);
+  // Only a globbed field or a pattern needs the escaped form.
+  for (size_t i = 0; i < n && (field->split_glob || field->as_pattern); i++) {
+    char c = text[i];
+    if (c == '\\' || (quoted && strchr("*?[]", c)))
+      buf_append(&field->pattern, "\\", 1);
+    else if (!quoted && strchr("*?[", c))
+      field->globbing = 1;
+    buf_append(&field->pattern, &c, 1);
+  }
+  if (n > 0 || quoted)
+    field->exists = 1;
+}
+
+static void field_reset(Field *field) {
+  field->text.len = field->pattern.len = 0;
+  field->text.data[0] = field->pattern.data[0] = '\0';
+  field->globbing = field->exists = 0;
+}
+
+// Emit the field: its glob matches if it has any, else the text itself.
+static void field_finish(Field *field, ArgList *out) {
+  if (!field->exists && field->split_glob)
+    return;
+
+  char **matches = NULL;
+  if (field->split_glob && field->globbing)
+    matches = expand_wildcards(field->pattern.data);
+  if (matches && matches[0] &&
+      !(matches[1] == NULL && strcmp(matches[0], field->pattern.data) == 0)) {
+    for (int i = 0; matches[i] != NULL; i++)
+      arglist_push(out, matches[i]);
+    free(matches);
+  } else {
+    free_args(matches);
+    STATS_ALLOC(STATS_EXPAND);
+    char *text =
+        strdup(field->as_pattern ? field->pattern.data : field->text.data);
+    if (!text) {
+      perror("strdup failed");
+      exit(EXIT_FAILURE);
+    }
+    arglist_push(out, text);
+  }
+  field_reset(field);
+}
+
+// An unquoted expansion is split on IFS into separate fields. Runs of IFS
+// white space only separate fields; every other IFS character ends one,
+// empty or not, taking the white space around it along.
+static void field_split(Field *field, const char *value, ArgList *out) {
+  const char *ifs = get_shell_variable("IFS");
+  if (!ifs)
+    ifs = DEFAULT_IFS;
+  int blank_ended = 0; // White space has just ended a field
+  for (const char *p = value; *p; p++) {
+    if (!strchr(ifs, *p)) {
+      field_add(field, p, 1, 0);
+      blank_ended = 0;
+    } else if (*p == ' ' || *p == '\t' || *p == '\n') {
+      if (field->exists) {
+        field_finish(field, out);
+        blank_ended = 1;
+      }
+    } else {
+      if (!blank_ended) {
+        field->exists = 1;
+        field_finish(field, out);
+      }
+      blank_ended = 0;
+    }
+  }
+}
+
+static void expand_into(const char *word, ArgList *out, int split_glob,
+                        int as_pattern) {
+  Field field;
+  buf_init(&field.text, strlen(word) + 16);
+  buf_init(&field.pattern, strlen(word) + 16);
+  field.globbing = field.exists = 0;
+  field.split_glob = split_glob;
+  field.as_pattern = as_pattern;
+
+  const char *p = word;
+  if (*p == '~' && (p[1] == '\0' || p[1] == '/')) {
+    const char *home = get_shell_variable("HOME");
+    if (home) {
+      field_add(&field, home, strlen(home), 1);
+      p++;
+    }
+  }
+
+  int in_double = 0;
+  ListCursor cursor;
+  size_t list_len;
+  while (*p) {
+    char c = *p;
+    if (c == '\'' && !in_double) {
+      const char *close = strchr(p + 1, '\'');
+      if (!close)
+        close = p + strlen(p);
+      field_add(&field, p + 1, close - p - 1, 1);
+      p = *close ? close + 1 : close;
+    } else if (c == '"') {
+      if (!in_double)
+        field.exists = 1;
+      in_double = !in_double;
+      p++;
+    } else if (c == '$' && split_glob &&
+               (list_len = list_reference(p, &cursor, in_double)) != 0) {
+      // "$@" and "${NAME[@]}" give every element a field of its own, with
+      // no joining and re-splitting; with none, not even an empty one.
+      // Unquoted, each element is split by itself.
+      const char *item = list_next(&cursor);
+      if (!item && in_double && field.text.len == 0)
+        field.exists = 0;
+      while (item) {
+        const char *following = list_next(&cursor);
+        if (!in_double) {
+          field_split(&field, item, out);
+        } else if (following && field.text.len == 0) {
+          char *arg = strdup(item); // Neither prefix nor suffix to add
+          if (!arg) {
+            perror("strdup failed");
+            exit(EXIT_FAILURE);
+          }
+          arglist_push(out, arg);
+          item = following;
+          continue;
+        } else {
+          field_add(&field, item, strlen(item), 1);
+        }
+        if (following)
+          field_finish(&field, out);
+        item = following;
+      }
+      p += list_len;
+    } else if (c == '\\' && p[1] == '\n') {
+      p += 2; // A backslash-newline joins two lines, quoted or not.
+    } else if (c == '\\' && p[1]) {
+      // Inside double quotes a backslash only escapes $ ` " and itself.
+      if (!in_double || strchr("$`\"\\", p[1])) {
+        field_add(&field, p + 1, 1, 1);
+        p += 2;
+      } else {
+        field_add(&field, p, 1, 1);
+        p++;
+      }
+    } else if (c == '$') {
+      char *value;
+      const char *end = parameter_value(p + 1, &value);
+      if (!end) {
+        field_add(&field, "$", 1, in_double);
+        p++;
+        continue;
+      }
+      // In a pattern, an unquoted expansion may hold glob characters.
+      if (value && (in_double || !split_glob))
+        field_add(&field, value, strlen(value),
+                  in_double || !field.as_pattern);
+      else if (value)
+        field_split(&field, value, out);
+      free(value);
+      p = end;
+    } else {
+      field_add(&field, p, 1, in_double);
+      p++;
+    }
+  }
+  field_finish(&field, out);
+  free(field.text.data);
+  free(field.pattern.data);
+}
+
+// Expand one word into zero or more arguments: tilde, parameters, quote
+// removal, then field splitting and globbing of the unquoted parts.
+void expand_word(const char *word, ArgList *out) {
+  expand_into(word, out, 1, 0);
+}
+
+// Expand a word that must stay one string (assignment values, redirection
+// targets): no field splitting and no globbing.
+char *expand_word_single(const char *word) {
+  ArgList list;
+  arglist_init(&list);
+  expand_into(word, &list, 0, 0);
+  char *result = list.items[0];
+  free(list.items);
+  return result;
+}
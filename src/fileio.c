@@ -0,0 +1,453 @@
+#define _GNU_SOURCE // copy_file_range
+#include "include/fileio.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef CSHELL_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// The engine behind the cat, cp and wc -l builtins. A regular file copied
+// to another goes through copy_file_range(), which moves no data through
+// the shell and lets the filesystem share extents. A regular file bigger
+// than a chunk going anywhere else, or being counted, is streamed through
+// an io_uring with a few registered buffers, the reads running ahead of
+// the writes. The rest, and kernels without io_uring, use read() and
+// write().
+
+#define CHUNK_SIZE (256 * 1024) // Stays in L2 while it is counted
+#define CHUNKS 4
+#define STREAM_SIZE (128 * 1024)
+#define RANGE_SIZE (16 << 20) // Per copy_file_range(), to notice ^C
+
+int option_fileio = 0;
+volatile sig_atomic_t fileio_interrupted = 0;
+
+size_t count_newlines(const char *data, size_t len) {
+  size_t count = 0, i = 0;
+#ifdef __SSE2__
+  const __m128i newline = _mm_set1_epi8('\n');
+  while (len - i >= 16) {
+    // Each byte lane counts its matches; 255 blocks and it would wrap.
+    size_t blocks = (len - i) / 16;
+    if (blocks > 255)
+      blocks = 255;
+    __m128i lanes = _mm_setzero_si128();
+    for (size_t b = 0; b < blocks; b++, i += 16) {
+      __m128i bytes = _mm_loadu_si128((const __m128i *)(data + i));
+      lanes = _mm_sub_epi8(lanes, _mm_cmpeq_epi8(bytes, newline));
+    }
+    __m128i sums = _mm_sad_epu8(lanes, _mm_setzero_si128());
+    count += (size_t)_mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4);
+  }
+#endif
+  const char *p = data + i, *end = data + len;
+  while ((p = memchr(p, '\n', end - p)) != NULL) {
+    count++;
+    p++;
+  }
+  return count;
+}
+
+static int interrupted(void) {
+  if (!fileio_interrupted)
+    return 0;
+  errno = EINTR;
+  return 1;
+}
+
+static int write_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n == -1) {
+      if (errno == EINTR && !interrupted())
+        continue;
+      return -1;
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// read() and write(), or read() and count. A terminal or pipe is polled
+// first: the shell's SIGINT handler restarts read(), but not poll().
+static int stream(int in, int out, long long *lines, int wait) {
+  char *buffer = malloc(STREAM_SIZE);
+  if (!buffer) {
+    perror("malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  int result = 0;
+  for (;;) {
+    if (interrupted()) {
+      result = -1;
+      break;
+    }
+    if (wait) {
+      struct pollfd ready = {.fd = in, .events = POLLIN};
+      if (poll(&ready, 1, -1) == -1) {
+        if (errno == EINTR)
+          continue;
+        result = -1;
+        break;
+      }
+    }
+    ssize_t n = read(in, buffer, STREAM_SIZE);
+    if (n == 0)
+      break;
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      result = -1;
+      break;
+    }
+    if (lines)
+      *lines += count_newlines(buffer, n);
+    else if (write_all(out, buffer, n) == -1) {
+      result = -1;
+      break;
+    }
+  }
+  int error = errno;
+  free(buffer);
+  errno = error;
+  return result;
+}
+
+// 1 once everything is copied, 0 if the files do not support it and
+// nothing was, -1 on an error.
+static int range_copy(int in, int out) {
+  int copied = 0;
+  for (;;) {
+    if (interrupted())
+      return -1;
+    ssize_t n = copy_file_range(in, NULL, out, NULL, RANGE_SIZE, 0);
+    if (n > 0) {
+      copied = 1;
+      continue;
+    }
+    if (n == 0)
+      return 1;
+    if (errno == EINTR)
+      continue;
+    // EBADF: the output was opened to append, which it cannot do.
+    if (!copied && (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                    errno == EOPNOTSUPP || errno == EBADF))
+      return 0;
+    return -1;
+  }
+}
+
+#ifdef CSHELL_IO_URING
+typedef struct {
+  int fd;
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+  unsigned unsubmitted;
+  int fixed; // The buffers are registered
+} Ring;
+
+static Ring ring = {.fd = -1};
+static int ring_state = 0; // 1 set up, -1 unavailable, 0 not tried yet
+static pid_t ring_pid = 0; // The process the ring belongs to
+static char *buffers = NULL; // CHUNKS of CHUNK_SIZE, kept for the next use
+
+static void ring_close(void) {
+  if (ring.sqes && ring.sqes != MAP_FAILED)
+    munmap(ring.sqes, ring.sqes_size);
+  if (ring.cq_ring && ring.cq_ring != MAP_FAILED &&
+      ring.cq_ring != ring.sq_ring)
+    munmap(ring.cq_ring, ring.cq_ring_size);
+  if (ring.sq_ring && ring.sq_ring != MAP_FAILED)
+    munmap(ring.sq_ring, ring.sq_ring_size);
+  if (ring.fd != -1)
+    close(ring.fd);
+  memset(&ring, 0, sizeof(ring));
+  ring.fd = -1;
+}
+
+static void *map_ring(size_t size, off_t offset) {
+  return mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              ring.fd, offset);
+}
+
+static int ring_open(void) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring.fd = (int)syscall(__NR_io_uring_setup, CHUNKS * 2, &params);
+  // Reads and writes at the file position came in 5.6, FAST_POLL in 5.7.
+  if (ring.fd == -1 || !(params.features & IORING_FEAT_FAST_POLL)) {
+    ring_close();
+    return -1;
+  }
+  ring.sq_ring_size =
+      params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring.cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  int single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single && ring.cq_ring_size > ring.sq_ring_size)
+    ring.sq_ring_size = ring.cq_ring_size;
+  ring.sq_ring = map_ring(ring.sq_ring_size, IORING_OFF_SQ_RING);
+  ring.cq_ring =
+      single ? ring.sq_ring : map_ring(ring.cq_ring_size, IORING_OFF_CQ_RING);
+  ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring.sqes = map_ring(ring.sqes_size, IORING_OFF_SQES);
+  if (ring.sq_ring == MAP_FAILED || ring.cq_ring == MAP_FAILED ||
+      ring.sqes == MAP_FAILED) {
+    ring_close();
+    return -1;
+  }
+  char *sq = ring.sq_ring, *cq = ring.cq_ring;
+  ring.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring.sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring.sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring.cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring.cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  if (!buffers) {
+    buffers = mmap(NULL, (size_t)CHUNKS * CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers == MAP_FAILED) {
+      buffers = NULL;
+      ring_close();
+      return -1;
+    }
+  }
+  // Registered, the buffers are pinned once instead of on every read and
+  // write; RLIMIT_MEMLOCK may not allow it, and then they stay plain.
+  struct iovec chunks[CHUNKS];
+  for (int i = 0; i < CHUNKS; i++) {
+    chunks[i].iov_base = buffers + (size_t)i * CHUNK_SIZE;
+    chunks[i].iov_len = CHUNK_SIZE;
+  }
+  ring.fixed = syscall(__NR_io_uring_register, ring.fd,
+                       IORING_REGISTER_BUFFERS, chunks, CHUNKS) == 0;
+  return 0;
+}
+
+static int ring_ready(void) {
+  pid_t self = getpid();
+  if (ring_pid != self) {
+    // A forked stage gets a ring of its own rather than share the shell's.
+    if (ring.fd != -1)
+      ring_close();
+    ring_state = 0;
+    ring_pid = self;
+  }
+  if (ring_state == 0)
+    ring_state = ring_open() == 0 ? 1 : -1;
+  return ring_state == 1;
+}
+
+typedef struct {
+  long long offset;  // Of the chunk in the input
+  unsigned length;   // Bytes asked for
+  unsigned filled;   // Bytes read so far
+  unsigned written;  // Bytes written so far
+  int read;          // The chunk is in its buffer
+} Slot;
+
+// An operation on part of the slot's buffer; the tag is the slot number
+// and whether it is a write.
+static void ring_queue(int write, int fd, int slot, unsigned from,
+                       unsigned len, long long offset) {
+  unsigned tail = *ring.sq_tail, index = tail & *ring.sq_mask;
+  struct io_uring_sqe *sqe = &ring.sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  if (ring.fixed) {
+    sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    sqe->buf_index = slot;
+  } else {
+    sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+  }
+  sqe->fd = fd;
+  sqe->off = (__u64)offset; // -1 is the file position
+  sqe->addr = (unsigned long)(buffers + (size_t)slot * CHUNK_SIZE + from);
+  sqe->len = len;
+  sqe->user_data = (__u64)slot << 1 | (write != 0);
+  ring.sq_array[index] = index;
+  __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring.unsubmitted++;
+}
+
+// Stream the regular file in from start to end into out, or count its
+// lines. Chunks are taken in order and written one at a time, so a pipe
+// or terminal sees them in sequence, while up to CHUNKS reads are out.
+static int ring_transfer(int in, long long start, long long end, int out,
+                         long long *lines) {
+  Slot slots[CHUNKS];
+  long long next = start;
+  unsigned issued = 0, finished = 0; // Chunks asked for, chunks done with
+  int in_flight = 0, writing = 0, error = 0;
+
+  for (;;) {
+    if (!error && fileio_interrupted)
+      error = EINTR;
+    while (!error && issued - finished < CHUNKS && next < end) {
+      int index = issued % CHUNKS;
+      Slot *slot = &slots[index];
+      slot->offset = next;
+      slot->length = end - next < CHUNK_SIZE ? end - next : CHUNK_SIZE;
+      slot->filled = slot->written = 0;
+      slot->read = 0;
+      ring_queue(0, in, index, 0, slot->length, next);
+      next += slot->length;
+      issued++;
+      in_flight++;
+    }
+    while (!error && !writing && finished < issued) {
+      int index = finished % CHUNKS;
+      Slot *slot = &slots[index];
+      if (!slot->read)
+        break;
+      if (lines || slot->filled == 0) {
+        if (lines)
+          *lines += count_newlines(buffers + (size_t)index * CHUNK_SIZE,
+                                   slot->filled);
+        finished++;
+        continue;
+      }
+      ring_queue(1, out, index, 0, slot->filled, -1);
+      writing = 1;
+      in_flight++;
+    }
+    if (in_flight == 0) {
+      if (error || next >= end)
+        break;
+      continue; // Counting freed slots for more reads
+    }
+
+    int submitted = (int)syscall(__NR_io_uring_enter, ring.fd,
+                                 ring.unsubmitted, 1, IORING_ENTER_GETEVENTS,
+                                 NULL, 0);
+    if (submitted >= 0) {
+      ring.unsubmitted -= submitted;
+    } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      // The ring is broken; closing it cancels what is still out.
+      error = errno;
+      ring_close();
+      ring_state = -1;
+      errno = error;
+      return -1;
+    }
+
+    unsigned head = *ring.cq_head;
+    unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+      int index = (int)(cqe->user_data >> 1), result = cqe->res;
+      int is_write = (int)(cqe->user_data & 1);
+      Slot *slot = &slots[index];
+      in_flight--;
+      int retry = result == -EINTR || result == -EAGAIN;
+      if ((result < 0 && !retry) || (is_write && result == 0)) {
+        if (!error)
+          error = result < 0 ? -result : EIO;
+        if (is_write)
+          writing = 0;
+        continue;
+      }
+      if (is_write) {
+        if (result > 0)
+          slot->written += result;
+        if (slot->written < slot->filled && !error) {
+          ring_queue(1, out, index, slot->written,
+                     slot->filled - slot->written, -1);
+          in_flight++;
+        } else {
+          writing = 0;
+          finished++;
+        }
+        continue;
+      }
+      if (result > 0)
+        slot->filled += result;
+      if (result == 0) {
+        // The file is shorter than it was; stop where it ends now.
+        if (slot->offset + slot->filled < end)
+          end = slot->offset + slot->filled;
+        slot->read = 1;
+      } else if (slot->filled < slot->length && !error) {
+        ring_queue(0, in, index, slot->filled, slot->length - slot->filled,
+                   slot->offset + slot->filled);
+        in_flight++;
+      } else {
+        slot->read = 1;
+      }
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+  }
+  if (error) {
+    errno = error;
+    return -1;
+  }
+  // Leave the input where read() would have.
+  return lseek(in, end, SEEK_SET) == -1 ? -1 : 0;
+}
+
+// Where the ring is worth setting up: the rest of a regular file is more
+// than a chunk. Returns the remaining range, or 0.
+static int ring_range(int in, const struct stat *st, long long *start) {
+  if (!S_ISREG(st->st_mode))
+    return 0;
+  off_t at = lseek(in, 0, SEEK_CUR);
+  if (at == -1 || st->st_size - at <= CHUNK_SIZE || !ring_ready())
+    return 0;
+  *start = at;
+  return 1;
+}
+#endif
+
+// Copy the rest of in to out; 0 when done, -1 with errno set.
+int fileio_copy(int in, int out) {
+  struct stat in_st, out_st;
+  if (fstat(in, &in_st) == -1 || fstat(out, &out_st) == -1)
+    return -1;
+  if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode)) {
+    int copied = range_copy(in, out);
+    if (copied != 0)
+      return copied == 1 ? 0 : -1;
+  }
+#ifdef CSHELL_IO_URING
+  long long start;
+  if (ring_range(in, &in_st, &start) &&
+      ring_transfer(in, start, in_st.st_size, out, NULL) == -1)
+    return -1;
+#endif
+  // Whatever is left, should the file have grown meanwhile.
+  return stream(in, out, NULL, !S_ISREG(in_st.st_mode));
+}
+
+// The newlines in the rest of fd, or -1 with errno set.
+long long fileio_count_lines(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+    return -1;
+  long long lines = 0;
+#ifdef CSHELL_IO_URING
+  long long start;
+  if (ring_range(fd, &st, &start) &&
+      ring_transfer(fd, start, st.st_size, -1, &lines) == -1)
+    return -1;
+#endif
+  if (stream(fd, -1, &lines, !S_ISREG(st.st_mode)) == -1)
+    return -1;
+  return lines;
+}
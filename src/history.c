@@ -1,20 +1,33 @@
 #include "include/history.h"
+#include "include/lineedit.h"
+#include "include/stats.h"
 #include "utils.h"
-#include <ctype.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <termios.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 char history[MAX_HISTORY_SIZE][MAX_INPUT_SIZE];
 int history_count = 0;
 
+// Persistent history file; loading can be deferred until first use.
+static char *history_file = NULL;
+static int history_loaded = 1;
+static int history_file_complete = 1; // Every session entry reached the file
+
 void add_to_history(char *command, char history[][MAX_INPUT_SIZE],
                     int *history_count, int *current_history_index) {
   if (strlen(command) > 0 && strcmp(command, "\n") != 0) {
-    command[strcspn(command, "\n")] = 0;
-    strcpy(history[(*history_count) % MAX_HISTORY_SIZE], command);
+    // Multi-line commands are kept whole; overlong ones are truncated.
+    size_t len = strlen(command);
+    if (command[len - 1] == '\n')
+      len--;
+    if (len > MAX_INPUT_SIZE - 1)
+      len = MAX_INPUT_SIZE - 1;
+    memcpy(history[(*history_count) % MAX_HISTORY_SIZE], command, len);
+    history[(*history_count) % MAX_HISTORY_SIZE][len] = '\0';
 
     (*history_count)++;
     *current_history_index = *history_count;
@@ -53,107 +66,121 @@ char *get_history_entry(char history[][MAX_INPUT_SIZE], int history_count,
   return history[real_index];
 }
 
-// Get input with history support and basic line editing
-int get_input(char *buffer, char history[][MAX_INPUT_SIZE], int *history_count,
-              int *current_history_index) {
+// The history array is fixed in size; used is the text it holds.
+size_t history_bytes(size_t *used, size_t *entries) {
+  size_t live = history_count < MAX_HISTORY_SIZE ? (size_t)history_count
+                                                 : MAX_HISTORY_SIZE;
+  *used = 0;
+  for (size_t i = 0; i < live; i++)
+    *used += strlen(history[i]) + 1;
+  *entries = live;
+  return sizeof(history) + stats_block(history_file);
+}
 
-  static struct termios old_termios,
-      new_termios; // static to keep values between function calls
-
-  // Get current terminal settings
-  tcgetattr(STDIN_FILENO, &old_termios);
-  new_termios = old_termios;
-
-  // Disable canonical mode (line buffering) and echo
-  new_termios.c_lflag &= ~(ICANON | ECHO);
-  tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
-
-  int i = 0; // Current position in the buffer
-  int ch;
-  *current_history_index = *history_count; // Start at the end of history.
-  while (1) {
-    ch = getchar();
-
-    if (ch == EOF || ch == '\n') {
-      buffer[i] = '\0';
-      putchar('\n');
-      break;
-    } else if (ch == 127 || ch == 8) { //  Backspace or delete key
-      if (i > 0) {
-        printf("\b \b"); // Erase character from screen
-        fflush(stdout);
-        i--;
-      }
-    } else if (ch == 27) {         // Escape sequence (likely arrow key)
-      if (getchar() == 91) {       // Check for '['
-        int arrow_key = getchar(); // Get the actual arrow key code
-        if (arrow_key == 65) {     // Up arrow
-          if (*current_history_index > 0 && *history_count > 0) {
-            (*current_history_index)--;
-
-            // Clear the current line
-            printf("\033[2K\r"); //\033[2K -> erase entire line, \r move cursor
-                                 // to the begining
-            printf("cshell> ");
-            char *history_entry = get_history_entry(history, *history_count,
-                                                    *current_history_index);
-
-            if (history_entry) {
-              strcpy(buffer, history_entry);
-              i = strlen(buffer); // Update cursor position
-              printf("%s", buffer);
-              fflush(stdout);
-            } else {
-              (*current_history_index)++; // prevent index errors
-            }
-          }
-        } else if (arrow_key == 66) { // Down arrow
-          if (*current_history_index < *history_count) {
-            (*current_history_index)++;
-            printf("\033[2K\r");
-            printf("cshell> ");
-
-            if (*current_history_index == *history_count) {
-              // Clear the buffer if we're at the "new" command
-              buffer[0] = '\0';
-              i = 0;
-              printf("%s", buffer);
-              fflush(stdout);
-            } else {
-              char *history_entry = get_history_entry(history, *history_count,
-                                                      *current_history_index);
-
-              if (history_entry) {
-                strcpy(buffer, history_entry);
-                i = strlen(buffer); // Update cursor position
-                printf("%s", buffer);
-                fflush(stdout);
-              } else {
-                (*current_history_index)--;
-              }
-            }
-          }
-        }
-      }
-    } else if (isprint(ch)) { // Check if is a printable character
-      // Regular character, add to buffer
-      buffer[i++] = ch;
-      putchar(ch); // Echo character to screen
-      fflush(stdout);
-
-      if (i >= MAX_INPUT_SIZE - 1) {
-        print_error("Maximum line length exceeded.");
-        buffer[0] = '\0';
-        i = 0;
-        break;
-      }
+// Remember where history is persisted. With defer set the file is not read
+// until history_ensure_loaded() is first called.
+void history_set_file(const char *path, int defer) {
+  free(history_file);
+  history_file = path ? strdup(path) : NULL;
+  history_loaded = (history_file == NULL);
+  if (!defer)
+    history_ensure_loaded();
+}
+
+// Load the history file if that hasn't happened yet. Commands entered
+// before the load stay the newest entries. Returns 1 if it loaded now.
+int history_ensure_loaded(void) {
+  if (history_loaded)
+    return 0;
+  history_loaded = 1;
+
+  char *contents = read_file(history_file, NULL);
+  if (!contents)
+    return 1;
+
+  // Session entries already appended to the file come back with it.
+  int session_count = history_file_complete ? 0 : history_count;
+  int session_start =
+      (session_count > MAX_HISTORY_SIZE) ? session_count - MAX_HISTORY_SIZE : 0;
+  char(*session)[MAX_INPUT_SIZE] = NULL;
+  if (session_count > 0) {
+    session = malloc(sizeof(*session) * (session_count - session_start));
+    if (!session) {
+      perror("malloc failed");
+      exit(EXIT_FAILURE);
     }
+    for (int i = session_start; i < session_count; i++)
+      strcpy(session[i - session_start],
+             get_history_entry(history, history_count, i));
+  }
+
+  int index = 0;
+  char *saveptr;
+  history_count = 0;
+  for (char *line = strtok_r(contents, "\n", &saveptr); line != NULL;
+       line = strtok_r(NULL, "\n", &saveptr))
+    add_to_history(line, history, &history_count, &index);
+  for (int i = 0; i < session_count - session_start; i++)
+    add_to_history(session[i], history, &history_count, &index);
+
+  free(session);
+  free(contents);
+  return 1;
+}
+
+void history_append_file(const char *command) {
+  if (!history_file || command[0] == '\0')
+    return;
+  int fd = open(history_file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (fd == -1) {
+    history_file_complete = 0;
+    return;
+  }
+  // One writev() keeps concurrent shells from interleaving half lines.
+  struct iovec iov[2] = {{(void *)command, strlen(command)}, {"\n", 1}};
+  if (writev(fd, iov, 2) == -1) {
+    perror("history");
+    history_file_complete = 0;
   }
+  close(fd);
+}
 
-  buffer[i++] = '\n'; // Add the newline
-  buffer[i] = '\0';   // Null-terminate *after* the newline
+// Read one line of input without a size limit. On a terminal this runs the
+// line editor with history support; otherwise a plain line is read from
+// stdin. Returns a malloc'd line without the newline, or NULL at EOF.
+char *read_input(char history[][MAX_INPUT_SIZE], int *history_count,
+                 int *current_history_index) {
+  char *line = NULL;
+
+  if (isatty(fileno(stdin)))
+    return read_line(PROMPT, history, history_count, current_history_index);
+
+  size_t cap = 0;
+  ssize_t n = getline(&line, &cap, stdin);
+  if (n <= 0) {
+    free(line);
+    return NULL;
+  }
+  line[strcspn(line, "\n")] = '\0';
+  return line;
+}
+
+// Fixed-size variant of read_input() that keeps the trailing newline.
+int get_input(char *buffer, char history[][MAX_INPUT_SIZE], int *history_count,
+              int *current_history_index) {
+  char *line = read_input(history, history_count, current_history_index);
+  if (!line)
+    return 0;
+
+  size_t len = strlen(line);
+  if (len > MAX_INPUT_SIZE - 2) {
+    print_error("Maximum line length exceeded.");
+    len = 0;
+  }
+  memcpy(buffer, line, len);
+  free(line);
 
-  // Restore original terminal settings
-  tcsetattr(STDIN_FILENO, TCSANOW, &old_termios);
-  return i; // Return the length of the input
+  buffer[len++] = '\n'; // Add the newline
+  buffer[len] = '\0';   // Null-terminate *after* the newline
+  return len;           // Return the length of the input
 }
@@ -1,10 +1,36 @@
 #ifndef BUILTINS_H
 #define BUILTINS_H
 
+typedef struct {
+  const char *name;
+  int (*func)(char **args);
+} Builtin;
+
+extern const Builtin builtins[];
+extern const int builtin_count;
+
+int builtin_cat(char **args);
 int builtin_cd(char **args);
+int builtin_cp(char **args);
+int builtin_declare(char **args);
 int builtin_exit(char **args);
+int builtin_export(char **args);
 int builtin_help(char **args);
 int builtin_history(char **args);
+int builtin_jobs(char **args);
+int builtin_local(char **args);
+int builtin_mapfile(char **args);
+int builtin_read(char **args);
+int builtin_return(char **args);
+int builtin_set(char **args);
+int builtin_source(char **args);
+int builtin_stats(char **args);
+int builtin_ulimit(char **args);
+int builtin_unset(char **args);
+int builtin_wait(char **args);
+int builtin_wc(char **args);
+const Builtin *find_builtin(const char *name);
+const Builtin *find_file_builtin(char **argv);
 int executable_builtin(char **args, int argc);
 
 #endif // !BUILTINS_H
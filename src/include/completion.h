@@ -0,0 +1,22 @@
+#ifndef COMPLETION_H
+#define COMPLETION_H
+
+#include <stddef.h>
+
+#define PATH_RECHECK_SECONDS 2
+#define DIR_CACHE_SIZE 8
+
+typedef struct {
+  char **items;      // Replacement words, already escaped for the parser
+  size_t count;
+  size_t capacity;
+  size_t word_start; // Offset in the line where the completed word begins
+} Completions;
+
+size_t complete_word(const char *line, size_t cursor, Completions *out);
+void free_completions(Completions *completions);
+void path_index_refresh(void);
+void free_completion_caches(void);
+size_t completion_bytes(void);
+
+#endif // !COMPLETION_H
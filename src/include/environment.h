@@ -0,0 +1,13 @@
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#include <stddef.h>
+
+// The exported environment, kept ready to hand to execve().
+char **env_vector(void);
+const char *env_get(const char *name);
+void env_set(const char *name, const char *value);
+void env_unset(const char *name);
+size_t env_bytes(void);
+
+#endif // !ENVIRONMENT_H
@@ -0,0 +1,18 @@
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include "utils.h"
+#include <sys/types.h>
+
+extern pid_t foreground_pid; // Process group of the running pipeline
+extern int job_control;      // Give pipelines their own group and the tty
+extern int option_pipefail;  // set -o pipefail
+extern int option_argbatch;  // set -o argbatch
+extern int last_exit_status; // $?
+
+int decode_status(int status);
+int execute_command(Command *cmd);
+int execute_node(Node *node);
+char *command_output(const char *commands);
+
+#endif // !EXECUTOR_H
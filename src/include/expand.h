@@ -0,0 +1,25 @@
+#ifndef EXPAND_H
+#define EXPAND_H
+
+#include <stddef.h>
+
+// Growable argument vector, always NULL-terminated.
+typedef struct {
+  char **items;
+  int count;
+  int capacity;
+} ArgList;
+
+void arglist_init(ArgList *list);
+void arglist_push(ArgList *list, char *item);
+void arglist_free(ArgList *list);
+
+extern int expansion_failed; // ${name:?message} failed
+
+int expansion_aborted(int stop);
+int is_assignment(const char *word);
+char *expand_variables(const char *text);
+char *expand_word_single(const char *word);
+void expand_word(const char *word, ArgList *out);
+
+#endif // !EXPAND_H
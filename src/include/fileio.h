@@ -0,0 +1,15 @@
+#ifndef FILEIO_H
+#define FILEIO_H
+
+#include <signal.h>
+#include <stddef.h>
+
+extern int option_fileio; // set -o fileio
+// Set by the interactive shell's SIGINT handler; a copy in progress stops.
+extern volatile sig_atomic_t fileio_interrupted;
+
+int fileio_copy(int in, int out);
+long long fileio_count_lines(int fd);
+size_t count_newlines(const char *data, size_t len);
+
+#endif // !FILEIO_H
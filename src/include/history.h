@@ -10,6 +10,12 @@ void add_to_history(char *command, char history[][MAX_INPUT_SIZE],
 void print_history(char history[][MAX_INPUT_SIZE], int history_count);
 char *get_history_entry(char history[][MAX_INPUT_SIZE], int history_count,
                         int index);
+size_t history_bytes(size_t *used, size_t *entries);
+void history_set_file(const char *path, int defer);
+int history_ensure_loaded(void);
+void history_append_file(const char *command);
+char *read_input(char history[][MAX_INPUT_SIZE], int *history_count,
+                 int *current_history_index);
 int get_input(char *buffer, char history[][MAX_INPUT_SIZE], int *history_count,
               int *current_history_index);
 #endif // !HISTORY_H
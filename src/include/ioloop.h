@@ -0,0 +1,11 @@
+#ifndef IOLOOP_H
+#define IOLOOP_H
+
+// Called when a watched descriptor is readable or its writer has gone.
+typedef void (*IoHandler)(int fd, void *data);
+
+int ioloop_watch(int fd, IoHandler handler, void *data);
+void ioloop_unwatch(int fd);
+int ioloop_wait_fd(int fd, int timeout_ms);
+
+#endif // !IOLOOP_H
@@ -0,0 +1,26 @@
+#ifndef JOBLIMITS_H
+#define JOBLIMITS_H
+
+#include <sys/resource.h>
+#include <sys/time.h>
+
+// A pipeline run under 'limit': its quotas, where they are enforced, and
+// what the stages used.
+typedef struct {
+  long long memory;    // Bytes, 0 for no limit
+  int cpu;             // Thousandths of a CPU, 0 for no limit
+  char *cgroup;        // The job's own cgroup v2 directory, or NULL
+  int memory_enforced; // memory.max is set; otherwise stages get RLIMIT_AS
+  int cpu_enforced;    // cpu.max is set
+  long long max_rss;   // Largest stage, from rusage, in bytes
+  struct timeval cpu_time; // Summed over the stages, from rusage
+} JobLimits;
+
+long long limit_parse_size(const char *text);
+int limit_parse_cpu(const char *text);
+void job_limits_start(JobLimits *job, long long memory, int cpu);
+void job_limits_enter(const JobLimits *job);
+void job_limits_reaped(JobLimits *job, const struct rusage *usage);
+void job_limits_finish(JobLimits *job);
+
+#endif // !JOBLIMITS_H
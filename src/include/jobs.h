@@ -0,0 +1,18 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <sys/types.h>
+
+#define MAX_JOBS 64
+
+extern pid_t last_background_pid; // $!
+
+int job_add(pid_t pid, const char *command);
+void jobs_child_exited(pid_t pid, int status);
+pid_t job_lookup(const char *spec);
+int jobs_wait(pid_t pid);
+int jobs_finished(void);
+int jobs_notify(void);
+void jobs_print(void);
+
+#endif // !JOBS_H
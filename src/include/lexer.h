@@ -0,0 +1,66 @@
+#ifndef LEXER_H
+#define LEXER_H
+
+#include <stddef.h>
+
+typedef enum {
+  TOKEN_WORD,     // Word with its quoting kept; removed at expansion time
+  TOKEN_PIPE,     // |
+  TOKEN_AND,      // &&
+  TOKEN_OR,       // ||
+  TOKEN_SEMI,     // ;
+  TOKEN_AMP,      // &
+  TOKEN_LPAREN,   // (
+  TOKEN_RPAREN,   // )
+  TOKEN_REDIRECT, // < > >> <> >| >& <& &> &>> << <<- <<<
+  TOKEN_END,
+  TOKEN_ERROR
+} TokenType;
+
+typedef struct {
+  TokenType type;
+  char *text;    // Word or operator text (malloc'd), or the error message
+  int fd;        // Descriptor written before a redirect (2>), else -1
+  char *fd_name; // Variable written before a redirect ({name}>), or NULL
+  size_t offset; // Where the token starts in the input
+} Token;
+
+typedef struct {
+  const char *input;
+  size_t pos;
+} Lexer;
+
+// The first statement of a script, as found by statement_scan().
+typedef struct {
+  size_t length;    // Through the newline that ends it, or all of the text
+  size_t group_end; // Just past the first { } or ( ) group closed, or 0
+  int open;         // The text ends before the statement does
+  char *code;       // The statement without its here-document bodies
+  char *bodies;     // Those bodies, each through its delimiter line
+} Statement;
+
+// Where statement_pending_from() left text that a reader is still adding
+// lines to: the unfinished statement, and the scanner's state at the last
+// newline in it, so that only the lines after that are scanned again.
+// Zeroed, it starts from the beginning.
+typedef struct {
+  size_t start;     // Where the unfinished statement begins
+  size_t pos;       // Past the newline the scan resumes from, or 0
+  size_t group_end; // The rest is statement_scan()'s state there
+  int depth, command_start, separable, more, name_next, named;
+  int function_parens, seen;
+} ScanState;
+
+void lexer_init(Lexer *lexer, const char *input);
+TokenType lexer_next(Lexer *lexer, Token *token);
+TokenType lexer_peek(Lexer *lexer);
+size_t substitution_end(const char *text);
+size_t parameter_end(const char *text);
+size_t assignment_length(const char *word);
+void token_free(Token *token);
+void statement_scan(const char *text, Statement *statement);
+void statement_free(Statement *statement);
+int statement_pending(const char *text);
+int statement_pending_from(const char *text, ScanState *state);
+
+#endif // !LEXER_H
@@ -0,0 +1,40 @@
+#ifndef LINEEDIT_H
+#define LINEEDIT_H
+
+#include "utils.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define KILL_RING_SIZE 8
+
+// Gap buffer: the text lives in data[0, gap_start) and data[gap_end,
+// capacity). The cursor is always at gap_start, so inserting or deleting at
+// the cursor never moves the rest of the line.
+typedef struct {
+  char *data;
+  size_t gap_start;
+  size_t gap_end;
+  size_t capacity;
+} GapBuffer;
+
+void gap_init(GapBuffer *gb, size_t capacity);
+void gap_free(GapBuffer *gb);
+size_t gap_length(const GapBuffer *gb);
+char gap_at(const GapBuffer *gb, size_t pos);
+void gap_move(GapBuffer *gb, size_t pos);
+void gap_insert(GapBuffer *gb, const char *text, size_t len);
+void gap_delete(GapBuffer *gb, size_t len);
+void gap_backspace(GapBuffer *gb, size_t len);
+char *gap_substr(const GapBuffer *gb, size_t start, size_t end);
+void gap_set(GapBuffer *gb, const char *text);
+
+size_t utf8_decode(const char *s, size_t len, uint32_t *cp);
+int utf8_char_width(uint32_t cp);
+size_t utf8_display_width(const char *s, size_t len);
+size_t grapheme_next(const GapBuffer *gb, size_t pos);
+size_t grapheme_prev(const GapBuffer *gb, size_t pos);
+
+char *read_line(const char *prompt, char history[][MAX_INPUT_SIZE],
+                int *history_count, int *current_history_index);
+
+#endif // !LINEEDIT_H
@@ -0,0 +1,25 @@
+#ifndef SCRIPTCACHE_H
+#define SCRIPTCACHE_H
+
+#include "scripting.h"
+#include <sys/stat.h>
+#include <time.h>
+
+// A parsed script file, valid while the file keeps its identity, mtime and
+// size.
+typedef struct {
+  char *path;
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  off_t size;
+  ScriptElement *script;
+  int refs; // The cache's own, plus one per script_cache_open()
+} CachedScript;
+
+CachedScript *script_cache_open(const char *path, const char **origin);
+void script_cache_close(CachedScript *entry);
+int source_file(const char *path, const char **origin);
+size_t script_cache_bytes(int *count);
+
+#endif // !SCRIPTCACHE_H
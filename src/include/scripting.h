@@ -10,23 +10,55 @@ typedef enum {
   SCRIPT_WHILE,
   SCRIPT_FUNCTION,
   SCRIPT_RETURN,
-  SCRIPT_VARIABLE
+  SCRIPT_VARIABLE,
+  SCRIPT_SYNTAX_ERROR // A statement that failed to parse; already reported
 } ScriptElementType;
 
+typedef struct ShellFunction ShellFunction;
+
 typedef struct ScriptElement {
   ScriptElementType type;
   char *content;
-  Command *cmd;
+  Node *list;               // SCRIPT_COMMAND: the parsed command list
+  ShellFunction *function;  // SCRIPT_FUNCTION: the definition
   struct ScriptElement *condition;
   struct ScriptElement *body;
   struct ScriptElement *next;
 } ScriptElement;
 
+// A function's body outlives the script that defined it for as long as the
+// function table or a running call still holds it.
+struct ShellFunction {
+  char *name;
+  ScriptElement *body;
+  int refs;
+};
+
+typedef enum { ARRAY_INDEXED, ARRAY_ASSOCIATIVE } ArrayKind;
+
+// An indexed array is a vector of values with NULL where an element is
+// unset. An associative array keeps keys and values in parallel vectors,
+// found through an open-addressing hash of the keys.
+typedef struct {
+  char *name;
+  ArrayKind kind;
+  char **keys; // Associative only
+  char **values;
+  int count;    // Indexed: highest index + 1; associative: entries
+  int used;     // Elements set
+  int capacity;
+  int *slots; // Associative: position + 1, or 0 for a free slot
+  int slot_count;
+} ShellArray;
+
 typedef struct {
   char **variables;
   char **values;
   int var_count;
   int max_var_capacity;
+  ShellArray **arrays;
+  int array_count;
+  int array_capacity;
 } ScriptContext;
 
 ScriptElement *parse_script(const char *script_text);
@@ -37,4 +69,35 @@ void add_variable(ScriptContext *context, const char *name, const char *value);
 char *get_variable(ScriptContext *context, const char *name);
 void free_script_context(ScriptContext *context);
 
+void remove_variable(ScriptContext *context, const char *name);
+
+void set_shell_variable(const char *name, const char *value);
+const char *get_shell_variable(const char *name);
+void unset_shell_variable(const char *name);
+int assign_word(const char *word);
+
+ShellArray *find_array(const char *name);
+ShellArray **shell_arrays(int *count);
+char **shell_variable_names(int *count);
+ShellArray *declare_array(const char *name, ArrayKind kind);
+const char *array_get(const ShellArray *array, const char *subscript);
+void array_set(ShellArray *array, const char *subscript, const char *value);
+void array_append(ShellArray *array, const char *value);
+void array_unset(ShellArray *array, const char *subscript);
+void array_clear(ShellArray *array);
+
+size_t variable_bytes(int *scalars, int *arrays);
+size_t function_bytes(int *count);
+
+extern int function_returning;
+extern int script_aborted;
+ShellFunction *find_function(const char *name);
+int define_function_command(const Command *cmd);
+int call_function(ShellFunction *function, char **argv);
+int function_return(int status);
+int declare_local(const char *word);
+void set_script_arguments(char **args, int count);
+const char *positional_parameter(int n);
+int positional_count(void);
+
 #endif // !SCRIPTING_H
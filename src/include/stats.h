@@ -0,0 +1,51 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "scripting.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+// Subsystems whose allocations are counted for the stats builtin.
+typedef enum {
+  STATS_PARSER,
+  STATS_EXPAND,
+  STATS_VARIABLES,
+  STATS_ENVIRONMENT,
+  STATS_SCRIPT_CACHE,
+  STATS_COMPLETION,
+  STATS_SUBSYSTEMS
+} StatsSubsystem;
+
+typedef enum {
+  STATS_FORKS,
+  STATS_GLOBS,
+  STATS_GLOB_PATHS, // Paths the globs matched
+  STATS_SCRIPT_MEMORY_HITS,
+  STATS_SCRIPT_DISK_HITS,
+  STATS_SCRIPT_PARSES,
+  STATS_DIR_CACHE_HITS,
+  STATS_DIR_CACHE_MISSES,
+  STATS_EVENTS
+} StatsEvent;
+
+// The counters are compiled in with -DCSHELL_STATS=ON; without it these
+// cost nothing and stats reports memory only.
+#ifdef CSHELL_STATS
+extern unsigned long stats_allocations[STATS_SUBSYSTEMS];
+extern unsigned long stats_events[STATS_EVENTS];
+#define STATS_ALLOC(subsystem) (stats_allocations[subsystem]++)
+#define STATS_COUNT(event, n) (stats_events[event] += (n))
+#else
+#define STATS_ALLOC(subsystem) ((void)0)
+#define STATS_COUNT(event, n) ((void)0)
+#endif
+
+pid_t stats_fork(void);
+size_t stats_block(const void *ptr);
+size_t stats_node_bytes(const Node *node);
+size_t stats_script_bytes(const ScriptElement *element);
+void stats_report(FILE *out);
+void stats_reset(void);
+
+#endif // !STATS_H
@@ -0,0 +1,31 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <time.h>
+
+// Command.timed flags, set by the 'time' keyword.
+#define TIME_REPORT 1  // time pipeline
+#define TIME_POSIX 2   // time -p: POSIX output, totals only
+#define TIME_VERBOSE 4 // time -v: max RSS and performance counters too
+
+#define TIMING_COUNTERS 3
+
+typedef struct {
+  char *label; // The stage's command name
+  struct timespec start;
+  struct timespec end;
+  struct rusage usage;        // The stage's own, from wait4() or getrusage()
+  struct rusage self_before;  // In-process stages: the shell's usage at start
+  struct rusage child_before; // ... and its children's
+  int counter_fds[TIMING_COUNTERS];
+  long long counts[TIMING_COUNTERS]; // -1 where a counter could not be read
+} StageTiming;
+
+void timing_begin(StageTiming *timing, const char *label);
+void timing_attach_counters(StageTiming *timing, pid_t pid, int on_exec);
+void timing_end(StageTiming *timing, const struct rusage *usage);
+void timing_report(StageTiming *stages, int count, int flags);
+
+#endif // !TIMING_H
@@ -0,0 +1,27 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "utils.h"
+#include <sys/types.h>
+#include <time.h>
+
+#define TRACE_RING_SIZE 65536
+
+// One pipeline stage on its way into the trace: the record is started at
+// launch and completed when the stage is reaped.
+typedef struct {
+  char *record;
+  size_t len;
+  struct timespec started;
+} TraceStage;
+
+int trace_open(const char *target);
+int trace_enabled(void);
+long trace_next_pipeline(void);
+void trace_launch(TraceStage *stage, long pipeline, int index,
+                  const Command *cmd, char **argv, const char *kind, pid_t pid,
+                  const struct timespec *before_fork);
+void trace_finish(TraceStage *stage, int status);
+void trace_flush(void);
+
+#endif // !TRACE_H
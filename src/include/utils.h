@@ -1,26 +1,113 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <stddef.h>
 #include <stdio.h>
+#include <sys/types.h>
 
 #define MAX_HISTORY_SIZE 100
 #define MAX_INPUT_SIZE 1024
+#define PROMPT "cshell> "
+#define READ_CHUNK_SIZE 65536
+
+#define REDIRECT_FD_MAX 255 // Highest descriptor a redirection may name
+
+// Redirection.here_flags
+#define HERE_STRIP_TABS 1 // <<- : leading tabs are removed from body lines
+#define HERE_EXPAND 2     // Unquoted delimiter: expand variables in the body
+#define HERE_PENDING 4    // target is still the delimiter; body not read yet
+#define HERE_STRING 8     // <<< : target is a word, fed with a newline
+
+typedef enum {
+  REDIR_INPUT,     // n<file
+  REDIR_OUTPUT,    // n>file, n>|file
+  REDIR_APPEND,    // n>>file
+  REDIR_READWRITE, // n<>file
+  REDIR_DUP,       // n>&m, n<&m
+  REDIR_CLOSE,     // n>&-, n<&-
+  REDIR_HEREDOC    // n<<word, n<<-word, n<<<word
+} RedirectionType;
+
+typedef struct Redirection Redirection;
+
+struct Redirection {
+  RedirectionType type;
+  int fd;        // Descriptor being redirected
+  int target_fd; // Source descriptor for REDIR_DUP
+  char *target;  // File name word, or here-document body
+  int here_flags;
+  char *fd_name; // {name}>...: fd is chosen by the shell and stored in name
+
+  Redirection *next;
+};
 
 typedef struct Command Command;
+typedef struct Node Node;
 
 struct Command {
   char **args;
   int argc;
-  char *input_file;
-  char *output_file;
-  int append;
+  Redirection *redirs; // Applied in order, after the pipe ends
+  Node *group;         // ( list ) or { list } in place of args
+  char *function_name; // name() group: running it defines name as group
+  int subshell;        // group is ( list ): it always runs in a child
+  int timed;           // First stage only: TIME_* flags from 'time'
+  int limited;         // First stage only: run under 'limit'
+  long long mem_limit; // ... its --mem in bytes, 0 if none
+  int cpu_limit;       // ... its --cpu in thousandths of a CPU, 0 if none
   Command *next;
 };
 
-Command *parse_command(char *input);
+typedef enum {
+  NODE_PIPELINE, // pipeline
+  NODE_AND,      // left && right
+  NODE_OR,       // left || right
+  NODE_SEQUENCE,   // left ; right
+  NODE_BACKGROUND, // left &
+  NODE_COPROC      // coproc [name] left
+} NodeType;
+
+struct Node {
+  NodeType type;
+  Command *pipeline;
+  Node *left;
+  Node *right;
+  char *name; // NODE_COPROC: variable that receives the descriptors
+  char *text; // NODE_BACKGROUND, NODE_COPROC: source, for job listings
+};
+
+// Buffered line reader for non-interactive input. Lines are carved out of
+// large read() calls on a regular file, whose offset line_reader_sync()
+// moves back before a command runs; a pipe is looked into with tee() and
+// read up to the end of a line; anything else is read a byte at a time.
+// Commands run in between then see the rest of the input.
+typedef struct {
+  int fd;
+  char *buf;
+  size_t start;
+  size_t end;
+  size_t capacity;
+  int eof;
+  int mode;      // 'f' regular file, 'p' pipe, 0 byte at a time
+  int peek[2];   // Private pipe for tee(), always left empty
+  off_t offset;  // File offset of buf + end
+  off_t synced;  // Where line_reader_sync() left the offset, or -1
+} LineReader;
+
+Command *parse_command(const char *input);
+Node *parse_list(const char *input);
 void free_command(Command *cmd);
+void free_node(Node *node);
+Node *copy_node(const Node *node);
 void free_args(char **args);
 void print_error(const char *message);
+extern int option_globstar; // set -o globstar: ** matches directories
 char **expand_wildcards(const char *arg);
+void line_reader_init(LineReader *reader, int fd);
+char *line_reader_next(LineReader *reader);
+void line_reader_sync(LineReader *reader);
+void line_reader_free(LineReader *reader);
+char *read_file(const char *path, size_t *length);
+int read_exactly(int fd, char *buffer, size_t n);
 
 #endif // !UTILS_H
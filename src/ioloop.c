@@ -0,0 +1,94 @@
+#include "include/ioloop.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+
+#define IOLOOP_BATCH 16
+
+// Descriptors the shell keeps an eye on between commands (job notices and
+// the like). All of them share one epoll instance, created on first use.
+typedef struct {
+  int fd;
+  IoHandler handler;
+  void *data;
+} IoSource;
+
+static IoSource *sources = NULL;
+static int source_count = 0;
+static int source_capacity = 0;
+static int epoll_fd = -1;
+
+static IoSource *find_source(int fd) {
+  for (int i = 0; i < source_count; i++) {
+    if (sources[i].fd == fd)
+      return &sources[i];
+  }
+  return NULL;
+}
+
+int ioloop_watch(int fd, IoHandler handler, void *data) {
+  if (epoll_fd == -1 && (epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+    perror("epoll_create1");
+    return -1;
+  }
+  struct epoll_event event = {.events = EPOLLIN, .data.fd = fd};
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+    perror("epoll_ctl");
+    return -1;
+  }
+
+  if (source_count == source_capacity) {
+    source_capacity = source_capacity ? source_capacity * 2 : 4;
+    sources = realloc(sources, sizeof(IoSource) * source_capacity);
+    if (!sources) {
+      perror("realloc failed");
+      exit(EXIT_FAILURE);
+    }
+  }
+  sources[source_count].fd = fd;
+  sources[source_count].handler = handler;
+  sources[source_count].data = data;
+  source_count++;
+  return 0;
+}
+
+void ioloop_unwatch(int fd) {
+  IoSource *source = find_source(fd);
+  if (!source)
+    return;
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+  *source = sources[--source_count];
+}
+
+// Wait until fd is readable, running the handlers of watched descriptors
+// that become ready in the meantime. Returns 1 when fd is ready, 0 when
+// the wait ended for another source or timed out, -1 on error. With
+// nothing watched the caller's own blocking read does the waiting.
+int ioloop_wait_fd(int fd, int timeout_ms) {
+  if (source_count == 0)
+    return 1;
+
+  struct epoll_event event = {.events = EPOLLIN, .data.fd = fd};
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+    return 1; // Regular files cannot be polled; they are always ready
+
+  struct epoll_event ready[IOLOOP_BATCH];
+  int n;
+  do {
+    n = epoll_wait(epoll_fd, ready, IOLOOP_BATCH, timeout_ms);
+  } while (n == -1 && errno == EINTR);
+
+  int found = 0;
+  for (int i = 0; i < n; i++) {
+    if (ready[i].data.fd == fd) {
+      found = 1;
+      continue;
+    }
+    IoSource *source = find_source(ready[i].data.fd);
+    if (source)
+      source->handler(source->fd, source->data);
+  }
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+  return n == -1 ? -1 : found;
+}
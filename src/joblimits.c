@@ -0,0 +1,289 @@
+#include "include/joblimits.h"
+#include "include/scripting.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// limit [--mem SIZE] [--cpu N] pipeline: the stages go into a cgroup v2
+// directory of their own, made under $CSHELL_CGROUP or else the shell's
+// own cgroup, with memory.max and cpu.max set, and the job's peak memory
+// and CPU time are reported once it is reaped. Where the controllers are
+// not delegated to the shell, --mem falls back to RLIMIT_AS in each stage
+// and the report to the stages' rusage.
+
+#define CPU_PERIOD_USEC 100000
+
+static char *detected_base = NULL; // The shell's own cgroup, once found
+static int base_detected = 0;
+static unsigned job_sequence = 0;
+static int warned_memory = 0, warned_cpu = 0;
+
+long long limit_parse_size(const char *text) {
+  char *end;
+  double value = strtod(text, &end);
+  if (end == text || value <= 0)
+    return -1;
+  static const char units[] = "KMGT";
+  const char *unit = *end ? strchr(units, *end & ~0x20) : NULL;
+  if (unit) {
+    for (const char *u = units; u <= unit; u++)
+      value *= 1024;
+    end++;
+    if (strcasecmp(end, "iB") == 0)
+      end += 2;
+  }
+  if (strcasecmp(end, "B") == 0)
+    end++;
+  if (*end != '\0' || value >= 9.2e18)
+    return -1;
+  return (long long)value;
+}
+
+// A number of CPUs, possibly fractional, in thousandths; -1 if bad.
+int limit_parse_cpu(const char *text) {
+  char *end;
+  double value = strtod(text, &end);
+  if (end == text || *end != '\0' || value < 0.001 || value > 1e6)
+    return -1;
+  return (int)(value * 1000 + 0.5);
+}
+
+static int write_text(const char *dir, const char *name, const char *text) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  int fd = open(path, O_WRONLY | O_CLOEXEC);
+  if (fd == -1)
+    return -1;
+  ssize_t len = (ssize_t)strlen(text);
+  int result = write(fd, text, len) == len ? 0 : -1;
+  close(fd);
+  return result;
+}
+
+static int read_text(const char *dir, const char *name, char *text,
+                     size_t size) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return -1;
+  ssize_t n = read(fd, text, size - 1);
+  close(fd);
+  if (n < 0)
+    return -1;
+  text[n] = '\0';
+  return 0;
+}
+
+// The number after "key " in a flat-keyed file such as cpu.stat, or -1.
+static long long read_key(const char *dir, const char *name, const char *key) {
+  char text[1024];
+  if (read_text(dir, name, text, sizeof(text)) == -1)
+    return -1;
+  size_t len = strlen(key);
+  for (char *line = text; line && *line; line = strchr(line, '\n')) {
+    if (*line == '\n')
+      line++;
+    if (strncmp(line, key, len) == 0 && line[len] == ' ')
+      return atoll(line + len + 1);
+  }
+  return -1;
+}
+
+static int has_word(const char *list, const char *word) {
+  size_t len = strlen(word);
+  for (const char *p = list; (p = strstr(p, word)) != NULL; p += len) {
+    if ((p == list || p[-1] == ' ') &&
+        (p[len] == '\0' || p[len] == ' ' || p[len] == '\n'))
+      return 1;
+  }
+  return 0;
+}
+
+// Where the cgroup2 hierarchy is mounted, joined with the shell's place
+// in it.
+static char *detect_base(void) {
+  char line[4096], mount[PATH_MAX] = "", path[PATH_MAX] = "";
+  FILE *info = fopen("/proc/self/mountinfo", "re");
+  if (info) {
+    while (fgets(line, sizeof(line), info)) {
+      if (strstr(line, " - cgroup2 ") &&
+          sscanf(line, "%*s %*s %*s %*s %4095s", mount) == 1)
+        break;
+      mount[0] = '\0';
+    }
+    fclose(info);
+  }
+  FILE *self = fopen("/proc/self/cgroup", "re");
+  if (self) {
+    while (fgets(line, sizeof(line), self)) {
+      if (strncmp(line, "0::", 3) == 0) {
+        line[strcspn(line, "\n")] = '\0';
+        snprintf(path, sizeof(path), "%s", line + 3);
+        break;
+      }
+    }
+    fclose(self);
+  }
+  if (!mount[0] || !path[0])
+    return NULL;
+  char *base = malloc(strlen(mount) + strlen(path) + 1);
+  if (!base) {
+    perror("malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  strcpy(base, mount);
+  if (strcmp(path, "/") != 0)
+    strcat(base, path);
+  return base;
+}
+
+// Make the controller available to the cgroups below base.
+static int enable_controller(const char *base, const char *name) {
+  char text[512], change[32];
+  if (read_text(base, "cgroup.subtree_control", text, sizeof(text)) == 0 &&
+      has_word(text, name))
+    return 1;
+  if (read_text(base, "cgroup.controllers", text, sizeof(text)) == -1 ||
+      !has_word(text, name))
+    return 0;
+  snprintf(change, sizeof(change), "+%s", name);
+  return write_text(base, "cgroup.subtree_control", change) == 0;
+}
+
+void job_limits_start(JobLimits *job, long long memory, int cpu) {
+  memset(job, 0, sizeof(*job));
+  job->memory = memory;
+  job->cpu = cpu;
+
+  const char *base = get_shell_variable("CSHELL_CGROUP");
+  if (!base || !*base) {
+    if (!base_detected) {
+      detected_base = detect_base();
+      base_detected = 1;
+    }
+    base = detected_base;
+  }
+  int memory_controller = memory && base && enable_controller(base, "memory");
+  int cpu_controller = cpu && base && enable_controller(base, "cpu");
+
+  char path[PATH_MAX];
+  if (base) {
+    snprintf(path, sizeof(path), "%s/cshell-%d-%u", base, (int)getpid(),
+             ++job_sequence);
+    if (mkdir(path, 0755) == 0) {
+      job->cgroup = strdup(path);
+      if (!job->cgroup) {
+        perror("strdup failed");
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+  if (job->cgroup && memory_controller) {
+    char text[32];
+    snprintf(text, sizeof(text), "%lld", memory);
+    job->memory_enforced = write_text(path, "memory.max", text) == 0;
+  }
+  if (job->cgroup && cpu_controller) {
+    char text[48];
+    snprintf(text, sizeof(text), "%lld %d",
+             (long long)cpu * CPU_PERIOD_USEC / 1000, CPU_PERIOD_USEC);
+    job->cpu_enforced = write_text(path, "cpu.max", text) == 0;
+  }
+
+  if (memory && !job->memory_enforced && !warned_memory) {
+    fprintf(stderr, "cshell: limit: no cgroup v2 memory controller; "
+                    "--mem is applied as RLIMIT_AS\n");
+    warned_memory = 1;
+  }
+  if (cpu && !job->cpu_enforced && !warned_cpu) {
+    fprintf(stderr, "cshell: limit: no cgroup v2 cpu controller; "
+                    "--cpu is not enforced\n");
+    warned_cpu = 1;
+  }
+}
+
+// In each stage's child, before it runs anything.
+void job_limits_enter(const JobLimits *job) {
+  if (job->cgroup)
+    write_text(job->cgroup, "cgroup.procs", "0");
+  if (job->memory && !job->memory_enforced) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_AS, &limit) == 0) {
+      if (limit.rlim_max == RLIM_INFINITY ||
+          (rlim_t)job->memory < limit.rlim_max)
+        limit.rlim_cur = (rlim_t)job->memory;
+      setrlimit(RLIMIT_AS, &limit);
+    }
+  }
+}
+
+void job_limits_reaped(JobLimits *job, const struct rusage *usage) {
+  long long rss = (long long)usage->ru_maxrss * 1024;
+  if (rss > job->max_rss)
+    job->max_rss = rss;
+  timeradd(&job->cpu_time, &usage->ru_utime, &job->cpu_time);
+  timeradd(&job->cpu_time, &usage->ru_stime, &job->cpu_time);
+}
+
+static void format_bytes(long long bytes, char *out, size_t size) {
+  static const char units[] = "BKMGT";
+  double value = (double)bytes;
+  int unit = 0;
+  while (value >= 1024 && unit < 4) {
+    value /= 1024;
+    unit++;
+  }
+  if (unit == 0)
+    snprintf(out, size, "%lldB", bytes);
+  else
+    snprintf(out, size, "%.1f%c", value, units[unit]);
+}
+
+// Report what the job used, then remove its cgroup.
+void job_limits_finish(JobLimits *job) {
+  long long peak = -1, cpu_usec = -1, oom_kills = 0;
+  if (job->cgroup) {
+    char text[64];
+    if (read_text(job->cgroup, "memory.peak", text, sizeof(text)) == 0)
+      peak = atoll(text);
+    cpu_usec = read_key(job->cgroup, "cpu.stat", "usage_usec");
+    oom_kills = read_key(job->cgroup, "memory.events", "oom_kill");
+  }
+  const char *peak_kind = "peak memory";
+  if (peak < 0) {
+    peak = job->max_rss;
+    peak_kind = "peak rss";
+  }
+  if (cpu_usec < 0)
+    cpu_usec = (long long)job->cpu_time.tv_sec * 1000000 +
+               job->cpu_time.tv_usec;
+
+  char peak_text[16], limit_text[16];
+  format_bytes(peak, peak_text, sizeof(peak_text));
+  fprintf(stderr, "limit: %s %s", peak_kind, peak_text);
+  if (job->memory) {
+    format_bytes(job->memory, limit_text, sizeof(limit_text));
+    fprintf(stderr, " of %s", limit_text);
+  }
+  fprintf(stderr, ", cpu %.2fs", cpu_usec / 1e6);
+  if (job->cpu_enforced)
+    fprintf(stderr, " at %g CPUs", job->cpu / 1000.0);
+  if (oom_kills > 0)
+    fprintf(stderr, ", %lld killed for memory", oom_kills);
+  fputc('\n', stderr);
+
+  if (job->cgroup) {
+    if (rmdir(job->cgroup) == -1 && errno != ENOENT)
+      fprintf(stderr, "cshell: limit: %s: %s\n", job->cgroup,
+              strerror(errno));
+    free(job->cgroup);
+    job->cgroup = NULL;
+  }
+}
@@ -0,0 +1,183 @@
+#define _GNU_SOURCE // pipe2
+#include "include/jobs.h"
+#include "include/executor.h"
+#include "include/ioloop.h"
+#include "include/utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Background jobs and coprocesses. The SIGCHLD handler reaps them and
+// records their status here; the prompt reports them afterwards, and
+// 'wait' collects them.
+typedef struct {
+  pid_t pid; // 0 for a free slot
+  int id;    // %n
+  volatile sig_atomic_t done;
+  volatile sig_atomic_t status; // Raw wait status once done
+  char *command;
+} Job;
+
+static Job jobs[MAX_JOBS];
+static int notify_pipe[2] = {-1, -1};
+
+pid_t last_background_pid = 0;
+
+// A byte per finished job wakes the I/O loop; the prompt notices it there.
+static void drain_notices(int fd, void *data) {
+  (void)data;
+  char buf[64];
+  while (read(fd, buf, sizeof(buf)) > 0) {
+  }
+}
+
+static void release_job(Job *job) {
+  free(job->command);
+  job->command = NULL;
+  job->pid = 0;
+}
+
+int job_add(pid_t pid, const char *command) {
+  if (notify_pipe[0] == -1) {
+    if (pipe2(notify_pipe, O_CLOEXEC | O_NONBLOCK) == 0)
+      ioloop_watch(notify_pipe[0], drain_notices, NULL);
+  }
+
+  // Finished jobs nobody asked about give way to new ones when full.
+  Job *slot = NULL;
+  int id = 0;
+  for (int i = 0; i < MAX_JOBS; i++) {
+    if (jobs[i].pid == 0 && !slot)
+      slot = &jobs[i];
+    else if (jobs[i].pid != 0 && jobs[i].id > id)
+      id = jobs[i].id;
+  }
+  for (int i = 0; !slot && i < MAX_JOBS; i++) {
+    if (jobs[i].done) {
+      release_job(&jobs[i]);
+      slot = &jobs[i];
+    }
+  }
+  if (!slot) {
+    print_error("too many background jobs; this one is not tracked");
+    return -1;
+  }
+
+  slot->command = strdup(command);
+  if (!slot->command) {
+    perror("strdup failed");
+    exit(EXIT_FAILURE);
+  }
+  slot->id = id + 1;
+  slot->done = 0;
+  slot->status = 0;
+  slot->pid = pid; // Last, so the SIGCHLD handler sees a complete entry
+  return slot->id;
+}
+
+// Called from the SIGCHLD handler: only async-signal-safe work here.
+void jobs_child_exited(pid_t pid, int status) {
+  for (int i = 0; i < MAX_JOBS; i++) {
+    if (jobs[i].pid == pid && !jobs[i].done) {
+      jobs[i].status = status;
+      jobs[i].done = 1;
+      if (notify_pipe[1] != -1)
+        write(notify_pipe[1], "", 1);
+      return;
+    }
+  }
+}
+
+// "%n" names a job by number, anything else is a process ID. Returns 0 if
+// there is no such job.
+pid_t job_lookup(const char *spec) {
+  int id = spec[0] == '%' ? atoi(spec + 1) : 0;
+  pid_t pid = spec[0] == '%' ? 0 : (pid_t)atoi(spec);
+  for (int i = 0; i < MAX_JOBS; i++) {
+    if (jobs[i].pid != 0 && (jobs[i].id == id || jobs[i].pid == pid))
+      return jobs[i].pid;
+  }
+  return 0;
+}
+
+// Wait for one job, or for all of them when pid is 0, and forget them.
+// Returns the exit status of the last job waited for; 127 if pid is not a
+// job of this shell.
+int jobs_wait(pid_t pid) {
+  sigset_t block, saved_mask;
+  int status = pid ? 127 : 0;
+
+  // With SIGCHLD held off, a job is either already marked done or still
+  // ours to reap.
+  sigemptyset(&block);
+  sigaddset(&block, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &block, &saved_mask);
+  for (int i = 0; i < MAX_JOBS; i++) {
+    if (jobs[i].pid == 0 || (pid && jobs[i].pid != pid))
+      continue;
+    if (!jobs[i].done) {
+      int raw = 0;
+      pid_t waited;
+      while ((waited = waitpid(jobs[i].pid, &raw, 0)) == -1 &&
+             errno == EINTR) {
+      }
+      jobs[i].status = waited > 0 ? raw : 0;
+      jobs[i].done = 1;
+    }
+    status = decode_status(jobs[i].status);
+    release_job(&jobs[i]);
+  }
+  sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+  return status;
+}
+
+static void print_job(const Job *job) {
+  char state[64];
+  if (!job->done)
+    snprintf(state, sizeof(state), "Running");
+  else if (WIFSIGNALED(job->status))
+    snprintf(state, sizeof(state), "%s", strsignal(WTERMSIG(job->status)));
+  else if (WEXITSTATUS(job->status) != 0)
+    snprintf(state, sizeof(state), "Exit %d", WEXITSTATUS(job->status));
+  else
+    snprintf(state, sizeof(state), "Done");
+  printf("[%d]  %-24s%s\n", job->id, state, job->command);
+}
+
+int jobs_finished(void) {
+  int finished = 0;
+  for (int i = 0; i < MAX_JOBS; i++)
+    finished += jobs[i].pid != 0 && jobs[i].done;
+  return finished;
+}
+
+// Report jobs that finished since the last prompt; returns how many.
+int jobs_notify(void) {
+  int reported = 0;
+  for (int i = 0; i < MAX_JOBS; i++) {
+    if (jobs[i].pid != 0 && jobs[i].done) {
+      print_job(&jobs[i]);
+      release_job(&jobs[i]);
+      reported++;
+    }
+  }
+  if (reported)
+    fflush(stdout);
+  return reported;
+}
+
+// The 'jobs' listing; finished jobs are reported once and forgotten.
+void jobs_print(void) {
+  for (int i = 0; i < MAX_JOBS; i++) {
+    if (jobs[i].pid == 0)
+      continue;
+    print_job(&jobs[i]);
+    if (jobs[i].done)
+      release_job(&jobs[i]);
+  }
+}
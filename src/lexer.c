@@ -0,0 +1,607 @@
+#include "include/lexer.h"
+#include "include/utils.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Redirect operators, longest first so a prefix never shadows a longer one.
+static const char *const redirect_ops[] = {"&>>", "<<<", "<<-", ">>", "<>",
+                                           ">|",  ">&",  "<&",  "&>", "<<",
+                                           "<",   ">"};
+
+void lexer_init(Lexer *lexer, const char *input) {
+  lexer->input = input;
+  lexer->pos = 0;
+}
+
+static char *copy_text(const char *start, size_t len) {
+  char *text = strndup(start, len);
+  if (!text) {
+    perror("strndup failed");
+    exit(EXIT_FAILURE);
+  }
+  return text;
+}
+
+static size_t match_redirect(const char *p) {
+  for (size_t i = 0; i < sizeof(redirect_ops) / sizeof(redirect_ops[0]); i++) {
+    size_t len = strlen(redirect_ops[i]);
+    if (strncmp(p, redirect_ops[i], len) == 0)
+      return len;
+  }
+  return 0;
+}
+
+// List operators, again longest first.
+static const struct {
+  const char *text;
+  TokenType type;
+} list_ops[] = {{"&&", TOKEN_AND},  {"||", TOKEN_OR},     {"|", TOKEN_PIPE},
+                {";", TOKEN_SEMI},  {"&", TOKEN_AMP},     {"(", TOKEN_LPAREN},
+                {")", TOKEN_RPAREN}};
+
+static int is_word_end(const char *p) {
+  return *p == '\0' || isspace((unsigned char)*p) || strchr("|&;()", *p) ||
+         match_redirect(p) != 0;
+}
+
+static TokenType set_token(Token *token, TokenType type, char *text, int fd) {
+  token->type = type;
+  token->text = text;
+  token->fd = fd;
+  token->fd_name = NULL;
+  return type;
+}
+
+// Length of the $( ... ) starting at text, through the matching ')', or 0
+// when it is never closed. Quotes and nested parentheses are skipped.
+size_t substitution_end(const char *text) {
+  int depth = 0;
+  for (size_t i = 1; text[i]; i++) {
+    char c = text[i];
+    if (c == '\\' && text[i + 1]) {
+      i++;
+    } else if (c == '\'' || c == '"') {
+      size_t close = i + 1;
+      while (text[close] && text[close] != c) {
+        if (c == '"' && text[close] == '\\' && text[close + 1])
+          close++;
+        close++;
+      }
+      if (!text[close])
+        return 0;
+      i = close;
+    } else if (c == '(') {
+      depth++;
+    } else if (c == ')' && --depth == 0) {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+// Length of the ${ ... } starting at text, through the matching '}', or 0
+// when it is never closed. Quotes, $( ... ) and nested ${ ... } are
+// skipped.
+size_t parameter_end(const char *text) {
+  int depth = 0;
+  for (size_t i = 1; text[i]; i++) {
+    char c = text[i];
+    if (c == '\\' && text[i + 1]) {
+      i++;
+    } else if (c == '\'' || c == '"') {
+      size_t close = i + 1;
+      while (text[close] && text[close] != c) {
+        if (c == '"' && text[close] == '\\' && text[close + 1])
+          close++;
+        close++;
+      }
+      if (!text[close])
+        return 0;
+      i = close;
+    } else if (c == '$' && text[i + 1] == '(') {
+      size_t sub = substitution_end(text + i);
+      if (sub == 0)
+        return 0;
+      i += sub - 1;
+    } else if (c == '{') {
+      depth++;
+    } else if (c == '}' && --depth == 0) {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+// Length of the NAME=, NAME+=, NAME[subscript]= or NAME[subscript]+= that
+// starts word, or 0 if word is not an assignment.
+size_t assignment_length(const char *word) {
+  const char *p = word;
+  if (!isalpha((unsigned char)*p) && *p != '_')
+    return 0;
+  while (isalnum((unsigned char)*p) || *p == '_')
+    p++;
+  if (*p == '[') {
+    const char *close = strchr(p, ']');
+    if (!close || close == p + 1)
+      return 0;
+    p = close + 1;
+  }
+  if (*p == '+')
+    p++;
+  return *p == '=' ? (size_t)(p - word + 1) : 0;
+}
+
+// NAME=( or NAME+=( at pos: the list up to the matching ')' belongs to the
+// word.
+static int array_list_start(const char *input, size_t start, size_t pos) {
+  return input[pos] == '(' && pos > start &&
+         assignment_length(input + start) == pos - start &&
+         memchr(input + start, '[', pos - start) == NULL;
+}
+
+// {name} directly before a redirect: the shell picks the descriptor and
+// stores its number in name, or takes the number from it for >&-.
+static int is_fd_variable(const char *word, size_t len) {
+  if (len < 3 || word[0] != '{' || word[len - 1] != '}')
+    return 0;
+  size_t i = 1;
+  if (!isalpha((unsigned char)word[i]) && word[i] != '_')
+    return 0;
+  while (isalnum((unsigned char)word[i]) || word[i] == '_')
+    i++;
+  if (word[i] == '[') {
+    size_t digits = ++i;
+    while (isdigit((unsigned char)word[i]))
+      i++;
+    if (i == digits || word[i++] != ']')
+      return 0;
+  }
+  return i == len - 1;
+}
+
+// Past the blanks at pos, newlines included only if newlines is set. An
+// unquoted '#' where a word would start comments out the rest of the line
+// ("a#b", "$#" and "${#x}" are words), and a backslash-newline joins lines.
+static size_t skip_blanks(const char *input, size_t pos, int newlines) {
+  while (1) {
+    char c = input[pos];
+    if (c == '#')
+      pos += strcspn(input + pos, "\n");
+    else if (c == '\\' && input[pos + 1] == '\n')
+      pos += 2;
+    else if (isspace((unsigned char)c) && (newlines || c != '\n'))
+      pos++;
+    else
+      return pos;
+  }
+}
+
+// Read the next token. Words keep their quotes and backslashes so that
+// expansion can tell quoted text from unquoted text later.
+TokenType lexer_next(Lexer *lexer, Token *token) {
+  const char *input = lexer->input;
+  size_t pos = lexer->pos;
+
+  pos = skip_blanks(input, pos, 1);
+  token->offset = pos;
+
+  if (input[pos] == '\0') {
+    lexer->pos = pos;
+    return set_token(token, TOKEN_END, NULL, -1);
+  }
+
+  // &> and &>> are redirects, so they are tried before & and &&.
+  size_t op_len = match_redirect(input + pos);
+  if (op_len) {
+    lexer->pos = pos + op_len;
+    return set_token(token, TOKEN_REDIRECT, copy_text(input + pos, op_len),
+                     -1);
+  }
+
+  for (size_t i = 0; i < sizeof(list_ops) / sizeof(list_ops[0]); i++) {
+    size_t len = strlen(list_ops[i].text);
+    if (strncmp(input + pos, list_ops[i].text, len) == 0) {
+      lexer->pos = pos + len;
+      return set_token(token, list_ops[i].type, copy_text(input + pos, len),
+                       -1);
+    }
+  }
+
+  size_t start = pos;
+  while (!is_word_end(input + pos) || array_list_start(input, start, pos)) {
+    char c = input[pos];
+    if (c == '(') {
+      // Scanned like $( ... ) from the '=' before it
+      size_t list = substitution_end(input + pos - 1);
+      if (list == 0) {
+        lexer->pos = pos + strlen(input + pos);
+        return set_token(
+            token, TOKEN_ERROR,
+            copy_text("Syntax error: unterminated array assignment", 43),
+            -1);
+      }
+      pos += list - 1;
+    } else if (c == '\\') {
+      pos += input[pos + 1] ? 2 : 1;
+    } else if (c == '$' && input[pos + 1] == '(') {
+      size_t sub = substitution_end(input + pos);
+      if (sub == 0) {
+        lexer->pos = pos + strlen(input + pos);
+        return set_token(
+            token, TOKEN_ERROR,
+            copy_text("Syntax error: unterminated command substitution", 47),
+            -1);
+      }
+      pos += sub;
+    } else if (c == '$' && input[pos + 1] == '{') {
+      // A parameter expansion is one piece, operators and blanks included;
+      // unclosed, the characters count one by one.
+      size_t len = parameter_end(input + pos);
+      pos += len ? len : 1;
+    } else if (c == '\'' || c == '"') {
+      size_t close = pos + 1;
+      while (input[close] && input[close] != c) {
+        // Quotes inside "${x:-"a b"}" or "$(cmd "a b")" nest.
+        size_t inner = 1;
+        if (c == '"' && input[close] == '\\' && input[close + 1])
+          inner = 2;
+        else if (c == '"' && input[close] == '$' && input[close + 1] == '{')
+          inner = parameter_end(input + close);
+        else if (c == '"' && input[close] == '$' && input[close + 1] == '(')
+          inner = substitution_end(input + close);
+        close += inner ? inner : 1;
+      }
+      if (!input[close]) {
+        lexer->pos = close;
+        return set_token(token, TOKEN_ERROR,
+                         copy_text("Syntax error: unterminated quote", 32),
+                         -1);
+      }
+      pos = close + 1;
+    } else {
+      pos++;
+    }
+  }
+
+  // Digits directly followed by < or > name the descriptor being
+  // redirected: "2>err" is one redirect, "2 >err" is an argument and one.
+  size_t len = pos - start;
+  size_t digits = 0;
+  while (digits < len && isdigit((unsigned char)input[start + digits]))
+    digits++;
+  if (digits == len && (input[pos] == '<' || input[pos] == '>')) {
+    long fd = strtol(input + start, NULL, 10);
+    op_len = match_redirect(input + pos);
+    lexer->pos = pos + op_len;
+    if (len > 3 || fd > REDIRECT_FD_MAX)
+      return set_token(token, TOKEN_ERROR,
+                       copy_text("Syntax error: bad file descriptor", 33), -1);
+    return set_token(token, TOKEN_REDIRECT, copy_text(input + pos, op_len),
+                     (int)fd);
+  }
+
+  if (is_fd_variable(input + start, len) &&
+      (input[pos] == '<' || input[pos] == '>')) {
+    op_len = match_redirect(input + pos);
+    lexer->pos = pos + op_len;
+    set_token(token, TOKEN_REDIRECT, copy_text(input + pos, op_len), -1);
+    token->fd_name = copy_text(input + start + 1, len - 2);
+    return TOKEN_REDIRECT;
+  }
+
+  lexer->pos = pos;
+  return set_token(token, TOKEN_WORD, copy_text(input + start, len), -1);
+}
+
+// Type of the next token without consuming it.
+TokenType lexer_peek(Lexer *lexer) {
+  size_t pos = lexer->pos;
+  Token token;
+  TokenType type = lexer_next(lexer, &token);
+  token_free(&token);
+  lexer->pos = pos;
+  return type;
+}
+
+void token_free(Token *token) {
+  free(token->text);
+  free(token->fd_name);
+  token->text = NULL;
+  token->fd_name = NULL;
+}
+
+// --- Statements ---
+
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} TextBuffer;
+
+static void text_append(TextBuffer *buffer, const char *text, size_t n) {
+  if (buffer->len + n + 1 > buffer->cap) {
+    buffer->cap = buffer->cap ? buffer->cap : 128;
+    while (buffer->len + n + 1 > buffer->cap)
+      buffer->cap *= 2;
+    buffer->data = realloc(buffer->data, buffer->cap);
+    if (!buffer->data) {
+      perror("realloc failed");
+      exit(EXIT_FAILURE);
+    }
+  }
+  memcpy(buffer->data + buffer->len, text, n);
+  buffer->len += n;
+  buffer->data[buffer->len] = '\0';
+}
+
+typedef struct {
+  char *word; // Quotes removed, as parse_redirect() does
+  int strip_tabs;
+} HereDelimiter;
+
+// Skip the here-document bodies that start at pos, one per delimiter in
+// order, and return where the statement goes on; *missing is set when the
+// text runs out first.
+static size_t skip_here_bodies(const char *text, size_t pos,
+                               const HereDelimiter *heres, int count,
+                               int *missing) {
+  for (int i = 0; i < count; i++) {
+    size_t want = strlen(heres[i].word);
+    while (1) {
+      if (text[pos] == '\0') {
+        *missing = 1;
+        return pos;
+      }
+      const char *line = text + pos;
+      size_t len = strcspn(line, "\n");
+      pos += len + (line[len] == '\n');
+      if (heres[i].strip_tabs) {
+        size_t tabs = strspn(line, "\t");
+        line += tabs;
+        len -= tabs;
+      }
+      if (len == want && strncmp(line, heres[i].word, len) == 0)
+        break;
+    }
+  }
+  return pos;
+}
+
+// A word that ends the text in an unescaped backslash, before or after a
+// final newline, continues on the next line.
+static int ends_escaped(const char *word) {
+  size_t len = strlen(word);
+  if (len > 0 && word[len - 1] == '\n')
+    len--;
+  size_t run = 0;
+  while (run < len && word[len - 1 - run] == '\\')
+    run++;
+  return run % 2 == 1;
+}
+
+// Find where the first statement of text ends: at a newline outside quotes,
+// $( ... ), ${ ... }, NAME=( ... ), { ... } and ( ... ) groups, past a
+// trailing |, && or ||, and past the bodies of the here-documents opened
+// on its lines. Newlines that separate commands inside a group become ';'
+// in statement->code, which leaves the bodies out. With resume set, the
+// scan picks up from the state saved there and saves it again at each
+// newline; code and bodies then hold only the text scanned this time.
+static void scan_statement(const char *text, Statement *statement,
+                           ScanState *resume) {
+  size_t total = strlen(text);
+  TextBuffer code = {NULL, 0, 0}, bodies = {NULL, 0, 0};
+  HereDelimiter *heres = NULL;
+  int here_count = 0;
+  size_t copied = 0, end = total;
+  int depth = 0, open = 0, seen = 0;
+  int command_start = 1; // Where "{" and "}" are reserved words
+  int separable = 0;     // A newline here ends a command
+  int more = 0;          // After |, && or ||: the command goes on
+  int name_next = 0;     // After "function" or "coproc": that word
+  int named = 0;         // After the name of a "function"
+  int function_parens = 0, delimiter_next = 0, strip_tabs = 0;
+  Lexer lexer;
+
+  statement->group_end = 0;
+  text_append(&code, "", 0);
+  text_append(&bodies, "", 0);
+  lexer_init(&lexer, text);
+  if (resume && resume->pos) {
+    lexer.pos = copied = resume->pos;
+    statement->group_end = resume->group_end;
+    depth = resume->depth;
+    command_start = resume->command_start;
+    separable = resume->separable;
+    more = resume->more;
+    name_next = resume->name_next;
+    named = resume->named;
+    function_parens = resume->function_parens;
+    seen = resume->seen;
+  }
+  while (1) {
+    size_t pos = skip_blanks(text, lexer.pos, 0);
+    if (text[pos] == '\0' && pos >= 2 && pos > lexer.pos &&
+        text[pos - 2] == '\\' && text[pos - 1] == '\n') {
+      open = 1;
+      break;
+    }
+    if (text[pos] == '\n') {
+      text_append(&code, text + copied, pos - copied);
+      text_append(&code, depth > 0 && separable ? ";" : "\n", 1);
+      copied = ++pos;
+      if (here_count > 0) {
+        int missing = 0;
+        pos = skip_here_bodies(text, pos, heres, here_count, &missing);
+        text_append(&bodies, text + copied, pos - copied);
+        copied = pos;
+        while (here_count > 0)
+          free(heres[--here_count].word);
+        if (missing) {
+          open = 1;
+          break;
+        }
+      }
+      lexer.pos = pos;
+      if (separable) {
+        command_start = 1;
+        separable = 0;
+      }
+      if (seen && depth == 0 && !more) {
+        end = pos;
+        break;
+      }
+      if (resume) {
+        // Nothing up to here changes with the text that follows.
+        resume->pos = pos;
+        resume->group_end = statement->group_end;
+        resume->depth = depth;
+        resume->command_start = command_start;
+        resume->separable = separable;
+        resume->more = more;
+        resume->name_next = name_next;
+        resume->named = named;
+        resume->function_parens = function_parens;
+        resume->seen = seen;
+      }
+      continue;
+    }
+    lexer.pos = pos;
+    if (text[pos] == '\\' && text[pos + 1] == '\0') {
+      open = 1;
+      break;
+    }
+
+    Token token;
+    TokenType type = lexer_next(&lexer, &token);
+    if (type == TOKEN_END || (type == TOKEN_ERROR && lexer.pos >= total)) {
+      // An unterminated quote, $( or array list waits for more text.
+      open = type == TOKEN_ERROR || depth > 0 || more || delimiter_next ||
+             here_count > 0;
+      token_free(&token);
+      break;
+    }
+    seen = 1;
+    int starts = command_start;
+    int naming = name_next, after_name = named;
+    command_start = name_next = named = more = 0;
+    separable = 1;
+    if (type == TOKEN_PIPE || type == TOKEN_AND || type == TOKEN_OR) {
+      more = command_start = 1;
+      separable = 0;
+    } else if (type == TOKEN_SEMI || type == TOKEN_AMP) {
+      command_start = 1;
+      separable = 0;
+    } else if (type == TOKEN_LPAREN) {
+      // "name()" rather than a subshell when a word comes before it
+      if (starts && !after_name)
+        depth++;
+      else
+        function_parens = 1;
+      command_start = 1;
+      separable = 0;
+    } else if (type == TOKEN_RPAREN) {
+      if (function_parens) {
+        function_parens = separable = 0;
+      } else if (depth > 0 && --depth == 0 && !statement->group_end) {
+        statement->group_end = lexer.pos;
+      }
+      command_start = 1;
+    } else if (type == TOKEN_REDIRECT) {
+      if (strcmp(token.text, "<<") == 0 || strcmp(token.text, "<<-") == 0) {
+        delimiter_next = 1;
+        strip_tabs = token.text[2] == '-';
+      }
+      command_start = starts;
+      separable = 0;
+    } else if (type == TOKEN_WORD && delimiter_next) {
+      heres = realloc(heres, (here_count + 1) * sizeof(HereDelimiter));
+      if (!heres) {
+        perror("realloc failed");
+        exit(EXIT_FAILURE);
+      }
+      size_t out = 0;
+      for (size_t i = 0; token.text[i]; i++) {
+        if (!strchr("'\"\\", token.text[i]))
+          token.text[out++] = token.text[i];
+      }
+      token.text[out] = '\0';
+      heres[here_count].word = token.text;
+      heres[here_count++].strip_tabs = strip_tabs;
+      token.text = NULL;
+      delimiter_next = 0;
+    } else if (type == TOKEN_WORD && starts && strcmp(token.text, "{") == 0) {
+      depth++;
+      command_start = 1;
+      separable = 0;
+    } else if (type == TOKEN_WORD && starts && depth > 0 &&
+               strcmp(token.text, "}") == 0) {
+      if (--depth == 0 && !statement->group_end)
+        statement->group_end = lexer.pos;
+      command_start = 1;
+    } else if (type == TOKEN_WORD && starts &&
+               (strcmp(token.text, "function") == 0 ||
+                strcmp(token.text, "coproc") == 0)) {
+      command_start = 1;
+      name_next = token.text[0] == 'f' ? 'f' : 'c';
+    } else if (type == TOKEN_WORD && starts &&
+               (strcmp(token.text, "time") == 0 ||
+                strcmp(token.text, "!") == 0)) {
+      command_start = 1;
+    } else if (type == TOKEN_WORD) {
+      // A function or coproc name may be followed by its body.
+      command_start = naming != 0;
+      named = naming == 'f';
+      if (lexer.pos == total && ends_escaped(token.text))
+        open = 1;
+    }
+    token_free(&token);
+    if (open)
+      break;
+  }
+
+  text_append(&code, text + copied, end - copied);
+  while (here_count > 0)
+    free(heres[--here_count].word);
+  free(heres);
+  statement->length = end;
+  statement->open = open;
+  statement->code = code.data;
+  statement->bodies = bodies.data;
+}
+
+void statement_scan(const char *text, Statement *statement) {
+  scan_statement(text, statement, NULL);
+}
+
+void statement_free(Statement *statement) {
+  free(statement->code);
+  free(statement->bodies);
+  statement->code = statement->bodies = NULL;
+}
+
+// Whether text stops partway through a statement, so that a reader has to
+// wait for more lines before running it.
+int statement_pending(const char *text) {
+  ScanState state = {0};
+  return statement_pending_from(text, &state);
+}
+
+// statement_pending() for text that only grows between calls: the scan
+// resumes from *state, which it leaves on the statement still open.
+int statement_pending_from(const char *text, ScanState *state) {
+  while (text[state->start]) {
+    Statement statement;
+    scan_statement(text + state->start, &statement, state);
+    int open = statement.open;
+    size_t length = statement.length;
+    statement_free(&statement);
+    if (open)
+      return 1;
+    size_t start = state->start + length;
+    *state = (ScanState){0};
+    state->start = start;
+  }
+  return 0;
+}
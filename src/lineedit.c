@@ -0,0 +1,1155 @@
+#define _GNU_SOURCE // memmem
+#include "include/lineedit.h"
+#include "include/completion.h"
+#include "include/history.h"
+#include "include/ioloop.h"
+#include "include/jobs.h"
+#include "include/lexer.h"
+#include "include/scripting.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define GAP_INITIAL_SIZE 256
+#define INPUT_CHUNK_SIZE 65536
+#define CONTINUATION_PROMPT "> "
+#define PASTE_END "\033[201~"
+#define PASTE_END_LEN 6
+#define CTRL_KEY(k) ((k) & 0x1f)
+#define ZERO_WIDTH_JOINER 0x200D
+
+// Keys that arrive as escape sequences are mapped above the byte range.
+enum {
+  KEY_LEFT = 1000,
+  KEY_RIGHT,
+  KEY_UP,
+  KEY_DOWN,
+  KEY_HOME,
+  KEY_END,
+  KEY_DELETE,
+  KEY_WORD_LEFT,
+  KEY_WORD_RIGHT,
+  KEY_KILL_WORD,
+  KEY_RUBOUT_WORD,
+  KEY_YANK_POP,
+  KEY_PASTE_START,
+  KEY_EVENT, // Something other than a key ended the wait
+  KEY_UNKNOWN
+};
+
+// --- Gap buffer ---
+
+void gap_init(GapBuffer *gb, size_t capacity) {
+  if (capacity < 16)
+    capacity = 16;
+  gb->data = malloc(capacity);
+  if (!gb->data) {
+    perror("malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  gb->capacity = capacity;
+  gb->gap_start = 0;
+  gb->gap_end = capacity;
+}
+
+void gap_free(GapBuffer *gb) {
+  free(gb->data);
+  gb->data = NULL;
+  gb->capacity = gb->gap_start = gb->gap_end = 0;
+}
+
+size_t gap_length(const GapBuffer *gb) {
+  return gb->capacity - (gb->gap_end - gb->gap_start);
+}
+
+char gap_at(const GapBuffer *gb, size_t pos) {
+  if (pos < gb->gap_start)
+    return gb->data[pos];
+  return gb->data[pos + (gb->gap_end - gb->gap_start)];
+}
+
+static void gap_grow(GapBuffer *gb, size_t needed) {
+  size_t length = gap_length(gb);
+  size_t capacity = gb->capacity;
+  while (capacity - length < needed)
+    capacity *= 2;
+
+  size_t tail = gb->capacity - gb->gap_end;
+  char *data = realloc(gb->data, capacity);
+  if (!data) {
+    perror("realloc failed");
+    exit(EXIT_FAILURE);
+  }
+  memmove(data + capacity - tail, data + gb->gap_end, tail);
+  gb->data = data;
+  gb->gap_end = capacity - tail;
+  gb->capacity = capacity;
+}
+
+void gap_move(GapBuffer *gb, size_t pos) {
+  size_t length = gap_length(gb);
+  if (pos > length)
+    pos = length;
+
+  if (pos < gb->gap_start) {
+    size_t n = gb->gap_start - pos;
+    memmove(gb->data + gb->gap_end - n, gb->data + pos, n);
+    gb->gap_start -= n;
+    gb->gap_end -= n;
+  } else if (pos > gb->gap_start) {
+    size_t n = pos - gb->gap_start;
+    memmove(gb->data + gb->gap_start, gb->data + gb->gap_end, n);
+    gb->gap_start += n;
+    gb->gap_end += n;
+  }
+}
+
+void gap_insert(GapBuffer *gb, const char *text, size_t len) {
+  if (gb->gap_end - gb->gap_start < len)
+    gap_grow(gb, len);
+  memcpy(gb->data + gb->gap_start, text, len);
+  gb->gap_start += len;
+}
+
+// Delete len bytes after the cursor.
+void gap_delete(GapBuffer *gb, size_t len) {
+  size_t available = gb->capacity - gb->gap_end;
+  gb->gap_end += (len > available) ? available : len;
+}
+
+// Delete len bytes before the cursor.
+void gap_backspace(GapBuffer *gb, size_t len) {
+  gb->gap_start -= (len > gb->gap_start) ? gb->gap_start : len;
+}
+
+char *gap_substr(const GapBuffer *gb, size_t start, size_t end) {
+  char *text = malloc(end - start + 1);
+  if (!text) {
+    perror("malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  size_t n = 0;
+  if (start < gb->gap_start) {
+    size_t stop = (end < gb->gap_start) ? end : gb->gap_start;
+    memcpy(text, gb->data + start, stop - start);
+    n = stop - start;
+    start = stop;
+  }
+  if (start < end) {
+    size_t gap = gb->gap_end - gb->gap_start;
+    memcpy(text + n, gb->data + start + gap, end - start);
+    n += end - start;
+  }
+  text[n] = '\0';
+  return text;
+}
+
+// Replace the whole buffer and leave the cursor at the end.
+void gap_set(GapBuffer *gb, const char *text) {
+  gb->gap_start = 0;
+  gb->gap_end = gb->capacity;
+  gap_insert(gb, text, strlen(text));
+}
+
+// --- UTF-8 and display width ---
+
+// Ranges of codepoints whose display width is not 1, sorted by start.
+// Width 0 covers combining marks and other grapheme extenders, width 2
+// covers East Asian wide/fullwidth characters and emoji.
+static const struct {
+  uint32_t first;
+  uint32_t last;
+  unsigned char width;
+} width_table[] = {
+    {0x0300, 0x036F, 0},   {0x0483, 0x0489, 0},   {0x0591, 0x05BD, 0},
+    {0x0610, 0x061A, 0},   {0x064B, 0x065F, 0},   {0x0670, 0x0670, 0},
+    {0x06D6, 0x06DC, 0},   {0x06DF, 0x06E4, 0},   {0x0900, 0x0902, 0},
+    {0x093A, 0x093C, 0},   {0x0941, 0x0948, 0},   {0x094D, 0x094D, 0},
+    {0x0E31, 0x0E31, 0},   {0x0E34, 0x0E3A, 0},   {0x0E47, 0x0E4E, 0},
+    {0x1100, 0x115F, 2},   {0x1AB0, 0x1AFF, 0},   {0x1DC0, 0x1DFF, 0},
+    {0x200B, 0x200F, 0},   {0x20D0, 0x20FF, 0},   {0x231A, 0x231B, 2},
+    {0x23E9, 0x23EC, 2},   {0x25FD, 0x25FE, 2},   {0x2614, 0x2615, 2},
+    {0x26AA, 0x26AB, 2},   {0x26BD, 0x26BE, 2},   {0x26F5, 0x26F5, 2},
+    {0x26FA, 0x26FA, 2},   {0x2705, 0x2705, 2},   {0x270A, 0x270B, 2},
+    {0x2728, 0x2728, 2},   {0x274C, 0x274C, 2},   {0x2753, 0x2755, 2},
+    {0x2795, 0x2797, 2},   {0x2E80, 0x303E, 2},   {0x3041, 0x33FF, 2},
+    {0x3400, 0x4DBF, 2},   {0x4E00, 0x9FFF, 2},   {0xA000, 0xA4CF, 2},
+    {0xAC00, 0xD7A3, 2},   {0xF900, 0xFAFF, 2},   {0xFE00, 0xFE0F, 0},
+    {0xFE20, 0xFE2F, 0},   {0xFE30, 0xFE4F, 2},   {0xFF00, 0xFF60, 2},
+    {0xFFE0, 0xFFE6, 2},   {0x1F004, 0x1F004, 2}, {0x1F0CF, 0x1F0CF, 2},
+    {0x1F18E, 0x1F18E, 2}, {0x1F191, 0x1F19A, 2}, {0x1F200, 0x1F251, 2},
+    {0x1F300, 0x1F3FA, 2}, {0x1F3FB, 0x1F3FF, 0}, {0x1F400, 0x1F64F, 2},
+    {0x1F680, 0x1F6FF, 2}, {0x1F7E0, 0x1F7EB, 2}, {0x1F900, 0x1F9FF, 2},
+    {0x1FA70, 0x1FAFF, 2}, {0x20000, 0x2FFFD, 2}, {0x30000, 0x3FFFD, 2},
+    {0xE0001, 0xE007F, 0}, {0xE0100, 0xE01EF, 0},
+};
+
+// Decode one codepoint. Malformed input consumes a single byte and yields
+// U+FFFD so the editor never gets stuck on bad bytes.
+size_t utf8_decode(const char *s, size_t len, uint32_t *cp) {
+  const unsigned char *u = (const unsigned char *)s;
+  size_t n;
+
+  if (len == 0) {
+    *cp = 0;
+    return 0;
+  }
+  if (u[0] < 0x80) {
+    *cp = u[0];
+    return 1;
+  } else if ((u[0] & 0xE0) == 0xC0) {
+    *cp = u[0] & 0x1F;
+    n = 2;
+  } else if ((u[0] & 0xF0) == 0xE0) {
+    *cp = u[0] & 0x0F;
+    n = 3;
+  } else if ((u[0] & 0xF8) == 0xF0) {
+    *cp = u[0] & 0x07;
+    n = 4;
+  } else {
+    *cp = 0xFFFD;
+    return 1;
+  }
+
+  if (n > len) {
+    *cp = 0xFFFD;
+    return 1;
+  }
+  for (size_t i = 1; i < n; i++) {
+    if ((u[i] & 0xC0) != 0x80) {
+      *cp = 0xFFFD;
+      return 1;
+    }
+    *cp = (*cp << 6) | (u[i] & 0x3F);
+  }
+  return n;
+}
+
+int utf8_char_width(uint32_t cp) {
+  if (cp < 0x20 || cp == 0x7F)
+    return 2; // Rendered in caret notation, e.g. ^I
+  if (cp < 0x300)
+    return 1;
+
+  size_t lo = 0;
+  size_t hi = sizeof(width_table) / sizeof(width_table[0]);
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (cp < width_table[mid].first)
+      hi = mid;
+    else if (cp > width_table[mid].last)
+      lo = mid + 1;
+    else
+      return width_table[mid].width;
+  }
+  return 1;
+}
+
+size_t utf8_display_width(const char *s, size_t len) {
+  size_t width = 0;
+  uint32_t cp;
+  while (len > 0) {
+    size_t n = utf8_decode(s, len, &cp);
+    width += utf8_char_width(cp);
+    s += n;
+    len -= n;
+  }
+  return width;
+}
+
+static size_t decode_at(const GapBuffer *gb, size_t pos, uint32_t *cp) {
+  char bytes[4];
+  size_t length = gap_length(gb);
+  size_t n = 0;
+  while (n < 4 && pos + n < length) {
+    bytes[n] = gap_at(gb, pos + n);
+    n++;
+  }
+  return utf8_decode(bytes, n, cp);
+}
+
+static int is_grapheme_extend(uint32_t cp) {
+  return cp >= 0x300 && utf8_char_width(cp) == 0;
+}
+
+static size_t codepoint_prev(const GapBuffer *gb, size_t pos) {
+  do {
+    pos--;
+  } while (pos > 0 && (gap_at(gb, pos) & 0xC0) == 0x80);
+  return pos;
+}
+
+// A grapheme is a base codepoint followed by any extenders (combining
+// marks, variation selectors, skin tones) and ZWJ-joined codepoints.
+size_t grapheme_next(const GapBuffer *gb, size_t pos) {
+  size_t length = gap_length(gb);
+  uint32_t cp;
+
+  if (pos >= length)
+    return length;
+  pos += decode_at(gb, pos, &cp);
+
+  int joined = (cp == ZERO_WIDTH_JOINER);
+  while (pos < length) {
+    size_t n = decode_at(gb, pos, &cp);
+    if (!joined && !is_grapheme_extend(cp))
+      break;
+    joined = (cp == ZERO_WIDTH_JOINER);
+    pos += n;
+  }
+  return pos;
+}
+
+size_t grapheme_prev(const GapBuffer *gb, size_t pos) {
+  if (pos == 0)
+    return 0;
+
+  size_t start = codepoint_prev(gb, pos);
+  while (start > 0) {
+    uint32_t cp, prev_cp;
+    size_t before = codepoint_prev(gb, start);
+    decode_at(gb, start, &cp);
+    decode_at(gb, before, &prev_cp);
+    if (!is_grapheme_extend(cp) && prev_cp != ZERO_WIDTH_JOINER)
+      break;
+    start = before;
+  }
+  return start;
+}
+
+static size_t range_width(const GapBuffer *gb, size_t start, size_t end) {
+  size_t width = 0;
+  uint32_t cp;
+  while (start < end) {
+    start += decode_at(gb, start, &cp);
+    width += utf8_char_width(cp);
+  }
+  return width;
+}
+
+// --- Terminal input ---
+
+static unsigned char input_buf[INPUT_CHUNK_SIZE];
+static size_t input_pos = 0;
+static size_t input_len = 0;
+
+static int read_byte(void) {
+  if (input_pos == input_len) {
+    ssize_t n;
+    do {
+      n = read(STDIN_FILENO, input_buf, sizeof(input_buf));
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0)
+      return EOF;
+    input_pos = 0;
+    input_len = (size_t)n;
+  }
+  return input_buf[input_pos++];
+}
+
+static int read_key(void) {
+  if (input_pos == input_len && ioloop_wait_fd(STDIN_FILENO, -1) == 0)
+    return KEY_EVENT;
+  int ch = read_byte();
+  if (ch != 27)
+    return ch;
+
+  int next = read_byte();
+  if (next == EOF)
+    return EOF;
+  if (next != '[' && next != 'O') {
+    // Meta (Alt) key combinations
+    switch (next) {
+    case 'b':
+      return KEY_WORD_LEFT;
+    case 'f':
+      return KEY_WORD_RIGHT;
+    case 'd':
+      return KEY_KILL_WORD;
+    case 'y':
+      return KEY_YANK_POP;
+    case 127:
+    case 8:
+      return KEY_RUBOUT_WORD;
+    default:
+      return KEY_UNKNOWN;
+    }
+  }
+
+  // CSI/SS3: numeric parameters separated by ';' and a final byte.
+  int params[2] = {0, 0};
+  int nparams = 0;
+  int final;
+  while ((final = read_byte()) != EOF) {
+    if (isdigit(final)) {
+      params[nparams < 2 ? nparams : 1] =
+          params[nparams < 2 ? nparams : 1] * 10 + (final - '0');
+    } else if (final == ';') {
+      nparams++;
+    } else {
+      break;
+    }
+  }
+  int ctrl = (nparams >= 1 && params[1] == 5);
+
+  switch (final) {
+  case 'A':
+    return KEY_UP;
+  case 'B':
+    return KEY_DOWN;
+  case 'C':
+    return ctrl ? KEY_WORD_RIGHT : KEY_RIGHT;
+  case 'D':
+    return ctrl ? KEY_WORD_LEFT : KEY_LEFT;
+  case 'H':
+    return KEY_HOME;
+  case 'F':
+    return KEY_END;
+  case '~':
+    switch (params[0]) {
+    case 1:
+    case 7:
+      return KEY_HOME;
+    case 4:
+    case 8:
+      return KEY_END;
+    case 3:
+      return KEY_DELETE;
+    case 200:
+      return KEY_PASTE_START;
+    }
+    return KEY_UNKNOWN;
+  default:
+    return KEY_UNKNOWN;
+  }
+}
+
+// Read a bracketed paste payload. Whatever is already buffered is taken
+// first; the rest arrives through large read() calls straight into a
+// growable buffer until the end marker shows up. Bytes typed after the
+// marker are handed back to the key reader.
+static char *read_paste(size_t *paste_len) {
+  size_t cap = INPUT_CHUNK_SIZE * 2;
+  size_t len = input_len - input_pos;
+  size_t scan = 0;
+  char *buf = malloc(cap);
+  char *end;
+
+  if (!buf) {
+    perror("malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(buf, input_buf + input_pos, len);
+  input_pos = input_len = 0;
+
+  while ((end = memmem(buf + scan, len - scan, PASTE_END, PASTE_END_LEN)) ==
+         NULL) {
+    scan = (len >= PASTE_END_LEN) ? len - PASTE_END_LEN + 1 : 0;
+    if (cap - len < INPUT_CHUNK_SIZE) {
+      cap *= 2;
+      char *grown = realloc(buf, cap);
+      if (!grown) {
+        perror("realloc failed");
+        exit(EXIT_FAILURE);
+      }
+      buf = grown;
+    }
+    ssize_t n = read(STDIN_FILENO, buf + len, INPUT_CHUNK_SIZE);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break; // Input ended mid-paste; keep what arrived
+    len += (size_t)n;
+  }
+
+  size_t payload = end ? (size_t)(end - buf) : len;
+  if (end) {
+    input_len = len - payload - PASTE_END_LEN;
+    memcpy(input_buf, end + PASTE_END_LEN, input_len);
+  }
+
+  // Terminals send CR for line breaks; store them as newlines.
+  size_t j = 0;
+  for (size_t i = 0; i < payload; i++) {
+    if (buf[i] == '\r') {
+      buf[j++] = '\n';
+      if (i + 1 < payload && buf[i + 1] == '\n')
+        i++;
+    } else {
+      buf[j++] = buf[i];
+    }
+  }
+  *paste_len = j;
+  return buf;
+}
+
+// --- Terminal output ---
+
+// All output for one keystroke is collected here and written at once.
+static struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} out;
+
+static void out_append(const char *s, size_t n) {
+  if (out.len + n > out.cap) {
+    size_t cap = out.cap ? out.cap : 256;
+    while (cap < out.len + n)
+      cap *= 2;
+    char *data = realloc(out.data, cap);
+    if (!data) {
+      perror("realloc failed");
+      exit(EXIT_FAILURE);
+    }
+    out.data = data;
+    out.cap = cap;
+  }
+  memcpy(out.data + out.len, s, n);
+  out.len += n;
+}
+
+static void out_str(const char *s) { out_append(s, strlen(s)); }
+
+static void out_printf(const char *fmt, ...) {
+  char tmp[64];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+  va_end(ap);
+  if (n > 0)
+    out_append(tmp, (size_t)n < sizeof(tmp) ? (size_t)n : sizeof(tmp) - 1);
+}
+
+static void out_flush(void) {
+  size_t written = 0;
+  while (written < out.len) {
+    ssize_t n = write(STDOUT_FILENO, out.data + written, out.len - written);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    written += (size_t)n;
+  }
+  out.len = 0;
+}
+
+// --- Editor ---
+
+typedef struct {
+  GapBuffer gb;
+  const char *prompt;
+  size_t prompt_width;
+  size_t cols;
+  size_t cursor_col; // Display column of the cursor, 0 = start of prompt
+  size_t end_col;    // Display column just past the last character
+} LineEditor;
+
+// The kill ring survives between lines, like readline's.
+static char *kill_ring[KILL_RING_SIZE];
+static int kill_head = 0;
+static int last_was_kill = 0;
+static int last_was_yank = 0;
+static int yank_index = 0;
+static size_t yank_len = 0;
+static int last_was_tab = 0;
+
+static size_t terminal_columns(void) {
+  struct winsize ws;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+    return ws.ws_col;
+  return 80;
+}
+
+static void emit_range(LineEditor *le, size_t start, size_t end) {
+  const GapBuffer *gb = &le->gb;
+  while (start < end) {
+    uint32_t cp;
+    size_t n = decode_at(gb, start, &cp);
+    if (cp < 0x20 || cp == 0x7F) {
+      char caret[2] = {'^', (char)(cp ^ 0x40)};
+      out_append(caret, 2);
+    } else {
+      for (size_t i = 0; i < n; i++) {
+        char c = gap_at(gb, start + i);
+        out_append(&c, 1);
+      }
+    }
+    start += n;
+  }
+}
+
+// Terminals defer the wrap after writing into the last column, which would
+// leave the real cursor one row above where we think it is.
+static void settle_wrap(LineEditor *le, size_t col) {
+  if (col > 0 && col % le->cols == 0)
+    out_str("\r\n");
+}
+
+static void move_cursor(LineEditor *le, size_t from, size_t to) {
+  size_t from_row = from / le->cols;
+  size_t to_row = to / le->cols;
+  if (from_row > to_row)
+    out_printf("\033[%zuA", from_row - to_row);
+  else if (to_row > from_row)
+    out_printf("\033[%zuB", to_row - from_row);
+  if (from_row == to_row) {
+    if (from > to)
+      out_printf("\033[%zuD", from - to);
+    else if (to > from)
+      out_printf("\033[%zuC", to - from);
+  } else if (from % le->cols != to % le->cols) {
+    out_str("\r");
+    if (to % le->cols)
+      out_printf("\033[%zuC", to % le->cols);
+  }
+}
+
+static int fits_one_row(const LineEditor *le) { return le->end_col < le->cols; }
+
+// Redraw from the cursor to the end of the line. Only the text after the
+// cursor is written, never the whole buffer.
+static void redraw_tail(LineEditor *le) {
+  emit_range(le, le->gb.gap_start, gap_length(&le->gb));
+  settle_wrap(le, le->end_col);
+  out_str("\033[J");
+  move_cursor(le, le->end_col, le->cursor_col);
+}
+
+static void redraw_all(LineEditor *le) {
+  move_cursor(le, le->cursor_col, 0);
+  out_str("\r");
+  out_str(le->prompt);
+  le->end_col = le->prompt_width + range_width(&le->gb, 0, gap_length(&le->gb));
+  emit_range(le, 0, gap_length(&le->gb));
+  settle_wrap(le, le->end_col);
+  out_str("\033[J");
+  le->cursor_col = le->prompt_width + range_width(&le->gb, 0, le->gb.gap_start);
+  move_cursor(le, le->end_col, le->cursor_col);
+}
+
+static void insert_text(LineEditor *le, const char *text, size_t len) {
+  size_t width = utf8_display_width(text, len);
+  int at_end = (le->gb.gap_end == le->gb.capacity);
+  size_t start = le->gb.gap_start;
+
+  gap_insert(&le->gb, text, len);
+  le->end_col += width;
+
+  if (at_end) {
+    emit_range(le, start, le->gb.gap_start);
+    le->cursor_col += width;
+    settle_wrap(le, le->cursor_col);
+  } else if (width > 0 && fits_one_row(le)) {
+    out_printf("\033[%zu@", width); // Open a hole, then fill it
+    emit_range(le, start, le->gb.gap_start);
+    le->cursor_col += width;
+  } else {
+    emit_range(le, start, le->gb.gap_start);
+    le->cursor_col += width;
+    settle_wrap(le, le->cursor_col);
+    redraw_tail(le);
+  }
+}
+
+// Delete the bytes in [start, end); the cursor must be at start or end.
+static void delete_range(LineEditor *le, size_t start, size_t end) {
+  size_t width = range_width(&le->gb, start, end);
+  int one_row = fits_one_row(le);
+
+  if (le->gb.gap_start == end) {
+    gap_backspace(&le->gb, end - start);
+    move_cursor(le, le->cursor_col, le->cursor_col - width);
+    le->cursor_col -= width;
+  } else {
+    gap_delete(&le->gb, end - start);
+  }
+  le->end_col -= width;
+
+  if (le->gb.gap_end == le->gb.capacity)
+    out_str("\033[J");
+  else if (width > 0 && one_row)
+    out_printf("\033[%zuP", width);
+  else
+    redraw_tail(le);
+}
+
+static void move_to(LineEditor *le, size_t pos) {
+  size_t cur = le->gb.gap_start;
+  size_t col;
+  if (pos == 0)
+    col = le->prompt_width;
+  else if (pos == gap_length(&le->gb))
+    col = le->end_col;
+  else if (pos < cur)
+    col = le->cursor_col - range_width(&le->gb, pos, cur);
+  else
+    col = le->cursor_col + range_width(&le->gb, cur, pos);
+
+  gap_move(&le->gb, pos);
+  move_cursor(le, le->cursor_col, col);
+  le->cursor_col = col;
+}
+
+static int is_word_byte(char c) {
+  return isalnum((unsigned char)c) || c == '_' || (unsigned char)c >= 0x80;
+}
+
+static size_t word_left(const GapBuffer *gb, size_t pos) {
+  while (pos > 0 && !is_word_byte(gap_at(gb, pos - 1)))
+    pos--;
+  while (pos > 0 && is_word_byte(gap_at(gb, pos - 1)))
+    pos--;
+  return pos;
+}
+
+static size_t word_right(const GapBuffer *gb, size_t pos) {
+  size_t length = gap_length(gb);
+  while (pos < length && !is_word_byte(gap_at(gb, pos)))
+    pos++;
+  while (pos < length && is_word_byte(gap_at(gb, pos)))
+    pos++;
+  return pos;
+}
+
+static size_t whitespace_word_left(const GapBuffer *gb, size_t pos) {
+  while (pos > 0 && isspace((unsigned char)gap_at(gb, pos - 1)))
+    pos--;
+  while (pos > 0 && !isspace((unsigned char)gap_at(gb, pos - 1)))
+    pos--;
+  return pos;
+}
+
+// Consecutive kills accumulate into one ring entry, as in emacs.
+static void kill_push(char *text, int prepend) {
+  if (last_was_kill && kill_ring[kill_head]) {
+    char *old = kill_ring[kill_head];
+    size_t old_len = strlen(old);
+    size_t text_len = strlen(text);
+    char *joined = malloc(old_len + text_len + 1);
+    if (!joined) {
+      perror("malloc failed");
+      exit(EXIT_FAILURE);
+    }
+    if (prepend) {
+      memcpy(joined, text, text_len);
+      memcpy(joined + text_len, old, old_len + 1);
+    } else {
+      memcpy(joined, old, old_len);
+      memcpy(joined + old_len, text, text_len + 1);
+    }
+    free(old);
+    free(text);
+    kill_ring[kill_head] = joined;
+    return;
+  }
+  kill_head = (kill_head + 1) % KILL_RING_SIZE;
+  free(kill_ring[kill_head]);
+  kill_ring[kill_head] = text;
+}
+
+static void kill_range(LineEditor *le, size_t start, size_t end, int prepend) {
+  if (start == end)
+    return;
+  kill_push(gap_substr(&le->gb, start, end), prepend);
+  delete_range(le, start, end);
+  last_was_kill = 1;
+}
+
+static void yank(LineEditor *le, int index) {
+  if (!kill_ring[index])
+    return;
+  yank_index = index;
+  yank_len = strlen(kill_ring[index]);
+  insert_text(le, kill_ring[index], yank_len);
+  last_was_yank = 1;
+}
+
+// File candidates are listed by their last path component.
+static const char *display_name(const char *item) {
+  size_t len = strlen(item);
+  const char *name = item;
+  for (size_t i = 0; i + 1 < len; i++) {
+    if (item[i] == '/')
+      name = item + i + 1;
+  }
+  return name;
+}
+
+// Print candidates in columns below the line, then redraw the line.
+static void list_completions(LineEditor *le, const Completions *c) {
+  size_t width = 0;
+  for (size_t i = 0; i < c->count; i++) {
+    size_t len = strlen(display_name(c->items[i]));
+    if (len > width)
+      width = len;
+  }
+  width += 2;
+  size_t per_row = le->cols / width ? le->cols / width : 1;
+
+  move_cursor(le, le->cursor_col, le->end_col);
+  out_str("\r\n");
+  for (size_t i = 0; i < c->count; i++) {
+    const char *name = display_name(c->items[i]);
+    out_str(name);
+    if ((i + 1) % per_row == 0 || i + 1 == c->count)
+      out_str("\r\n");
+    else
+      for (size_t pad = strlen(name); pad < width; pad++)
+        out_str(" ");
+  }
+  le->cursor_col = 0;
+  redraw_all(le);
+}
+
+// Replace the word before the cursor, only drawing what actually changed
+// when the completion extends what was typed.
+static void replace_word(LineEditor *le, const char *word, size_t word_len,
+                         const char *item, size_t len) {
+  if (len >= word_len && strncmp(word, item, word_len) == 0) {
+    insert_text(le, item + word_len, len - word_len);
+  } else {
+    delete_range(le, le->gb.gap_start - word_len, le->gb.gap_start);
+    insert_text(le, item, len);
+  }
+}
+
+// Tab: insert a unique match, extend to the longest common prefix, or list
+// the candidates on a second Tab.
+static void complete(LineEditor *le, int was_tab) {
+  Completions c;
+  char *line = gap_substr(&le->gb, 0, gap_length(&le->gb));
+  size_t cursor = le->gb.gap_start;
+
+  complete_word(line, cursor, &c);
+  size_t typed = cursor - c.word_start;
+
+  if (c.count == 0) {
+    out_str("\a");
+  } else if (c.count == 1) {
+    const char *item = c.items[0];
+    size_t len = strlen(item);
+    replace_word(le, line + c.word_start, typed, item, len);
+    if (len > 0 && item[len - 1] != '/')
+      insert_text(le, " ", 1);
+  } else {
+    size_t common = strlen(c.items[0]);
+    for (size_t i = 1; i < c.count; i++) {
+      size_t j = 0;
+      while (j < common && c.items[i][j] == c.items[0][j])
+        j++;
+      common = j;
+    }
+    if (common > typed) {
+      replace_word(le, line + c.word_start, typed, c.items[0], common);
+    } else if (was_tab) {
+      list_completions(le, &c);
+    } else {
+      out_str("\a");
+    }
+  }
+
+  free_completions(&c);
+  free(line);
+}
+
+static void replace_line(LineEditor *le, const char *text) {
+  gap_set(&le->gb, text);
+  redraw_all(le);
+}
+
+// Returns 1 when the text ends in an unescaped backslash, which joins the
+// next line on, and 2 while the statement is still open: a quote, $( ... ),
+// group or here-document, or a trailing | or &&. The newline is then kept
+// and the lines run as one statement.
+static int needs_continuation(const char *text) {
+  int in_single = 0, in_double = 0;
+  size_t len = strlen(text);
+
+  for (size_t i = 0; i < len; i++) {
+    char c = text[i];
+    if (in_single) {
+      if (c == '\'')
+        in_single = 0;
+    } else if (c == '\\') {
+      if (i + 1 == len)
+        return 1;
+      i++;
+    } else if (c == '\'' && !in_double) {
+      in_single = 1;
+    } else if (c == '"') {
+      in_double = !in_double;
+    }
+  }
+  return statement_pending(text) ? 2 : 0;
+}
+
+static void enable_raw_mode(struct termios *saved) {
+  struct termios raw;
+  tcgetattr(STDIN_FILENO, saved);
+  raw = *saved;
+  raw.c_iflag &= ~(IXON | ICRNL);
+  raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+  out_str("\033[?2004h"); // Bracketed paste on
+}
+
+static void start_segment(LineEditor *le, const char *prompt) {
+  le->prompt = prompt;
+  le->prompt_width = utf8_display_width(prompt, strlen(prompt));
+  le->cursor_col = le->end_col = le->prompt_width;
+  le->gb.gap_start = 0;
+  le->gb.gap_end = le->gb.capacity;
+  out_str(prompt);
+  out_flush();
+}
+
+static char *append_segment(char *accum, const char *segment, size_t len,
+                            int newline) {
+  size_t accum_len = accum ? strlen(accum) : 0;
+  char *joined = realloc(accum, accum_len + len + 2);
+  if (!joined) {
+    perror("realloc failed");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(joined + accum_len, segment, len);
+  if (newline)
+    joined[accum_len + len++] = '\n';
+  joined[accum_len + len] = '\0';
+  return joined;
+}
+
+// Interactive line editor. Returns a malloc'd line without the trailing
+// newline, or NULL on end of input.
+char *read_line(const char *prompt, char history[][MAX_INPUT_SIZE],
+                int *history_count, int *current_history_index) {
+  struct termios saved;
+  LineEditor le;
+  char *accum = NULL; // Completed continuation lines
+  char *saved_line = NULL;
+  char *result = NULL;
+
+  enable_raw_mode(&saved);
+  gap_init(&le.gb, GAP_INITIAL_SIZE);
+  le.cols = terminal_columns();
+  *current_history_index = *history_count;
+  start_segment(&le, prompt);
+
+  while (1) {
+    int key = read_key();
+    int was_kill = last_was_kill;
+    int was_yank = last_was_yank;
+    int was_tab = last_was_tab;
+    last_was_kill = last_was_yank = last_was_tab = 0;
+
+    if (key == EOF || (key == CTRL_KEY('d') && gap_length(&le.gb) == 0 &&
+                       accum == NULL)) {
+      out_str("\r\n");
+      break;
+    }
+
+    switch (key) {
+    case '\r':
+    case '\n': {
+      char *segment = gap_substr(&le.gb, 0, gap_length(&le.gb));
+      size_t len = strlen(segment);
+      char *full = append_segment(accum ? strdup(accum) : NULL, segment, len,
+                                  0);
+      int cont = needs_continuation(full);
+      free(full);
+
+      move_to(&le, gap_length(&le.gb));
+      out_str("\r\n");
+      if (cont) {
+        // A trailing backslash joins the lines; an open quote keeps the
+        // newline as part of the word.
+        accum = append_segment(accum, segment, cont == 1 ? len - 1 : len,
+                               cont == 2);
+        free(segment);
+        start_segment(&le, CONTINUATION_PROMPT);
+        continue;
+      }
+      result = append_segment(accum, segment, len, 0);
+      accum = NULL;
+      free(segment);
+      goto done;
+    }
+    case CTRL_KEY('c'):
+      out_str("^C\r\n");
+      free(accum);
+      accum = NULL;
+      result = strdup("");
+      goto done;
+    case 127:
+    case CTRL_KEY('h'):
+      if (le.gb.gap_start > 0)
+        delete_range(&le, grapheme_prev(&le.gb, le.gb.gap_start),
+                     le.gb.gap_start);
+      break;
+    case KEY_DELETE:
+    case CTRL_KEY('d'):
+      if (le.gb.gap_end < le.gb.capacity)
+        delete_range(&le, le.gb.gap_start,
+                     grapheme_next(&le.gb, le.gb.gap_start));
+      break;
+    case KEY_LEFT:
+    case CTRL_KEY('b'):
+      move_to(&le, grapheme_prev(&le.gb, le.gb.gap_start));
+      break;
+    case KEY_RIGHT:
+    case CTRL_KEY('f'):
+      move_to(&le, grapheme_next(&le.gb, le.gb.gap_start));
+      break;
+    case KEY_HOME:
+    case CTRL_KEY('a'):
+      move_to(&le, 0);
+      break;
+    case KEY_END:
+    case CTRL_KEY('e'):
+      move_to(&le, gap_length(&le.gb));
+      break;
+    case KEY_WORD_LEFT:
+      move_to(&le, word_left(&le.gb, le.gb.gap_start));
+      break;
+    case KEY_WORD_RIGHT:
+      move_to(&le, word_right(&le.gb, le.gb.gap_start));
+      break;
+    case CTRL_KEY('k'):
+      last_was_kill = was_kill;
+      kill_range(&le, le.gb.gap_start, gap_length(&le.gb), 0);
+      break;
+    case CTRL_KEY('u'):
+      last_was_kill = was_kill;
+      kill_range(&le, 0, le.gb.gap_start, 1);
+      break;
+    case CTRL_KEY('w'):
+      last_was_kill = was_kill;
+      kill_range(&le, whitespace_word_left(&le.gb, le.gb.gap_start),
+                 le.gb.gap_start, 1);
+      break;
+    case KEY_RUBOUT_WORD:
+      last_was_kill = was_kill;
+      kill_range(&le, word_left(&le.gb, le.gb.gap_start), le.gb.gap_start, 1);
+      break;
+    case KEY_KILL_WORD:
+      last_was_kill = was_kill;
+      kill_range(&le, le.gb.gap_start, word_right(&le.gb, le.gb.gap_start), 0);
+      break;
+    case CTRL_KEY('y'):
+      yank(&le, kill_head);
+      break;
+    case '\t':
+      complete(&le, was_tab);
+      last_was_tab = 1;
+      break;
+    case KEY_PASTE_START: {
+      // The whole payload is inserted and drawn once.
+      size_t len;
+      char *paste = read_paste(&len);
+      insert_text(&le, paste, len);
+      free(paste);
+      break;
+    }
+    case KEY_YANK_POP:
+      if (was_yank) {
+        int index = yank_index;
+        for (int i = 0; i < KILL_RING_SIZE; i++) {
+          index = (index + KILL_RING_SIZE - 1) % KILL_RING_SIZE;
+          if (kill_ring[index])
+            break;
+        }
+        delete_range(&le, le.gb.gap_start - yank_len, le.gb.gap_start);
+        yank(&le, index);
+      }
+      break;
+    case KEY_EVENT:
+      // A background job finished while the prompt was up: report it
+      // above the line being edited.
+      if (jobs_finished()) {
+        move_cursor(&le, le.cursor_col, 0);
+        out_str("\r\033[J");
+        out_flush();
+        jobs_notify();
+        le.cursor_col = 0;
+        redraw_all(&le);
+      }
+      break;
+    case CTRL_KEY('l'):
+      out_str("\033[H\033[2J");
+      le.cursor_col = 0;
+      redraw_all(&le);
+      break;
+    case KEY_UP:
+    case CTRL_KEY('p'):
+      if (history_ensure_loaded())
+        *current_history_index = *history_count;
+      if (*current_history_index > 0 && *history_count > 0) {
+        char *entry = get_history_entry(history, *history_count,
+                                        *current_history_index - 1);
+        if (entry) {
+          if (*current_history_index == *history_count) {
+            free(saved_line);
+            saved_line = gap_substr(&le.gb, 0, gap_length(&le.gb));
+          }
+          (*current_history_index)--;
+          replace_line(&le, entry);
+        }
+      }
+      break;
+    case KEY_DOWN:
+    case CTRL_KEY('n'):
+      if (*current_history_index < *history_count) {
+        (*current_history_index)++;
+        if (*current_history_index == *history_count) {
+          replace_line(&le, saved_line ? saved_line : "");
+        } else {
+          char *entry = get_history_entry(history, *history_count,
+                                          *current_history_index);
+          if (entry)
+            replace_line(&le, entry);
+        }
+      }
+      break;
+    default:
+      if (key >= 0x80 && key < 0x100) {
+        // Collect the rest of a multi-byte character before inserting it
+        char bytes[4] = {(char)key};
+        size_t n = 1;
+        size_t expected = (key & 0xE0) == 0xC0   ? 2
+                          : (key & 0xF0) == 0xE0 ? 3
+                          : (key & 0xF8) == 0xF0 ? 4
+                                                 : 1;
+        while (n < expected) {
+          int next = read_byte();
+          if (next == EOF)
+            break;
+          bytes[n++] = (char)next;
+        }
+        insert_text(&le, bytes, n);
+      } else if (key >= 0x20 && key < 0x7F) {
+        char c = (char)key;
+        insert_text(&le, &c, 1);
+      }
+      break;
+    }
+    out_flush();
+  }
+
+done:
+  out_str("\033[?2004l"); // Bracketed paste off
+  out_flush();
+  free(accum);
+  free(saved_line);
+  gap_free(&le.gb);
+  tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+  return result;
+}
@@ -0,0 +1,604 @@
+#include "include/joblimits.h"
+#include "include/lexer.h"
+#include "include/stats.h"
+#include "include/timing.h"
+#include "include/utils.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Recursive descent over the token stream with one token of lookahead:
+//
+//   list     := and_or ((';' | '&') and_or)* [';' | '&']
+//   and_or   := pipeline (('&&' | '||') pipeline)*
+//   pipeline := ['time' [-p] [-v]] ['coproc' [name]] command ('|' command)*
+//   command  := '(' list ')' redirect* | '{' list '}' redirect*
+//             | (word | redirect)+
+typedef struct {
+  Lexer lexer;
+  Token token;
+  int error; // A syntax error has been reported
+} Parser;
+
+static Command *new_command(void) {
+  STATS_ALLOC(STATS_PARSER);
+  Command *cmd = malloc(sizeof(Command));
+  if (!cmd) {
+    perror("malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  cmd->args = malloc(sizeof(char *));
+  if (!cmd->args) {
+    perror("malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  cmd->argc = 0;
+  cmd->args[0] = NULL;
+  cmd->redirs = NULL;
+  cmd->group = NULL;
+  cmd->function_name = NULL;
+  cmd->subshell = 0;
+  cmd->timed = 0;
+  cmd->limited = 0;
+  cmd->mem_limit = 0;
+  cmd->cpu_limit = 0;
+  cmd->next = NULL;
+  return cmd;
+}
+
+static void add_redirection(Command *cmd, RedirectionType type, int fd,
+                            int target_fd, char *target, int here_flags) {
+  STATS_ALLOC(STATS_PARSER);
+  Redirection *redir = malloc(sizeof(Redirection));
+  if (!redir) {
+    perror("malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  redir->type = type;
+  redir->fd = fd;
+  redir->target_fd = target_fd;
+  redir->target = target;
+  redir->here_flags = here_flags;
+  redir->fd_name = NULL;
+  redir->next = NULL;
+
+  Redirection **tail = &cmd->redirs;
+  while (*tail)
+    tail = &(*tail)->next;
+  *tail = redir;
+}
+
+static int is_number(const char *text) {
+  if (*text == '\0')
+    return 0;
+  for (; *text; text++) {
+    if (*text < '0' || *text > '9')
+      return 0;
+  }
+  return 1;
+}
+
+// Turn a redirect operator and its word into redirections; the word is
+// taken over. Returns -1 on a syntax error.
+static int parse_redirect(Command *cmd, const Token *op, char *word) {
+  const char *text = op->text;
+  int fd = op->fd != -1 ? op->fd : (text[0] == '<' ? 0 : 1);
+
+  if (strcmp(text, "<") == 0) {
+    add_redirection(cmd, REDIR_INPUT, fd, -1, word, 0);
+  } else if (strcmp(text, ">") == 0 || strcmp(text, ">|") == 0) {
+    add_redirection(cmd, REDIR_OUTPUT, fd, -1, word, 0);
+  } else if (strcmp(text, ">>") == 0) {
+    add_redirection(cmd, REDIR_APPEND, fd, -1, word, 0);
+  } else if (strcmp(text, "<>") == 0) {
+    add_redirection(cmd, REDIR_READWRITE, fd, -1, word, 0);
+  } else if (strcmp(text, ">&") == 0 || strcmp(text, "<&") == 0) {
+    if (strcmp(word, "-") == 0) {
+      add_redirection(cmd, REDIR_CLOSE, fd, -1, NULL, 0);
+    } else if (is_number(word) && strlen(word) <= 3 &&
+               atoi(word) <= REDIRECT_FD_MAX) {
+      add_redirection(cmd, REDIR_DUP, fd, atoi(word), NULL, 0);
+    } else if (is_number(word) || strchr(word, '$')) {
+      // >&$fd: the descriptor is known only once the word is expanded. One
+      // out of range is refused then, like a closed one, not taken for a
+      // file name.
+      add_redirection(cmd, REDIR_DUP, fd, -1, word, 0);
+      return 0;
+    } else if (text[0] == '>' && op->fd == -1 && op->fd_name == NULL) {
+      // >&file is the old spelling of &>file.
+      add_redirection(cmd, REDIR_OUTPUT, 1, -1, word, 0);
+      add_redirection(cmd, REDIR_DUP, 2, 1, NULL, 0);
+      return 0;
+    } else {
+      print_error("Syntax error: bad file descriptor for duplication");
+      free(word);
+      return -1;
+    }
+    free(word);
+  } else if (strcmp(text, "&>") == 0 || strcmp(text, "&>>") == 0) {
+    add_redirection(cmd, text[2] ? REDIR_APPEND : REDIR_OUTPUT, 1, -1, word,
+                    0);
+    add_redirection(cmd, REDIR_DUP, 2, 1, NULL, 0);
+  } else if (strcmp(text, "<<<") == 0) {
+    add_redirection(cmd, REDIR_HEREDOC, fd, -1, word, HERE_STRING);
+  } else {
+    // <<WORD and <<-WORD: the body comes from the following lines and is
+    // filled in by parse_script(). Quoting the delimiter turns off
+    // expansion in the body.
+    int flags = HERE_PENDING | (text[2] == '-' ? HERE_STRIP_TABS : 0);
+    size_t out = 0, len = strlen(word);
+    for (size_t i = 0; i < len; i++) {
+      if (word[i] != '\'' && word[i] != '"' && word[i] != '\\')
+        word[out++] = word[i];
+    }
+    word[out] = '\0';
+    if (out == len)
+      flags |= HERE_EXPAND;
+    add_redirection(cmd, REDIR_HEREDOC, fd, -1, word, flags);
+  }
+  return 0;
+}
+
+static void syntax_error(Parser *parser, const char *message) {
+  if (!parser->error)
+    print_error(message);
+  parser->error = 1;
+}
+
+static void advance(Parser *parser) {
+  token_free(&parser->token);
+  if (lexer_next(&parser->lexer, &parser->token) == TOKEN_ERROR)
+    syntax_error(parser, parser->token.text);
+}
+
+static void unexpected(Parser *parser) {
+  char message[128];
+  snprintf(message, sizeof(message), "Syntax error: unexpected '%s'",
+           parser->token.text ? parser->token.text : "end of input");
+  syntax_error(parser, message);
+}
+
+// '{' and '}' are reserved words: special only where a command starts.
+static int at_word(Parser *parser, const char *word) {
+  return parser->token.type == TOKEN_WORD &&
+         strcmp(parser->token.text, word) == 0;
+}
+
+static int at_list_end(Parser *parser) {
+  return parser->token.type == TOKEN_END ||
+         parser->token.type == TOKEN_RPAREN || at_word(parser, "}");
+}
+
+static Node *new_node(NodeType type, Command *pipeline, Node *left,
+                      Node *right) {
+  STATS_ALLOC(STATS_PARSER);
+  Node *node = malloc(sizeof(Node));
+  if (!node) {
+    perror("malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  node->type = type;
+  node->pipeline = pipeline;
+  node->left = left;
+  node->right = right;
+  node->name = NULL;
+  node->text = NULL;
+  return node;
+}
+
+// The input from start up to the current token, for job listings.
+static char *source_text(Parser *parser, size_t start) {
+  size_t end = parser->token.offset;
+  while (end > start && isspace((unsigned char)parser->lexer.input[end - 1]))
+    end--;
+  char *text = strndup(parser->lexer.input + start, end - start);
+  if (!text) {
+    perror("strndup failed");
+    exit(EXIT_FAILURE);
+  }
+  return text;
+}
+
+static Node *parse_and_or(Parser *parser);
+
+static Node *parse_list_tokens(Parser *parser) {
+  Node *list = NULL;
+  while (1) {
+    size_t start = parser->token.offset;
+    Node *item = parse_and_or(parser);
+    if (!parser->error && parser->token.type == TOKEN_AMP) {
+      item = new_node(NODE_BACKGROUND, NULL, item, NULL);
+      item->text = source_text(parser, start);
+    }
+    list = list ? new_node(NODE_SEQUENCE, NULL, list, item) : item;
+    if (parser->error || (parser->token.type != TOKEN_SEMI &&
+                          parser->token.type != TOKEN_AMP))
+      break;
+    advance(parser);
+    if (at_list_end(parser))
+      break;
+  }
+  return list;
+}
+
+// Redirections are collected until something else turns up.
+static void parse_redirections(Parser *parser, Command *cmd) {
+  while (!parser->error && parser->token.type == TOKEN_REDIRECT) {
+    Token op = parser->token;
+    parser->token.text = NULL;
+    parser->token.fd_name = NULL;
+    advance(parser);
+    if (parser->error || parser->token.type != TOKEN_WORD) {
+      char message[128];
+      snprintf(message, sizeof(message),
+               "Syntax error: Expected file name after %s", op.text);
+      syntax_error(parser, message);
+      token_free(&op);
+      return;
+    }
+    char *word = parser->token.text;
+    parser->token.text = NULL;
+    if (parse_redirect(cmd, &op, word) == -1) {
+      parser->error = 1;
+    } else if (op.fd_name) {
+      // One redirection per operator once &> and >&file are ruled out.
+      Redirection *last = cmd->redirs;
+      while (last->next)
+        last = last->next;
+      last->fd_name = op.fd_name;
+      op.fd_name = NULL;
+    }
+    token_free(&op);
+    advance(parser);
+  }
+}
+
+static int is_function_name(const char *word) {
+  if (!isalpha((unsigned char)*word) && *word != '_')
+    return 0;
+  while (isalnum((unsigned char)*word) || *word == '_' || *word == '-')
+    word++;
+  return *word == '\0';
+}
+
+// name ( ) or function name [( )] where a command starts: takes the name
+// and leaves the parser on the body, or returns NULL having consumed
+// nothing.
+static char *parse_function_header(Parser *parser) {
+  if (parser->token.type != TOKEN_WORD)
+    return NULL;
+  int keyword = strcmp(parser->token.text, "function") == 0;
+  Lexer ahead = parser->lexer;
+  Token next[3];
+  for (int i = 0; i < 3; i++)
+    lexer_next(&ahead, &next[i]);
+
+  int length = 0; // Tokens in the header after the current one
+  if (keyword && next[0].type == TOKEN_WORD &&
+      is_function_name(next[0].text)) {
+    if (next[1].type != TOKEN_LPAREN)
+      length = 1;
+    else if (next[2].type == TOKEN_RPAREN)
+      length = 3;
+  } else if (!keyword && is_function_name(parser->token.text) &&
+             next[0].type == TOKEN_LPAREN && next[1].type == TOKEN_RPAREN) {
+    length = 2;
+  }
+  char *name = NULL;
+  if (length) {
+    Token *word = keyword ? &next[0] : &parser->token;
+    name = word->text; // The command takes it
+    word->text = NULL;
+    for (int i = 0; i <= length; i++)
+      advance(parser);
+  }
+  for (int i = 0; i < 3; i++)
+    token_free(&next[i]);
+  return name;
+}
+
+static Command *parse_simple_or_group(Parser *parser) {
+  Command *cmd = new_command();
+
+  // A function definition is a command of its own: the body is a group,
+  // stored as a one-stage list, and the executor defines it.
+  char *name = parse_function_header(parser);
+  if (name) {
+    cmd->function_name = name;
+    if (!parser->error && parser->token.type != TOKEN_LPAREN &&
+        !at_word(parser, "{")) {
+      syntax_error(parser, "Syntax error: function body must be a group");
+      return cmd;
+    }
+    if (!parser->error)
+      cmd->group = new_node(NODE_PIPELINE, parse_simple_or_group(parser),
+                            NULL, NULL);
+    return cmd;
+  }
+
+  if (parser->token.type == TOKEN_LPAREN || at_word(parser, "{")) {
+    int subshell = parser->token.type == TOKEN_LPAREN;
+    advance(parser);
+    cmd->group = parse_list_tokens(parser);
+    cmd->subshell = subshell;
+    if (!parser->error && cmd->group == NULL)
+      unexpected(parser);
+    else if (!parser->error &&
+             !(subshell ? parser->token.type == TOKEN_RPAREN
+                        : at_word(parser, "}")))
+      syntax_error(parser, subshell ? "Syntax error: missing ')'"
+                                    : "Syntax error: missing '}'");
+    if (!parser->error)
+      advance(parser);
+    parse_redirections(parser, cmd);
+    return cmd;
+  }
+
+  int capacity = 1;
+  while (!parser->error) {
+    if (parser->token.type == TOKEN_WORD) {
+      if (cmd->argc + 1 >= capacity) {
+        STATS_ALLOC(STATS_PARSER);
+        capacity *= 2;
+        cmd->args = realloc(cmd->args, capacity * sizeof(char *));
+        if (!cmd->args) {
+          perror("realloc failed");
+          exit(EXIT_FAILURE);
+        }
+      }
+      cmd->args[cmd->argc++] = parser->token.text; // The command takes it
+      cmd->args[cmd->argc] = NULL;
+      parser->token.text = NULL;
+      advance(parser);
+    } else if (parser->token.type == TOKEN_REDIRECT) {
+      parse_redirections(parser, cmd);
+    } else {
+      break;
+    }
+  }
+  if (!parser->error && cmd->argc == 0 && cmd->redirs == NULL)
+    unexpected(parser);
+  return cmd;
+}
+
+static Command *parse_pipeline(Parser *parser) {
+  Command *head = parse_simple_or_group(parser);
+  Command *tail = head;
+  while (!parser->error && parser->token.type == TOKEN_PIPE) {
+    advance(parser);
+    tail->next = parse_simple_or_group(parser);
+    tail = tail->next;
+  }
+  return head;
+}
+
+static int is_identifier(const char *word) {
+  if (!isalpha((unsigned char)*word) && *word != '_')
+    return 0;
+  while (isalnum((unsigned char)*word) || *word == '_')
+    word++;
+  return *word == '\0';
+}
+
+// time [-p] [-v] pipeline: the report comes from the executor once every
+// stage has been reaped.
+static Node *parse_timed_pipeline(Parser *parser) {
+  int flags = TIME_REPORT;
+  advance(parser);
+  while (!parser->error && parser->token.type == TOKEN_WORD &&
+         parser->token.text[0] == '-' && parser->token.text[1] &&
+         strspn(parser->token.text + 1, "pv") ==
+             strlen(parser->token.text + 1)) {
+    if (strchr(parser->token.text, 'p'))
+      flags |= TIME_POSIX;
+    if (strchr(parser->token.text, 'v'))
+      flags |= TIME_VERBOSE;
+    advance(parser);
+  }
+  Command *pipeline = parse_pipeline(parser);
+  pipeline->timed = flags;
+  return new_node(NODE_PIPELINE, pipeline, NULL, NULL);
+}
+
+static Node *parse_pipeline_node(Parser *parser);
+
+// limit [--mem SIZE] [--cpu N] [--] pipeline: the executor runs the
+// pipeline in a cgroup of its own with those quotas and reports its usage.
+static Node *parse_limited_pipeline(Parser *parser) {
+  long long memory = 0;
+  int cpu = 0;
+  advance(parser);
+  while (!parser->error && parser->token.type == TOKEN_WORD &&
+         strncmp(parser->token.text, "--", 2) == 0) {
+    if (strcmp(parser->token.text, "--") == 0) {
+      advance(parser);
+      break;
+    }
+    int is_memory = strcmp(parser->token.text, "--mem") == 0;
+    if (!is_memory && strcmp(parser->token.text, "--cpu") != 0) {
+      syntax_error(parser, "Syntax error: limit takes --mem and --cpu");
+      break;
+    }
+    advance(parser);
+    if (parser->error || parser->token.type != TOKEN_WORD ||
+        (is_memory ? (memory = limit_parse_size(parser->token.text))
+                   : (cpu = limit_parse_cpu(parser->token.text))) < 0) {
+      syntax_error(parser, is_memory
+                               ? "Syntax error: limit --mem needs a size"
+                               : "Syntax error: limit --cpu needs a count");
+      break;
+    }
+    advance(parser);
+  }
+  Node *node = parse_pipeline_node(parser);
+  if (node->type != NODE_PIPELINE) {
+    syntax_error(parser, "Syntax error: limit takes a pipeline");
+  } else {
+    node->pipeline->limited = 1;
+    node->pipeline->mem_limit = memory;
+    node->pipeline->cpu_limit = cpu;
+  }
+  return node;
+}
+
+// A coprocess is named only when a ( or { group follows the name, as
+// "coproc cat file" runs cat. The default name is COPROC.
+static Node *parse_pipeline_node(Parser *parser) {
+  if (at_word(parser, "time"))
+    return parse_timed_pipeline(parser);
+  if (at_word(parser, "limit"))
+    return parse_limited_pipeline(parser);
+  if (!at_word(parser, "coproc"))
+    return new_node(NODE_PIPELINE, parse_pipeline(parser), NULL, NULL);
+
+  size_t start = parser->token.offset;
+  char *name = NULL;
+  advance(parser);
+  if (!parser->error && parser->token.type == TOKEN_WORD &&
+      is_identifier(parser->token.text)) {
+    Lexer ahead = parser->lexer;
+    Token next;
+    lexer_next(&ahead, &next);
+    if (next.type == TOKEN_LPAREN ||
+        (next.type == TOKEN_WORD && strcmp(next.text, "{") == 0)) {
+      name = parser->token.text;
+      parser->token.text = NULL;
+      advance(parser);
+    }
+    token_free(&next);
+  }
+
+  Node *body = new_node(NODE_PIPELINE, parse_pipeline(parser), NULL, NULL);
+  Node *node = new_node(NODE_COPROC, NULL, body, NULL);
+  node->name = name ? name : strdup("COPROC");
+  node->text = source_text(parser, start);
+  return node;
+}
+
+static Node *parse_and_or(Parser *parser) {
+  Node *node = parse_pipeline_node(parser);
+  while (!parser->error && (parser->token.type == TOKEN_AND ||
+                            parser->token.type == TOKEN_OR)) {
+    NodeType type = parser->token.type == TOKEN_AND ? NODE_AND : NODE_OR;
+    advance(parser);
+    node = new_node(type, NULL, node, parse_pipeline_node(parser));
+  }
+  return node;
+}
+
+static void parser_init(Parser *parser, const char *input) {
+  lexer_init(&parser->lexer, input);
+  parser->token.text = NULL;
+  parser->token.fd_name = NULL;
+  parser->error = 0;
+  advance(parser);
+}
+
+// Parse a pipeline: words, redirections and '|'. Words keep their quoting;
+// expansion happens when the command runs.
+Command *parse_command(const char *input) {
+  Parser parser;
+  parser_init(&parser, input);
+  if (parser.token.type == TOKEN_END) {
+    token_free(&parser.token);
+    return NULL;
+  }
+
+  Command *cmd = parse_pipeline(&parser);
+  if (!parser.error && parser.token.type != TOKEN_END)
+    unexpected(&parser);
+  token_free(&parser.token);
+  if (parser.error) {
+    free_command(cmd);
+    return NULL;
+  }
+  return cmd;
+}
+
+// Parse a command list with ;, &, && and ||, subshells, brace groups and
+// coprocesses.
+// Returns NULL for empty input or after reporting a syntax error.
+Node *parse_list(const char *input) {
+  Parser parser;
+  parser_init(&parser, input);
+  if (parser.token.type == TOKEN_END) {
+    token_free(&parser.token);
+    return NULL;
+  }
+
+  Node *list = parse_list_tokens(&parser);
+  if (!parser.error && parser.token.type != TOKEN_END)
+    unexpected(&parser);
+  token_free(&parser.token);
+  if (parser.error) {
+    free_node(list);
+    return NULL;
+  }
+  return list;
+}
+
+static char *copy_string(const char *text) {
+  if (text == NULL)
+    return NULL;
+  char *copy = strdup(text);
+  if (!copy) {
+    perror("malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  return copy;
+}
+
+static Command *copy_command(const Command *cmd) {
+  if (cmd == NULL)
+    return NULL;
+  Command *copy = new_command();
+  copy->args = realloc(copy->args, (cmd->argc + 1) * sizeof(char *));
+  if (!copy->args) {
+    perror("realloc failed");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < cmd->argc; i++)
+    copy->args[i] = copy_string(cmd->args[i]);
+  copy->args[cmd->argc] = NULL;
+  copy->argc = cmd->argc;
+  for (const Redirection *r = cmd->redirs; r; r = r->next) {
+    add_redirection(copy, r->type, r->fd, r->target_fd,
+                    copy_string(r->target), r->here_flags);
+    Redirection *last = copy->redirs;
+    while (last->next)
+      last = last->next;
+    last->fd_name = copy_string(r->fd_name);
+  }
+  copy->group = copy_node(cmd->group);
+  copy->function_name = copy_string(cmd->function_name);
+  copy->subshell = cmd->subshell;
+  copy->timed = cmd->timed;
+  copy->limited = cmd->limited;
+  copy->mem_limit = cmd->mem_limit;
+  copy->cpu_limit = cmd->cpu_limit;
+  copy->next = copy_command(cmd->next);
+  return copy;
+}
+
+// A deep copy, for a function body that outlives the list it was parsed in.
+Node *copy_node(const Node *node) {
+  if (node == NULL)
+    return NULL;
+  Node *copy = new_node(node->type, copy_command(node->pipeline),
+                        copy_node(node->left), copy_node(node->right));
+  copy->name = copy_string(node->name);
+  copy->text = copy_string(node->text);
+  return copy;
+}
+
+void free_node(Node *node) {
+  if (node == NULL)
+    return;
+  free_command(node->pipeline);
+  free_node(node->left);
+  free_node(node->right);
+  free(node->name);
+  free(node->text);
+  free(node);
+}
@@ -0,0 +1,437 @@
+#include "include/scriptcache.h"
+#include "include/stats.h"
+#include "include/utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Parsed scripts for 'source' and the rc file. A script is parsed once and
+// reused until its file changes, which is told by (device, inode, mtime,
+// size). With CSHELL_SCRIPT_CACHE=1 the parsed form is also written under
+// $XDG_CACHE_HOME/cshell (~/.cache/cshell by default), so a new shell
+// reading an unchanged rc file loads it instead of parsing it.
+
+#define CACHE_MAGIC "cshell script cache 5\n"
+#define MAX_CACHED_STRING (16 << 20)
+
+static CachedScript **entries = NULL;
+static int entry_count = 0, entry_capacity = 0;
+
+static void free_entry(CachedScript *entry) {
+  free(entry->path);
+  free_script_element(entry->script);
+  free(entry);
+}
+
+void script_cache_close(CachedScript *entry) {
+  if (entry && --entry->refs == 0)
+    free_entry(entry);
+}
+
+static int same_file(const CachedScript *entry, const struct stat *st) {
+  return entry->dev == st->st_dev && entry->ino == st->st_ino &&
+         entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+         entry->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+         entry->size == st->st_size;
+}
+
+// --- On-disk form ---
+//
+// A header with the file's key and path, then the script tree written
+// depth-first: ints in host byte order, strings as a length (-1 for NULL)
+// and bytes, and every list or optional child behind a 1/0 marker. The
+// cache is per machine, so host byte order is fine.
+
+static void put_int(FILE *out, int value) {
+  fwrite(&value, sizeof(value), 1, out);
+}
+
+static void put_str(FILE *out, const char *text) {
+  if (!text) {
+    put_int(out, -1);
+    return;
+  }
+  int len = (int)strlen(text);
+  put_int(out, len);
+  fwrite(text, 1, len, out);
+}
+
+static void put_node(FILE *out, const Node *node);
+
+static void put_commands(FILE *out, const Command *cmd) {
+  for (; cmd; cmd = cmd->next) {
+    put_int(out, 1);
+    put_int(out, cmd->argc);
+    for (int i = 0; i < cmd->argc; i++)
+      put_str(out, cmd->args[i]);
+    for (const Redirection *r = cmd->redirs; r; r = r->next) {
+      put_int(out, 1);
+      put_int(out, r->type);
+      put_int(out, r->fd);
+      put_int(out, r->target_fd);
+      put_str(out, r->target);
+      put_int(out, r->here_flags);
+      put_str(out, r->fd_name);
+    }
+    put_int(out, 0);
+    put_node(out, cmd->group);
+    put_str(out, cmd->function_name);
+    put_int(out, cmd->subshell);
+    put_int(out, cmd->timed);
+    put_int(out, cmd->limited);
+    fwrite(&cmd->mem_limit, sizeof(cmd->mem_limit), 1, out);
+    put_int(out, cmd->cpu_limit);
+  }
+  put_int(out, 0);
+}
+
+static void put_node(FILE *out, const Node *node) {
+  put_int(out, node != NULL);
+  if (!node)
+    return;
+  put_int(out, node->type);
+  put_commands(out, node->pipeline);
+  put_node(out, node->left);
+  put_node(out, node->right);
+  put_str(out, node->name);
+  put_str(out, node->text);
+}
+
+static void put_script(FILE *out, const ScriptElement *element) {
+  for (; element; element = element->next) {
+    put_int(out, 1);
+    put_int(out, element->type);
+    put_str(out, element->content);
+    put_node(out, element->list);
+    put_int(out, element->function != NULL);
+    if (element->function) {
+      put_str(out, element->function->name);
+      put_script(out, element->function->body);
+    }
+    put_script(out, element->condition);
+    put_script(out, element->body);
+  }
+  put_int(out, 0);
+}
+
+// Readers set *ok to 0 on a short or implausible read and return what they
+// built so far, which the caller frees.
+static int get_int(FILE *in, int *ok) {
+  int value = 0;
+  if (*ok && fread(&value, sizeof(value), 1, in) != 1)
+    *ok = 0;
+  return *ok ? value : 0;
+}
+
+static char *get_str(FILE *in, int *ok) {
+  int len = get_int(in, ok);
+  if (!*ok || len == -1)
+    return NULL;
+  if (len < 0 || len > MAX_CACHED_STRING) {
+    *ok = 0;
+    return NULL;
+  }
+  STATS_ALLOC(STATS_SCRIPT_CACHE);
+  char *text = malloc(len + 1);
+  if (!text) {
+    perror("malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  if (fread(text, 1, len, in) != (size_t)len)
+    *ok = 0;
+  text[len] = '\0';
+  return text;
+}
+
+static void *xcalloc(size_t size) {
+  STATS_ALLOC(STATS_SCRIPT_CACHE);
+  void *ptr = calloc(1, size);
+  if (!ptr) {
+    perror("calloc failed");
+    exit(EXIT_FAILURE);
+  }
+  return ptr;
+}
+
+static Node *get_node(FILE *in, int *ok);
+
+static Command *get_commands(FILE *in, int *ok) {
+  Command *head = NULL, **tail = &head;
+  while (get_int(in, ok) == 1) {
+    Command *cmd = xcalloc(sizeof(Command));
+    *tail = cmd;
+    tail = &cmd->next;
+    int argc = get_int(in, ok);
+    if (argc < 0 || argc > MAX_CACHED_STRING) {
+      *ok = 0;
+      break;
+    }
+    cmd->args = xcalloc((argc + 1) * sizeof(char *));
+    for (int i = 0; i < argc && *ok; i++, cmd->argc++)
+      cmd->args[i] = get_str(in, ok);
+    Redirection **redir_tail = &cmd->redirs;
+    while (get_int(in, ok) == 1) {
+      Redirection *r = xcalloc(sizeof(Redirection));
+      *redir_tail = r;
+      redir_tail = &r->next;
+      r->type = (RedirectionType)get_int(in, ok);
+      r->fd = get_int(in, ok);
+      r->target_fd = get_int(in, ok);
+      r->target = get_str(in, ok);
+      r->here_flags = get_int(in, ok);
+      r->fd_name = get_str(in, ok);
+    }
+    cmd->group = get_node(in, ok);
+    cmd->function_name = get_str(in, ok);
+    cmd->subshell = get_int(in, ok);
+    cmd->timed = get_int(in, ok);
+    cmd->limited = get_int(in, ok);
+    if (*ok && fread(&cmd->mem_limit, sizeof(cmd->mem_limit), 1, in) != 1)
+      *ok = 0;
+    cmd->cpu_limit = get_int(in, ok);
+  }
+  return head;
+}
+
+static Node *get_node(FILE *in, int *ok) {
+  if (get_int(in, ok) != 1)
+    return NULL;
+  Node *node = xcalloc(sizeof(Node));
+  node->type = (NodeType)get_int(in, ok);
+  node->pipeline = get_commands(in, ok);
+  node->left = get_node(in, ok);
+  node->right = get_node(in, ok);
+  node->name = get_str(in, ok);
+  node->text = get_str(in, ok);
+  return node;
+}
+
+static ScriptElement *get_script(FILE *in, int *ok) {
+  ScriptElement *head = NULL, **tail = &head;
+  while (get_int(in, ok) == 1) {
+    ScriptElement *element = xcalloc(sizeof(ScriptElement));
+    *tail = element;
+    tail = &element->next;
+    element->type = (ScriptElementType)get_int(in, ok);
+    element->content = get_str(in, ok);
+    element->list = get_node(in, ok);
+    if (get_int(in, ok) == 1) {
+      element->function = xcalloc(sizeof(ShellFunction));
+      element->function->refs = 1;
+      element->function->name = get_str(in, ok);
+      element->function->body = get_script(in, ok);
+      if (!element->function->name)
+        *ok = 0;
+    }
+    element->condition = get_script(in, ok);
+    element->body = get_script(in, ok);
+  }
+  return head;
+}
+
+static int persistent_cache_enabled(void) {
+  const char *setting = getenv("CSHELL_SCRIPT_CACHE");
+  return setting && *setting && strcmp(setting, "0") != 0;
+}
+
+// The cache file for a script: named by a hash of its absolute path, which
+// is left in absolute.
+static char *cache_file_path(const char *path, int create_dir,
+                             char absolute[PATH_MAX]) {
+  char dir[PATH_MAX];
+  if (!realpath(path, absolute))
+    return NULL;
+  const char *base = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  if (base && *base)
+    snprintf(dir, sizeof(dir), "%s/cshell", base);
+  else if (home)
+    snprintf(dir, sizeof(dir), "%s/.cache/cshell", home);
+  else
+    return NULL;
+  if (create_dir) {
+    char parent[PATH_MAX];
+    snprintf(parent, sizeof(parent), "%.*s", (int)(strrchr(dir, '/') - dir),
+             dir);
+    mkdir(parent, 0700);
+    mkdir(dir, 0700);
+  }
+
+  uint64_t hash = 14695981039346656037ULL; // FNV-1a
+  for (const char *p = absolute; *p; p++) {
+    hash ^= (unsigned char)*p;
+    hash *= 1099511628211ULL;
+  }
+  size_t size = strlen(dir) + sizeof("/0123456789abcdef.script");
+  char *file = malloc(size);
+  if (!file) {
+    perror("malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  snprintf(file, size, "%s/%016llx.script", dir, (unsigned long long)hash);
+  return file;
+}
+
+static void file_key(const struct stat *st, uint64_t key[5]) {
+  key[0] = st->st_dev;
+  key[1] = st->st_ino;
+  key[2] = (uint64_t)st->st_mtim.tv_sec;
+  key[3] = (uint64_t)st->st_mtim.tv_nsec;
+  key[4] = (uint64_t)st->st_size;
+}
+
+static void put_key(FILE *out, const struct stat *st, const char *path) {
+  fwrite(CACHE_MAGIC, 1, sizeof(CACHE_MAGIC) - 1, out);
+  uint64_t key[5];
+  file_key(st, key);
+  fwrite(key, sizeof(key), 1, out);
+  put_str(out, path);
+}
+
+// Written to a temporary name and renamed, so a concurrent shell never
+// reads half a file. Failures only cost the next shell a parse.
+static void save_parsed(const char *path, const struct stat *st,
+                        const ScriptElement *script) {
+  char absolute[PATH_MAX];
+  char *file = cache_file_path(path, 1, absolute);
+  if (!file)
+    return;
+  char temp[PATH_MAX + 8];
+  snprintf(temp, sizeof(temp), "%s.XXXXXX", file);
+  int fd = mkstemp(temp);
+  FILE *out = fd == -1 ? NULL : fdopen(fd, "w");
+  if (out) {
+    put_key(out, st, absolute);
+    put_script(out, script);
+    if (fclose(out) == 0 && rename(temp, file) == 0)
+      temp[0] = '\0';
+  } else if (fd != -1) {
+    close(fd);
+  }
+  if (temp[0])
+    unlink(temp);
+  free(file);
+}
+
+static ScriptElement *load_parsed(const char *path, const struct stat *st,
+                                  int *found) {
+  *found = 0;
+  char absolute[PATH_MAX];
+  char *file = cache_file_path(path, 0, absolute);
+  FILE *in = file ? fopen(file, "r") : NULL;
+  free(file);
+  if (!in)
+    return NULL;
+
+  char magic[sizeof(CACHE_MAGIC) - 1];
+  uint64_t key[5], want[5];
+  file_key(st, want);
+  int ok = fread(magic, sizeof(magic), 1, in) == 1 &&
+           memcmp(magic, CACHE_MAGIC, sizeof(magic)) == 0 &&
+           fread(key, sizeof(key), 1, in) == 1 &&
+           memcmp(key, want, sizeof(key)) == 0;
+  char *stored_path = get_str(in, &ok);
+  ok = ok && stored_path && strcmp(stored_path, absolute) == 0;
+  free(stored_path);
+  ScriptElement *script = ok ? get_script(in, &ok) : NULL;
+  ok = ok && getc(in) == EOF;
+  fclose(in);
+  if (!ok) {
+    free_script_element(script);
+    return NULL;
+  }
+  *found = 1;
+  return script;
+}
+
+// --- Lookup ---
+
+// The parsed script for path, from memory, from the on-disk cache or
+// parsed now; NULL with errno set if the file cannot be read. origin, if
+// given, is set to "memory", "disk" or "parsed". Release the entry with
+// script_cache_close().
+CachedScript *script_cache_open(const char *path, const char **origin) {
+  struct stat st;
+  if (stat(path, &st) == -1)
+    return NULL;
+
+  for (int i = 0; i < entry_count; i++) {
+    if (strcmp(entries[i]->path, path) != 0)
+      continue;
+    if (same_file(entries[i], &st)) {
+      if (origin)
+        *origin = "memory";
+      STATS_COUNT(STATS_SCRIPT_MEMORY_HITS, 1);
+      entries[i]->refs++;
+      return entries[i];
+    }
+    // Stale: running copies keep theirs until they finish.
+    script_cache_close(entries[i]);
+    entries[i] = entries[--entry_count];
+    break;
+  }
+
+  int persistent = persistent_cache_enabled(), found = 0;
+  ScriptElement *script = persistent ? load_parsed(path, &st, &found) : NULL;
+  if (!found) {
+    char *text = read_file(path, NULL);
+    if (!text)
+      return NULL;
+    script = parse_script(text);
+    free(text);
+    if (persistent)
+      save_parsed(path, &st, script);
+  }
+  if (origin)
+    *origin = found ? "disk" : "parsed";
+  STATS_COUNT(found ? STATS_SCRIPT_DISK_HITS : STATS_SCRIPT_PARSES, 1);
+
+  CachedScript *entry = xcalloc(sizeof(CachedScript));
+  entry->path = strdup(path);
+  if (!entry->path) {
+    perror("strdup failed");
+    exit(EXIT_FAILURE);
+  }
+  entry->dev = st.st_dev;
+  entry->ino = st.st_ino;
+  entry->mtime = st.st_mtim;
+  entry->size = st.st_size;
+  entry->script = script;
+  entry->refs = 2; // The cache's and the caller's
+
+  if (entry_count == entry_capacity) {
+    entry_capacity = entry_capacity ? entry_capacity * 2 : 8;
+    entries = realloc(entries, entry_capacity * sizeof(CachedScript *));
+    if (!entries) {
+      perror("realloc failed");
+      exit(EXIT_FAILURE);
+    }
+  }
+  entries[entry_count++] = entry;
+  return entry;
+}
+
+size_t script_cache_bytes(int *count) {
+  size_t total = stats_block(entries);
+  for (int i = 0; i < entry_count; i++)
+    total += stats_block(entries[i]) + stats_block(entries[i]->path) +
+             stats_script_bytes(entries[i]->script);
+  *count = entry_count;
+  return total;
+}
+
+// Run a script file in the current shell. Returns its status, or -1 with
+// errno set when it cannot be read.
+int source_file(const char *path, const char **origin) {
+  CachedScript *entry = script_cache_open(path, origin);
+  if (!entry)
+    return -1;
+  int status = execute_script(entry->script);
+  script_cache_close(entry);
+  return status;
+}
@@ -1,27 +1,45 @@
 #include "include/scripting.h"
-#include "include/builtins.h"
+#include "include/environment.h"
+#include "include/executor.h"
+#include "include/expand.h"
+#include "include/lexer.h"
+#include "include/stats.h"
 #include "include/utils.h"
+#include <ctype.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 void init_script_context(ScriptContext *context) {
+  STATS_ALLOC(STATS_VARIABLES);
   context->variables = malloc(sizeof(char *) * 10);
   context->values = malloc(sizeof(char *) * 10);
   context->var_count = 0;
   context->max_var_capacity = 10;
+  context->arrays = NULL;
+  context->array_count = 0;
+  context->array_capacity = 0;
 }
 
 void add_variable(ScriptContext *context, const char *name, const char *value) {
+  STATS_ALLOC(STATS_VARIABLES);
   if (context->var_count >= context->max_var_capacity) {
     context->max_var_capacity *= 2;
     context->variables =
+        realloc(context->variables, sizeof(char *) * context->max_var_capacity);
+    context->values =
         realloc(context->values, sizeof(char *) * context->max_var_capacity);
+    if (!context->variables || !context->values) {
+      perror("realloc failed");
+      exit(EXIT_FAILURE);
+    }
   }
 
   for (int i = 0; i < context->var_count; i++) {
     if (strcmp(context->variables[i], name) == 0) {
+      char *copy = strdup(value); // value may be the string being replaced
       free(context->values[i]);
-      context->values[i] = strdup(value);
+      context->values[i] = copy;
       return;
     }
   }
@@ -40,6 +58,22 @@ char *get_variable(ScriptContext *context, const char *name) {
   return NULL;
 }
 
+// The last variable fills the hole.
+void remove_variable(ScriptContext *context, const char *name) {
+  for (int i = 0; i < context->var_count; i++) {
+    if (strcmp(context->variables[i], name) == 0) {
+      free(context->variables[i]);
+      free(context->values[i]);
+      context->var_count--;
+      context->variables[i] = context->variables[context->var_count];
+      context->values[i] = context->values[context->var_count];
+      return;
+    }
+  }
+}
+
+static void free_array(ShellArray *array);
+
 void free_script_context(ScriptContext *context) {
   for (int i = 0; i < context->var_count; i++) {
     free(context->variables[i]);
@@ -47,39 +81,700 @@ void free_script_context(ScriptContext *context) {
   }
   free(context->variables);
   free(context->values);
+  for (int i = 0; i < context->array_count; i++)
+    free_array(context->arrays[i]);
+  free(context->arrays);
+}
+
+// --- Shell variables ---
+
+// Variables of the running shell, shared by everything it executes.
+static ScriptContext shell_context;
+static int shell_context_ready = 0;
+
+static ScriptContext *shell_variables(void) {
+  if (!shell_context_ready) {
+    init_script_context(&shell_context);
+    shell_context_ready = 1;
+  }
+  return &shell_context;
+}
+
+// Assigning to an exported variable updates the environment as well. A
+// plain assignment to an array sets its element 0.
+void set_shell_variable(const char *name, const char *value) {
+  ShellArray *array = find_array(name);
+  if (array) {
+    array_set(array, "0", value);
+    return;
+  }
+  add_variable(shell_variables(), name, value);
+  if (env_get(name))
+    env_set(name, value);
+}
+
+// Shell variables shadow the environment; an array stands for its element
+// 0.
+const char *get_shell_variable(const char *name) {
+  ScriptContext *context = shell_variables();
+  const char *value = get_variable(context, name);
+  if (value)
+    return value;
+  if (context->array_count) {
+    ShellArray *array = find_array(name);
+    if (array)
+      return array_get(array, "0");
+  }
+  return env_get(name);
+}
+
+static void remove_array(ScriptContext *context, const char *name);
+
+void unset_shell_variable(const char *name) {
+  remove_variable(shell_variables(), name);
+  remove_array(shell_variables(), name);
+}
+
+// --- Arrays ---
+
+#define MAX_ARRAY_INDEX (1 << 24)
+
+static void *xrealloc(void *ptr, size_t size) {
+  STATS_ALLOC(STATS_VARIABLES);
+  ptr = realloc(ptr, size);
+  if (!ptr) {
+    perror("realloc failed");
+    exit(EXIT_FAILURE);
+  }
+  return ptr;
+}
+
+static char *xstrdup(const char *text) {
+  STATS_ALLOC(STATS_VARIABLES);
+  char *copy = strdup(text);
+  if (!copy) {
+    perror("strdup failed");
+    exit(EXIT_FAILURE);
+  }
+  return copy;
+}
+
+static void free_array(ShellArray *array) {
+  for (int i = 0; i < array->count; i++) {
+    if (array->keys)
+      free(array->keys[i]);
+    free(array->values[i]);
+  }
+  free(array->keys);
+  free(array->values);
+  free(array->slots);
+  free(array->name);
+  free(array);
+}
+
+static int array_position(ScriptContext *context, const char *name) {
+  for (int i = 0; i < context->array_count; i++) {
+    if (strcmp(context->arrays[i]->name, name) == 0)
+      return i;
+  }
+  return -1;
+}
+
+// The last array fills the hole.
+static void remove_array(ScriptContext *context, const char *name) {
+  int i = array_position(context, name);
+  if (i < 0)
+    return;
+  free_array(context->arrays[i]);
+  context->arrays[i] = context->arrays[--context->array_count];
+}
+
+ShellArray *find_array(const char *name) {
+  ScriptContext *context = shell_variables();
+  int i = array_position(context, name);
+  return i < 0 ? NULL : context->arrays[i];
+}
+
+ShellArray **shell_arrays(int *count) {
+  ScriptContext *context = shell_variables();
+  *count = context->array_count;
+  return context->arrays;
+}
+
+// Every scalar the shell holds, exported or not.
+char **shell_variable_names(int *count) {
+  ScriptContext *context = shell_variables();
+  *count = context->var_count;
+  return context->variables;
+}
+
+// Make name an array of the given kind. A scalar of that name becomes its
+// element 0; an array of the other kind is replaced by an empty one.
+ShellArray *declare_array(const char *name, ArrayKind kind) {
+  ScriptContext *context = shell_variables();
+  ShellArray *array = find_array(name);
+  if (array && array->kind == kind)
+    return array;
+  if (array)
+    remove_array(context, name);
+
+  array = calloc(1, sizeof(ShellArray));
+  if (!array) {
+    perror("calloc failed");
+    exit(EXIT_FAILURE);
+  }
+  array->name = xstrdup(name);
+  array->kind = kind;
+  if (context->array_count == context->array_capacity) {
+    context->array_capacity =
+        context->array_capacity ? context->array_capacity * 2 : 8;
+    context->arrays = xrealloc(context->arrays, context->array_capacity *
+                                                    sizeof(ShellArray *));
+  }
+  context->arrays[context->array_count++] = array;
+
+  const char *scalar = get_variable(context, name);
+  if (scalar) {
+    array_set(array, "0", scalar);
+    remove_variable(context, name);
+  }
+  return array;
+}
+
+static void reserve_elements(ShellArray *array, int wanted) {
+  if (wanted <= array->capacity)
+    return;
+  int capacity = array->capacity ? array->capacity * 2 : 8;
+  while (capacity < wanted)
+    capacity *= 2;
+  array->values = xrealloc(array->values, capacity * sizeof(char *));
+  memset(array->values + array->capacity, 0,
+         (capacity - array->capacity) * sizeof(char *));
+  if (array->kind == ARRAY_ASSOCIATIVE)
+    array->keys = xrealloc(array->keys, capacity * sizeof(char *));
+  array->capacity = capacity;
+}
+
+// An indexed subscript: a number, negative counting back from the end, or
+// the name of a variable holding one.
+static long element_index(const ShellArray *array, const char *subscript) {
+  char *end;
+  long index = strtol(subscript, &end, 10);
+  if (end == subscript || *end != '\0') {
+    const char *value = get_shell_variable(subscript);
+    index = value ? strtol(value, NULL, 10) : 0;
+  }
+  return index < 0 ? index + array->count : index;
+}
+
+static unsigned hash_key(const char *key) {
+  unsigned hash = 2166136261u; // FNV-1a
+  for (; *key; key++) {
+    hash ^= (unsigned char)*key;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// The slot holding key, or the free slot where it would go.
+static int *find_key_slot(const ShellArray *array, const char *key) {
+  int mask = array->slot_count - 1;
+  for (int i = hash_key(key) & mask;; i = (i + 1) & mask) {
+    int slot = array->slots[i];
+    if (slot == 0 || strcmp(array->keys[slot - 1], key) == 0)
+      return &array->slots[i];
+  }
+}
+
+static void rehash_keys(ShellArray *array) {
+  int wanted = 16;
+  while (wanted < array->count * 2 + 2)
+    wanted *= 2;
+  if (wanted != array->slot_count) {
+    array->slot_count = wanted;
+    array->slots = xrealloc(array->slots, wanted * sizeof(int));
+  }
+  memset(array->slots, 0, array->slot_count * sizeof(int));
+  for (int i = 0; i < array->count; i++)
+    *find_key_slot(array, array->keys[i]) = i + 1;
+}
+
+const char *array_get(const ShellArray *array, const char *subscript) {
+  if (array->kind == ARRAY_ASSOCIATIVE) {
+    if (array->count == 0)
+      return NULL;
+    int slot = *find_key_slot(array, subscript);
+    return slot ? array->values[slot - 1] : NULL;
+  }
+  long index = element_index(array, subscript);
+  return index >= 0 && index < array->count ? array->values[index] : NULL;
+}
+
+void array_set(ShellArray *array, const char *subscript, const char *value) {
+  char *copy = xstrdup(value); // value may be the element being replaced
+  if (array->kind == ARRAY_ASSOCIATIVE) {
+    if (array->slot_count == 0)
+      rehash_keys(array);
+    int *slot = find_key_slot(array, subscript);
+    if (*slot) {
+      free(array->values[*slot - 1]);
+      array->values[*slot - 1] = copy;
+      return;
+    }
+    reserve_elements(array, array->count + 1);
+    array->keys[array->count] = xstrdup(subscript);
+    array->values[array->count] = copy;
+    *slot = ++array->count;
+    array->used++;
+    if (array->count * 2 + 2 > array->slot_count)
+      rehash_keys(array);
+    return;
+  }
+
+  long index = element_index(array, subscript);
+  if (index < 0 || index >= MAX_ARRAY_INDEX) {
+    fprintf(stderr, "cshell: %s[%s]: bad array subscript\n", array->name,
+            subscript);
+    free(copy);
+    return;
+  }
+  reserve_elements(array, (int)index + 1);
+  if (array->values[index])
+    free(array->values[index]);
+  else
+    array->used++;
+  array->values[index] = copy;
+  if (index >= array->count)
+    array->count = (int)index + 1;
+}
+
+// After the last element; for an associative array the key is the next
+// free position.
+void array_append(ShellArray *array, const char *value) {
+  if (array->kind == ARRAY_INDEXED && array->count < MAX_ARRAY_INDEX) {
+    reserve_elements(array, array->count + 1);
+    array->values[array->count++] = xstrdup(value);
+    array->used++;
+    return;
+  }
+  char subscript[16];
+  snprintf(subscript, sizeof(subscript), "%d", array->count);
+  array_set(array, subscript, value);
+}
+
+void array_unset(ShellArray *array, const char *subscript) {
+  if (array->kind == ARRAY_INDEXED) {
+    long index = element_index(array, subscript);
+    if (index < 0 || index >= array->count || !array->values[index])
+      return;
+    free(array->values[index]);
+    array->values[index] = NULL;
+    array->used--;
+    while (array->count > 0 && !array->values[array->count - 1])
+      array->count--;
+    return;
+  }
+  if (array->count == 0)
+    return;
+  int *slot = find_key_slot(array, subscript);
+  if (*slot == 0)
+    return;
+  int position = *slot - 1;
+
+  // Close the gap in the probe sequence: a later entry moves back into it
+  // unless its home slot lies between the gap and where it sits.
+  int mask = array->slot_count - 1;
+  int hole = (int)(slot - array->slots);
+  for (int i = (hole + 1) & mask; array->slots[i]; i = (i + 1) & mask) {
+    int home = hash_key(array->keys[array->slots[i] - 1]) & mask;
+    int between = hole <= i ? (home > hole && home <= i)
+                            : (home > hole || home <= i);
+    if (!between) {
+      array->slots[hole] = array->slots[i];
+      hole = i;
+    }
+  }
+  array->slots[hole] = 0;
+
+  // The last entry fills the hole, so the vectors stay dense.
+  free(array->keys[position]);
+  free(array->values[position]);
+  int last = --array->count;
+  array->used--;
+  if (position != last) {
+    array->keys[position] = array->keys[last];
+    array->values[position] = array->values[last];
+    *find_key_slot(array, array->keys[position]) = position + 1;
+  }
+}
+
+void array_clear(ShellArray *array) {
+  for (int i = 0; i < array->count; i++) {
+    if (array->keys)
+      free(array->keys[i]);
+    free(array->values[i]);
+    array->values[i] = NULL;
+  }
+  array->count = array->used = 0;
+  if (array->slots)
+    memset(array->slots, 0, array->slot_count * sizeof(int));
+}
+
+static char *concat(const char *left, const char *right) {
+  size_t len = strlen(left);
+  char *joined = malloc(len + strlen(right) + 1);
+  if (!joined) {
+    perror("malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(joined, left, len);
+  strcpy(joined + len, right);
+  return joined;
+}
+
+// NAME=(words): each word is expanded into fields that become successive
+// elements, and [subscript]=value sets one element. An associative array
+// takes unsubscripted fields as key, value pairs.
+static int assign_list(const char *name, const char *list, int append) {
+  ShellArray *array = find_array(name);
+  array = declare_array(name, array ? array->kind : ARRAY_INDEXED);
+  if (!append)
+    array_clear(array);
+
+  char *inner = strndup(list + 1, strlen(list) - 2);
+  if (!inner) {
+    perror("strndup failed");
+    exit(EXIT_FAILURE);
+  }
+  Lexer lexer;
+  Token token;
+  char *key = NULL;
+  lexer_init(&lexer, inner);
+  while (lexer_next(&lexer, &token) == TOKEN_WORD) {
+    const char *close = token.text[0] == '[' ? strstr(token.text, "]=") : NULL;
+    if (close) {
+      char *raw = strndup(token.text + 1, close - token.text - 1);
+      char *subscript = expand_word_single(raw);
+      char *value = expand_word_single(close + 2);
+      array_set(array, subscript, value);
+      free(value);
+      free(subscript);
+      free(raw);
+      token_free(&token);
+      continue;
+    }
+    ArgList fields;
+    arglist_init(&fields);
+    expand_word(token.text, &fields);
+    for (int i = 0; i < fields.count; i++) {
+      if (array->kind == ARRAY_INDEXED) {
+        array_append(array, fields.items[i]);
+      } else if (!key) {
+        key = xstrdup(fields.items[i]);
+      } else {
+        array_set(array, key, fields.items[i]);
+        free(key);
+        key = NULL;
+      }
+    }
+    arglist_free(&fields);
+    token_free(&token);
+  }
+  int status = token.type == TOKEN_END ? 0 : 1;
+  if (status)
+    fprintf(stderr, "cshell: %s: syntax error in array assignment\n", name);
+  token_free(&token);
+  if (key)
+    array_set(array, key, "");
+  free(key);
+  free(inner);
+  return status;
+}
+
+// Carry out an assignment word as written in a command: NAME=value,
+// NAME[subscript]=value or NAME=(words), each also with += to append.
+// Returns the assignment's exit status.
+int assign_word(const char *word) {
+  size_t len = assignment_length(word);
+  if (len == 0)
+    return 1;
+  int append = word[len - 2] == '+';
+  size_t target_len = len - 1 - append;
+  const char *bracket = memchr(word, '[', target_len);
+  char *name = strndup(word, bracket ? (size_t)(bracket - word) : target_len);
+  if (!name) {
+    perror("strndup failed");
+    exit(EXIT_FAILURE);
+  }
+  const char *text = word + len;
+  if (!bracket && *text == '(') {
+    int status = assign_list(name, text, append);
+    free(name);
+    return status;
+  }
+
+  char *value = expand_word_single(text);
+  if (expansion_failed) { // ${x:?} said why; nothing is assigned
+    free(value);
+    free(name);
+    return 1;
+  }
+  if (bracket) {
+    char *raw = strndup(bracket + 1, word + target_len - bracket - 2);
+    char *subscript = expand_word_single(raw);
+    ShellArray *array = find_array(name);
+    if (!array)
+      array = declare_array(name, ARRAY_INDEXED);
+    const char *old = append ? array_get(array, subscript) : NULL;
+    char *joined = old ? concat(old, value) : NULL;
+    array_set(array, subscript, joined ? joined : value);
+    free(joined);
+    free(subscript);
+    free(raw);
+  } else {
+    const char *old = append ? get_shell_variable(name) : NULL;
+    char *joined = old ? concat(old, value) : NULL;
+    set_shell_variable(name, joined ? joined : value);
+    free(joined);
+  }
+  free(value);
+  free(name);
+  return 0;
+}
+
+// Cut the next line out of the script buffer; blank lines are kept so
+// here-document bodies stay intact.
+static char *next_line(char **cursor) {
+  char *line = *cursor;
+  if (line == NULL || *line == '\0')
+    return NULL;
+  char *newline = strchr(line, '\n');
+  if (newline) {
+    *newline = '\0';
+    *cursor = newline + 1;
+  } else {
+    *cursor = NULL;
+  }
+  return line;
 }
 
+// Collect here-document lines up to the delimiter. A missing delimiter
+// takes the rest of the script, like other shells.
+static char *read_here_doc(char **cursor, const char *delimiter,
+                           int strip_tabs) {
+  size_t len = 0, cap = 256;
+  char *body = malloc(cap);
+  if (!body) {
+    perror("malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  body[0] = '\0';
+
+  char *line;
+  while ((line = next_line(cursor)) != NULL) {
+    if (strip_tabs)
+      line += strspn(line, "\t");
+    if (strcmp(line, delimiter) == 0)
+      break;
+    size_t n = strlen(line);
+    if (len + n + 2 > cap) {
+      while (len + n + 2 > cap)
+        cap *= 2;
+      body = realloc(body, cap);
+      if (!body) {
+        perror("realloc failed");
+        exit(EXIT_FAILURE);
+      }
+    }
+    memcpy(body + len, line, n);
+    len += n;
+    body[len++] = '\n';
+    body[len] = '\0';
+  }
+  return body;
+}
+
+// Fill in here-document bodies in the order their commands appear.
+static void read_here_docs(Node *node, char **cursor) {
+  if (node == NULL)
+    return;
+  read_here_docs(node->left, cursor);
+  for (Command *c = node->pipeline; c != NULL; c = c->next) {
+    read_here_docs(c->group, cursor);
+    for (Redirection *r = c->redirs; r != NULL; r = r->next) {
+      if (r->here_flags & HERE_PENDING) {
+        char *body = read_here_doc(cursor, r->target,
+                                   r->here_flags & HERE_STRIP_TABS);
+        free(r->target);
+        r->target = body;
+        r->here_flags &= ~HERE_PENDING;
+      }
+    }
+  }
+  read_here_docs(node->right, cursor);
+}
+
+// --- Function definitions ---
+
+// "name() {", "name () {", "function name {" or "function name() {" at the
+// start of line. Returns the length of the name, which starts at *name,
+// and points *rest just past the "{"; 0 if line does not define a function.
+static size_t function_header(const char *line, const char **name,
+                              const char **rest) {
+  const char *p = line;
+  int keyword = strncmp(p, "function", 8) == 0 && (p[8] == ' ' || p[8] == '\t');
+  if (keyword)
+    p += 8 + strspn(p + 8, " \t");
+  *name = p;
+  while (isalnum((unsigned char)*p) || *p == '_' || *p == '-')
+    p++;
+  size_t len = p - *name;
+  if (len == 0 || isdigit((unsigned char)**name))
+    return 0;
+  p += strspn(p, " \t");
+  if (p[0] == '(' && p[1] == ')')
+    p += 2 + strspn(p + 2, " \t");
+  else if (!keyword)
+    return 0;
+  if (*p != '{' || (p[1] != '\0' && !isspace((unsigned char)p[1])))
+    return 0;
+  *rest = p + 1;
+  return len;
+}
+
+// Length of text without trailing blanks.
+static size_t trimmed_length(const char *text, size_t len) {
+  while (len > 0 && isspace((unsigned char)text[len - 1]))
+    len--;
+  return len;
+}
+
+// The body is parsed as a script of its own.
+static ShellFunction *parse_function(const char *name, size_t name_len,
+                                     const char *body, size_t body_len) {
+  ShellFunction *function = calloc(1, sizeof(ShellFunction));
+  char *text = strndup(body, body_len);
+  if (!function || !text || !(function->name = strndup(name, name_len))) {
+    perror("malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  function->refs = 1;
+  function->body = parse_script(text);
+  free(text);
+  return function;
+}
+
+// "return" or "return n" on a line of its own.
+static int is_return(const char *line) {
+  if (strncmp(line, "return", 6) != 0)
+    return 0;
+  const char *arg = line + 6;
+  if (*arg == '\0')
+    return 1;
+  return (*arg == ' ' || *arg == '\t') &&
+         arg[strcspn(arg, ";&|<>()")] == '\0';
+}
+
+// One statement as an element, or NULL when it holds only blanks and
+// comments. A function's body runs to the "}" that closes it, and whatever
+// follows that on its line is left in *after for the caller.
+static ScriptElement *parse_statement(const char *text, Statement *statement,
+                                      char **after) {
+  Lexer lexer;
+  Token first;
+  lexer_init(&lexer, statement->code);
+  TokenType type = lexer_next(&lexer, &first);
+  token_free(&first);
+  *after = NULL;
+  if (type == TOKEN_END)
+    return NULL;
+
+  // Up to its first newline the code is the statement's own text.
+  size_t start = first.offset;
+  char *token = strndup(statement->code + start,
+                        trimmed_length(statement->code + start,
+                                       strlen(statement->code + start)));
+  ScriptElement *element = calloc(1, sizeof(ScriptElement));
+  if (!token || !element) {
+    perror("malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  const char *name, *rest;
+  size_t name_len;
+
+  if ((name_len = function_header(token, &name, &rest)) != 0) {
+    size_t body = start + (rest - token);
+    size_t close = statement->group_end ? statement->group_end
+                                        : statement->length + 1;
+    element->type = SCRIPT_FUNCTION;
+    element->content = strndup(name, name_len);
+    element->function =
+        parse_function(name, name_len, text + body, close - 1 - body);
+    if (statement->group_end) {
+      const char *tail = text + statement->group_end;
+      size_t tail_len = statement->length - statement->group_end;
+      size_t skip = strspn(tail, " \t");
+      if (skip < tail_len && tail[skip] == ';')
+        skip++;
+      if (trimmed_length(tail + skip, tail_len - skip) > 0)
+        *after = strndup(tail + skip, tail_len - skip);
+    }
+  } else if (is_return(token)) {
+    element->type = SCRIPT_RETURN;
+    const char *arg = token + 6 + strspn(token + 6, " \t");
+    size_t arg_len = trimmed_length(arg, strlen(arg));
+    element->content = arg_len ? strndup(arg, arg_len) : NULL;
+  } else if (strncmp(token, "if ", 3) == 0) {
+    element->type = SCRIPT_IF;
+    element->content = strdup(token + 3);
+  } else if (strncmp(token, "else", 4) == 0) {
+    element->type = SCRIPT_ELSE;
+  } else if (strncmp(token, "while ", 6) == 0) {
+    element->type = SCRIPT_WHILE;
+    element->content = strdup(token + 6);
+  } else {
+    element->type = SCRIPT_COMMAND;
+    element->content = token;
+    token = NULL;
+    element->list = parse_list(statement->code);
+    if (!element->list)
+      element->type = SCRIPT_SYNTAX_ERROR;
+    char *cursor = statement->bodies;
+    read_here_docs(element->list, &cursor);
+  }
+  free(token);
+  return element;
+}
+
+// Statements end where statement_scan() says, so quotes, $( ... ), groups
+// and backslash-newlines may span lines.
 ScriptElement *parse_script(const char *script_text) {
   ScriptElement *head = NULL;
   ScriptElement *current = NULL;
-  char *token;
-  char *script_copy = strdup(script_text);
-
-  token = strtok(script_copy, "\n");
-
-  while (token != NULL) {
-    ScriptElement *element = malloc(sizeof(ScriptElement));
-    memset(element, 0, sizeof(ScriptElement));
-
-    while (*token == ' ' || *token == '\t')
-      token++;
-
-    if (strncmp(token, "if ", 3) == 0) {
-      element->type = SCRIPT_IF;
-      element->content = strdup(token + 3);
-    } else if (strncmp(token, "else", 4) == 0) {
-      element->type = SCRIPT_ELSE;
-    } else if (strncmp(token, "while ", 6) == 0) {
-      element->type = SCRIPT_WHILE;
-      element->content = strdup(token + 6);
-    } else if (strchr(token, '=')) {
-      element->type = SCRIPT_VARIABLE;
-      element->content = strdup(token);
+  const char *cursor = script_text;
+  char *pending = NULL; // What followed a function's "}" on its line
+
+  while (pending || *cursor) {
+    const char *text = pending ? pending : cursor;
+    Statement statement;
+    char *after;
+    statement_scan(text, &statement);
+    ScriptElement *element = parse_statement(text, &statement, &after);
+    if (pending) {
+      const char *left = pending + statement.length;
+      char *next = after ? concat(after, left) : NULL;
+      if (!next && *left)
+        next = strdup(left);
+      free(after);
+      free(pending);
+      pending = next;
     } else {
-      element->type = SCRIPT_COMMAND;
-      element->content = strdup(token);
-      element->cmd = parse_command(token);
+      cursor += statement.length;
+      pending = after;
     }
+    statement_free(&statement);
+    if (element == NULL)
+      continue;
 
     if (head == NULL) {
       head = element;
@@ -88,67 +783,437 @@ ScriptElement *parse_script(const char *script_text) {
       current->next = element;
       current = element;
     }
-    token = strtok(NULL, "\n");
   }
-
-  free(script_copy);
   return head;
 }
 
+// --- Function calls ---
+
+#define MAX_CALL_DEPTH 1000 // Calls made through the executor, on the C stack
+#define MAX_FRAMES 100000   // All calls in progress
+
+// A call in progress. Frames live in one array that is reused from call
+// to call, as do the saved values of local variables.
+typedef struct {
+  ShellFunction *function;
+  char **args; // $0 (the function's name), $1, ...
+  int argc;
+  ScriptElement *resume; // Where execute_script() continues afterwards
+  int locals;            // This call's first entry in saved_variables
+} Frame;
+
+typedef struct {
+  char *name;
+  char *value; // The value before 'local', NULL if it was unset
+} SavedVariable;
+
+static ShellFunction **functions = NULL;
+static int function_count = 0, function_capacity = 0;
+static Frame *frames = NULL;
+static int frame_count = 0, frame_capacity = 0;
+static SavedVariable *saved_variables = NULL;
+static int saved_count = 0, saved_capacity = 0;
+static int call_depth = 0;
+
+int function_returning = 0; // 'return' ran; unwinding to the call
+// A syntax error stopped the script: every execute_script() unwinds, and
+// the shell leaves unless it is interactive, which clears it per line.
+int script_aborted = 0;
+
+static void release_function(ShellFunction *function) {
+  if (function && --function->refs == 0) {
+    free(function->name);
+    free_script_element(function->body);
+    free(function);
+  }
+}
+
+ShellFunction *find_function(const char *name) {
+  for (int i = 0; i < function_count; i++) {
+    if (strcmp(functions[i]->name, name) == 0)
+      return functions[i];
+  }
+  return NULL;
+}
+
+static void define_function(ShellFunction *function) {
+  function->refs++;
+  for (int i = 0; i < function_count; i++) {
+    if (strcmp(functions[i]->name, function->name) == 0) {
+      release_function(functions[i]);
+      functions[i] = function;
+      return;
+    }
+  }
+  if (function_count == function_capacity) {
+    function_capacity = function_capacity ? function_capacity * 2 : 16;
+    functions = realloc(functions, function_capacity * sizeof(ShellFunction *));
+    if (!functions) {
+      perror("realloc failed");
+      exit(EXIT_FAILURE);
+    }
+  }
+  functions[function_count++] = function;
+}
+
+// name() { ... } met as a command: the function gets a copy of the body,
+// which outlives the list it was parsed in.
+int define_function_command(const Command *cmd) {
+  ShellFunction *function = calloc(1, sizeof(ShellFunction));
+  ScriptElement *body = calloc(1, sizeof(ScriptElement));
+  if (!function || !body || !(function->name = strdup(cmd->function_name))) {
+    perror("malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  body->type = SCRIPT_COMMAND;
+  body->list = copy_node(cmd->group);
+  function->body = body;
+  define_function(function);
+  return 0;
+}
+
+// Bytes held by the shell's variables and arrays.
+size_t variable_bytes(int *scalars, int *arrays) {
+  ScriptContext *context = shell_variables();
+  size_t total = stats_block(context->variables) +
+                 stats_block(context->values) + stats_block(context->arrays);
+  for (int i = 0; i < context->var_count; i++)
+    total += stats_block(context->variables[i]) +
+             stats_block(context->values[i]);
+  for (int i = 0; i < context->array_count; i++) {
+    ShellArray *array = context->arrays[i];
+    total += stats_block(array) + stats_block(array->name) +
+             stats_block(array->keys) + stats_block(array->values) +
+             stats_block(array->slots);
+    for (int j = 0; j < array->count; j++) {
+      total += stats_block(array->values[j]);
+      if (array->keys)
+        total += stats_block(array->keys[j]);
+    }
+  }
+  *scalars = context->var_count;
+  *arrays = context->array_count;
+  return total;
+}
+
+size_t function_bytes(int *count) {
+  size_t total = stats_block(functions);
+  for (int i = 0; i < function_count; i++)
+    total += stats_block(functions[i]) + stats_block(functions[i]->name) +
+             stats_script_bytes(functions[i]->body);
+  *count = function_count;
+  return total;
+}
+
+static int count_args(char **args) {
+  int n = 0;
+  while (args[n])
+    n++;
+  return n;
+}
+
+// Takes ownership of args.
+static int push_frame(ShellFunction *function, char **args,
+                      ScriptElement *resume) {
+  if (frame_count == MAX_FRAMES) {
+    fprintf(stderr, "cshell: %s: maximum function nesting level exceeded\n",
+            function->name);
+    free_args(args);
+    return -1;
+  }
+  if (frame_count == frame_capacity) {
+    frame_capacity = frame_capacity ? frame_capacity * 2 : 16;
+    frames = realloc(frames, frame_capacity * sizeof(Frame));
+    if (!frames) {
+      perror("realloc failed");
+      exit(EXIT_FAILURE);
+    }
+  }
+  Frame *frame = &frames[frame_count++];
+  function->refs++;
+  frame->function = function;
+  frame->args = args;
+  frame->argc = count_args(args);
+  frame->resume = resume;
+  frame->locals = saved_count;
+  return 0;
+}
+
+// Put back the variables made local since entry 'from'.
+static void restore_locals(int from) {
+  while (saved_count > from) {
+    SavedVariable *var = &saved_variables[--saved_count];
+    if (var->value)
+      set_shell_variable(var->name, var->value);
+    else
+      unset_shell_variable(var->name);
+    free(var->name);
+    free(var->value);
+  }
+}
+
+static ScriptElement *pop_frame(void) {
+  Frame *frame = &frames[--frame_count];
+  restore_locals(frame->locals);
+  free_args(frame->args);
+  release_function(frame->function);
+  function_returning = 0;
+  return frame->resume;
+}
+
+// A call in tail position takes over the caller's frame.
+static void replace_frame(ShellFunction *function, char **args) {
+  Frame *frame = &frames[frame_count - 1];
+  restore_locals(frame->locals);
+  free_args(frame->args);
+  function->refs++;
+  release_function(frame->function);
+  frame->function = function;
+  frame->args = args;
+  frame->argc = count_args(args);
+}
+
+// Calls in a pipeline, a condition or $(...) come through the executor
+// and recurse; argv stays the caller's.
+int call_function(ShellFunction *function, char **argv) {
+  if (call_depth == MAX_CALL_DEPTH) {
+    fprintf(stderr, "cshell: %s: maximum function nesting level exceeded\n",
+            function->name);
+    return 1;
+  }
+  ArgList args;
+  arglist_init(&args);
+  for (int i = 0; argv[i]; i++) {
+    char *arg = strdup(argv[i]);
+    if (!arg) {
+      perror("strdup failed");
+      exit(EXIT_FAILURE);
+    }
+    arglist_push(&args, arg);
+  }
+  if (push_frame(function, args.items, NULL) == -1)
+    return 1;
+  call_depth++;
+  int status = execute_script(function->body);
+  call_depth--;
+  pop_frame();
+  return status;
+}
+
+int function_return(int status) {
+  if (frame_count == 0) {
+    print_error("return: can only be used in a function");
+    return 1;
+  }
+  function_returning = 1;
+  return status;
+}
+
+// local NAME[=value]: the variable gets its old value back when the
+// function returns.
+int declare_local(const char *word) {
+  if (frame_count == 0) {
+    print_error("local: can only be used in a function");
+    return 1;
+  }
+  const char *eq = strchr(word, '=');
+  char *name = strndup(word, eq ? (size_t)(eq - word) : strlen(word));
+  if (!name) {
+    perror("strndup failed");
+    exit(EXIT_FAILURE);
+  }
+
+  int seen = 0;
+  for (int i = frames[frame_count - 1].locals; i < saved_count && !seen; i++)
+    seen = strcmp(saved_variables[i].name, name) == 0;
+  if (!seen) {
+    if (saved_count == saved_capacity) {
+      saved_capacity = saved_capacity ? saved_capacity * 2 : 16;
+      saved_variables =
+          realloc(saved_variables, saved_capacity * sizeof(SavedVariable));
+      if (!saved_variables) {
+        perror("realloc failed");
+        exit(EXIT_FAILURE);
+      }
+    }
+    const char *old = get_shell_variable(name);
+    SavedVariable *var = &saved_variables[saved_count++];
+    var->name = name;
+    var->value = old ? strdup(old) : NULL;
+    if (old && !var->value) {
+      perror("strdup failed");
+      exit(EXIT_FAILURE);
+    }
+    if (!eq)
+      unset_shell_variable(name);
+  }
+  if (eq)
+    set_shell_variable(name, eq + 1);
+  if (seen)
+    free(name);
+  return 0;
+}
+
+// $0 and, outside functions, $1...: what the shell was started with.
+static char **script_args = NULL;
+static int script_argc = 0;
+
+// args[0] becomes $0 (the script, or the name after -c cmd) and the rest
+// $1...; the strings are not copied.
+void set_script_arguments(char **args, int count) {
+  script_args = args;
+  script_argc = count;
+}
+
+const char *positional_parameter(int n) {
+  if (n == 0)
+    return script_argc ? script_args[0] : "cshell";
+  if (frame_count == 0)
+    return n < script_argc ? script_args[n] : NULL;
+  if (n >= frames[frame_count - 1].argc)
+    return NULL;
+  return frames[frame_count - 1].args[n];
+}
+
+int positional_count(void) {
+  if (frame_count == 0)
+    return script_argc ? script_argc - 1 : 0;
+  return frames[frame_count - 1].argc - 1;
+}
+
+// A simple command naming a function, which execute_script() can call
+// without recursing: no redirections, prefix assignments, 'time' or
+// 'limit', and a literal name, so that telling does not expand anything.
+static ShellFunction *direct_call(Node *node) {
+  if (node->type != NODE_PIPELINE)
+    return NULL;
+  Command *cmd = node->pipeline;
+  if (cmd->next || cmd->redirs || cmd->group || cmd->timed ||
+      cmd->limited || cmd->argc == 0 ||
+      strpbrk(cmd->args[0], "$'\"\\`*?[~="))
+    return NULL;
+  return find_function(cmd->args[0]);
+}
+
+// Run node up to a function call in its last position -- "f", "a && f",
+// "a; f" -- and return that call; NULL once the whole node has run, with
+// its status in *status.
+static Command *run_until_call(Node *node, int *status,
+                               ShellFunction **function) {
+  if ((*function = direct_call(node)) != NULL)
+    return node->pipeline;
+  switch (node->type) {
+  case NODE_AND:
+  case NODE_OR:
+  case NODE_SEQUENCE:
+    *status = execute_node(node->left);
+    if (function_returning || script_aborted ||
+        (node->type == NODE_AND && *status != 0) ||
+        (node->type == NODE_OR && *status == 0))
+      return NULL;
+    return run_until_call(node->right, status, function);
+  default:
+    *status = execute_node(node);
+    return NULL;
+  }
+}
+
 int evaluate_condition(const char *condition) {
-  Command *cmd = parse_command(condition);
-  if (!cmd)
+  Node *list = parse_list(condition);
+  if (!list)
     return 0;
-  int result = executable_builtin(cmd->args, cmd->argc);
-  free_command(cmd);
+  int result = execute_node(list);
+  free_node(list);
   return result == 0;
 }
 
+// Execute a parsed script and return the status of the last command.
+// A function call that ends a statement is made here rather than by the
+// executor: a frame remembers where to resume and the loop carries on in
+// the function's body, so recursion uses no C stack, and a call that ends
+// a body reuses the caller's frame.
 int execute_script(ScriptElement *script) {
-  ScriptContext context;
-  init_script_context(&context);
+  int status = 0;
+  int base = frame_count; // Frames above this are calls made by this loop
 
   ScriptElement *current = script;
 
-  while (current != NULL) {
-    switch (current->type) {
-    case SCRIPT_COMMAND:
-      if (current->cmd) {
-        executable_builtin(current->cmd->args, current->cmd->argc);
+  while (1) {
+    if (current == NULL || function_returning || script_aborted) {
+      if (frame_count == base)
+        break;
+      current = pop_frame();
+      last_exit_status = status;
+      continue;
+    }
+    ScriptElement *element = current;
+    current = current->next;
+
+    switch (element->type) {
+    case SCRIPT_COMMAND: {
+      ShellFunction *function;
+      Command *call =
+          element->list ? run_until_call(element->list, &status, &function)
+                        : NULL;
+      if (call == NULL)
+        break;
+      ArgList args;
+      arglist_init(&args);
+      for (int i = 0; i < call->argc; i++)
+        expand_word(call->args[i], &args);
+      if (expansion_aborted(1)) {
+        arglist_free(&args);
+        status = last_exit_status = 1;
+        break;
+      }
+      if (current == NULL && frame_count > base) {
+        replace_frame(function, args.items);
+      } else if (push_frame(function, args.items, current) == -1) {
+        status = 1;
+        break;
       }
+      current = function->body;
+      status = 0;
       break;
-    case SCRIPT_VARIABLE: {
-      char *eq_pos = strchr(current->content, '=');
-      if (eq_pos) {
-        *eq_pos = '\0';
-        char *name = current->content;
-        char *value = eq_pos + 1;
-
-        while (*name == ' ')
-          name++;
-        while (*value == ' ')
-          value++;
-
-        add_variable(&context, name, value);
+    }
+    case SCRIPT_SYNTAX_ERROR:
+      status = last_exit_status = 2;
+      script_aborted = 1;
+      break;
+    case SCRIPT_FUNCTION:
+      define_function(element->function);
+      status = 0;
+      break;
+    case SCRIPT_RETURN: {
+      int code = status;
+      if (element->content) {
+        char *arg = expand_word_single(element->content);
+        code = atoi(arg);
+        free(arg);
+      }
+      if (expansion_aborted(1)) {
+        status = last_exit_status = 1;
+        break;
       }
+      status = function_return(code);
       break;
     }
     case SCRIPT_IF: {
-      if (evaluate_condition(current->content)) {
-        if (current->body) {
-          execute_script(current->body);
+      if (evaluate_condition(element->content)) {
+        if (element->body) {
+          execute_script(element->body);
         }
-      } else if (current->next && current->next->type == SCRIPT_ELSE) {
-        if (current->next->body) {
-          execute_script(current->next->body);
+      } else if (element->next && element->next->type == SCRIPT_ELSE) {
+        if (element->next->body) {
+          execute_script(element->next->body);
         }
       }
       break;
     }
     case SCRIPT_WHILE: {
-      while (evaluate_condition(current->content)) {
-        if (current->body) {
-          execute_script(current->body);
+      while (!script_aborted && evaluate_condition(element->content)) {
+        if (element->body) {
+          execute_script(element->body);
         }
       }
       break;
@@ -156,10 +1221,8 @@ int execute_script(ScriptElement *script) {
     default:
       break;
     }
-    current = current->next;
   }
-  free_script_context(&context);
-  return 0;
+  return status;
 }
 
 void free_script_element(ScriptElement *element) {
@@ -172,8 +1235,10 @@ void free_script_element(ScriptElement *element) {
   if (element->content)
     free(element->content);
 
-  if (element->cmd)
-    free_command(element->cmd);
+  if (element->list)
+    free_node(element->list);
+
+  release_function(element->function);
 
   if (element->body)
     free_script_element(element->body);
@@ -1,194 +1,334 @@
-#include "include/builtins.h"
+#include "include/completion.h"
+#include "include/executor.h"
+#include "include/fileio.h"
 #include "include/history.h"
+#include "include/jobs.h"
+#include "include/lexer.h"
+#include "include/scriptcache.h"
 #include "include/scripting.h"
+#include "include/trace.h"
 #include "include/utils.h"
-#include <fcntl.h>
+#include <errno.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
-#define MAX_INPUT_SIZE 1024
-pid_t foreground_pid = 0;
 
 void sigint_handler(int signo) {
   (void)signo;
   printf("\n");
   if (foreground_pid > 0)
-    kill(foreground_pid, SIGINT);
+    kill(-foreground_pid, SIGINT);
+  fileio_interrupted = 1; // For a file builtin running in the shell
   fflush(stdout);
 }
 
+// Pipelines block SIGCHLD and reap their own stages; whatever turns up
+// here is a background job, a coprocess or a here-document writer.
 void sigchld_handler(int signo) {
   (void)signo;
+  int saved_errno = errno;
   int status;
   pid_t pid;
-  while ((pid == waitpid(-1, &status, WNOHANG)) > 0) {
-  }
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    jobs_child_exited(pid, status);
+  errno = saved_errno;
 }
 
 void sigtstp_handler(int signo) {
 
   (void)signo;
   if (foreground_pid > 0) {
-    kill(foreground_pid, SIGTSTP);
+    kill(-foreground_pid, SIGTSTP);
     printf("\nStopped: %d\n", (int)foreground_pid);
     fflush(stdout);
   }
 }
 
-int main() {
-  char input[MAX_INPUT_SIZE];
-  Command *cmd;
-  int status;
+// Parse and run a chunk of shell text; returns the last exit status.
+static int execute_text(const char *text) {
+  ScriptElement *script = parse_script(text);
+  if (!script)
+    return 0;
+  int status = execute_script(script);
+  free_script_element(script);
+  return status;
+}
 
-  // --- Command History ---
-  int current_history_index = 0;
+// Run a single line of input: a script invocation or shell text.
+static int execute_line(char *input) {
+  // Check if input is a script
+  if (strncmp(input, "run ", 4) == 0) {
+    char *script_filename = input + 4;
+    script_filename[strcspn(script_filename, "\n")] = 0;
+    char *script_content = read_file(script_filename, NULL);
+    if (!script_content) {
+      perror("Error opening script file.");
+      return 1;
+    }
+    int status = execute_text(script_content);
+    free(script_content);
+    return status;
+  }
 
-  if (signal(SIGINT, sigint_handler) == SIG_ERR) {
-    perror("signal failed");
-    exit(EXIT_FAILURE);
+  return execute_text(input);
+}
+
+// Non-interactive input: no termios and no prompt. The reader gives back
+// what it read past a statement before it runs, so commands reading stdin
+// get the lines after it.
+static int run_noninteractive(int fd) {
+  LineReader reader;
+  int status = 0;
+  char *line;
+  char *pending = NULL; // A statement still waiting for its other lines
+  size_t pending_len = 0;
+  ScanState scan = {0}; // How far pending is known to be complete
+
+  line_reader_init(&reader, fd);
+  while ((line = line_reader_next(&reader)) != NULL) {
+    size_t len = strlen(line);
+    pending = realloc(pending, pending_len + len + 2);
+    if (!pending) {
+      perror("realloc failed");
+      exit(EXIT_FAILURE);
+    }
+    memcpy(pending + pending_len, line, len);
+    pending_len += len;
+    pending[pending_len++] = '\n';
+    pending[pending_len] = '\0';
+    if (statement_pending_from(pending, &scan))
+      continue;
+    line_reader_sync(&reader);
+    status = execute_line(pending);
+    free(pending);
+    pending = NULL;
+    pending_len = 0;
+    scan = (ScanState){0};
+    if (script_aborted)
+      break;
   }
-  if (signal(SIGCHLD, sigchld_handler) == SIG_ERR) {
-    perror("signal (SIGCHLD) failed");
+  if (pending) {
+    status = execute_line(pending);
+    free(pending);
+  }
+  line_reader_free(&reader);
+  return status;
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: cshell [--startup-trace] [--fast-start] [--norc] "
+                  "[-c command [name [arg ...]] | script [arg ...]]\n");
+}
+
+// --- Startup tracing ---
+
+static int startup_trace = 0;
+static struct timespec trace_start, trace_last;
+
+static double elapsed_ms(const struct timespec *from,
+                         const struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) * 1e3 +
+         (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+// Report the time spent since the previous phase ended.
+static void trace_phase(const char *phase, const char *note) {
+  if (!startup_trace)
+    return;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  fprintf(stderr, "cshell: startup %-12s %9.3f ms%s\n", phase,
+          elapsed_ms(&trace_last, &now), note);
+  trace_last = now;
+}
+
+static void trace_total(const char *until) {
+  if (!startup_trace)
+    return;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  fprintf(stderr, "cshell: startup %-12s %9.3f ms (to %s)\n", "total",
+          elapsed_ms(&trace_start, &now), until);
+}
+
+static char *history_file_path(void) {
+  const char *path = getenv("CSHELL_HISTFILE");
+  if (path)
+    return *path ? strdup(path) : NULL;
+
+  const char *home = getenv("HOME");
+  if (!home)
+    return NULL;
+  char *file = malloc(strlen(home) + sizeof("/.cshell_history"));
+  if (!file) {
+    perror("malloc failed");
     exit(EXIT_FAILURE);
   }
+  sprintf(file, "%s/.cshell_history", home);
+  return file;
+}
 
-  if (signal(SIGTSTP, sigtstp_handler) == SIG_ERR) {
-    perror("signal (SIGTSTP) failed");
+// ~/.cshellrc, or $CSHELL_RC; an empty CSHELL_RC reads none.
+static char *rc_file_path(void) {
+  const char *path = getenv("CSHELL_RC");
+  if (path)
+    return *path ? strdup(path) : NULL;
+
+  const char *home = getenv("HOME");
+  if (!home)
+    return NULL;
+  char *file = malloc(strlen(home) + sizeof("/.cshellrc"));
+  if (!file) {
+    perror("malloc failed");
     exit(EXIT_FAILURE);
   }
+  sprintf(file, "%s/.cshellrc", home);
+  return file;
+}
 
-  while (1) {
-    printf("cshell> ");
-    fflush(stdout);
-    if (get_input(input, history, &history_count, &current_history_index) ==
-            0 &&
-        feof(stdin)) {
-      printf("\n");
+int main(int argc, char **argv) {
+  char *input;
+  const char *command = NULL;
+  const char *script_path = NULL;
+  int fast_start = 0;
+  int read_rc = 1;
+
+  clock_gettime(CLOCK_MONOTONIC, &trace_start);
+  trace_last = trace_start;
+
+  // --- Command History ---
+  int current_history_index = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--startup-trace") == 0) {
+      startup_trace = 1;
+    } else if (strcmp(argv[i], "--fast-start") == 0) {
+      fast_start = 1;
+    } else if (strcmp(argv[i], "--norc") == 0) {
+      read_rc = 0;
+    } else if (strcmp(argv[i], "-c") == 0) {
+      if (i + 1 >= argc) {
+        print_error("-c: option requires an argument");
+        usage();
+        return 2;
+      }
+      command = argv[++i];
+      // "cshell -c cmd name a b": $0 is name, $1... the rest.
+      if (i + 1 < argc)
+        set_script_arguments(argv + i + 1, argc - i - 1);
+      break;
+    } else if (strcmp(argv[i], "--") == 0) {
+      if (i + 1 < argc) {
+        script_path = argv[i + 1];
+        set_script_arguments(argv + i + 1, argc - i - 1);
+      }
+      break;
+    } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+      fprintf(stderr, "cshell: unknown option: %s\n", argv[i]);
+      usage();
+      return 2;
+    } else {
+      script_path = argv[i];
+      set_script_arguments(argv + i, argc - i);
       break;
     }
-    if (strlen(input) > 0) {
-      add_to_history(input, history, &history_count, &current_history_index);
+  }
+
+  if (signal(SIGCHLD, sigchld_handler) == SIG_ERR) {
+    perror("signal (SIGCHLD) failed");
+    exit(EXIT_FAILURE);
+  }
+
+  // Job control only for an interactive shell: each pipeline gets its own
+  // process group and the terminal while it runs. Scripts leave their
+  // children in the shell's group so ^C reaches everything.
+  int interactive = !command && !script_path && isatty(STDIN_FILENO);
+  if (interactive) {
+    if (signal(SIGINT, sigint_handler) == SIG_ERR) {
+      perror("signal failed");
+      exit(EXIT_FAILURE);
     }
+    if (signal(SIGTSTP, sigtstp_handler) == SIG_ERR) {
+      perror("signal (SIGTSTP) failed");
+      exit(EXIT_FAILURE);
+    }
+    signal(SIGTTOU, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    setpgid(0, 0);
+    tcsetpgrp(STDIN_FILENO, getpgrp());
+    job_control = 1;
+  }
+  trace_phase("signals", "");
 
-    // Check if input is a script
-    if (strncmp(input, "run ", 4) == 0) {
-      char *script_filename = input + 4;
-      script_filename[strcspn(script_filename, "\n")] = 0;
-      FILE *script_file = fopen(script_filename, "r");
-      if (script_file) {
-        char script_content[4096] = {0};
-        size_t bytes_read =
-            fread(script_content, 1, sizeof(script_content) - 1, script_file);
-        fclose(script_file);
-
-        ScriptElement *script = parse_script(script_content);
-        if (script) {
-          execute_script(script);
-          free_script_element(script);
-        }
-      } else {
-        perror("Error opening script file.");
-      }
-      continue;
+  if (command) {
+    trace_total("command");
+    return execute_text(command);
+  }
+  if (script_path) {
+    char *script = read_file(script_path, NULL);
+    if (!script) {
+      perror(script_path);
+      return 127;
     }
+    trace_phase("script read", "");
+    trace_total("script");
+    int status = execute_text(script);
+    free(script);
+    return status;
+  }
+  if (!interactive) {
+    trace_total("input");
+    return run_noninteractive(STDIN_FILENO);
+  }
 
-    cmd = parse_command(input);
-    if (!cmd)
-      continue;
+  // Interactive only: history and the completion index. With --fast-start
+  // both are loaded on first use instead.
+  char *history_path = history_file_path();
+  history_set_file(history_path, fast_start);
+  free(history_path);
+  trace_phase("history", fast_start ? " (deferred)" : "");
 
-    Command *current = cmd;
-    int input_fd = 0;
+  if (!fast_start)
+    path_index_refresh();
+  trace_phase("completion", fast_start ? " (deferred)" : "");
 
-    while (current != NULL) {
-      int pipefd[2];
-      if (current->next != NULL) {
-        if (pipe(pipefd) == -1) {
-          perror("pipe failed");
-          exit(EXIT_FAILURE);
-        }
-      }
+  // The rc file runs through the script cache, so an unchanged file is
+  // not parsed again when CSHELL_SCRIPT_CACHE keeps it on disk.
+  char *rc_path = read_rc ? rc_file_path() : NULL;
+  if (rc_path && access(rc_path, R_OK) == 0) {
+    const char *origin = "";
+    source_file(rc_path, &origin);
+    char note[32];
+    snprintf(note, sizeof(note), " (%s)", origin);
+    trace_phase("rc file", note);
+  }
+  free(rc_path);
+  trace_total("first prompt");
 
-      if (current == cmd &&
-          executable_builtin(current->args, current->argc) != -1) {
-        current = current->next;
-        continue;
-      }
-      pid_t pid = fork();
-
-      if (pid == -1) {
-        perror("fork failed");
-        exit(EXIT_FAILURE);
-      } else if (pid == 0) {
-
-        if (current->input_file) {
-          int fd = open(current->input_file, O_RDONLY);
-          if (fd == -1) {
-            perror("open failed");
-            exit(EXIT_FAILURE);
-          }
-          dup2(fd, STDIN_FILENO);
-          close(fd);
-        } else if (input_fd != 0) { // If not the first command
-          dup2(input_fd, STDIN_FILENO);
-        }
-
-        if (current->output_file) {
-          int flags = O_WRONLY | O_CREAT;
-          flags |= (current->append) ? O_APPEND : O_TRUNC;
-          int fd = open(current->output_file, flags, 0644);
-          if (fd == -1) {
-            perror("open failed");
-            exit(EXIT_FAILURE);
-          }
-          dup2(fd, STDOUT_FILENO);
-          close(fd);
-        } else if (current->next != NULL) {
-          dup2(pipefd[1], STDOUT_FILENO);
-        }
-
-        // Close all pipe ends in the child
-        if (current->next != NULL) {
-          close(pipefd[0]);
-          close(pipefd[1]);
-        }
-        if (input_fd != 0) {
-          close(input_fd);
-        }
-
-        if (execvp(current->args[0], current->args) == -1) {
-          perror("execvp failed");
-          exit(EXIT_FAILURE);
-        }
-
-      } else {
-        if (current == cmd) {
-          foreground_pid = pid;
-          setpgid(pid, pid);
-        }
-        if (input_fd != 0) {
-          close(input_fd);
-        }
-
-        if (current->next != NULL) {
-          close(pipefd[1]);
-          input_fd = pipefd[0];
-        }
-        current = current->next;
-      }
-    }
-    (void)status;
+  while (1) {
+    jobs_notify();
+    trace_flush(); // Whatever ran is in the trace before the next prompt
 
-    if (foreground_pid > 0) {
-      waitpid(foreground_pid, &status, WUNTRACED);
-      foreground_pid = 0;
+    input = read_input(history, &history_count, &current_history_index);
+    if (input == NULL)
+      break;
+    if (strlen(input) > 0) {
+      add_to_history(input, history, &history_count, &current_history_index);
+      history_append_file(input);
     }
 
-    free_command(cmd); // Free the entire command list
+    // A paste may carry several lines; the script parser runs them in
+    // order and keeps here-document bodies together. A syntax error stops
+    // the rest of them, not the shell.
+    script_aborted = 0;
+    execute_line(input);
+    free(input);
   }
 
   return 0;
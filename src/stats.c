@@ -0,0 +1,162 @@
+#include "include/stats.h"
+#include "include/completion.h"
+#include "include/environment.h"
+#include "include/history.h"
+#include "include/scriptcache.h"
+#include <malloc.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// What the shell itself holds and does, for the stats builtin. Memory is
+// measured when asked, by walking each subsystem's structures and summing
+// malloc_usable_size(); the counters are bumped where the work happens and
+// exist only in builds configured with CSHELL_STATS.
+
+#ifdef CSHELL_STATS
+unsigned long stats_allocations[STATS_SUBSYSTEMS];
+unsigned long stats_events[STATS_EVENTS];
+static long long fork_nanoseconds = 0; // Spent in fork() by the parent
+
+static const char *subsystem_names[STATS_SUBSYSTEMS] = {
+    "parser",      "expansion",    "variables",
+    "environment", "script cache", "completion",
+};
+#endif
+
+pid_t stats_fork(void) {
+#ifdef CSHELL_STATS
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pid_t pid = fork();
+  if (pid != 0) {
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fork_nanoseconds += (end.tv_sec - start.tv_sec) * 1000000000LL +
+                        (end.tv_nsec - start.tv_nsec);
+    stats_events[STATS_FORKS]++;
+  }
+  return pid;
+#else
+  return fork();
+#endif
+}
+
+void stats_reset(void) {
+#ifdef CSHELL_STATS
+  memset(stats_allocations, 0, sizeof(stats_allocations));
+  memset(stats_events, 0, sizeof(stats_events));
+  fork_nanoseconds = 0;
+#endif
+}
+
+size_t stats_block(const void *ptr) {
+  return ptr ? malloc_usable_size((void *)ptr) : 0;
+}
+
+static size_t command_bytes(const Command *cmd) {
+  size_t total = 0;
+  for (; cmd; cmd = cmd->next) {
+    total += stats_block(cmd) + stats_block(cmd->args);
+    for (int i = 0; i < cmd->argc; i++)
+      total += stats_block(cmd->args[i]);
+    for (const Redirection *r = cmd->redirs; r; r = r->next)
+      total += stats_block(r) + stats_block(r->target) +
+               stats_block(r->fd_name);
+    total += stats_node_bytes(cmd->group);
+  }
+  return total;
+}
+
+size_t stats_node_bytes(const Node *node) {
+  if (!node)
+    return 0;
+  return stats_block(node) + stats_block(node->name) +
+         stats_block(node->text) + command_bytes(node->pipeline) +
+         stats_node_bytes(node->left) + stats_node_bytes(node->right);
+}
+
+// A function's body is counted with the function table, not here.
+size_t stats_script_bytes(const ScriptElement *element) {
+  size_t total = 0;
+  for (; element; element = element->next) {
+    total += stats_block(element) + stats_block(element->content) +
+             stats_node_bytes(element->list) +
+             stats_script_bytes(element->condition) +
+             stats_script_bytes(element->body);
+  }
+  return total;
+}
+
+static void print_bytes(FILE *out, const char *name, size_t bytes,
+                        const char *detail) {
+  fprintf(out, "  %-20s %12zu%s%s\n", name, bytes, detail[0] ? "  " : "",
+          detail);
+}
+
+#ifdef CSHELL_STATS
+static void print_rate(FILE *out, const char *name, unsigned long hits,
+                       unsigned long total, const char *detail) {
+  fprintf(out, "  %-20s %12lu", name, total);
+  if (total > 0)
+    fprintf(out, "  %s, %.0f%% hits", detail, 100.0 * hits / total);
+  fputc('\n', out);
+}
+#endif
+
+void stats_report(FILE *out) {
+  char detail[96];
+  struct mallinfo2 heap = mallinfo2();
+  fprintf(out, "memory (bytes)\n");
+  print_bytes(out, "heap in use", heap.uordblks + heap.hblkhd, "");
+
+  size_t used, entries;
+  size_t history_total = history_bytes(&used, &entries);
+  snprintf(detail, sizeof(detail), "%zu used by %zu entries", used, entries);
+  print_bytes(out, "history", history_total, detail);
+
+  int scalars, arrays;
+  size_t variables = variable_bytes(&scalars, &arrays);
+  snprintf(detail, sizeof(detail), "%d scalars, %d arrays", scalars, arrays);
+  print_bytes(out, "variables", variables, detail);
+
+  int functions;
+  size_t function_total = function_bytes(&functions);
+  snprintf(detail, sizeof(detail), "%d defined", functions);
+  print_bytes(out, "functions", function_total, detail);
+  print_bytes(out, "environment", env_bytes(), "");
+
+  int scripts;
+  size_t script_total = script_cache_bytes(&scripts);
+  snprintf(detail, sizeof(detail), "%d files", scripts);
+  print_bytes(out, "script cache", script_total, detail);
+  print_bytes(out, "completion caches", completion_bytes(), "");
+
+#ifdef CSHELL_STATS
+  fprintf(out, "allocations\n");
+  for (int i = 0; i < STATS_SUBSYSTEMS; i++)
+    fprintf(out, "  %-20s %12lu\n", subsystem_names[i], stats_allocations[i]);
+
+  unsigned long forks = stats_events[STATS_FORKS];
+  fprintf(out, "processes\n  %-20s %12lu", "forks", forks);
+  if (forks > 0)
+    fprintf(out, "  %.1f us each in fork()",
+            fork_nanoseconds / 1000.0 / forks);
+  fprintf(out, "\nglobs\n  %-20s %12lu  %lu paths matched\n", "calls",
+          stats_events[STATS_GLOBS], stats_events[STATS_GLOB_PATHS]);
+
+  fprintf(out, "caches\n");
+  unsigned long memory = stats_events[STATS_SCRIPT_MEMORY_HITS],
+                disk = stats_events[STATS_SCRIPT_DISK_HITS],
+                parsed = stats_events[STATS_SCRIPT_PARSES];
+  snprintf(detail, sizeof(detail), "%lu from memory, %lu from disk", memory,
+           disk);
+  print_rate(out, "script loads", memory + disk, memory + disk + parsed,
+             detail);
+  unsigned long hits = stats_events[STATS_DIR_CACHE_HITS],
+                misses = stats_events[STATS_DIR_CACHE_MISSES];
+  snprintf(detail, sizeof(detail), "%lu listings reused", hits);
+  print_rate(out, "directory lookups", hits, hits + misses, detail);
+#else
+  fprintf(out, "counters not compiled in (configure with -DCSHELL_STATS=ON)\n");
+#endif
+}
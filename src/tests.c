@@ -1,5 +1,18 @@
 #include "include/builtins.h"
+#include "include/completion.h"
+#include "include/environment.h"
+#include "include/executor.h"
+#include "include/expand.h"
+#include "include/fileio.h"
 #include "include/history.h"
+#include "include/joblimits.h"
+#include "include/lexer.h"
+#include "include/lineedit.h"
+#include "include/scriptcache.h"
+#include "include/scripting.h"
+#include "include/stats.h"
+#include "include/timing.h"
+#include "include/trace.h"
 #include "include/utils.h"
 #include <assert.h>
 #include <fcntl.h>
@@ -7,16 +20,26 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+// The first redirection of fd in a command, or NULL.
+static Redirection *find_redirection(Command *cmd, int fd) {
+  for (Redirection *redir = cmd->redirs; redir != NULL; redir = redir->next) {
+    if (redir->fd == fd)
+      return redir;
+  }
+  return NULL;
+}
+
 void test_parse_simple_command() {
   Command *cmd = parse_command("ls");
   assert(cmd != NULL);
   assert(strcmp(cmd->args[0], "ls") == 0);
   assert(cmd->argc == 1);
-  assert(cmd->input_file == NULL);
-  assert(cmd->output_file == NULL);
-  assert(cmd->append == 0);
+  assert(find_redirection(cmd, 0) == NULL);
+  assert(cmd->redirs == NULL);
   assert(cmd->next == NULL);
   printf("test_parse_simple_command: Passed\n");
 }
@@ -28,8 +51,8 @@ void test_parse_command_with_args() {
   assert(strcmp(cmd->args[1], "-l") == 0);
   assert(strcmp(cmd->args[2], "-a") == 0);
   assert(cmd->argc == 3);
-  assert(cmd->input_file == NULL);
-  assert(cmd->output_file == NULL);
+  assert(find_redirection(cmd, 0) == NULL);
+  assert(find_redirection(cmd, 1) == NULL);
   assert(cmd->next == NULL);
   printf("test_parse_command_with_args: Passed\n");
 }
@@ -39,8 +62,9 @@ void test_parse_input_redirection() {
   assert(cmd != NULL);
   assert(strcmp(cmd->args[0], "sort") == 0);
   assert(cmd->argc == 1);
-  assert(strcmp(cmd->input_file, "input.txt") == 0);
-  assert(cmd->output_file == NULL);
+  assert(strcmp(find_redirection(cmd, 0)->target, "input.txt") == 0);
+  assert(find_redirection(cmd, 0)->type == REDIR_INPUT);
+  assert(find_redirection(cmd, 1) == NULL);
   assert(cmd->next == NULL);
   printf("test_parse_input_redirection: Passed\n");
 }
@@ -50,9 +74,9 @@ void test_parse_output_redirection() {
   assert(cmd != NULL);
   assert(strcmp(cmd->args[0], "ls") == 0);
   assert(cmd->argc == 1);
-  assert(cmd->input_file == NULL);
-  assert(strcmp(cmd->output_file, "output.txt") == 0);
-  assert(cmd->append == 0);
+  assert(find_redirection(cmd, 0) == NULL);
+  assert(strcmp(find_redirection(cmd, 1)->target, "output.txt") == 0);
+  assert(find_redirection(cmd, 1)->type == REDIR_OUTPUT);
   assert(cmd->next == NULL);
   printf("test_parse_output_redirection: Passed\n");
 }
@@ -63,9 +87,9 @@ void test_parse_append_redirection() {
   assert(strcmp(cmd->args[0], "echo") == 0);
   assert(strcmp(cmd->args[1], "hello") == 0);
   assert(cmd->argc == 2);
-  assert(cmd->input_file == NULL);
-  assert(strcmp(cmd->output_file, "output.txt") == 0);
-  assert(cmd->append == 1);
+  assert(find_redirection(cmd, 0) == NULL);
+  assert(strcmp(find_redirection(cmd, 1)->target, "output.txt") == 0);
+  assert(find_redirection(cmd, 1)->type == REDIR_APPEND);
   assert(cmd->next == NULL);
   printf("test_parse_append_redirection: Passed\n");
 }
@@ -77,16 +101,16 @@ void test_parse_pipe() {
   assert(strcmp(cmd->args[0], "ls") == 0);
   assert(strcmp(cmd->args[1], "-l") == 0);
   assert(cmd->argc == 2);
-  assert(cmd->input_file == NULL);
-  assert(cmd->output_file == NULL);
+  assert(find_redirection(cmd, 0) == NULL);
+  assert(find_redirection(cmd, 1) == NULL);
   assert(cmd->next != NULL);
 
   Command *next_cmd = cmd->next;
   assert(strcmp(next_cmd->args[0], "grep") == 0);
   assert(strcmp(next_cmd->args[1], "foo") == 0);
   assert(next_cmd->argc == 2);
-  assert(next_cmd->input_file == NULL);
-  assert(next_cmd->output_file == NULL);
+  assert(find_redirection(next_cmd, 0) == NULL);
+  assert(find_redirection(next_cmd, 1) == NULL);
   assert(next_cmd->next == NULL);
 
   printf("test_parse_pipe: Passed\n");
@@ -124,13 +148,14 @@ void test_parse_combined_redirection_and_pipe() {
   Command *cmd = parse_command("cat < input.txt | grep error > output.txt");
   assert(cmd != NULL);
   assert(strcmp(cmd->args[0], "cat") == 0);
-  assert(strcmp(cmd->input_file, "input.txt") == 0);
+  assert(strcmp(find_redirection(cmd, 0)->target, "input.txt") == 0);
+  assert(find_redirection(cmd, 0)->type == REDIR_INPUT);
   assert(cmd->next != NULL);
 
   Command *cmd2 = cmd->next;
   assert(strcmp(cmd2->args[0], "grep") == 0);
   assert(strcmp(cmd2->args[1], "error") == 0);
-  assert(strcmp(cmd2->output_file, "output.txt") == 0);
+  assert(strcmp(find_redirection(cmd2, 1)->target, "output.txt") == 0);
   assert(cmd2->next == NULL);
 
   printf("test_parse_combined_redirection_and_pipe: Passed\n");
@@ -147,6 +172,73 @@ void test_parse_error_handling() {
   printf("test_parse_error_handling: Passed\n");
 }
 
+void test_parse_fd_redirections() {
+  Command *cmd = parse_command("make 2>&1 >build.log 3<>state 4>&- 2 &>all");
+  assert(cmd != NULL);
+  assert(cmd->argc == 2);
+  assert(strcmp(cmd->args[1], "2") == 0);
+
+  Redirection *r = cmd->redirs;
+  assert(r->type == REDIR_DUP && r->fd == 2 && r->target_fd == 1);
+  r = r->next;
+  assert(r->type == REDIR_OUTPUT && r->fd == 1);
+  assert(strcmp(r->target, "build.log") == 0);
+  r = r->next;
+  assert(r->type == REDIR_READWRITE && r->fd == 3);
+  r = r->next;
+  assert(r->type == REDIR_CLOSE && r->fd == 4);
+  r = r->next;
+  assert(r->type == REDIR_OUTPUT && r->fd == 1 && strcmp(r->target, "all") == 0);
+  r = r->next;
+  assert(r->type == REDIR_DUP && r->fd == 2 && r->target_fd == 1);
+  assert(r->next == NULL);
+  free_command(cmd);
+
+  // Quoted operators are plain words.
+  cmd = parse_command("echo 'a > b' \"c|d\" e\\>f");
+  assert(cmd != NULL && cmd->argc == 4 && cmd->redirs == NULL);
+  assert(strcmp(cmd->args[1], "'a > b'") == 0);
+  free_command(cmd);
+
+  assert(parse_command("echo 'open") == NULL);
+  assert(parse_command("ls |") == NULL);
+  assert(parse_command("cat 1>&x") == NULL);
+
+  // Digits out of range still name a descriptor, never a file.
+  cmd = parse_command("echo hi >&999");
+  assert(cmd->redirs->type == REDIR_DUP &&
+         strcmp(cmd->redirs->target, "999") == 0);
+  free_command(cmd);
+  char *output = command_output("echo hi >&999; echo $?");
+  assert(output && strcmp(output, "1") == 0 && access("999", F_OK) == -1);
+  free(output);
+  printf("test_parse_fd_redirections: Passed\n");
+}
+
+void test_parse_command_lists() {
+  Node *list = parse_list("a && b || c; (d | e) > f; { g; }");
+  assert(list != NULL && list->type == NODE_SEQUENCE);
+  Node *first = list->left->left;
+  assert(first->type == NODE_OR && first->left->type == NODE_AND);
+  assert(strcmp(first->left->left->pipeline->args[0], "a") == 0);
+  assert(strcmp(first->right->pipeline->args[0], "c") == 0);
+
+  Command *sub = list->left->right->pipeline;
+  assert(sub->subshell && sub->group->type == NODE_PIPELINE);
+  assert(sub->group->pipeline->next != NULL);
+  assert(sub->redirs && strcmp(sub->redirs->target, "f") == 0);
+
+  Command *group = list->right->pipeline;
+  assert(!group->subshell && strcmp(group->group->pipeline->args[0], "g") == 0);
+  free_node(list);
+
+  assert(parse_list("a &&") == NULL);
+  assert(parse_list("( a") == NULL);
+  assert(parse_list("{ a }") == NULL);
+  assert(parse_list("a ;; b") == NULL);
+  printf("test_parse_command_lists: Passed\n");
+}
+
 void test_history_add_and_get() {
   char test_history[MAX_HISTORY_SIZE][MAX_INPUT_SIZE];
   int test_history_count = 0;
@@ -184,12 +276,62 @@ void test_history_circular_buffer() {
   printf("test_history_circular_buffer: Passed\n");
 }
 
+void test_history_long_and_multiline() {
+  char test_history[MAX_HISTORY_SIZE][MAX_INPUT_SIZE];
+  int test_history_count = 0;
+  int current_index = 0;
+
+  add_to_history("echo one\necho two\n", test_history, &test_history_count,
+                 &current_index);
+  assert(strcmp(get_history_entry(test_history, test_history_count, 0),
+                "echo one\necho two") == 0);
+
+  char *long_command = malloc(MAX_INPUT_SIZE * 4);
+  memset(long_command, 'x', MAX_INPUT_SIZE * 4 - 1);
+  long_command[MAX_INPUT_SIZE * 4 - 1] = '\0';
+  add_to_history(long_command, test_history, &test_history_count,
+                 &current_index);
+  assert(strlen(get_history_entry(test_history, test_history_count, 1)) ==
+         MAX_INPUT_SIZE - 1);
+  free(long_command);
+  printf("test_history_long_and_multiline: Passed\n");
+}
+
+void test_history_file_deferred_load() {
+  char path[] = "/tmp/cshell_historyXXXXXX";
+  int fd = mkstemp(path);
+  assert(fd != -1);
+  assert(write(fd, "old1\nold2\n", 10) == 10);
+  close(fd);
+
+  int current_index = 0;
+  history_count = 0;
+  history_set_file(path, 1); // Deferred: nothing is read yet
+  assert(history_count == 0);
+
+  add_to_history("new", history, &history_count, &current_index);
+  history_append_file("new");
+  assert(history_count == 1);
+
+  assert(history_ensure_loaded() == 1);
+  assert(history_ensure_loaded() == 0); // Only loads once
+  assert(history_count == 3);
+  assert(strcmp(get_history_entry(history, history_count, 0), "old1") == 0);
+  assert(strcmp(get_history_entry(history, history_count, 2), "new") == 0);
+
+  history_set_file(NULL, 0);
+  history_count = 0;
+  remove(path);
+  printf("test_history_file_deferred_load: Passed\n");
+}
+
 void test_get_input_basic() {
   char buffer[MAX_INPUT_SIZE];
   char test_history[MAX_HISTORY_SIZE][MAX_INPUT_SIZE]; // Dummy history.
   int test_history_count = 0;
   int current_history_index = 0;
 
+  FILE *saved_stdin = stdin;
   FILE *input_stream = fmemopen("hello\n", 6, "r");
   stdin = input_stream; // Redirect stdin
 
@@ -201,17 +343,76 @@ void test_get_input_basic() {
   fclose(input_stream);
 
   // Restore
-  freopen("/dev/tty", "r", stdin);
+  stdin = saved_stdin;
   printf("test_get_input_basic: Passed\n");
 }
 
+void test_gap_buffer_editing() {
+  GapBuffer gb;
+  gap_init(&gb, 4); // Small capacity forces the buffer to grow
+
+  gap_insert(&gb, "echo world", 10);
+  gap_move(&gb, 5);
+  gap_insert(&gb, "hello ", 6);
+  char *text = gap_substr(&gb, 0, gap_length(&gb));
+  assert(strcmp(text, "echo hello world") == 0);
+  free(text);
+
+  gap_backspace(&gb, 6); // Remove "hello " before the cursor
+  gap_delete(&gb, 5);    // Remove "world" after the cursor
+  assert(gap_length(&gb) == 5);
+  assert(gap_at(&gb, 4) == ' ');
+
+  gap_set(&gb, "ls");
+  text = gap_substr(&gb, 0, gap_length(&gb));
+  assert(strcmp(text, "ls") == 0);
+  assert(gb.gap_start == 2);
+  free(text);
+
+  gap_free(&gb);
+  printf("test_gap_buffer_editing: Passed\n");
+}
+
+void test_utf8_display_width() {
+  uint32_t cp;
+  assert(utf8_decode("\xc3\xa9", 2, &cp) == 2 && cp == 0xE9);
+  assert(utf8_decode("\xff", 1, &cp) == 1 && cp == 0xFFFD);
+
+  assert(utf8_display_width("abc", 3) == 3);
+  assert(utf8_display_width("\xe6\x97\xa5\xe6\x9c\xac", 6) == 4); // CJK
+  assert(utf8_display_width("e\xcc\x81", 3) == 1); // e + combining acute
+  assert(utf8_char_width('\t') == 2);                // Shown as ^I
+  printf("test_utf8_display_width: Passed\n");
+}
+
+void test_grapheme_motion() {
+  GapBuffer gb;
+  gap_init(&gb, 16);
+  // "a", "e" + combining acute, CJK character
+  const char *text = "ae\xcc\x81\xe6\x97\xa5";
+  gap_insert(&gb, text, strlen(text));
+
+  assert(grapheme_next(&gb, 0) == 1);
+  assert(grapheme_next(&gb, 1) == 4);
+  assert(grapheme_next(&gb, 4) == 7);
+  assert(grapheme_prev(&gb, 7) == 4);
+  assert(grapheme_prev(&gb, 4) == 1);
+  assert(grapheme_prev(&gb, 1) == 0);
+
+  gap_free(&gb);
+  printf("test_grapheme_motion: Passed\n");
+}
+
 void test_builtin_cd() {
   char *original_dir = getcwd(NULL, 0); // Get the current working directory
   assert(original_dir != NULL);
 
   // Test changing to a valid directory
-  char *test_dir_name = "test_dir";
-  mkdtemp(test_dir_name); // create a temporal directory.
+  char test_dir_name[] = "test_dirXXXXXX";
+  assert(mkdtemp(test_dir_name) != NULL); // create a temporal directory.
+
+  char full_test_dir_path[PATH_MAX];
+  assert(realpath(test_dir_name, full_test_dir_path) != NULL);
 
   char *args1[] = {"cd", test_dir_name, NULL};
   assert(builtin_cd(args1) == 0);
@@ -219,9 +420,6 @@ void test_builtin_cd() {
   char *new_dir = getcwd(NULL, 0);
   assert(new_dir != NULL);
 
-  char full_test_dir_path[PATH_MAX];
-
-  realpath(test_dir_name, full_test_dir_path);
   assert(strcmp(new_dir, full_test_dir_path) == 0);
 
   char *args_restore[] = {"cd", original_dir, NULL};
@@ -237,12 +435,12 @@ void test_builtin_exit() { printf("test_builtin_exit: Check Manually\n"); }
 
 void test_builtin_history() {
 
-  char test_history[MAX_HISTORY_SIZE][MAX_INPUT_SIZE];
-  int test_history_count = 0;
+  // builtin_history prints the shell's global history.
   int current_index = 0;
 
-  add_to_history("command1", test_history, &test_history_count, &current_index);
-  add_to_history("command2", test_history, &test_history_count, &current_index);
+  add_to_history("command1", history, &history_count, &current_index);
+  add_to_history("command2", history, &history_count, &current_index);
+  fflush(stdout);
   int stdout_copy = dup(STDOUT_FILENO); // Save stdout
   char buffer[1024];
   int fd =
@@ -251,6 +449,7 @@ void test_builtin_history() {
 
   char *args[] = {"history", NULL};
   builtin_history(args);
+  fflush(stdout);
 
   dup2(stdout_copy, STDOUT_FILENO);
   close(stdout_copy);
@@ -282,6 +481,485 @@ void test_execute_builtin() {
   printf("test_execute_builtin: Passed\n");
 }
 
+void test_complete_commands_from_path() {
+  char dir[] = "/tmp/cshell_pathXXXXXX";
+  assert(mkdtemp(dir) != NULL);
+  char file[PATH_MAX];
+  const char *names[] = {"zzfoo", "zzfoobar", "zzplain"};
+  for (int i = 0; i < 3; i++) {
+    snprintf(file, sizeof(file), "%s/%s", dir, names[i]);
+    int fd = open(file, O_WRONLY | O_CREAT, i < 2 ? 0755 : 0644);
+    close(fd);
+  }
+
+  char *old_path = getenv("PATH") ? strdup(getenv("PATH")) : NULL;
+  setenv("PATH", dir, 1);
+
+  Completions c;
+  assert(complete_word("zzf", 3, &c) == 2); // zzplain is not executable
+  assert(strcmp(c.items[0], "zzfoo") == 0);
+  assert(strcmp(c.items[1], "zzfoobar") == 0);
+  assert(c.word_start == 0);
+  free_completions(&c);
+
+  assert(complete_word("ls | zzfoob", 11, &c) == 1);
+  assert(strcmp(c.items[0], "zzfoobar") == 0);
+  assert(c.word_start == 5);
+  free_completions(&c);
+
+  assert(complete_word("hist", 4, &c) == 1); // Builtins complete too
+  assert(strcmp(c.items[0], "history") == 0);
+  free_completions(&c);
+
+  for (int i = 0; i < 3; i++) {
+    snprintf(file, sizeof(file), "%s/%s", dir, names[i]);
+    remove(file);
+  }
+  rmdir(dir);
+  if (old_path) {
+    setenv("PATH", old_path, 1);
+    free(old_path);
+  }
+  free_completion_caches();
+  printf("test_complete_commands_from_path: Passed\n");
+}
+
+void test_complete_variables() {
+  set_shell_variable("zzlocal", "1");
+  declare_array("zzlist", ARRAY_INDEXED);
+  setenv("zzexported", "1", 1);
+
+  Completions c;
+  assert(complete_word("echo $zz", 8, &c) == 3);
+  assert(strcmp(c.items[0], "$zzexported") == 0);
+  assert(strcmp(c.items[1], "$zzlist") == 0);
+  assert(strcmp(c.items[2], "$zzlocal") == 0);
+  assert(c.word_start == 5);
+  free_completions(&c);
+
+  unset_shell_variable("zzlocal");
+  unset_shell_variable("zzlist");
+  unsetenv("zzexported");
+  printf("test_complete_variables: Passed\n");
+}
+
+void test_complete_files() {
+  char dir[] = "/tmp/cshell_filesXXXXXX";
+  assert(mkdtemp(dir) != NULL);
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/alpha file", dir);
+  close(open(path, O_WRONLY | O_CREAT, 0644));
+  snprintf(path, sizeof(path), "%s/alps", dir);
+  mkdir(path, 0755);
+
+  char line[PATH_MAX];
+  snprintf(line, sizeof(line), "cat %s/al", dir);
+
+  Completions c;
+  assert(complete_word(line, strlen(line), &c) == 2);
+  snprintf(path, sizeof(path), "%s/alpha\\ file", dir);
+  assert(strcmp(c.items[0], path) == 0); // Space is escaped
+  snprintf(path, sizeof(path), "%s/alps/", dir);
+  assert(strcmp(c.items[1], path) == 0); // Directories end in '/'
+  assert(c.word_start == 4);
+  free_completions(&c);
+
+  snprintf(path, sizeof(path), "%s/alpha file", dir);
+  remove(path);
+  snprintf(path, sizeof(path), "%s/alps", dir);
+  rmdir(path);
+  rmdir(dir);
+  free_completion_caches();
+  printf("test_complete_files: Passed\n");
+}
+
+void test_line_reader() {
+  int fds[2];
+  assert(pipe(fds) == 0);
+  const char *text = "echo one\n\nlast line without newline";
+  assert(write(fds[1], text, strlen(text)) == (ssize_t)strlen(text));
+  close(fds[1]);
+
+  LineReader reader;
+  line_reader_init(&reader, fds[0]);
+  assert(strcmp(line_reader_next(&reader), "echo one") == 0);
+  assert(strcmp(line_reader_next(&reader), "") == 0);
+  assert(strcmp(line_reader_next(&reader), "last line without newline") == 0);
+  assert(line_reader_next(&reader) == NULL);
+  line_reader_free(&reader);
+  close(fds[0]);
+
+  // Whatever a command reads between lines is not read again, from a pipe
+  // or from a file.
+  char taken[8] = "";
+  text = "read x\nhello\necho $x\n";
+  assert(pipe(fds) == 0);
+  assert(write(fds[1], text, strlen(text)) == (ssize_t)strlen(text));
+  close(fds[1]);
+  line_reader_init(&reader, fds[0]);
+  assert(strcmp(line_reader_next(&reader), "read x") == 0);
+  assert(read(fds[0], taken, 6) == 6 && strcmp(taken, "hello\n") == 0);
+  assert(strcmp(line_reader_next(&reader), "echo $x") == 0);
+  line_reader_free(&reader);
+  close(fds[0]);
+
+  char path[] = "/tmp/cshell_readerXXXXXX";
+  int fd = mkstemp(path);
+  assert(fd != -1 && write(fd, text, strlen(text)) == (ssize_t)strlen(text));
+  assert(lseek(fd, 0, SEEK_SET) == 0);
+  line_reader_init(&reader, fd);
+  assert(strcmp(line_reader_next(&reader), "read x") == 0);
+  line_reader_sync(&reader); // Nothing read this time: the buffer is kept
+  assert(strcmp(line_reader_next(&reader), "hello") == 0);
+  line_reader_sync(&reader);
+  memset(taken, 0, sizeof(taken));
+  assert(read(fd, taken, 7) == 7 && strcmp(taken, "echo $x") == 0);
+  assert(strcmp(line_reader_next(&reader), "") == 0);
+  assert(line_reader_next(&reader) == NULL);
+  line_reader_free(&reader);
+  close(fd);
+  unlink(path);
+  printf("test_line_reader: Passed\n");
+}
+
+void test_execute_command_status() {
+  Command *cmd = parse_command("false");
+  assert(execute_command(cmd) == 1);
+  free_command(cmd);
+
+  cmd = parse_command("true");
+  assert(execute_command(cmd) == 0);
+  free_command(cmd);
+
+  cmd = parse_command("cshell_no_such_command_xyz");
+  assert(execute_command(cmd) == 127);
+  free_command(cmd);
+  printf("test_execute_command_status: Passed\n");
+}
+
+void test_pipeline_status_and_pipefail() {
+  Command *cmd = parse_command("false | true | cat");
+  assert(execute_command(cmd) == 0);
+  char *statuses = expand_word_single("${PIPESTATUS[@]}");
+  assert(strcmp(statuses, "1 0 0") == 0);
+  free(statuses);
+  assert(last_exit_status == 0);
+
+  char *set_args[] = {"set", "-o", "pipefail", NULL};
+  assert(builtin_set(set_args) == 0);
+  assert(execute_command(cmd) == 1);
+  assert(last_exit_status == 1);
+  set_args[1] = "+o";
+  assert(builtin_set(set_args) == 0);
+  assert(option_pipefail == 0);
+  free_command(cmd);
+  printf("test_pipeline_status_and_pipefail: Passed\n");
+}
+
+void test_builtins_in_pipelines() {
+  char template[] = "/tmp/cshell_pipeXXXXXX";
+  char *dir = mkdtemp(template);
+  assert(dir != NULL);
+  char out_path[PATH_MAX], cmdline[PATH_MAX * 2];
+  snprintf(out_path, sizeof(out_path), "%s/out", dir);
+
+  // A builtin feeding a pipe runs in a child.
+  snprintf(cmdline, sizeof(cmdline), "set -o | cat > %s", out_path);
+  Command *cmd = parse_command(cmdline);
+  assert(execute_command(cmd) == 0);
+  free_command(cmd);
+  char *text = read_file(out_path, NULL);
+  assert(text &&
+         strcmp(text, "argbatch\toff\nfileio\toff\nglobstar\toff\n"
+                       "pipefail\toff\n") == 0);
+  free(text);
+
+  // The last stage runs in the shell, so cd changes our directory.
+  char original[PATH_MAX], resolved[PATH_MAX], now[PATH_MAX];
+  assert(getcwd(original, sizeof(original)) != NULL);
+  assert(realpath(dir, resolved) != NULL);
+  snprintf(cmdline, sizeof(cmdline), "true | cd %s", dir);
+  cmd = parse_command(cmdline);
+  assert(execute_command(cmd) == 0);
+  free_command(cmd);
+  assert(getcwd(now, sizeof(now)) != NULL);
+  assert(strcmp(now, resolved) == 0);
+  assert(chdir(original) == 0);
+
+  unlink(out_path);
+  rmdir(dir);
+  printf("test_builtins_in_pipelines: Passed\n");
+}
+
+void test_here_documents() {
+  // The reader keeps going until the delimiter line has arrived.
+  assert(statement_pending("cat <<EOF\nline\n"));
+  assert(!statement_pending("cat <<EOF\nline\nEOF\n"));
+  assert(statement_pending("cat <<-'END'\n\tEND x\n"));
+  assert(!statement_pending("cat <<-'END'\n\t\tEND\n"));
+  assert(!statement_pending("tr a-z A-Z <<<word\n"));
+  assert(statement_pending("cat <<A <<B\nA\n"));
+
+  char template[] = "/tmp/cshell_hereXXXXXX";
+  char *dir = mkdtemp(template);
+  assert(dir != NULL);
+  char out_path[PATH_MAX], script[PATH_MAX * 2];
+  snprintf(out_path, sizeof(out_path), "%s/out", dir);
+
+  set_shell_variable("who", "world");
+  snprintf(script, sizeof(script),
+           "cat <<EOF > %s\nhello $who\n\n\tindented\nEOF\n", out_path);
+  ScriptElement *parsed = parse_script(script);
+  assert(execute_script(parsed) == 0);
+  free_script_element(parsed);
+  char *text = read_file(out_path, NULL);
+  assert(text && strcmp(text, "hello world\n\n\tindented\n") == 0);
+  free(text);
+
+  snprintf(script, sizeof(script), "cat <<-'EOF' > %s\n\t$who\n\tEOF\n",
+           out_path);
+  parsed = parse_script(script);
+  assert(execute_script(parsed) == 0);
+  free_script_element(parsed);
+  text = read_file(out_path, NULL);
+  assert(text && strcmp(text, "$who\n") == 0);
+  free(text);
+
+  snprintf(script, sizeof(script), "cat <<<$who > %s", out_path);
+  parsed = parse_script(script);
+  assert(execute_script(parsed) == 0);
+  free_script_element(parsed);
+  text = read_file(out_path, NULL);
+  assert(text && strcmp(text, "world\n") == 0);
+  free(text);
+
+  unlink(out_path);
+  rmdir(dir);
+  printf("test_here_documents: Passed\n");
+}
+
+void test_redirection_order() {
+  char template[] = "/tmp/cshell_redirXXXXXX";
+  char *dir = mkdtemp(template);
+  assert(dir != NULL);
+  char out_path[PATH_MAX], err_path[PATH_MAX], cmdline[PATH_MAX * 3];
+  snprintf(out_path, sizeof(out_path), "%s/out", dir);
+  snprintf(err_path, sizeof(err_path), "%s/err", dir);
+
+  // >file 2>&1 sends both streams to the file.
+  snprintf(cmdline, sizeof(cmdline),
+           "sh -c \"echo out; echo err >&2\" >%s 2>&1", out_path);
+  Command *cmd = parse_command(cmdline);
+  assert(execute_command(cmd) == 0);
+  free_command(cmd);
+  char *text = read_file(out_path, NULL);
+  assert(text && strcmp(text, "out\nerr\n") == 0);
+  free(text);
+
+  // 2>&1 >file: stderr still goes where stdout pointed before.
+  snprintf(cmdline, sizeof(cmdline),
+           "sh -c \"echo out; echo err >&2\" 2>&1 >%s | cat >%s", out_path,
+           err_path);
+  cmd = parse_command(cmdline);
+  assert(execute_command(cmd) == 0);
+  free_command(cmd);
+  text = read_file(out_path, NULL);
+  assert(text && strcmp(text, "out\n") == 0);
+  free(text);
+  text = read_file(err_path, NULL);
+  assert(text && strcmp(text, "err\n") == 0);
+  free(text);
+
+  // No pipe end leaks into a stage: ls sees as many descriptors inside a
+  // pipeline as it does on its own.
+  int counts[2];
+  const char *forms[2] = {"ls /proc/self/fd >%s", "ls /proc/self/fd | cat >%s"};
+  for (int i = 0; i < 2; i++) {
+    snprintf(cmdline, sizeof(cmdline), forms[i], out_path);
+    cmd = parse_command(cmdline);
+    assert(execute_command(cmd) == 0);
+    free_command(cmd);
+    text = read_file(out_path, NULL);
+    assert(text != NULL);
+    counts[i] = 0;
+    for (char *p = text; *p; p++)
+      counts[i] += *p == '\n';
+    free(text);
+  }
+  assert(counts[0] == counts[1]);
+
+  unlink(out_path);
+  unlink(err_path);
+  rmdir(dir);
+  printf("test_redirection_order: Passed\n");
+}
+
+void test_expand_word() {
+  ArgList args;
+  arglist_init(&args);
+  set_shell_variable("list", "a  b c");
+  expand_word("$list", &args);
+  expand_word("\"$list\"", &args);
+  expand_word("'$list'", &args);
+  expand_word("x\\ y\"\"", &args);
+  expand_word("$undefined_var_xyz", &args);
+  expand_word("''", &args);
+  assert(args.count == 7);
+  assert(strcmp(args.items[0], "a") == 0);
+  assert(strcmp(args.items[2], "c") == 0);
+  assert(strcmp(args.items[3], "a  b c") == 0);
+  assert(strcmp(args.items[4], "$list") == 0);
+  assert(strcmp(args.items[5], "x y") == 0);
+  assert(strcmp(args.items[6], "") == 0);
+  arglist_free(&args);
+
+  // A non-blank IFS character delimits on its own, so fields can be empty.
+  arglist_init(&args);
+  set_shell_variable("IFS", ":");
+  set_shell_variable("list", "a::b:");
+  expand_word("$list", &args);
+  set_shell_variable("list", ":c");
+  expand_word("$list", &args);
+  set_shell_variable("IFS", " :");
+  set_shell_variable("list", " d : e  ::f ");
+  expand_word("$list", &args);
+  unset_shell_variable("IFS");
+  const char *fields[] = {"a", "", "b", "", "c", "d", "e", "", "f"};
+  assert(args.count == 9);
+  for (int i = 0; i < 9; i++)
+    assert(strcmp(args.items[i], fields[i]) == 0);
+  arglist_free(&args);
+  printf("test_expand_word: Passed\n");
+}
+
+void test_execute_command_lists() {
+  char original[PATH_MAX], now[PATH_MAX];
+  assert(getcwd(original, sizeof(original)) != NULL);
+
+  Node *list = parse_list("false && v=and; false || v=or; true || v=no");
+  assert(execute_node(list) == 0);
+  free_node(list);
+  assert(strcmp(get_shell_variable("v"), "or") == 0);
+
+  // A subshell's cd stays in the child; a brace group runs in the shell.
+  list = parse_list("(cd /; exit 3) || { cd /; v=group; }");
+  assert(execute_node(list) == 0);
+  free_node(list);
+  assert(strcmp(get_shell_variable("v"), "group") == 0);
+  assert(getcwd(now, sizeof(now)) != NULL && strcmp(now, "/") == 0);
+  assert(chdir(original) == 0);
+
+  list = parse_list("true; (exit 5)");
+  assert(execute_node(list) == 5);
+  assert(last_exit_status == 5);
+  free_node(list);
+  printf("test_execute_command_lists: Passed\n");
+}
+
+void test_command_substitution() {
+  char *output = command_output("echo one; printf 'two\\n\\n'");
+  assert(strcmp(output, "one\ntwo") == 0);
+  free(output);
+
+  ArgList args;
+  arglist_init(&args);
+  expand_word("$(echo a b)\"$(echo c d)\"", &args);
+  assert(args.count == 2);
+  assert(strcmp(args.items[0], "a") == 0);
+  assert(strcmp(args.items[1], "bc d") == 0);
+  arglist_free(&args);
+  printf("test_command_substitution: Passed\n");
+}
+
+void test_background_jobs_and_coproc() {
+  Node *list = parse_list("(exit 3) & wait $!");
+  assert(list != NULL && list->type == NODE_SEQUENCE);
+  assert(list->left->type == NODE_BACKGROUND);
+  assert(strcmp(list->left->text, "(exit 3)") == 0);
+  assert(execute_node(list) == 3);
+  free_node(list);
+
+  // The shell talks to the coprocess through ${UP[1]} and ${UP[0]}, and
+  // closing its write end lets the coprocess finish.
+  unlink("/tmp/cshell_test_coproc.txt");
+  list = parse_list("coproc UP { tr a-z A-Z; }; echo hello >&${UP[1]}; "
+                    "{UP[1]}>&-; cat <&${UP[0]} >/tmp/cshell_test_coproc.txt;"
+                    " {UP[0]}>&-; wait $UP_PID");
+  Node *first = list;
+  while (first->type == NODE_SEQUENCE)
+    first = first->left;
+  assert(first->type == NODE_COPROC && strcmp(first->name, "UP") == 0);
+  assert(execute_node(list) == 0);
+  free_node(list);
+  char *content = read_file("/tmp/cshell_test_coproc.txt", NULL);
+  assert(content != NULL && strcmp(content, "HELLO\n") == 0);
+  free(content);
+  unlink("/tmp/cshell_test_coproc.txt");
+  printf("test_background_jobs_and_coproc: Passed\n");
+}
+
+void test_time_keyword() {
+  Node *list = parse_list("time -p -v sleep 0 | cat");
+  assert(list != NULL && list->type == NODE_PIPELINE);
+  assert(list->pipeline->timed == (TIME_REPORT | TIME_POSIX | TIME_VERBOSE));
+  assert(list->pipeline->next->timed == 0);
+  free_node(list);
+
+  // The report goes to the shell's stderr once both stages are reaped.
+  list = parse_list("{ time -p sh -c 'exit 4' | cat; } "
+                    "2>/tmp/cshell_test_time.txt");
+  assert(execute_node(list) == 0);
+  free_node(list);
+  char *report = read_file("/tmp/cshell_test_time.txt", NULL);
+  assert(report != NULL);
+  assert(strncmp(report, "real ", 5) == 0);
+  assert(strstr(report, "\nuser ") != NULL && strstr(report, "\nsys ") != NULL);
+  free(report);
+  unlink("/tmp/cshell_test_time.txt");
+  printf("test_time_keyword: Passed\n");
+}
+
+void test_execution_trace() {
+  const char *path = "/tmp/cshell_test_trace.jsonl";
+  unlink(path);
+  assert(trace_open(path) == 0);
+  Node *list = parse_list("echo hi | cat >/dev/null; cd .");
+  assert(execute_node(list) == 0);
+  free_node(list);
+  trace_open(NULL); // Flushes the ring
+
+  char *log = read_file(path, NULL);
+  assert(log != NULL);
+  int lines = 0;
+  for (char *p = log; (p = strchr(p, '\n')) != NULL; p++)
+    lines++;
+  assert(lines == 3);
+  assert(strstr(log, "\"stage\":0,") != NULL);
+  assert(strstr(log, "\"kind\":\"exec\",\"argv\":[\"echo\",\"hi\"]") != NULL);
+  assert(strstr(log, "\"redirs\":[\"1>/dev/null\"]") != NULL);
+  assert(strstr(log, "\"kind\":\"builtin\",\"argv\":[\"cd\",\".\"]") != NULL);
+  free(log);
+  unlink(path);
+  printf("test_execution_trace: Passed\n");
+}
+
+void test_expand_variables() {
+  set_shell_variable("greeting", "hello");
+  last_exit_status = 3;
+  char *word = expand_variables("${greeting}-$greeting.$?$undefined_var_xyz");
+  assert(strcmp(word, "hello-hello.3") == 0);
+  free(word);
+  word = expand_variables("cost$");
+  assert(strcmp(word, "cost$") == 0);
+  free(word);
+  // Unquoted here-document bodies take \$, \`, \\ and \newline only.
+  set_shell_variable("x", "hi");
+  word = expand_variables("price \\$x and $x\\\\ \\`a\\`\\q jo\\\nined\\");
+  assert(strcmp(word, "price $x and hi\\ `a`\\q joined\\") == 0);
+  free(word);
+  printf("test_expand_variables: Passed\n");
+}
+
 void test_expand_wildcards_no_match() {
   char **expanded = expand_wildcards("nonexistent_file_*.txt");
   assert(expanded != NULL);
@@ -366,6 +1044,642 @@ void test_expand_wildcards_star() {
   printf("test_expand_wildcards_star: Passed\n");
 }
 
+void test_export_environment() {
+  Node *list = parse_list("export CSHELL_TEST_EXPORT=one");
+  assert(execute_node(list) == 0);
+  free_node(list);
+  assert(strcmp(getenv("CSHELL_TEST_EXPORT"), "one") == 0);
+  char **env = env_vector();
+  int found = 0;
+  for (int i = 0; env[i]; i++)
+    found += strcmp(env[i], "CSHELL_TEST_EXPORT=one") == 0;
+  assert(found == 1);
+
+  // In the $(...) subshell an assignment to the exported variable reaches
+  // printenv; a prefix assignment reaches only its own command.
+  char *output = command_output("CSHELL_TEST_EXPORT=two; printenv "
+                                "CSHELL_TEST_EXPORT; CSHELL_TEST_ONCE=x "
+                                "printenv CSHELL_TEST_ONCE");
+  assert(output && strcmp(output, "two\nx") == 0);
+  free(output);
+  assert(env_get("CSHELL_TEST_ONCE") == NULL);
+
+  list = parse_list("export -n CSHELL_TEST_EXPORT");
+  assert(execute_node(list) == 0);
+  free_node(list);
+  assert(env_get("CSHELL_TEST_EXPORT") == NULL);
+  assert(strcmp(get_shell_variable("CSHELL_TEST_EXPORT"), "one") == 0);
+
+  // setenv() behind the shell's back is picked up, not lost.
+  setenv("CSHELL_TEST_SETENV", "3", 1);
+  assert(strcmp(env_get("CSHELL_TEST_SETENV"), "3") == 0);
+  env_unset("CSHELL_TEST_SETENV");
+  assert(getenv("CSHELL_TEST_SETENV") == NULL);
+  printf("test_export_environment: Passed\n");
+}
+
+void test_shell_functions() {
+  ScriptElement *script = parse_script("greet() {\n"
+                                       "  local who=$1\n"
+                                       "  echo \"$who:$#\"\n"
+                                       "  return 3\n"
+                                       "  echo unreachable\n"
+                                       "}\n"
+                                       "args() { printf '[%s]' \"$@\"; }\n"
+                                       "who=outside\n");
+  assert(script->type == SCRIPT_FUNCTION);
+  assert(strcmp(script->content, "greet") == 0);
+  assert(execute_script(script) == 0);
+  free_script_element(script); // The definitions outlive their script
+
+  char *output = command_output("greet world x; echo \" $? $who\"");
+  assert(output && strcmp(output, "world:2\n 3 outside") == 0);
+  free(output);
+  output = command_output("args a 'b c' ''");
+  assert(output && strcmp(output, "[a][b c][]") == 0);
+  free(output);
+  // Whatever follows the "}" of a one-line definition runs after it.
+  output = command_output("one() { echo 1; }; two() { echo \"{ 2 }\"; }; "
+                          "one; two");
+  assert(output && strcmp(output, "1\n{ 2 }") == 0);
+  free(output);
+  // A definition is a command: it can follow ;, && and ||.
+  output = command_output("echo hi; g() { echo \"$#\"; }; g 1 2");
+  assert(output && strcmp(output, "hi\n2") == 0);
+  free(output);
+  output = command_output("true && g() { echo and; }; "
+                          "false || function h { echo or; }; g; h");
+  assert(output && strcmp(output, "and\nor") == 0);
+  free(output);
+  Node *definition = parse_list("true | k() ( echo $1 )");
+  assert(definition && definition->pipeline->next->function_name &&
+         strcmp(definition->pipeline->next->function_name, "k") == 0);
+  Node *copy = copy_node(definition);
+  free_node(definition);
+  assert(copy->pipeline->next->group->pipeline->subshell);
+  free_node(copy);
+
+  // Tail calls reuse the frame; the condition ends the recursion.
+  script = parse_script("down() {\n"
+                        "  test \"$1\" = xxxxxxxxxx && return 4\n"
+                        "  down \"${1}x\"\n"
+                        "}\n"
+                        "down\n");
+  assert(execute_script(script) == 4);
+  free_script_element(script);
+  assert(function_returning == 0);
+  assert(positional_count() == 0);
+
+  // Outside functions $0, $1... are the shell's own arguments.
+  char *script_args[] = {"script.sh", "a", "b c", NULL};
+  set_script_arguments(script_args, 3);
+  output = command_output("echo \"$0 $# $2\"; args \"$@\"");
+  assert(output && strcmp(output, "script.sh 2 b c\n[a][b c]") == 0);
+  free(output);
+  set_script_arguments(NULL, 0);
+  assert(strcmp(positional_parameter(0), "cshell") == 0);
+  assert(strcmp(get_shell_variable("who"), "outside") == 0);
+  printf("test_shell_functions: Passed\n");
+}
+
+void test_source_cache() {
+  char dir[] = "/tmp/cshell_source_XXXXXX";
+  assert(mkdtemp(dir));
+  char rc[PATH_MAX], alias[PATH_MAX], missing[PATH_MAX],
+      command[PATH_MAX + 16];
+  snprintf(rc, sizeof(rc), "%s/rc", dir);
+  snprintf(alias, sizeof(alias), "%s/./rc", dir);
+  FILE *file = fopen(rc, "w");
+  assert(file);
+  fputs("sourced() { echo \"in $1\"; }\nSOURCED=1\n", file);
+  fclose(file);
+  setenv("XDG_CACHE_HOME", dir, 1);
+  setenv("CSHELL_SCRIPT_CACHE", "1", 1);
+
+  const char *origin = NULL;
+  assert(source_file(rc, &origin) == 0 && strcmp(origin, "parsed") == 0);
+  assert(source_file(rc, &origin) == 0 && strcmp(origin, "memory") == 0);
+  // Another spelling of the path misses in memory but not on disk.
+  assert(source_file(alias, &origin) == 0 && strcmp(origin, "disk") == 0);
+  char *output = command_output("sourced x; echo $SOURCED");
+  assert(output && strcmp(output, "in x\n1") == 0);
+  free(output);
+
+  // A changed file is parsed again.
+  file = fopen(rc, "a");
+  fputs("SOURCED=2\n", file);
+  fclose(file);
+  assert(source_file(rc, &origin) == 0 && strcmp(origin, "parsed") == 0);
+  assert(strcmp(get_shell_variable("SOURCED"), "2") == 0);
+  snprintf(missing, sizeof(missing), "%s/nowhere", dir);
+  char *args[] = {"source", missing, NULL};
+  assert(builtin_source(args) == 1);
+
+  unsetenv("CSHELL_SCRIPT_CACHE");
+  unsetenv("XDG_CACHE_HOME");
+  snprintf(command, sizeof(command), "rm -rf %s", dir);
+  assert(system(command) == 0);
+  printf("test_source_cache: Passed\n");
+}
+
+void test_arrays() {
+  ScriptElement *script = parse_script("list=(one 'two words' '' four)\n"
+                                       "list+=(five)\n"
+                                       "list[9]=nine\n"
+                                       "declare -A colors\n"
+                                       "colors[sky]=blue\n"
+                                       "colors=([grass]=green [sky]=grey)\n");
+  assert(execute_script(script) == 0);
+  free_script_element(script);
+
+  ShellArray *list = find_array("list");
+  assert(list && list->kind == ARRAY_INDEXED && list->used == 6);
+  assert(strcmp(array_get(list, "-1"), "nine") == 0);
+  assert(array_get(list, "7") == NULL);
+  assert(strcmp(get_shell_variable("list"), "one") == 0);
+
+  // "${list[@]}" is one argument per element, empty ones included.
+  ArgList args;
+  arglist_init(&args);
+  expand_word("\"<${list[@]}>\"", &args);
+  assert(args.count == 6 && strcmp(args.items[0], "<one") == 0 &&
+         strcmp(args.items[1], "two words") == 0 &&
+         strcmp(args.items[2], "") == 0 &&
+         strcmp(args.items[5], "nine>") == 0);
+  arglist_free(&args);
+  char *output = command_output("echo ${#list[@]} ${!list[@]}");
+  assert(output && strcmp(output, "6 0 1 2 3 4 9") == 0);
+  free(output);
+
+  ShellArray *colors = find_array("colors");
+  assert(colors && colors->kind == ARRAY_ASSOCIATIVE && colors->used == 2);
+  assert(strcmp(array_get(colors, "sky"), "grey") == 0);
+  // Removal keeps every other key reachable.
+  char key[16];
+  for (int i = 0; i < 1000; i++) {
+    snprintf(key, sizeof(key), "k%d", i);
+    array_set(colors, key, key);
+  }
+  for (int i = 0; i < 1000; i += 2) {
+    snprintf(key, sizeof(key), "k%d", i);
+    array_unset(colors, key);
+  }
+  for (int i = 0; i < 1000; i++) {
+    snprintf(key, sizeof(key), "k%d", i);
+    const char *value = array_get(colors, key);
+    assert(i % 2 ? value && strcmp(value, key) == 0 : value == NULL);
+  }
+  assert(colors->used == 502);
+
+  char *unset_args[] = {"unset", "list", "colors", NULL};
+  assert(builtin_unset(unset_args) == 0);
+  assert(find_array("list") == NULL && find_array("colors") == NULL);
+  printf("test_arrays: Passed\n");
+}
+
+void test_parameter_operators() {
+  set_shell_variable("file", "src/lib/parser.tar.gz");
+  set_shell_variable("pat", "*.");
+  const struct {
+    const char *word, *expected;
+  } cases[] = {
+      {"${file#*/}", "lib/parser.tar.gz"},
+      {"${file##*/}", "parser.tar.gz"},
+      {"${file%.*}", "src/lib/parser.tar"},
+      {"${file%%.*}", "src/lib/parser"},
+      {"${file#$pat}", "tar.gz"},
+      {"${file#\"$pat\"}", "src/lib/parser.tar.gz"},
+      {"${file/r/R}", "sRc/lib/parser.tar.gz"},
+      {"${file//r/R}", "sRc/lib/paRseR.taR.gz"},
+      {"${file//[a-c]/_}", "sr_/li_/p_rser.t_r.gz"},
+      {"${file/#src/lib}", "lib/lib/parser.tar.gz"},
+      {"${file/%gz/xz}", "src/lib/parser.tar.xz"},
+      {"${#file}", "21"},
+      {"${file:4:3}", "lib"},
+      {"${file: -2}", "gz"},
+      {"${file:0:-7}", "src/lib/parser"},
+      {"${nothing:-a default}", "a default"},
+      {"${file:+set}", "set"},
+      {"${nothing:+set}", ""},
+  };
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    char *value = expand_word_single(cases[i].word);
+    assert(strcmp(value, cases[i].expected) == 0);
+    free(value);
+  }
+
+  char *value = expand_word_single("${assigned:=now}");
+  assert(strcmp(value, "now") == 0);
+  assert(strcmp(get_shell_variable("assigned"), "now") == 0);
+  free(value);
+  // Operators and blanks inside ${...} do not end the word.
+  char *output = command_output("x='a;b c'; echo ${x//;/ and }");
+  assert(output && strcmp(output, "a and b c") == 0);
+  free(output);
+
+  // ${name:?message} drops the command and stops the script.
+  ScriptElement *script = parse_script("reached=before\n"
+                                       "reached=${nothing:?} && reached=and\n"
+                                       "reached=after\n");
+  assert(execute_script(script) == 1);
+  free_script_element(script);
+  assert(script_aborted && last_exit_status == 1 && !expansion_failed);
+  assert(strcmp(get_shell_variable("reached"), "before") == 0);
+  script_aborted = 0;
+  output = command_output("echo ${nothing:?unset}; echo after");
+  assert(output && strcmp(output, "") == 0 && last_exit_status == 1);
+  free(output);
+  unset_shell_variable("reached");
+  unset_shell_variable("file");
+  unset_shell_variable("pat");
+  unset_shell_variable("assigned");
+  printf("test_parameter_operators: Passed\n");
+}
+
+void test_read_builtins() {
+  char path[] = "/tmp/cshell_read_XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd != -1);
+  const char *text = "  first  line \\\n goes on\nsecond\nthird";
+  assert(write(fd, text, strlen(text)) == (ssize_t)strlen(text));
+  lseek(fd, 0, SEEK_SET);
+  char fd_text[16];
+  snprintf(fd_text, sizeof(fd_text), "%d", fd);
+
+  // read consumes the line and nothing after it.
+  char *read_args[] = {"read", "-u", fd_text, "a", "b", NULL};
+  assert(builtin_read(read_args) == 0);
+  assert(strcmp(get_shell_variable("a"), "first") == 0);
+  assert(strcmp(get_shell_variable("b"), "line  goes on") == 0);
+  assert(lseek(fd, 0, SEEK_CUR) == (off_t)(strstr(text, "second") - text));
+  // The chunk read ahead serves the next line only from where read left
+  // the offset.
+  char *line_args[] = {"read", "-u", fd_text, "c", NULL};
+  assert(builtin_read(line_args) == 0);
+  assert(strcmp(get_shell_variable("c"), "second") == 0);
+  lseek(fd, 2, SEEK_SET);
+  assert(builtin_read(line_args) == 0);
+  assert(strcmp(get_shell_variable("c"), "first  line  goes on") == 0);
+
+  char *mapfile_args[] = {"mapfile", "-t", "-u", fd_text, "lines", NULL};
+  assert(builtin_mapfile(mapfile_args) == 0);
+  ShellArray *lines = find_array("lines");
+  assert(lines && lines->used == 2);
+  assert(strcmp(array_get(lines, "0"), "second") == 0);
+  assert(strcmp(array_get(lines, "1"), "third") == 0);
+  assert(builtin_read(read_args) == 1);
+  close(fd);
+  unlink(path);
+
+  // From a pipe, too, only the line is taken.
+  int pipefd[2];
+  assert(pipe(pipefd) == 0);
+  assert(write(pipefd[1], "x:y::z\nrest\n", 12) == 12);
+  close(pipefd[1]);
+  snprintf(fd_text, sizeof(fd_text), "%d", pipefd[0]);
+  set_shell_variable("IFS", ":");
+  char *raw_args[] = {"read", "-r", "-u", fd_text, "-a", "fields", NULL};
+  assert(builtin_read(raw_args) == 0);
+  unset_shell_variable("IFS");
+  char rest[8];
+  assert(read(pipefd[0], rest, sizeof(rest)) == 5);
+  close(pipefd[0]);
+  char *output = command_output("echo ${#fields[@]} ${fields[3]}");
+  assert(output && strcmp(output, "4 z") == 0);
+  free(output);
+  // Blanks around a non-blank delimiter belong to it.
+  ScriptElement *script =
+      parse_script("IFS=' :' read -r -a fields <<< ' : a : :b '\n");
+  assert(execute_script(script) == 0);
+  free_script_element(script);
+  output = command_output("echo ${#fields[@]} \"[${fields[0]}]\" "
+                          "\"[${fields[2]}]\" ${fields[3]}");
+  assert(output && strcmp(output, "4 [] [] b") == 0);
+  free(output);
+
+  // A prefix assignment holds for the builtin alone.
+  script = parse_script("IFS=: read -r a b <<< \"x:y\"\n"
+                         "IFS= read -r line <<< \"  sp  \"\n");
+  assert(execute_script(script) == 0);
+  free_script_element(script);
+  assert(strcmp(get_shell_variable("a"), "x") == 0);
+  assert(strcmp(get_shell_variable("b"), "y") == 0);
+  assert(strcmp(get_shell_variable("line"), "  sp  ") == 0);
+  assert(get_shell_variable("IFS") == NULL && env_get("IFS") == NULL);
+
+  // A delimiter that is the last byte of a full 64 KiB read.
+  char big_path[] = "/tmp/cshell_mapfile_XXXXXX";
+  fd = mkstemp(big_path);
+  assert(fd != -1);
+  char *big = malloc(65536 + 2);
+  assert(big);
+  memset(big, 'x', 65535);
+  memcpy(big + 65535, "\ny\n", 3);
+  assert(write(fd, big, 65538) == 65538);
+  lseek(fd, 0, SEEK_SET);
+  snprintf(fd_text, sizeof(fd_text), "%d", fd);
+  char *keep_args[] = {"mapfile", "-u", fd_text, "lines", NULL};
+  assert(builtin_mapfile(keep_args) == 0);
+  lines = find_array("lines");
+  assert(lines && lines->used == 2);
+  assert(strlen(array_get(lines, "0")) == 65536);
+  assert(strcmp(array_get(lines, "1"), "y\n") == 0);
+  free(big);
+  close(fd);
+  unlink(big_path);
+
+  unset_shell_variable("a");
+  unset_shell_variable("b");
+  unset_shell_variable("line");
+  unset_shell_variable("lines");
+  unset_shell_variable("fields");
+  printf("test_read_builtins: Passed\n");
+}
+
+void test_argument_batching() {
+  // Commands have no fixed argument limit.
+  char line[1024] = "echo";
+  for (int i = 0; i < 200; i++)
+    strcat(line, " w");
+  Command *cmd = parse_command(line);
+  assert(cmd && cmd->argc == 201 && cmd->args[201] == NULL);
+  free_command(cmd);
+
+  // An argv over ARG_MAX is split, the words around the expansion repeated.
+  option_argbatch = 1;
+  char *output = command_output(
+      "sh -c 'echo $# $0 ${1:-}' head $(seq 400000) tail | "
+      "awk '$2 == \"head\" { n++; s += $1 - 1 } "
+      "END { print (n > 1), s }'");
+  option_argbatch = 0;
+  assert(output && strcmp(output, "1 400000") == 0);
+  free(output);
+  printf("test_argument_batching: Passed\n");
+}
+
+void test_resource_limits() {
+  Node *node = parse_list("limit --mem 64M --cpu 1.5 -- echo hi | cat");
+  Command *cmd = node ? node->pipeline : NULL;
+  assert(cmd && cmd->limited && cmd->mem_limit == 64LL << 20 &&
+         cmd->cpu_limit == 1500 && cmd->next && !cmd->next->limited);
+  free_node(node);
+  assert(limit_parse_size("2G") == 2LL << 30);
+  assert(limit_parse_size("1.5k") == 1536);
+  assert(limit_parse_size("lots") == -1 && limit_parse_cpu("0") == -1);
+
+  // Every stage runs in a child, builtins too, and the status is kept.
+  char before[PATH_MAX], after[PATH_MAX];
+  assert(getcwd(before, sizeof(before)));
+  node = parse_list("limit -- cd /");
+  assert(execute_node(node) == 0);
+  free_node(node);
+  assert(getcwd(after, sizeof(after)) && strcmp(before, after) == 0);
+  node = parse_list("limit --mem 1G -- sh -c 'exit 3'");
+  assert(execute_node(node) == 3);
+  free_node(node);
+
+  // ulimit changes the shell's own limits.
+  struct rlimit saved, now;
+  assert(getrlimit(RLIMIT_NOFILE, &saved) == 0);
+  char *set_args[] = {"ulimit", "-S", "-n", "100", NULL};
+  assert(builtin_ulimit(set_args) == 0);
+  assert(getrlimit(RLIMIT_NOFILE, &now) == 0);
+  assert(now.rlim_cur == 100 && now.rlim_max == saved.rlim_max);
+  char *bad_args[] = {"ulimit", "-n", "many", NULL};
+  assert(builtin_ulimit(bad_args) == 1);
+  setrlimit(RLIMIT_NOFILE, &saved);
+  printf("test_resource_limits: Passed\n");
+}
+
+void test_stats_builtin() {
+  stats_reset();
+  set_shell_variable("stats_probe", "a value");
+  Command *cmd = parse_command("true");
+  assert(execute_command(cmd) == 0);
+  free_command(cmd);
+
+  char *report = NULL;
+  size_t size = 0;
+  FILE *out = open_memstream(&report, &size);
+  assert(out);
+  stats_report(out);
+  fclose(out);
+  assert(strstr(report, "\n  history ") && strstr(report, "\n  variables "));
+  int scalars, arrays;
+  assert(variable_bytes(&scalars, &arrays) > strlen("stats_probe"));
+#ifdef CSHELL_STATS
+  assert(strstr(report, "\n  forks                           1"));
+#endif
+  free(report);
+  unset_shell_variable("stats_probe");
+  printf("test_stats_builtin: Passed\n");
+}
+
+static int run_line(const char *line) {
+  Node *node = parse_list(line);
+  assert(node);
+  int status = execute_node(node);
+  free_node(node);
+  return status;
+}
+
+void test_file_builtins() {
+  // Odd offsets and lengths around the 16-byte blocks.
+  char sample[100];
+  for (size_t i = 0; i < sizeof(sample); i++)
+    sample[i] = i % 7 == 3 ? '\n' : 'x';
+  for (size_t start = 0; start < 5; start++) {
+    size_t expected = 0;
+    for (size_t i = start; i < sizeof(sample); i++)
+      expected += sample[i] == '\n';
+    assert(count_newlines(sample + start, sizeof(sample) - start) == expected);
+  }
+
+  // Only the forms they implement, and only under set -o fileio.
+  char *cat_argv[] = {"cat", "-", "file", NULL};
+  char *cat_option[] = {"cat", "-n", "file", NULL};
+  char *wc_bytes[] = {"wc", "-c", NULL};
+  char *cp_one[] = {"cp", "file", NULL};
+  assert(find_file_builtin(cat_argv) == NULL);
+  option_fileio = 1;
+  assert(find_file_builtin(cat_argv) != NULL);
+  assert(find_file_builtin(cat_option) == NULL);
+  assert(find_file_builtin(wc_bytes) == NULL);
+  assert(find_file_builtin(cp_one) == NULL);
+
+  char template[] = "/tmp/cshell_fileio_XXXXXX";
+  char *dir = mkdtemp(template);
+  assert(dir != NULL);
+  char big[PATH_MAX], copy[PATH_MAX], piped[PATH_MAX], out[PATH_MAX];
+  char line[PATH_MAX * 5];
+  snprintf(big, sizeof(big), "%s/big", dir);
+  snprintf(copy, sizeof(copy), "%s/copy", dir);
+  snprintf(piped, sizeof(piped), "%s/piped", dir);
+  snprintf(out, sizeof(out), "%s/out", dir);
+
+  // Several chunks and a ragged end, so the ring has reads out at once.
+  size_t size = 3 * 1024 * 1024 + 4321, lines = 0;
+  char *data = malloc(size);
+  assert(data);
+  for (size_t i = 0; i < size; i++) {
+    data[i] = i % 61 == 60 ? '\n' : 'a' + i % 26;
+    lines += data[i] == '\n';
+  }
+  FILE *file = fopen(big, "w");
+  assert(file && fwrite(data, 1, size, file) == size);
+  fclose(file);
+
+  char expected[PATH_MAX + 32];
+  snprintf(line, sizeof(line), "wc -l %s > %s", big, out);
+  assert(run_line(line) == 0);
+  char *text = read_file(out, NULL);
+  snprintf(expected, sizeof(expected), "%zu %s\n", lines, big);
+  assert(text && strcmp(text, expected) == 0);
+  free(text);
+
+  // The first cat writes into a pipe from its child, the last reads one.
+  snprintf(line, sizeof(line), "cp %s %s && cat %s | cat - > %s", big, copy,
+           big, piped);
+  assert(run_line(line) == 0);
+  size_t length;
+  text = read_file(copy, &length);
+  assert(text && length == size && memcmp(text, data, size) == 0);
+  free(text);
+  text = read_file(piped, &length);
+  assert(text && length == size && memcmp(text, data, size) == 0);
+  free(text);
+
+  snprintf(line, sizeof(line), "cat %s | wc -l > %s; cat %s/none 2> %s", big,
+           out, dir, piped);
+  assert(run_line(line) == 1);
+  text = read_file(out, NULL);
+  snprintf(expected, sizeof(expected), "%zu\n", lines);
+  assert(text && strcmp(text, expected) == 0);
+  free(text);
+  text = read_file(piped, NULL);
+  assert(text && strstr(text, "cat: ") && strstr(text, "No such file"));
+  free(text);
+
+  option_fileio = 0;
+  free(data);
+  unlink(big);
+  unlink(copy);
+  unlink(piped);
+  unlink(out);
+  rmdir(dir);
+  printf("test_file_builtins: Passed\n");
+}
+
+void test_script_syntax_errors() {
+  // A statement that does not parse stops the script with status 2.
+  set_shell_variable("reached", "no");
+  ScriptElement *script = parse_script("reached=before\n)\nreached=after\n");
+  assert(script && script->next && script->next->type == SCRIPT_SYNTAX_ERROR);
+  assert(execute_script(script) == 2 && script_aborted);
+  assert(strcmp(get_shell_variable("reached"), "before") == 0);
+  assert(last_exit_status == 2);
+  free_script_element(script);
+  script_aborted = 0;
+  unset_shell_variable("reached");
+  printf("test_script_syntax_errors: Passed\n");
+}
+
+void test_script_comments() {
+  char template[] = "/tmp/cshell_commentXXXXXX";
+  char *dir = mkdtemp(template);
+  assert(dir != NULL);
+  char path[PATH_MAX], out_path[PATH_MAX], script[PATH_MAX * 2];
+  snprintf(path, sizeof(path), "%s/script.sh", dir);
+  snprintf(out_path, sizeof(out_path), "%s/out", dir);
+
+  // A shebang, comment lines and trailing comments are skipped; a '#'
+  // inside a word or quotes is kept.
+  snprintf(script, sizeof(script),
+           "#!/bin/cshell\n"
+           "# set things up\n"
+           "  # indented\n"
+           "first=one # second=two\n"
+           "word=a#b\n"
+           "echo \"# kept\" '#' \\#x > %s # dropped\n",
+           out_path);
+  FILE *file = fopen(path, "w");
+  assert(file && fputs(script, file) >= 0);
+  fclose(file);
+  unset_shell_variable("second");
+  char *args[] = {"source", path, NULL};
+  assert(builtin_source(args) == 0);
+  assert(strcmp(get_shell_variable("first"), "one") == 0);
+  assert(get_shell_variable("second") == NULL);
+  assert(strcmp(get_shell_variable("word"), "a#b") == 0);
+  char *text = read_file(out_path, NULL);
+  assert(text && strcmp(text, "# kept # #x\n") == 0);
+  free(text);
+
+  unset_shell_variable("first");
+  unset_shell_variable("word");
+  unlink(path);
+  unlink(out_path);
+  rmdir(dir);
+  printf("test_script_comments: Passed\n");
+}
+
+void test_script_statements() {
+  // Quotes, $( ... ), array lists, groups and a trailing && or backslash
+  // carry a statement over to the next line.
+  ScriptElement *script = parse_script("quoted='a\nb'\n"
+                                       "joined=x\\\ny\n"
+                                       "echo a \\\n  b > /dev/null\n"
+                                       "sub=$(echo a\necho b)\n"
+                                       "list=(1\n2)\n"
+                                       "{\n"
+                                       "  grouped=one\n"
+                                       "  grouped=$grouped.two\n"
+                                       "}\n"
+                                       "true &&\n"
+                                       "  chained=yes\n"
+                                       "double=\"c\\\nd\"\n");
+  int count = 0;
+  for (ScriptElement *e = script; e; e = e->next)
+    count++;
+  assert(count == 8);
+  assert(execute_script(script) == 0);
+  free_script_element(script);
+  assert(strcmp(get_shell_variable("quoted"), "a\nb") == 0);
+  assert(strcmp(get_shell_variable("joined"), "xy") == 0);
+  assert(strcmp(get_shell_variable("sub"), "a\nb") == 0);
+  assert(strcmp(get_shell_variable("grouped"), "one.two") == 0);
+  assert(strcmp(get_shell_variable("chained"), "yes") == 0);
+  assert(strcmp(get_shell_variable("double"), "cd") == 0);
+  char *output = command_output("echo ${list[1]}");
+  assert(output && strcmp(output, "2") == 0);
+  free(output);
+
+  assert(statement_pending("echo 'a\n"));
+  assert(statement_pending("echo a \\\n"));
+  assert(statement_pending("x=$(echo a\n"));
+  assert(statement_pending("{\n  echo a\n"));
+  assert(statement_pending("true &&\n"));
+  assert(!statement_pending("echo 'a\nb'\n{ echo a; }\n"));
+  assert(!statement_pending("echo '#' # it's a comment\n"));
+  // Resuming line by line agrees with scanning everything each time.
+  const char *lines = "f() {\n  cat <<EOF\n}\nEOF\n  echo 'a\nb' |\n"
+                      "  tr a b\n}\necho \\\nc; (\n)\n";
+  ScanState scan = {0};
+  for (const char *end = strchr(lines, '\n'); end;
+       end = strchr(end + 1, '\n')) {
+    char *text = strndup(lines, end + 1 - lines);
+    assert(statement_pending_from(text, &scan) == statement_pending(text));
+    free(text);
+  }
+  assert(scan.start == strlen(lines));
+
+  const char *names[] = {"quoted", "joined", "sub", "list",
+                         "grouped", "chained", "double"};
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    unset_shell_variable(names[i]);
+  printf("test_script_statements: Passed\n");
+}
+
 int main() {
   // Run all test cases
   test_parse_simple_command();
@@ -378,13 +1692,49 @@ int main() {
   test_parse_multiple_pipes();
   test_parse_combined_redirection_and_pipe();
   test_parse_error_handling();
+  test_parse_fd_redirections();
+  test_parse_command_lists();
   test_history_add_and_get();
   test_history_circular_buffer();
+  test_history_long_and_multiline();
+  test_history_file_deferred_load();
   test_get_input_basic();
+  test_gap_buffer_editing();
+  test_utf8_display_width();
+  test_grapheme_motion();
   test_builtin_cd();
   test_builtin_exit();
   test_builtin_history();
   test_execute_builtin();
+  test_complete_commands_from_path();
+  test_complete_variables();
+  test_complete_files();
+  test_line_reader();
+  test_execute_command_status();
+  test_pipeline_status_and_pipefail();
+  test_builtins_in_pipelines();
+  test_here_documents();
+  test_redirection_order();
+  test_expand_word();
+  test_execute_command_lists();
+  test_command_substitution();
+  test_background_jobs_and_coproc();
+  test_time_keyword();
+  test_execution_trace();
+  test_export_environment();
+  test_shell_functions();
+  test_source_cache();
+  test_arrays();
+  test_parameter_operators();
+  test_read_builtins();
+  test_argument_batching();
+  test_resource_limits();
+  test_stats_builtin();
+  test_file_builtins();
+  test_script_syntax_errors();
+  test_script_comments();
+  test_script_statements();
+  test_expand_variables();
   test_expand_wildcards_no_match();
   test_expand_wildcards_single_match();
   test_expand_wildcards_multiple_matches();
@@ -0,0 +1,170 @@
+#define _GNU_SOURCE // syscall
+#include "include/timing.h"
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Hardware counters when the machine has a PMU we may use; otherwise
+// (VMs, containers, perf_event_paranoid) the kernel's software counters.
+static const struct {
+  unsigned type;
+  unsigned long long config;
+  const char *name;
+} counter_sets[2][TIMING_COUNTERS] = {
+    {{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+     {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+     {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache-misses"}},
+    {{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "task-clock-ns"},
+     {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, "context-switches"},
+     {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, "page-faults"}},
+};
+static int counter_set = 0; // Drops to 1 once hardware counters fail
+
+static int open_counter(int index, pid_t pid, int on_exec) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = counter_sets[counter_set][index].type;
+  attr.config = counter_sets[counter_set][index].config;
+  attr.inherit = 1; // Count the stage's own children as well
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.disabled = on_exec;
+  attr.enable_on_exec = on_exec;
+  return (int)syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+}
+
+void timing_begin(StageTiming *timing, const char *label) {
+  memset(timing, 0, sizeof(*timing));
+  timing->label = strdup(label);
+  if (!timing->label) {
+    perror("strdup failed");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < TIMING_COUNTERS; i++) {
+    timing->counter_fds[i] = -1;
+    timing->counts[i] = -1;
+  }
+  getrusage(RUSAGE_SELF, &timing->self_before);
+  getrusage(RUSAGE_CHILDREN, &timing->child_before);
+  clock_gettime(CLOCK_MONOTONIC, &timing->start);
+}
+
+// Count events in pid (0 for the shell itself). With on_exec the counters
+// start at the child's exec, so the shell's fork-side work is left out.
+void timing_attach_counters(StageTiming *timing, pid_t pid, int on_exec) {
+  for (int i = 0; i < TIMING_COUNTERS; i++) {
+    int fd = open_counter(i, pid, on_exec);
+    if (fd == -1 && i == 0 && counter_set == 0) {
+      counter_set = 1;
+      fd = open_counter(i, pid, on_exec);
+    }
+    timing->counter_fds[i] = fd;
+  }
+}
+
+// to += now - before
+static void add_delta(struct timeval *to, const struct timeval *now,
+                      const struct timeval *before) {
+  long long usec = (to->tv_sec + now->tv_sec - before->tv_sec) * 1000000LL +
+                   to->tv_usec + now->tv_usec - before->tv_usec;
+  to->tv_sec = usec / 1000000LL;
+  to->tv_usec = usec % 1000000LL;
+}
+
+// Finish a stage. usage is the child's from wait4(); NULL for a stage that
+// ran in the shell, whose usage is what the shell and the children it
+// reaped meanwhile used.
+void timing_end(StageTiming *timing, const struct rusage *usage) {
+  clock_gettime(CLOCK_MONOTONIC, &timing->end);
+  if (usage) {
+    timing->usage = *usage;
+  } else {
+    struct rusage self, children;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    memset(&timing->usage, 0, sizeof(timing->usage));
+    add_delta(&timing->usage.ru_utime, &self.ru_utime,
+              &timing->self_before.ru_utime);
+    add_delta(&timing->usage.ru_utime, &children.ru_utime,
+              &timing->child_before.ru_utime);
+    add_delta(&timing->usage.ru_stime, &self.ru_stime,
+              &timing->self_before.ru_stime);
+    add_delta(&timing->usage.ru_stime, &children.ru_stime,
+              &timing->child_before.ru_stime);
+    timing->usage.ru_maxrss = self.ru_maxrss;
+  }
+
+  for (int i = 0; i < TIMING_COUNTERS; i++) {
+    long long count;
+    if (timing->counter_fds[i] == -1)
+      continue;
+    if (read(timing->counter_fds[i], &count, sizeof(count)) ==
+        (ssize_t)sizeof(count))
+      timing->counts[i] = count;
+    close(timing->counter_fds[i]);
+    timing->counter_fds[i] = -1;
+  }
+}
+
+static double seconds(const struct timeval *tv) {
+  return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static double elapsed(const struct timespec *from, const struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static void print_minutes(const char *name, double value) {
+  int minutes = (int)(value / 60);
+  fprintf(stderr, "%s\t%dm%.3fs\n", name, minutes, value - minutes * 60);
+}
+
+// Print the pipeline's totals on stderr, then a line per stage when there
+// is more than one or -v asked for counters. Frees the stage labels.
+void timing_report(StageTiming *stages, int count, int flags) {
+  struct timespec first = stages[0].start, last = stages[0].end;
+  double user = 0, sys = 0;
+  for (int i = 0; i < count; i++) {
+    if (elapsed(&stages[i].start, &first) > 0)
+      first = stages[i].start;
+    if (elapsed(&last, &stages[i].end) > 0)
+      last = stages[i].end;
+    user += seconds(&stages[i].usage.ru_utime);
+    sys += seconds(&stages[i].usage.ru_stime);
+  }
+
+  if (flags & TIME_POSIX) {
+    fprintf(stderr, "real %.2f\nuser %.2f\nsys %.2f\n",
+            elapsed(&first, &last), user, sys);
+  } else {
+    print_minutes("real", elapsed(&first, &last));
+    print_minutes("user", user);
+    print_minutes("sys", sys);
+  }
+
+  for (int i = 0; i < count; i++) {
+    const StageTiming *stage = &stages[i];
+    if (!(flags & TIME_POSIX) && (count > 1 || (flags & TIME_VERBOSE))) {
+      fprintf(stderr, "  %d: real %.3fs  user %.3fs  sys %.3fs  %s\n", i + 1,
+              elapsed(&stage->start, &stage->end),
+              seconds(&stage->usage.ru_utime),
+              seconds(&stage->usage.ru_stime), stage->label);
+    }
+    if (!(flags & TIME_POSIX) && (flags & TIME_VERBOSE)) {
+      fprintf(stderr, "     max RSS %ld KiB", stage->usage.ru_maxrss);
+      for (int c = 0; c < TIMING_COUNTERS; c++) {
+        if (stage->counts[c] >= 0)
+          fprintf(stderr, "  %s %lld", counter_sets[counter_set][c].name,
+                  stage->counts[c]);
+      }
+      if (stage->counts[0] < 0)
+        fprintf(stderr, "  (counters unavailable)");
+      fprintf(stderr, "\n");
+    }
+    free(stages[i].label);
+  }
+}
@@ -0,0 +1,284 @@
+#include "include/trace.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Execution trace: one JSON line per pipeline stage, written to the file or
+// descriptor named by CSHELL_TRACE. Finished records go into a ring buffer
+// and reach the descriptor in batches, so a traced command costs a few
+// memcpy()s rather than a write() each.
+
+#define TRACE_FD_BASE (REDIRECT_FD_MAX + 1)
+
+static int trace_fd = -2; // -2 until CSHELL_TRACE has been looked at
+static long pipeline_count = 0;
+
+// Single-producer, single-consumer ring: trace_finish() only moves head and
+// trace_flush() only moves tail, so neither needs a lock. Both count bytes
+// ever written; the offset in the ring is the count modulo its size.
+static char ring[TRACE_RING_SIZE];
+static atomic_size_t ring_head;
+static atomic_size_t ring_tail;
+
+void trace_flush(void) {
+  if (trace_fd < 0)
+    return;
+  size_t head = atomic_load_explicit(&ring_head, memory_order_acquire);
+  size_t tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+  if (head == tail)
+    return;
+
+  size_t start = tail % TRACE_RING_SIZE;
+  size_t len = head - tail;
+  struct iovec iov[2];
+  int count = 1;
+  iov[0].iov_base = ring + start;
+  iov[0].iov_len = len;
+  if (start + len > TRACE_RING_SIZE) {
+    iov[0].iov_len = TRACE_RING_SIZE - start;
+    iov[1].iov_base = ring;
+    iov[1].iov_len = len - iov[0].iov_len;
+    count = 2;
+  }
+  // A short or failed write loses the batch; tracing never stops the shell.
+  if (writev(trace_fd, iov, count) == -1)
+    perror("cshell: trace");
+  atomic_store_explicit(&ring_tail, head, memory_order_release);
+}
+
+static void ring_push(const char *data, size_t len) {
+  size_t head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+  if (len > TRACE_RING_SIZE - (head - tail)) {
+    trace_flush();
+    tail = head;
+  }
+  if (len > TRACE_RING_SIZE) {
+    if (write(trace_fd, data, len) == -1)
+      perror("cshell: trace");
+    return;
+  }
+
+  size_t start = head % TRACE_RING_SIZE;
+  size_t first = len < TRACE_RING_SIZE - start ? len : TRACE_RING_SIZE - start;
+  memcpy(ring + start, data, first);
+  memcpy(ring, data + first, len - first);
+  atomic_store_explicit(&ring_head, head + len, memory_order_release);
+  if (head + len - tail >= TRACE_RING_SIZE / 2)
+    trace_flush();
+}
+
+// A forked child starts with the parent's unflushed records; they are the
+// parent's to write.
+static void forget_records(void) {
+  atomic_store(&ring_head, 0);
+  atomic_store(&ring_tail, 0);
+}
+
+// Send the trace to a file (appended to) or, for a number, to that
+// descriptor; NULL or "" turns tracing off. The shell keeps its own copy
+// of the descriptor above the redirectable range.
+int trace_open(const char *target) {
+  static int registered = 0;
+  trace_flush();
+  if (trace_fd >= 0)
+    close(trace_fd);
+  trace_fd = -1;
+  if (!target || !*target)
+    return 0;
+
+  int fd;
+  if (strspn(target, "0123456789") == strlen(target)) {
+    fd = fcntl(atoi(target), F_DUPFD_CLOEXEC, TRACE_FD_BASE);
+  } else if ((fd = open(target, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                        0644)) != -1) {
+    int high = fcntl(fd, F_DUPFD_CLOEXEC, TRACE_FD_BASE);
+    close(fd);
+    fd = high;
+  }
+  if (fd == -1) {
+    perror(target);
+    return -1;
+  }
+  trace_fd = fd;
+  if (!registered) {
+    atexit(trace_flush);
+    pthread_atfork(NULL, NULL, forget_records);
+    registered = 1;
+  }
+  return 0;
+}
+
+// Tracing is on when CSHELL_TRACE names a file or descriptor.
+int trace_enabled(void) {
+  if (trace_fd == -2)
+    trace_open(getenv("CSHELL_TRACE"));
+  return trace_fd >= 0;
+}
+
+long trace_next_pipeline(void) { return ++pipeline_count; }
+
+// --- Record building ---
+
+static void put(TraceStage *stage, const char *text, size_t len) {
+  char *record = realloc(stage->record, stage->len + len + 1);
+  if (!record) {
+    perror("realloc failed");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(record + stage->len, text, len);
+  stage->record = record;
+  stage->len += len;
+  record[stage->len] = '\0';
+}
+
+static void put_str(TraceStage *stage, const char *text) {
+  put(stage, text, strlen(text));
+}
+
+static void put_json_string(TraceStage *stage, const char *text) {
+  put_str(stage, "\"");
+  const char *run = text;
+  for (const char *p = text;; p++) {
+    unsigned char c = (unsigned char)*p;
+    if (c != '\0' && c != '"' && c != '\\' && c >= 0x20)
+      continue;
+    put(stage, run, p - run);
+    if (c == '\0')
+      break;
+    char escape[8];
+    if (c == '"' || c == '\\')
+      snprintf(escape, sizeof(escape), "\\%c", c);
+    else
+      snprintf(escape, sizeof(escape), "\\u%04x", c);
+    put_str(stage, escape);
+    run = p + 1;
+  }
+  put_str(stage, "\"");
+}
+
+// The file execvp() will find, or NULL.
+static char *resolve_path(const char *name) {
+  if (strchr(name, '/'))
+    return strdup(name);
+  const char *path = getenv("PATH");
+  while (path && *path) {
+    size_t len = strcspn(path, ":");
+    char candidate[PATH_MAX];
+    if (snprintf(candidate, sizeof(candidate), "%.*s/%s", (int)len, path,
+                 name) < (int)sizeof(candidate) &&
+        access(candidate, X_OK) == 0)
+      return strdup(candidate);
+    path += len + (path[len] == ':');
+  }
+  return NULL;
+}
+
+// Redirections are written as in the command, before expansion; the
+// bodies of here-documents are left out.
+static void put_redirection(TraceStage *stage, const Redirection *redir) {
+  static const char *const ops[] = {"<", ">", ">>", "<>", ">&", ">&", "<<"};
+  char number[16];
+  const char *target = redir->target ? redir->target : "";
+  if (redir->type == REDIR_DUP && redir->target == NULL) {
+    snprintf(number, sizeof(number), "%d", redir->target_fd);
+    target = number;
+  } else if (redir->type == REDIR_CLOSE) {
+    target = "-";
+  } else if (redir->type == REDIR_HEREDOC) {
+    target = redir->here_flags & HERE_STRING ? redir->target : NULL;
+  }
+
+  size_t size = (redir->fd_name ? strlen(redir->fd_name) : 0) +
+                (target ? strlen(target) : 0) + 32;
+  char *word = malloc(size);
+  if (!word) {
+    perror("malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  int len = redir->fd_name
+                ? snprintf(word, size, "{%s}%s", redir->fd_name,
+                           ops[redir->type])
+                : snprintf(word, size, "%d%s", redir->fd, ops[redir->type]);
+  if (redir->type == REDIR_HEREDOC && target)
+    snprintf(word + len, size - len, "<%s", target);
+  else if (target)
+    snprintf(word + len, size - len, "%s", target);
+  put_json_string(stage, word);
+  free(word);
+}
+
+static long long micros(const struct timespec *from,
+                        const struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) * 1000000LL +
+         (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+// Start a stage's record once it is running. kind is "exec", "builtin",
+// "subshell", "group" or "assignment"; before_fork is when the shell began
+// to launch it, so spawn_us is the cost of the fork itself.
+void trace_launch(TraceStage *stage, long pipeline, int index,
+                  const Command *cmd, char **argv, const char *kind, pid_t pid,
+                  const struct timespec *before_fork) {
+  struct timespec wall;
+  clock_gettime(CLOCK_MONOTONIC, &stage->started);
+  clock_gettime(CLOCK_REALTIME, &wall);
+  stage->record = NULL;
+  stage->len = 0;
+
+  char number[128];
+  snprintf(number, sizeof(number),
+           "{\"ts\":%lld,\"shell\":%d,\"pipeline\":%ld,\"stage\":%d,"
+           "\"pid\":%d,\"kind\":",
+           wall.tv_sec * 1000000LL + wall.tv_nsec / 1000, (int)getpid(),
+           pipeline, index, (int)pid);
+  put_str(stage, number);
+  put_json_string(stage, kind);
+
+  put_str(stage, ",\"argv\":[");
+  for (int i = 0; argv && argv[i]; i++) {
+    if (i)
+      put_str(stage, ",");
+    put_json_string(stage, argv[i]);
+  }
+  put_str(stage, "],\"path\":");
+  char *path = strcmp(kind, "exec") == 0 && argv && argv[0]
+                   ? resolve_path(argv[0])
+                   : NULL;
+  if (path)
+    put_json_string(stage, path);
+  else
+    put_str(stage, "null");
+  free(path);
+
+  put_str(stage, ",\"redirs\":[");
+  for (const Redirection *redir = cmd->redirs; redir; redir = redir->next) {
+    if (redir != cmd->redirs)
+      put_str(stage, ",");
+    put_redirection(stage, redir);
+  }
+  snprintf(number, sizeof(number), "],\"spawn_us\":%lld",
+           micros(before_fork, &stage->started));
+  put_str(stage, number);
+}
+
+// Complete the record with the run time and status and queue it.
+void trace_finish(TraceStage *stage, int status) {
+  if (!stage->record)
+    return;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  char tail[64];
+  snprintf(tail, sizeof(tail), ",\"run_us\":%lld,\"status\":%d}\n",
+           micros(&stage->started, &now), status);
+  put_str(stage, tail);
+  ring_push(stage->record, stage->len);
+  free(stage->record);
+  stage->record = NULL;
+}
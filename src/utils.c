@@ -1,14 +1,17 @@
+#define _GNU_SOURCE // pipe2, tee
 #include "include/utils.h"
+#include "include/stats.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
 #include <glob.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <termios.h>
 #include <unistd.h>
 
-#define MAX_ARGS 64
-#define DELIMITERS " \t\r\n\a" // Whitespace delimeters
-
 void reset_input_line(char *buffer, int *i) {
   printf("\n");
   printf("cshell> ");
@@ -17,154 +20,155 @@ void reset_input_line(char *buffer, int *i) {
   *i = 0;
 }
 
-Command *parse_command(char *input) {
-  Command *head = NULL;
-  Command *tail = NULL;
-  char *token;
-  char *input_copy = strdup(input);
+int option_globstar = 0;
+
+// --- ** (set -o globstar) ---
+
+typedef struct {
+  char **items;
+  size_t count;
+  size_t capacity;
+} PathList;
 
-  if (!input_copy) {
+static void path_add(PathList *list, char *path) {
+  if (!path) {
     perror("strdup failed");
     exit(EXIT_FAILURE);
   }
+  if (list->count + 1 >= list->capacity) {
+    list->capacity = list->capacity ? list->capacity * 2 : 64;
+    list->items = realloc(list->items, list->capacity * sizeof(char *));
+    if (!list->items) {
+      perror("realloc failed");
+      exit(EXIT_FAILURE);
+    }
+  }
+  list->items[list->count++] = path;
+  list->items[list->count] = NULL;
+}
 
-  token = strtok(input_copy, DELIMITERS);
+static int compare_paths(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
 
-  if (token == NULL) {
-    free(input_copy);
-    return NULL;
+// The first ** that is a whole path component, or NULL.
+static const char *globstar_component(const char *pattern) {
+  for (const char *p = pattern; (p = strstr(p, "**")) != NULL; p++) {
+    if ((p == pattern || p[-1] == '/') && (p[2] == '\0' || p[2] == '/'))
+      return p;
   }
-  while (token != NULL) {
-    Command *cmd = malloc(sizeof(Command));
-    if (!cmd) {
-      perror("malloc failed");
-      exit(EXIT_FAILURE);
-    }
-    cmd->args = malloc(MAX_ARGS * sizeof(char *));
-    if (!cmd->args) {
+  return NULL;
+}
+
+static void globstar_into(const char *pattern, PathList *list);
+
+// Match rest in dir, a plain path ending in '/' or empty for the current
+// directory, and in every directory below it. Hidden directories and
+// symbolic links are not entered.
+static void globstar_walk(const char *dir, const char *rest, PathList *list) {
+  size_t dir_len = strlen(dir);
+  char *pattern = malloc(dir_len * 2 + strlen(rest) + 2);
+  if (!pattern) {
+    perror("malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  char *out = pattern;
+  for (const char *p = dir; *p; p++) {
+    if (strchr("\\*?[", *p))
+      *out++ = '\\';
+    *out++ = *p;
+  }
+  strcpy(out, *rest ? rest : "*"); // A trailing ** is everything below
+  globstar_into(pattern, list);
+  free(pattern);
+
+  DIR *stream = opendir(dir_len ? dir : ".");
+  if (!stream)
+    return;
+  struct dirent *entry;
+  while ((entry = readdir(stream)) != NULL) {
+    if (entry->d_name[0] == '.')
+      continue;
+    size_t name_len = strlen(entry->d_name);
+    char *sub = malloc(dir_len + name_len + 2);
+    if (!sub) {
       perror("malloc failed");
-      free(cmd);
-      free_command(head);
-      free(input_copy);
       exit(EXIT_FAILURE);
     }
-    cmd->input_file = NULL;
-    cmd->output_file = NULL;
-    cmd->append = 0;
-    cmd->argc = 0;
-    cmd->next = NULL;
-
-    while (token != NULL) {
-      if (strcmp(token, "|") == 0) {
-        token = strtok(NULL, DELIMITERS);
-        break;
-      } else if (strcmp(token, ">") == 0) {
-        token = strtok(NULL, DELIMITERS);
-        if (token == NULL) {
-          print_error("Syntax Error: Expected file name after >");
-          free_command(cmd);
-          free_command(head);
-          free(input_copy);
-          return NULL;
-        }
-        cmd->output_file = strdup(token);
-        if (!cmd->output_file) {
-          perror("strdup failed");
-          // Clean up and exit.
-          free_command(cmd);
-          free_command(head);
-          free(input_copy);
-          exit(EXIT_FAILURE);
-        }
-        token = strtok(NULL, DELIMITERS);
-        break; // Stop parsing arguments
-      } else if (strcmp(token, "<") == 0) {
-        token = strtok(NULL, DELIMITERS);
-        if (token == NULL) {
-          print_error("Syntax Error: Expected file name after <");
-          free_command(cmd);
-          free_command(head);
-          free(input_copy);
-          return NULL;
-        }
-        cmd->input_file = strdup(token);
-
-        if (!cmd->input_file) {
-          perror("strdup failed");
-          // Clean up and exit.
-          free_command(cmd);
-          free_command(head);
-          free(input_copy);
-          exit(EXIT_FAILURE);
-        }
-
-        token = strtok(NULL, DELIMITERS); // Get next
-
-      } else if (strcmp(token, ">>") == 0) {
-
-        token = strtok(NULL, DELIMITERS);
-        if (token == NULL) {
-          print_error("Syntax error: Expected filename after >>");
-          free_command(cmd);
-          free_command(head);
-          free(input_copy);
-          return NULL;
-        }
-
-        cmd->output_file = strdup(token);
-
-        if (!cmd->output_file) {
-          perror("strdup failed");
-          // Clean up and exit.
-          free_command(cmd);
-          free_command(head);
-          free(input_copy);
-          exit(EXIT_FAILURE);
-        }
-        cmd->append = 1;
-        token = strtok(NULL, DELIMITERS);
-        break;
-
-      } else {
-        char **expanded_args = expand_wildcards(token);
-        if (expanded_args) {
-          for (int i = 0; expanded_args[i] != NULL; i++) {
-            if (cmd->argc < MAX_ARGS - 1) {
-              cmd->args[cmd->argc++] = expanded_args[i];
-            } else {
-              print_error("Too many arguments");
-              free_command(cmd);
-              free_command(head);
-              free(input_copy);
-              return NULL;
-            }
-          }
-          free(expanded_args);
-        } else {
-          free_command(cmd);
-          free_command(head);
-          free(input_copy);
-          return NULL;
-        }
-        token = strtok(NULL, DELIMITERS);
-      }
+    memcpy(sub, dir, dir_len);
+    memcpy(sub + dir_len, entry->d_name, name_len);
+    sub[dir_len + name_len] = '\0';
+    int is_dir = entry->d_type == DT_DIR;
+    struct stat st;
+    if (entry->d_type == DT_UNKNOWN && lstat(sub, &st) == 0)
+      is_dir = S_ISDIR(st.st_mode);
+    if (is_dir) {
+      strcpy(sub + dir_len + name_len, "/");
+      globstar_walk(sub, rest, list);
     }
-    cmd->args[cmd->argc] = NULL;
+    free(sub);
+  }
+  closedir(stream);
+}
 
-    if (head == NULL) {
-      head = cmd;
-      tail = cmd;
-    } else {
-      tail->next = cmd;
-      tail = cmd;
+// Append pattern's matches to list. Any ** component matches zero or more
+// directories: the part before it is globbed to directories, and each of
+// those is walked.
+static void globstar_into(const char *pattern, PathList *list) {
+  const char *star = globstar_component(pattern);
+  glob_t found;
+  if (!star) {
+    if (glob(pattern, GLOB_TILDE, NULL, &found) == 0) {
+      for (size_t i = 0; i < found.gl_pathc; i++)
+        path_add(list, strdup(found.gl_pathv[i]));
     }
+    globfree(&found);
+    return;
+  }
+  const char *rest = star[2] == '/' ? star + 3 : star + 2;
+  if (star == pattern) {
+    globstar_walk("", rest, list);
+    return;
+  }
+  char *prefix = strndup(pattern, star - pattern); // Ends in '/'
+  if (!prefix) {
+    perror("strndup failed");
+    exit(EXIT_FAILURE);
+  }
+  if (glob(prefix, GLOB_TILDE | GLOB_ONLYDIR, NULL, &found) == 0) {
+    for (size_t i = 0; i < found.gl_pathc; i++)
+      globstar_walk(found.gl_pathv[i], rest, list);
   }
+  globfree(&found);
+  free(prefix);
+}
 
-  free(input_copy);
-  return head;
+// Matches for a pattern with a ** component, sorted; without any, the
+// pattern itself, as glob()'s GLOB_NOCHECK would give.
+static char **expand_globstar(const char *arg) {
+  PathList list = {NULL, 0, 0};
+  globstar_into(arg, &list);
+  if (list.count == 0) {
+    path_add(&list, strdup(arg));
+    return list.items;
+  }
+  STATS_COUNT(STATS_GLOB_PATHS, list.count);
+  qsort(list.items, list.count, sizeof(char *), compare_paths);
+  size_t kept = 1; // Several ** can reach one path more than once
+  for (size_t i = 1; i < list.count; i++) {
+    if (strcmp(list.items[i], list.items[kept - 1]) == 0)
+      free(list.items[i]);
+    else
+      list.items[kept++] = list.items[i];
+  }
+  list.items[kept] = NULL;
+  return list.items;
 }
 
 char **expand_wildcards(const char *arg) {
+  STATS_COUNT(STATS_GLOBS, 1);
+  if (option_globstar && globstar_component(arg))
+    return expand_globstar(arg);
   glob_t glob_result;
   int flags = GLOB_NOCHECK | GLOB_TILDE;
   int ret = glob(arg, flags, NULL, &glob_result);
@@ -211,6 +215,7 @@ char **expand_wildcards(const char *arg) {
     }
   }
   expanded_args[glob_result.gl_pathc] = NULL;
+  STATS_COUNT(STATS_GLOB_PATHS, glob_result.gl_pathc);
 
   globfree(&glob_result);
   return expanded_args;
@@ -219,10 +224,16 @@ char **expand_wildcards(const char *arg) {
 void free_command(Command *cmd) {
   if (cmd) {
     free_args(cmd->args);
-    if (cmd->input_file)
-      free(cmd->input_file);
-    if (cmd->output_file)
-      free(cmd->output_file);
+    free_node(cmd->group);
+    free(cmd->function_name);
+    Redirection *redir = cmd->redirs;
+    while (redir) {
+      Redirection *next = redir->next;
+      free(redir->target);
+      free(redir->fd_name);
+      free(redir);
+      redir = next;
+    }
     if (cmd->next)
       free_command(cmd->next);
     free(cmd);
@@ -237,6 +248,200 @@ void free_args(char **args) {
   }
 }
 
+void line_reader_init(LineReader *reader, int fd) {
+  struct stat st;
+  reader->fd = fd;
+  reader->capacity = READ_CHUNK_SIZE;
+  reader->buf = malloc(reader->capacity);
+  if (!reader->buf) {
+    perror("malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  reader->start = reader->end = 0;
+  reader->eof = 0;
+  reader->mode = 0;
+  reader->peek[0] = reader->peek[1] = -1;
+  reader->offset = 0;
+  reader->synced = -1;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    reader->mode = 'f';
+    reader->offset = lseek(fd, 0, SEEK_CUR);
+  } else if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode) &&
+             pipe2(reader->peek, O_CLOEXEC) == 0) {
+    reader->mode = 'p';
+  }
+}
+
+// Read up to room bytes into buf, but from a pipe or a byte at a time only
+// through the first newline, so nothing past it is consumed.
+static ssize_t line_reader_fill(LineReader *reader, char *buf, size_t room) {
+  if (reader->mode == 'f') {
+    ssize_t n = read(reader->fd, buf, room);
+    if (n > 0)
+      reader->offset += n;
+    return n;
+  }
+  if (reader->mode == 'p') {
+    ssize_t n = tee(reader->fd, reader->peek[1], room, 0);
+    if (n == -1 && errno == EINVAL) {
+      reader->mode = 0; // The kernel cannot tee this pipe
+      return line_reader_fill(reader, buf, room);
+    }
+    if (n <= 0)
+      return n;
+    if (read_exactly(reader->peek[0], buf, n) == -1)
+      return -1;
+    char *newline = memchr(buf, '\n', n);
+    size_t used = newline ? (size_t)(newline - buf) + 1 : (size_t)n;
+    return read_exactly(reader->fd, buf, used) == -1 ? -1 : (ssize_t)used;
+  }
+  return read(reader->fd, buf, 1);
+}
+
+// Return the next line without its newline, or NULL at end of input. The
+// line points into the reader's buffer and is valid until the next call.
+char *line_reader_next(LineReader *reader) {
+  if (reader->synced != -1) {
+    // Unless the command read on from there, the buffered text still
+    // follows and the offset goes back to where reading left off.
+    off_t now = lseek(reader->fd, 0, SEEK_CUR);
+    if (now == reader->synced) {
+      lseek(reader->fd, reader->offset, SEEK_SET);
+    } else {
+      reader->start = reader->end = 0;
+      reader->offset = now;
+      reader->eof = 0;
+    }
+    reader->synced = -1;
+  }
+
+  while (1) {
+    char *line = reader->buf + reader->start;
+    size_t available = reader->end - reader->start;
+    char *newline = memchr(line, '\n', available);
+
+    if (newline) {
+      *newline = '\0';
+      reader->start += newline - line + 1;
+      return line;
+    }
+    if (reader->eof) {
+      if (available == 0)
+        return NULL;
+      line[available] = '\0'; // Space is always left for this
+      reader->start = reader->end;
+      return line;
+    }
+
+    // Keep the partial line and make room for at least one more chunk.
+    if (reader->start > 0)
+      memmove(reader->buf, line, available);
+    reader->start = 0;
+    reader->end = available;
+    if (reader->capacity - reader->end <= READ_CHUNK_SIZE / 2) {
+      reader->capacity *= 2;
+      char *grown = realloc(reader->buf, reader->capacity);
+      if (!grown) {
+        perror("realloc failed");
+        exit(EXIT_FAILURE);
+      }
+      reader->buf = grown;
+    }
+
+    ssize_t n = line_reader_fill(reader, reader->buf + reader->end,
+                                 reader->capacity - reader->end - 1);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      reader->eof = 1;
+    else
+      reader->end += (size_t)n;
+  }
+}
+
+// Before a command runs, move a regular file's offset back to the end of
+// the lines returned so far; the next line_reader_next() finds out whether
+// the command read on.
+void line_reader_sync(LineReader *reader) {
+  if (reader->mode != 'f' || reader->start == reader->end)
+    return;
+  reader->synced = reader->offset - (off_t)(reader->end - reader->start);
+  lseek(reader->fd, reader->synced, SEEK_SET);
+}
+
+void line_reader_free(LineReader *reader) {
+  free(reader->buf);
+  reader->buf = NULL;
+  if (reader->peek[0] != -1) {
+    close(reader->peek[0]);
+    close(reader->peek[1]);
+    reader->peek[0] = reader->peek[1] = -1;
+  }
+}
+
+// Read exactly n bytes that are known to be there.
+int read_exactly(int fd, char *buffer, size_t n) {
+  while (n > 0) {
+    ssize_t got = read(fd, buffer, n);
+    if (got <= 0) {
+      if (got == -1 && errno == EINTR)
+        continue;
+      return -1;
+    }
+    buffer += got;
+    n -= got;
+  }
+  return 0;
+}
+
+// Read a whole file into a NUL-terminated malloc'd buffer, sized from
+// fstat so a regular file is normally read in a single call.
+char *read_file(const char *path, size_t *length) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return NULL;
+
+  struct stat st;
+  size_t capacity = (fstat(fd, &st) == 0 && st.st_size > 0)
+                        ? (size_t)st.st_size + 1
+                        : READ_CHUNK_SIZE;
+  size_t len = 0;
+  char *buf = malloc(capacity);
+  if (!buf) {
+    perror("malloc failed");
+    exit(EXIT_FAILURE);
+  }
+
+  while (1) {
+    if (len + 1 == capacity) {
+      capacity *= 2;
+      char *grown = realloc(buf, capacity);
+      if (!grown) {
+        perror("realloc failed");
+        exit(EXIT_FAILURE);
+      }
+      buf = grown;
+    }
+    ssize_t n = read(fd, buf + len, capacity - len - 1);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      free(buf);
+      close(fd);
+      return NULL;
+    }
+    if (n == 0)
+      break;
+    len += (size_t)n;
+  }
+  close(fd);
+
+  buf[len] = '\0';
+  if (length)
+    *length = len;
+  return buf;
+}
+
 void print_error(const char *message) {
   fprintf(stderr, "cshell: %s\n", message);
 }